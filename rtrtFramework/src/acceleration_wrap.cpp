@@ -9,8 +9,17 @@
 
 #include "acceleration_wrap.h"
 #include "vkapp.h"
+#include "app.h"
+#include <algorithm>
 #include <numeric>
 
+VkDeviceAddress getBufferDeviceAddress(VkDevice device, VkBuffer buffer);  // vkapp_loadModel.cpp
+
+// The builders' step by step trace, only while verbose
+#define TRACE(...) do { if (RaytracingBuilderKHR::verbose) printf(__VA_ARGS__); } while (0)
+
+bool RaytracingBuilderKHR::verbose = true;
+
 //--------------------------------------------------------------------------------------------------
 // Initializing the allocator and querying the raytracing properties
 //
@@ -20,6 +29,13 @@ void RaytracingBuilderKHR::setup(VkApp* _VK, const VkDevice& device, uint32_t qu
     VK = _VK;
     m_device     = device;
     m_queueIndex = queueIndex;
+
+    // Scratch offsets (see cmdUpdateBlas) must be multiples of this
+    VkPhysicalDeviceAccelerationStructurePropertiesKHR asProps{VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ACCELERATION_STRUCTURE_PROPERTIES_KHR};
+    VkPhysicalDeviceProperties2 prop2{VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2};
+    prop2.pNext = &asProps;
+    vkGetPhysicalDeviceProperties2(VK->m_physicalDevice, &prop2);
+    m_scratchAlignment = std::max<VkDeviceSize>(asProps.minAccelerationStructureScratchOffsetAlignment, 1);
 }
 
 //--------------------------------------------------------------------------------------------------
@@ -27,17 +43,22 @@ void RaytracingBuilderKHR::setup(VkApp* _VK, const VkDevice& device, uint32_t qu
 //
 void RaytracingBuilderKHR::destroy()
 {
-    printf("RaytracingBuilderKHR::destroy\n");
+    TRACE("RaytracingBuilderKHR::destroy\n");
     for(auto& blas : m_blas)  {
         blas.bw.destroy(VK->m_device);
-        printf("  vkDestroyAccelerationStructureKHR blas\n");
+        TRACE("  vkDestroyAccelerationStructureKHR blas\n");
         vkDestroyAccelerationStructureKHR(VK->m_device, blas.accel, nullptr); }
     
     m_tlas.bw.destroy(VK->m_device);
-        printf("  vkDestroyAccelerationStructureKHR tlas\n");
+        TRACE("  vkDestroyAccelerationStructureKHR tlas\n");
     vkDestroyAccelerationStructureKHR(VK->m_device, m_tlas.accel, nullptr);
+    m_tlasScratch.destroy(VK->m_device);
+    m_tlasScratchSize = 0;
+    m_blasScratch.destroy(VK->m_device);
+    m_blasScratchSize = 0;
 
     m_blas.clear();
+    m_freeBlas.clear();
 }
 
 //--------------------------------------------------------------------------------------------------
@@ -56,10 +77,34 @@ VkDeviceAddress RaytracingBuilderKHR::getBlasDeviceAddress(uint32_t blasId)
     assert(size_t(blasId) < m_blas.size());
     VkAccelerationStructureDeviceAddressInfoKHR addressInfo{VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_DEVICE_ADDRESS_INFO_KHR};
     addressInfo.accelerationStructure = m_blas[blasId].accel;
-    printf("    vkGetAccelerationStructureDeviceAddressKHR\n");
+    TRACE("    vkGetAccelerationStructureDeviceAddressKHR\n");
     return vkGetAccelerationStructureDeviceAddressKHR(m_device, &addressInfo);
 }
 
+//--------------------------------------------------------------------------------------------------
+// Device memory bound to the BLASes / the TLAS, for reporting.
+//
+static VkDeviceSize bufferMemorySize(VkDevice device, const BufferWrap& bw)
+{
+    VkMemoryRequirements memReq;
+    vkGetBufferMemoryRequirements(device, bw.buffer, &memReq);
+    return memReq.size;
+}
+
+VkDeviceSize RaytracingBuilderKHR::blasMemorySize()
+{
+    VkDeviceSize total = 0;
+    for (const auto& blas : m_blas)
+        if (blas.accel != VK_NULL_HANDLE)  // Not a slot freed by replaceBlas
+            total += bufferMemorySize(m_device, blas.bw);
+    return total;
+}
+
+VkDeviceSize RaytracingBuilderKHR::tlasMemorySize()
+{
+    return m_tlas.accel == VK_NULL_HANDLE ? 0 : bufferMemorySize(m_device, m_tlas.bw);
+}
+
 //--------------------------------------------------------------------------------------------------
 // Create all the BLAS from the vector of BlasInput
 // - There will be one BLAS per input-vector entry
@@ -71,7 +116,7 @@ VkDeviceAddress RaytracingBuilderKHR::getBlasDeviceAddress(uint32_t blasId)
 void RaytracingBuilderKHR::buildBlas(const std::vector<BlasInput>& input,
                                      VkBuildAccelerationStructureFlagsKHR flags)
 {
-    printf("  Call buildBlas\n");
+    TRACE("  Call buildBlas\n");
     auto         nbBlas = static_cast<uint32_t>(input.size());
     VkDeviceSize asTotalSize{0};     // Memory size of all allocated BLAS
     uint32_t     nbCompactions{0};   // Nb of BLAS requesting compaction
@@ -81,7 +126,7 @@ void RaytracingBuilderKHR::buildBlas(const std::vector<BlasInput>& input,
     std::vector<BuildAccelerationStructure> buildAs(nbBlas);
     for(uint32_t idx = 0; idx < nbBlas; idx++)
         {
-            printf("    For BLAS %d of %d.\n", idx, nbBlas);
+            TRACE("    For BLAS %d of %d.\n", idx, nbBlas);
             // Filling partially the VkAccelerationStructureBuildGeometryInfoKHR for querying the build sizes.
             // Other information will be filled in the createBlas (see #2)
             buildAs[idx].buildInfo.type          = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
@@ -97,7 +142,7 @@ void RaytracingBuilderKHR::buildBlas(const std::vector<BlasInput>& input,
             std::vector<uint32_t> maxPrimCount(input[idx].asBuildOffsetInfo.size());
             for(auto tt = 0; tt < input[idx].asBuildOffsetInfo.size(); tt++)
                 maxPrimCount[tt] = input[idx].asBuildOffsetInfo[tt].primitiveCount; //# of triangles
-            printf("      vkGetAccelerationStructureBuildSizesKHR to request needed size\n");
+            TRACE("      vkGetAccelerationStructureBuildSizesKHR to request needed size\n");
             vkGetAccelerationStructureBuildSizesKHR(m_device,
                                                     VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR,
                                                     &buildAs[idx].buildInfo, maxPrimCount.data(),
@@ -112,16 +157,17 @@ void RaytracingBuilderKHR::buildBlas(const std::vector<BlasInput>& input,
 
 
     // Allocate the scratch buffers holding the temporary data of the acceleration structure builder
-    printf("    Create scratch buffer of max size\n");
+    TRACE("    Create scratch buffer of max size\n");
     VK->m_scratch1 = VK->createBufferWrap(maxScratchSize,
                                     VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT
                                     | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
-                                    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+                                    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                                    {MEM_SCRATCH, "BLAS build scratch"});
     NAME(VK->m_scratch1.buffer, VK_OBJECT_TYPE_BUFFER, "buildBlas scratch buffer");
   
     VkBufferDeviceAddressInfo bufferInfo{VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO,
         nullptr, VK->m_scratch1.buffer};
-    printf("    vkGetBufferDeviceAddress for address of scratch buffer\n");
+    TRACE("    vkGetBufferDeviceAddress for address of scratch buffer\n");
     VkDeviceAddress           scratchAddress = vkGetBufferDeviceAddress(m_device, &bufferInfo);
 
     // Allocate a query pool for storing the needed size for every BLAS compaction.
@@ -182,25 +228,27 @@ void RaytracingBuilderKHR::buildBlas(const std::vector<BlasInput>& input,
 
     // Clean up
     if (queryPool) {
-        printf("  vkDestroyQueryPool\n");
+        TRACE("  vkDestroyQueryPool\n");
         vkDestroyQueryPool(m_device, queryPool, nullptr); }
 }
 
 WrapAccelerationStructure createAcceleration(VkApp* VK,
-                                              VkAccelerationStructureCreateInfoKHR& accel_)
+                                              VkAccelerationStructureCreateInfoKHR& accel_,
+                                              const std::string& owner)
 {
     WrapAccelerationStructure result;
     // Allocating the buffer to hold the acceleration structure
-    printf("        create buffer for aceleration struct\n");
+    TRACE("        create buffer for aceleration struct\n");
 
     result.bw = VK->createBufferWrap(accel_.size,
                                      VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR
                                      | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
-                                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+                                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                                     {MEM_ACCELERATION, owner});
 
     // Create the acceleration structure
     accel_.buffer = result.bw.buffer;
-    printf("        vkCreateAccelerationStructureKHR\n");
+    TRACE("        vkCreateAccelerationStructureKHR\n");
     vkCreateAccelerationStructureKHR(VK->m_device, &accel_, nullptr, &result.accel);
 
     return result;
@@ -216,20 +264,20 @@ void RaytracingBuilderKHR::cmdCreateBlas(VkCommandBuffer
                                          VkDeviceAddress                          scratchAddress,
                                          VkQueryPool                              queryPool)
 {
-    printf("    Call cmdCreateBlas\n");
+    TRACE("    Call cmdCreateBlas\n");
     if(queryPool)  // For querying the compaction size
         vkResetQueryPool(m_device, queryPool, 0, static_cast<uint32_t>(indices.size()));
     uint32_t queryCnt{0};
 
     for(const auto& idx : indices)
         {
-            printf("      For BLAS #%d of %ld\n", idx, indices.size());
+            TRACE("      For BLAS #%d of %ld\n", idx, indices.size());
             // Actual allocation of buffer and acceleration structure.
             VkAccelerationStructureCreateInfoKHR createInfo{VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR};
             createInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
             // Will be used to allocate memory.
             createInfo.size = buildAs[idx].sizeInfo.accelerationStructureSize;
-            buildAs[idx].as = createAcceleration(VK, createInfo);
+            buildAs[idx].as = createAcceleration(VK, createInfo, "BLAS " + std::to_string(idx));
     
             // BuildInfo #2 part
             // Setting where the build lands
@@ -238,7 +286,7 @@ void RaytracingBuilderKHR::cmdCreateBlas(VkCommandBuffer
             buildAs[idx].buildInfo.scratchData.deviceAddress = scratchAddress;
 
             // Building the bottom-level-acceleration-structure
-            printf("        vkCmdBuildAccelerationStructuresKHR build BLAS\n");
+            TRACE("        vkCmdBuildAccelerationStructuresKHR build BLAS\n");
             vkCmdBuildAccelerationStructuresKHR(cmdBuf, 1, &buildAs[idx].buildInfo,
                                                 &buildAs[idx].rangeInfo);
 
@@ -248,7 +296,7 @@ void RaytracingBuilderKHR::cmdCreateBlas(VkCommandBuffer
             VkMemoryBarrier barrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER};
             barrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
             barrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR;
-            printf("        vkCmdPipelineBarrier\n");
+            TRACE("        vkCmdPipelineBarrier\n");
             vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
                                  VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
                                  0, 1, &barrier, 0, nullptr, 0, nullptr);
@@ -256,7 +304,7 @@ void RaytracingBuilderKHR::cmdCreateBlas(VkCommandBuffer
             if(queryPool)
                 {
                     // Add a query to find the 'real' amount of memory needed, use for compaction
-                    printf("      vkCmdWriteAccelerationStructuresPropertiesKHR\n");
+                    TRACE("      vkCmdWriteAccelerationStructuresPropertiesKHR\n");
                     vkCmdWriteAccelerationStructuresPropertiesKHR(cmdBuf, 1,
                                &buildAs[idx].buildInfo.dstAccelerationStructure,
                                VK_QUERY_TYPE_ACCELERATION_STRUCTURE_COMPACTED_SIZE_KHR,
@@ -273,7 +321,7 @@ void RaytracingBuilderKHR::cmdCompactBlas(VkCommandBuffer
                                           std::vector<BuildAccelerationStructure>& buildAs,
                                           VkQueryPool                              queryPool)
 {
-    printf("  cmdCompactBlas\n");
+    TRACE("  cmdCompactBlas\n");
     uint32_t queryCtn{0};
 
     // Get the compacted size result back
@@ -290,14 +338,14 @@ void RaytracingBuilderKHR::cmdCompactBlas(VkCommandBuffer
             VkAccelerationStructureCreateInfoKHR asCreateInfo{VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR};
             asCreateInfo.size = buildAs[idx].sizeInfo.accelerationStructureSize;
             asCreateInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
-            buildAs[idx].as = createAcceleration(VK, asCreateInfo);
+            buildAs[idx].as = createAcceleration(VK, asCreateInfo, "BLAS " + std::to_string(idx) + " (compact)");
 
             // Copy the original BLAS to a compact version
             VkCopyAccelerationStructureInfoKHR copyInfo{VK_STRUCTURE_TYPE_COPY_ACCELERATION_STRUCTURE_INFO_KHR};
             copyInfo.src  = buildAs[idx].buildInfo.dstAccelerationStructure;
             copyInfo.dst  = buildAs[idx].as.accel;
             copyInfo.mode = VK_COPY_ACCELERATION_STRUCTURE_MODE_COMPACT_KHR;
-            printf("  vkCmdCopyAccelerationStructureKHR for BLAS commodification\n");
+            TRACE("  vkCmdCopyAccelerationStructureKHR for BLAS commodification\n");
             vkCmdCopyAccelerationStructureKHR(cmdBuf, &copyInfo);
         }
 }
@@ -307,7 +355,7 @@ void RaytracingBuilderKHR::cmdCompactBlas(VkCommandBuffer
 //
 void RaytracingBuilderKHR::destroyNonCompacted(std::vector<uint32_t> indices, std::vector<BuildAccelerationStructure>& buildAs)
 {
-    printf("  RaytracingBuilderKHR::destroyNonCompacted\n");
+    TRACE("  RaytracingBuilderKHR::destroyNonCompacted\n");
     for(auto& i : indices)
         {
             vkDestroyAccelerationStructureKHR(VK->m_device, buildAs[i].cleanupAS, nullptr);
@@ -324,7 +372,6 @@ void RaytracingBuilderKHR::cmdCreateTlas(VkCommandBuffer                      cm
                                          bool                                 update,
                                          bool                                 motion)
 {
-    printf("  Call cmdCreateTlas\n");
     // Wraps a device pointer to the above uploaded instances.
     VkAccelerationStructureGeometryInstancesDataKHR instancesVk{VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_INSTANCES_DATA_KHR};
     instancesVk.data.deviceAddress = instBufferAddr;
@@ -343,174 +390,309 @@ void RaytracingBuilderKHR::cmdCreateTlas(VkCommandBuffer                      cm
     buildInfo.type                     = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
     buildInfo.srcAccelerationStructure = VK_NULL_HANDLE;
 
-    VkAccelerationStructureBuildSizesInfoKHR sizeInfo{VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR};
-    printf("    vkGetAccelerationStructureBuildSizesKHR\n");
-    vkGetAccelerationStructureBuildSizesKHR(m_device, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR, &buildInfo,
-                                            &countInstance, &sizeInfo);
-
-    // Create TLAS
+    // Create TLAS.  A refit keeps the instance count, so the scratch
+    // buffer, sized for both when the TLAS was built, is large enough.
     if(update == false)
         {
+            VkAccelerationStructureBuildSizesInfoKHR sizeInfo{VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR};
+            vkGetAccelerationStructureBuildSizesKHR(m_device, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR, &buildInfo,
+                                                    &countInstance, &sizeInfo);
+
+            // Replacing an earlier one; nothing may be using it any more
+            if (m_tlas.accel != VK_NULL_HANDLE) {
+                m_tlas.bw.destroy(m_device);
+                vkDestroyAccelerationStructureKHR(m_device, m_tlas.accel, nullptr); }
+            m_tlasInstances = countInstance;
 
             VkAccelerationStructureCreateInfoKHR createInfo{VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR};
             createInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
             createInfo.size = sizeInfo.accelerationStructureSize;
-            m_tlas = createAcceleration(VK, createInfo);
+            m_tlas = createAcceleration(VK, createInfo, "TLAS");
+
+            // The scratch buffer is kept from build to build, and only
+            // replaced when it is too small
+            VkDeviceSize scratchSize = std::max(sizeInfo.buildScratchSize, sizeInfo.updateScratchSize);
+            if (scratchSize > m_tlasScratchSize) {
+                m_tlasScratch.destroy(m_device);
+                m_tlasScratch = VK->createBufferWrap(scratchSize,
+                                                     VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT
+                                                     | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                                                     {MEM_SCRATCH, "TLAS build scratch"});
+                NAME(m_tlasScratch.buffer, VK_OBJECT_TYPE_BUFFER, "cmdCreateTlas scratch buffer");
+                VkBufferDeviceAddressInfo bufferInfo{VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO,
+                    nullptr, m_tlasScratch.buffer};
+                m_tlasScratchAddress = vkGetBufferDeviceAddress(m_device, &bufferInfo);
+                m_tlasScratchSize = scratchSize; }
         }
-
-    // Allocate the scratch memory
-    printf("    Create a scratch buffer for the TLAS build\n");
-    VK->m_scratch2 = VK->createBufferWrap(sizeInfo.buildScratchSize,
-                                              VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT
-                                              | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
-                                              VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-    NAME(VK->m_scratch2.buffer, VK_OBJECT_TYPE_BUFFER, "cmdCreateTlas scratch buffer");
-
-    VkBufferDeviceAddressInfo bufferInfo{VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO,
-        nullptr, VK->m_scratch2.buffer};
-    printf("    vkGetBufferDeviceAddress of the scratch buffer\n");
-    VkDeviceAddress scratchAddress = vkGetBufferDeviceAddress(m_device, &bufferInfo);
+    assert(countInstance == m_tlasInstances && m_tlasScratchSize > 0);
 
     // Update build information
     buildInfo.srcAccelerationStructure  = update ? m_tlas.accel : VK_NULL_HANDLE;
     buildInfo.dstAccelerationStructure  = m_tlas.accel;
-    buildInfo.scratchData.deviceAddress = scratchAddress;
+    buildInfo.scratchData.deviceAddress = m_tlasScratchAddress;
 
     // Build Offsets info: n instances
     VkAccelerationStructureBuildRangeInfoKHR        buildOffsetInfo{countInstance, 0, 0, 0};
     const VkAccelerationStructureBuildRangeInfoKHR* pBuildOffsetInfo = &buildOffsetInfo;
 
     // Build the TLAS
-    printf("    vkCmdBuildAccelerationStructuresKHR to build the TLAS\n");
     vkCmdBuildAccelerationStructuresKHR(cmdBuf, 1, &buildInfo, &pBuildOffsetInfo);
-    //scratch.destroy(VK->m_device);
 }
 
 //--------------------------------------------------------------------------------------------------
-// Refit BLAS number blasIdx from updated buffer contents.
+// Build new BLASes in place of old ones: the first input.size() of
+// the slots freed so far (blasIds first, in order) are reused, and the
+// rest appended.  Returns the id of each input's BLAS.  Nothing may be
+// using the BLASes in blasIds any more.
 //
-void RaytracingBuilderKHR::updateBlas(uint32_t blasIdx, BlasInput& blas, VkBuildAccelerationStructureFlagsKHR flags)
+std::vector<uint32_t> RaytracingBuilderKHR::replaceBlas(const std::vector<uint32_t>&        blasIds,
+                                                        const std::vector<BlasInput>&        input,
+                                                        VkBuildAccelerationStructureFlagsKHR flags)
 {
-    assert (false && "Not used; Not maintained;  Probably leaks a VkDeviceMemory");
-    printf("  updateBlas\n");
-    assert(size_t(blasIdx) < m_blas.size());
-
-    // Preparing all build information, acceleration is filled later
-    VkAccelerationStructureBuildGeometryInfoKHR buildInfos{VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR};
-    buildInfos.flags                    = flags;
-    buildInfos.geometryCount            = (uint32_t)blas.asGeometry.size();
-    buildInfos.pGeometries              = blas.asGeometry.data();
-    buildInfos.mode                     = VK_BUILD_ACCELERATION_STRUCTURE_MODE_UPDATE_KHR;  // UPDATE
-    buildInfos.type                     = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
-    buildInfos.srcAccelerationStructure = m_blas[blasIdx].accel;  // UPDATE
-    buildInfos.dstAccelerationStructure = m_blas[blasIdx].accel;
-
-    // Find size to build on the device
-    std::vector<uint32_t> maxPrimCount(blas.asBuildOffsetInfo.size());
-    for(auto tt = 0; tt < blas.asBuildOffsetInfo.size(); tt++)
-        maxPrimCount[tt] = blas.asBuildOffsetInfo[tt].primitiveCount;  // Number of primitives/triangles
-    VkAccelerationStructureBuildSizesInfoKHR sizeInfo{VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR};
-    vkGetAccelerationStructureBuildSizesKHR(m_device, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR, &buildInfos,
-                                            maxPrimCount.data(), &sizeInfo);
-
-    // Allocate the scratch buffer and setting the scratch info
-    BufferWrap scratch = VK->createBufferWrap(sizeInfo.buildScratchSize,
-                                              VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT
-                                              | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
-                                              VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-    VkBufferDeviceAddressInfo bufferInfo{VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO};
-    bufferInfo.buffer = scratch.buffer;
-    buildInfos.scratchData.deviceAddress = vkGetBufferDeviceAddress(m_device, &bufferInfo);
-
-    std::vector<const VkAccelerationStructureBuildRangeInfoKHR*> pBuildOffset(blas.asBuildOffsetInfo.size());
-    for(size_t i = 0; i < blas.asBuildOffsetInfo.size(); i++)
-        pBuildOffset[i] = &blas.asBuildOffsetInfo[i];
-
-    VkCommandBuffer cmdBuf = VK->createTempCmdBuffer();
+    TRACE("  Call replaceBlas\n");
+    for (auto it = blasIds.rbegin(); it != blasIds.rend(); ++it) {
+        WrapAccelerationStructure& blas = m_blas[*it];
+        blas.bw.destroy(m_device);
+        vkDestroyAccelerationStructureKHR(m_device, blas.accel, nullptr);
+        blas = WrapAccelerationStructure{};
+        m_freeBlas.push_back(*it); }
+
+    // Built at the end of m_blas, then moved into the free slots
+    size_t first = m_blas.size();
+    buildBlas(input, flags);
+    std::vector<WrapAccelerationStructure> built(m_blas.begin() + first, m_blas.end());
+    m_blas.resize(first);
+
+    std::vector<uint32_t> ids;
+    for (auto& as : built) {
+        uint32_t id = static_cast<uint32_t>(m_blas.size());
+        if (m_freeBlas.empty())
+            m_blas.emplace_back();
+        else {
+            id = m_freeBlas.back();
+            m_freeBlas.pop_back(); }
+        m_blas[id] = as;
+        ids.push_back(id); }
+    return ids;
+}
 
-    // Update the instance buffer on the device side and build the TLAS
-    // Update the acceleration structure. Note the VK_TRUE parameter to trigger the update,
-    // and the existing BLAS being passed and updated in place
-    printf("  vkCmdBuildAccelerationStructuresKHR for BLAS update\n");
-    vkCmdBuildAccelerationStructuresKHR(cmdBuf, 1, &buildInfos, pBuildOffset.data());
+//--------------------------------------------------------------------------------------------------
+// Refit the BLASes in blasIds, built with 'allow_update' from input
+// (the same geometry, primitive counts and flags), to the current
+// contents of the buffers input reads.  Recorded into cmdBuf as one
+// build command, each with its own part of a scratch buffer kept from
+// call to call; a barrier after it makes the BLASes visible to later
+// builds (the TLAS refit).  Nothing may still be using the scratch
+// buffer from the last call.
+//
+void RaytracingBuilderKHR::cmdUpdateBlas(VkCommandBuffer                      cmdBuf,
+                                         const std::vector<uint32_t>&         blasIds,
+                                         const std::vector<BlasInput>&        input,
+                                         VkBuildAccelerationStructureFlagsKHR flags)
+{
+    assert(blasIds.size() == input.size());
+    if (input.empty())
+        return;
+
+    std::vector<VkAccelerationStructureBuildGeometryInfoKHR> buildInfos(input.size());
+    std::vector<const VkAccelerationStructureBuildRangeInfoKHR*> rangeInfos(input.size());
+    std::vector<VkDeviceSize> scratchOffsets(input.size());
+    VkDeviceSize scratchSize = 0;
+    for (size_t b = 0; b < input.size(); b++) {
+        assert(size_t(blasIds[b]) < m_blas.size());
+        VkAccelerationStructureBuildGeometryInfoKHR& buildInfo = buildInfos[b];
+        buildInfo = {VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR};
+        buildInfo.type                     = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
+        buildInfo.mode                     = VK_BUILD_ACCELERATION_STRUCTURE_MODE_UPDATE_KHR;
+        buildInfo.flags                    = input[b].flags | flags;
+        buildInfo.geometryCount            = static_cast<uint32_t>(input[b].asGeometry.size());
+        buildInfo.pGeometries              = input[b].asGeometry.data();
+        buildInfo.srcAccelerationStructure = m_blas[blasIds[b]].accel;  // In place
+        buildInfo.dstAccelerationStructure = m_blas[blasIds[b]].accel;
+        rangeInfos[b] = input[b].asBuildOffsetInfo.data();
+
+        std::vector<uint32_t> maxPrimCount(input[b].asBuildOffsetInfo.size());
+        for (size_t g = 0; g < maxPrimCount.size(); g++)
+            maxPrimCount[g] = input[b].asBuildOffsetInfo[g].primitiveCount;
+        VkAccelerationStructureBuildSizesInfoKHR sizeInfo{VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR};
+        vkGetAccelerationStructureBuildSizesKHR(m_device, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR,
+                                                &buildInfo, maxPrimCount.data(), &sizeInfo);
+        scratchOffsets[b] = scratchSize;
+        scratchSize += (sizeInfo.updateScratchSize + m_scratchAlignment - 1) & ~(m_scratchAlignment - 1); }
+
+    if (scratchSize > m_blasScratchSize) {
+        m_blasScratch.destroy(m_device);
+        m_blasScratch = VK->createBufferWrap(scratchSize,
+                                             VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT
+                                             | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                             VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                                             {MEM_SCRATCH, "BLAS update scratch"});
+        NAME(m_blasScratch.buffer, VK_OBJECT_TYPE_BUFFER, "cmdUpdateBlas scratch buffer");
+        VkBufferDeviceAddressInfo bufferInfo{VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO,
+            nullptr, m_blasScratch.buffer};
+        m_blasScratchAddress = vkGetBufferDeviceAddress(m_device, &bufferInfo);
+        m_blasScratchSize = scratchSize; }
+    for (size_t b = 0; b < input.size(); b++)
+        buildInfos[b].scratchData.deviceAddress = m_blasScratchAddress + scratchOffsets[b];
+
+    vkCmdBuildAccelerationStructuresKHR(cmdBuf, static_cast<uint32_t>(buildInfos.size()),
+                                        buildInfos.data(), rangeInfos.data());
 
-    VK->submitTempCmdBuffer(cmdBuf);
+    VkMemoryBarrier barrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER};
+    barrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+    barrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR
+                          | VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+    vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+                         VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, 0,
+                         1, &barrier, 0, nullptr, 0, nullptr);
 }
     
-void RaytracingBuilderKHR::buildTlas(
-                                 const std::vector<VkAccelerationStructureInstanceKHR>& instances,
-                                 VkBuildAccelerationStructureFlagsKHR flags,
-                                 bool update, bool motion)
+void RaytracingBuilderKHR::buildTlas(VkDeviceAddress instances, uint32_t count,
+                                     VkBuildAccelerationStructureFlagsKHR flags,
+                                     bool motion)
 {
-    printf("  Call buildTlas\n");
-    // Cannot call buildTlas twice except to update.
-    //assert(m_tlas.accel == VK_NULL_HANDLE || update);
-    uint32_t countInstance = static_cast<uint32_t>(instances.size());
-
-    // Command buffer to create the TLAS
-    VkCommandBuffer    cmdBuf = VK->createTempCmdBuffer();
-
-    // Create a buffer holding the actual instance data (matrices++) for use by the AS builder
-    printf("    Create a buffer for the TLAS\n");
-    BufferWrap instancesBuffer = VK->createStagedBufferWrap(cmdBuf, instances,
-                                                      VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT
-                                                  | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR);
-    VkBufferDeviceAddressInfo bufferInfo{VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO, nullptr,
-        instancesBuffer.buffer};
-    printf("  vkGetBufferDeviceAddress of that instance buffer\n");
-    VkDeviceAddress           instBufferAddr = vkGetBufferDeviceAddress(m_device, &bufferInfo);
-    
-    // Make sure the copy of the instance buffer are copied before triggering the acceleration structure build
+    // Command buffer to create the TLAS.  The instances were written
+    // by the host into coherent memory, which the submission makes
+    // visible to the build; no copy or barrier is needed.
+    VkCommandBuffer cmdBuf = VK->createTempCmdBuffer();
+    cmdCreateTlas(cmdBuf, count, instances, flags, false, motion);
+    VK->submitTempCmdBuffer(cmdBuf);
+}
+
+//--------------------------------------------------------------------------------------------------
+// Refit the TLAS in cmdBuf, which is submitted after the instances
+// are written, and make it visible to the ray tracing shaders
+// recorded after it (and to the next build, which reuses the scratch
+// buffer).  Nothing waits on it.
+//
+void RaytracingBuilderKHR::cmdUpdateTlas(VkCommandBuffer cmdBuf, VkDeviceAddress instances, uint32_t count,
+                                         VkBuildAccelerationStructureFlagsKHR flags, bool motion)
+{
+    cmdCreateTlas(cmdBuf, count, instances, flags, true, motion);
+
     VkMemoryBarrier barrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER};
-    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-    barrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
-    printf("  vkCmdPipelineBarrier\n");
-    vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_TRANSFER_BIT,
-                         VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
-                         0, 1, &barrier, 0, nullptr, 0, nullptr);
+    barrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+    barrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR
+                          | VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+    vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+                         VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR
+                         | VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, 0,
+                         1, &barrier, 0, nullptr, 0, nullptr);
+}
 
-    // Creating the TLAS
-    cmdCreateTlas(cmdBuf, countInstance, instBufferAddr, flags, update, motion);
+//-------------------------------------------------------------------------------------------------
+// TlasInstances
+//
+void TlasInstances::resize(uint32_t count)
+{
+    m_transform.resize(count, toTransformMatrixKHR(glm::mat4(0.0f)));
+    m_blas.resize(count, 0);
+    m_customIndex.resize(count, 0);
+    m_sbtOffset.resize(count, 0);
+    m_mask.resize(count, 0);
+    m_flags.resize(count, 0);
+    m_marked.resize(count, 0);
+    markAll();
+}
 
-    // Finalizing and destroying temporary data
-    VK->submitTempCmdBuffer(cmdBuf);
-    
-    instancesBuffer.destroy(VK->m_device);
- }
+void TlasInstances::set(uint32_t i, const glm::mat4& transform, VkDeviceAddress blas,
+                        uint32_t customIndex, uint8_t mask, uint32_t sbtOffset,
+                        VkGeometryInstanceFlagsKHR flags)
+{
+    m_transform[i]   = toTransformMatrixKHR(transform);
+    m_blas[i]        = blas;
+    m_customIndex[i] = customIndex;
+    m_sbtOffset[i]   = sbtOffset;
+    m_mask[i]        = mask;
+    m_flags[i]       = static_cast<uint8_t>(flags);
+    mark(i);
+}
+
+void TlasInstances::setTransform(uint32_t i, const glm::mat4& transform)
+{
+    m_transform[i] = toTransformMatrixKHR(transform);
+    mark(i);
+}
+
+void TlasInstances::markAll()
+{
+    for (uint32_t i : m_markedList)
+        if (i < m_marked.size())
+            m_marked[i] = 0;
+    m_allMarked = true;
+    m_markedList.clear();
+}
+
+void TlasInstances::mark(uint32_t i)
+{
+    if (!m_allMarked && !m_marked[i]) {
+        m_marked[i] = 1;
+        m_markedList.push_back(i); }
+}
+
+uint32_t TlasInstances::write(VkAccelerationStructureInstanceKHR* out)
+{
+    auto pack = [&](uint32_t i) {
+        VkAccelerationStructureInstanceKHR& inst = out[i];
+        inst.transform                              = m_transform[i];
+        inst.instanceCustomIndex                    = m_customIndex[i];
+        inst.mask                                   = m_mask[i];
+        inst.instanceShaderBindingTableRecordOffset = m_sbtOffset[i];
+        inst.flags                                  = m_flags[i];
+        inst.accelerationStructureReference         = m_blas[i]; };
+
+    uint32_t written;
+    if (m_allMarked) {
+        for (uint32_t i = 0; i < size(); i++)
+            pack(i);
+        written = size();
+        m_allMarked = false; }
+    else {
+        for (uint32_t i : m_markedList) {
+            pack(i);
+            m_marked[i] = 0; }
+        written = static_cast<uint32_t>(m_markedList.size()); }
+    m_markedList.clear();
+    return written;
+}
 
 
 //-------------------------------------------------------------------------------------------------
 //-------------------------------------------------------------------------------------------------
-// Convert an OBJ model into the ray tracing geometry used to build the BLAS
+// Convert one mesh of an OBJ model into the ray tracing geometry used
+// to build the BLAS.  Its vertices are addressed from its first one,
+// which its (16 or 32 bit) indices are relative to.
 //
-BlasInput VkApp::objectToVkGeometryKHR(const ObjData& model)
+BlasInput VkApp::objectToVkGeometryKHR(const ObjData& model, const ObjMesh& mesh)
 {
-    printf("    Call VkApp::objectToVkGeometryKHR\n");
+    TRACE("    Call VkApp::objectToVkGeometryKHR\n");
     // BLAS builder requires raw device addresses.
     VkBufferDeviceAddressInfo _b1{VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO,
         nullptr, model.vertexBuffer.buffer};
-    printf("      vkGetBufferDeviceAddress of object's vertex buffer\n");
+    TRACE("      vkGetBufferDeviceAddress of object's vertex buffer\n");
     VkDeviceAddress vertexAddress = vkGetBufferDeviceAddress(m_device, &_b1);
 
     
     VkBufferDeviceAddressInfo _b2{VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO,
         nullptr, model.indexBuffer.buffer};
-    printf("      vkGetBufferDeviceAddress of object's index buffer\n");
+    TRACE("      vkGetBufferDeviceAddress of object's index buffer\n");
     VkDeviceAddress indexAddress  = vkGetBufferDeviceAddress(m_device, &_b2);
 
-    uint32_t maxPrimitiveCount = model.nbIndices / 3;
+    uint32_t maxPrimitiveCount = mesh.nbIndices / 3;
 
-    // Describe buffer as array of Vertex.
+    // Describe buffer as array of Vertex.  The position is the first
+    // member and full precision in either Vertex layout.
     VkAccelerationStructureGeometryTrianglesDataKHR triangles{VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_TRIANGLES_DATA_KHR};
     triangles.vertexFormat             = VK_FORMAT_R32G32B32_SFLOAT;  // vec3 vertex position data.
-    triangles.vertexData.deviceAddress = vertexAddress;
+    triangles.vertexData.deviceAddress = vertexAddress + sizeof(Vertex)*VkDeviceAddress(mesh.firstVertex);
     triangles.vertexStride             = sizeof(Vertex);
-    // Describe index data (32-bit unsigned int)
-    triangles.indexType               = VK_INDEX_TYPE_UINT32;
+    // Describe index data (16 or 32-bit unsigned int)
+    triangles.indexType               = mesh.indexType;
     triangles.indexData.deviceAddress = indexAddress;
     // Indicate identity transform by setting transformData to null device pointer.
     //triangles.transformData = {};
-    triangles.maxVertex = model.nbVertices;
+    triangles.maxVertex = mesh.nbVertices;
 
     // Identify the above data as containing opaque triangles.
     VkAccelerationStructureGeometryKHR asGeom{VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR};
@@ -518,11 +700,11 @@ BlasInput VkApp::objectToVkGeometryKHR(const ObjData& model)
     asGeom.flags              = VK_GEOMETRY_OPAQUE_BIT_KHR;
     asGeom.geometry.triangles = triangles;
 
-    // The entire array will be used to build the BLAS.
+    // The requested range of the array will be used to build the BLAS.
     VkAccelerationStructureBuildRangeInfoKHR offset;
     offset.firstVertex     = 0;
     offset.primitiveCount  = maxPrimitiveCount;
-    offset.primitiveOffset = 0;
+    offset.primitiveOffset = static_cast<uint32_t>(mesh.indexOffset);  // In bytes
     offset.transformOffset = 0;
 
     // Our blas is made from only one geometry, but could be made of many geometries
@@ -533,6 +715,163 @@ BlasInput VkApp::objectToVkGeometryKHR(const ObjData& model)
     return input;
 }
 
+// The monolithic layout's BLAS for object objIndex: a geometry for
+// each of its instances, with the instance transform applied at build
+// (or refit) time.  The transform of m_objInst[i] is the
+// VkTransformMatrixKHR number i in m_asTransformBW.
+BlasInput VkApp::instancesToVkGeometryKHR(uint32_t objIndex)
+{
+    BlasInput blas;
+    const ObjData& obj = m_objData[objIndex];
+    for (uint32_t i = 0; i < m_objInst.size(); i++) {
+        const ObjInst& inst = m_objInst[i];
+        if (inst.objIndex != objIndex)
+            continue;
+        const ObjMesh& mesh = obj.meshes[inst.meshIndex];
+        BlasInput geom = objectToVkGeometryKHR(obj, mesh);
+        geom.asGeometry[0].geometry.triangles.transformData.deviceAddress = m_asTransformAddress;
+        geom.asBuildOffsetInfo[0].transformOffset = i * sizeof(VkTransformMatrixKHR);
+        blas.asGeometry.push_back(geom.asGeometry[0]);
+        blas.asBuildOffsetInfo.push_back(geom.asBuildOffsetInfo[0]); }
+    return blas;
+}
+
+// The transforms of every m_objInst, which the monolithic BLASes are
+// built and refit from, made anew after m_objInst changed (nothing may
+// be using the old ones).  Uploaded with m_upload's batch, which goes
+// out ahead of the builds; updateSceneGraph rewrites moved entries.
+void VkApp::createAsTransformBuffer()
+{
+    m_asTransformBW.destroy(m_device);
+    m_asTransformBW = {};
+    m_asTransformAddress = 0;
+    if (m_objInst.empty())
+        return;
+
+    std::vector<VkTransformMatrixKHR> transforms;
+    transforms.reserve(m_objInst.size());
+    for (const ObjInst& inst : m_objInst)
+        transforms.push_back(toTransformMatrixKHR(inst.transform));
+
+    m_asTransformBW = createStagedBufferWrap(m_upload.cmdBuf(), transforms,
+                                             VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT
+                                             | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR,
+                                             {MEM_ACCELERATION, "BLAS transforms"});
+    m_asTransformAddress = getBufferDeviceAddress(m_device, m_asTransformBW.buffer);
+}
+
+// Sets every m_tlasInstances entry from the current BLASes and
+// m_objInst.  The custom index is the first m_objInst entry the BLAS
+// covers; the hit shader adds the geometry index to find the InstDesc.
+// With one BLAS per mesh, entry i is m_objInst[i] (updateSceneGraph
+// relies on it).
+void VkApp::fillTlasInstances()
+{
+    const VkGeometryInstanceFlagsKHR flags = VK_GEOMETRY_INSTANCE_TRIANGLE_FACING_CULL_DISABLE_BIT_KHR;
+    const uint8_t  mask      = 0xFF;  // Only be hit if rayMask & instance.mask != 0
+    const uint32_t sbtOffset = 0;     // Use the same hit group for all objects
+
+    if (m_splitBlas) {
+        m_tlasInstances.resize(static_cast<uint32_t>(m_objInst.size()));
+        for (uint32_t i = 0; i < m_objInst.size(); i++) {
+            const ObjInst& inst = m_objInst[i];
+            const ObjData& obj  = m_objData[inst.objIndex];
+            m_tlasInstances.set(i, inst.transform,  // Position of the instance
+                                m_rtBuilder.getBlasDeviceAddress(obj.meshes[inst.meshIndex].blasIndex),
+                                i, mask, sbtOffset, flags); }
+        return; }
+
+    // Transforms are already in the BLAS; one TLAS entry per object
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < m_objInst.size(); i++)
+        if (i == 0 || m_objInst[i-1].objIndex != m_objInst[i].objIndex)
+            count++;
+    m_tlasInstances.resize(count);
+    for (uint32_t i = 0, entry = 0; i < m_objInst.size(); i++)
+        if (i == 0 || m_objInst[i-1].objIndex != m_objInst[i].objIndex) {
+            const ObjData& obj = m_objData[m_objInst[i].objIndex];
+            m_tlasInstances.set(entry++, glm::mat4(1.0f), m_rtBuilder.getBlasDeviceAddress(obj.blasIndex),
+                                i, mask, sbtOffset, flags); }
+}
+
+/*********************************************************************
+ * param:  fill, whether to set every entry anew (fillTlasInstances);
+ *         otherwise only the entries changed since are written
+ *
+ * brief:  Builds the TLAS from m_tlasInstances, by refitting it if the
+ *         entry count is the same as last time.  The entries are
+ *         packed straight into m_tlasInstanceBW, which stays mapped,
+ *         and the build reads them there.  A refit is left for
+ *         recordRefits to record into the frame; a new TLAS is
+ *         built (and waited on) here.  Returns whether the TLAS is
+ *         refit; if not, it is a new one, which the descriptor sets
+ *         must be given.
+ **********************************************************************/
+bool VkApp::buildTlas(bool fill)
+{
+    if (fill)
+        fillTlasInstances();
+
+    uint32_t count = m_tlasInstances.size();
+    if (count > m_tlasInstanceCapacity) {
+        if (m_tlasInstanceMap)
+            m_tlasInstanceBW.destroy(m_device);
+        m_tlasInstanceCapacity = std::max(count, m_tlasInstanceCapacity + m_tlasInstanceCapacity/2);
+        m_tlasInstanceBW = createBufferWrap(sizeof(VkAccelerationStructureInstanceKHR)*m_tlasInstanceCapacity,
+                                            VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT
+                                            | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR,
+                                            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
+                                            | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                                            {MEM_ACCELERATION, "TLAS instances"});
+        NAME(m_tlasInstanceBW.buffer, VK_OBJECT_TYPE_BUFFER, "TLAS instances");
+        m_tlasInstanceMap = (VkAccelerationStructureInstanceKHR*)m_tlasInstanceBW.allocation.mapped;
+        m_tlasInstanceAddress = getBufferDeviceAddress(m_device, m_tlasInstanceBW.buffer);
+        m_tlasInstances.markAll(); }  // The new buffer has none of them
+
+    m_tlasInstances.write(m_tlasInstanceMap);
+    bool refit = count == m_rtBuilder.tlasInstanceCount()
+        && m_rtBuilder.getAccelerationStructure() != VK_NULL_HANDLE;
+    m_tlasRefit = refit;  // A new TLAS reads the same instances
+    if (!refit) {
+        m_rtBuilder.buildTlas(m_tlasInstanceAddress, count,
+                              VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR
+                              | VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR);
+        m_tlasMemory = m_rtBuilder.tlasMemorySize(); }
+    return refit;
+}
+
+/*********************************************************************
+ * param:  cmdBuf, the frame's command buffer, ahead of the ray tracing
+ *
+ * brief:  Records the refits left pending: the monolithic BLASes of
+ *         the objects in m_blasRefits (see updateSceneGraph), then the
+ *         TLAS if buildTlas left it to be refit.  The last frame is
+ *         done with the acceleration structures and the instances (see
+ *         prepareFrame); the host writes to the instances are visible
+ *         to the frame's submission, and m_upload's batch, with the
+ *         new transforms, goes ahead of it.
+ **********************************************************************/
+void VkApp::recordRefits(VkCommandBuffer cmdBuf)
+{
+    if (!m_blasRefits.empty()) {
+        std::sort(m_blasRefits.begin(), m_blasRefits.end());
+        m_blasRefits.erase(std::unique(m_blasRefits.begin(), m_blasRefits.end()), m_blasRefits.end());
+        std::vector<uint32_t> ids;
+        std::vector<BlasInput> blas;
+        for (uint32_t objIndex : m_blasRefits) {
+            ids.push_back(m_objData[objIndex].blasIndex);
+            blas.emplace_back(instancesToVkGeometryKHR(objIndex)); }
+        m_rtBuilder.cmdUpdateBlas(cmdBuf, ids, blas, blasFlags());
+        m_blasRefits.clear(); }
+
+    if (!m_tlasRefit)
+        return;
+    m_tlasRefit = false;
+    m_rtBuilder.cmdUpdateTlas(cmdBuf, m_tlasInstanceAddress, m_tlasInstances.size(),
+                              VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR
+                              | VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR);
+}
+
 /*********************************************************************
  *
  *
@@ -541,41 +880,89 @@ BlasInput VkApp::objectToVkGeometryKHR(const ObjData& model)
  **********************************************************************/
 void VkApp::createRtAccelerationStructure()
 {
-    printf("\nVkApp::createRtAccelerationStructure\n");
+    TRACE("\nVkApp::createRtAccelerationStructure\n");
     // BLAS - Storing each primitive in a geometry
+    // Split layout: one BLAS per distinct mesh, shared by all of its
+    // instances.  Monolithic layout: one BLAS per object, holding a
+    // geometry for each of its instances with the instance transform
+    // applied at build time (so repeated meshes are duplicated).
+    // The monolithic geometries read their transforms from
+    // m_asTransformBW, and are updatable so that updateSceneGraph can
+    // refit them.
+    if (!m_splitBlas)
+        createAsTransformBuffer();
+
     std::vector<BlasInput> allBlas;
     allBlas.reserve(m_objData.size());
-    printf("  For each object of %ld objects\n", m_objData.size());
-    for (const auto& obj : m_objData)  {
-        BlasInput blas = objectToVkGeometryKHR(obj);
-        // We could add more geometry in each BLAS, but we add only one for now
-        allBlas.emplace_back(blas); }
-
-    m_rtBuilder.buildBlas(allBlas, VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR);
-
-    // TLAS (Top-Level Acceleration Structure)
-    printf("  Create a TLAS vector to hold each BLAS and it's transformation\n");
-    std::vector<VkAccelerationStructureInstanceKHR> tlas;
-    tlas.reserve(m_objInst.size());
-    for(const ObjInst& inst : m_objInst) {
-        printf("  For each object\n");
-        VkAccelerationStructureInstanceKHR _i{};
-        _i.transform = toTransformMatrixKHR(inst.transform);  // Position of the instance
-        _i.instanceCustomIndex = inst.objIndex; 
-        _i.accelerationStructureReference = m_rtBuilder.getBlasDeviceAddress(inst.objIndex);
-        _i.flags = VK_GEOMETRY_INSTANCE_TRIANGLE_FACING_CULL_DISABLE_BIT_KHR;
-        _i.mask  = 0xFF;       //  Only be hit if rayMask & instance.mask != 0
-        _i.instanceShaderBindingTableRecordOffset = 0; // Use the same hit group for all objects
-        printf("    append object's BLAS-address and transformation to TLAS vector\n");
-        tlas.emplace_back(_i);
-    }
-    
-    m_rtBuilder.buildTlas(tlas, VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR,
-                          false, false);
+    TRACE("  For each object of %ld objects\n", m_objData.size());
+    for (uint32_t o = 0; o < m_objData.size(); o++)  {
+        ObjData& obj = m_objData[o];
+        if (m_splitBlas) {
+            for (auto& mesh : obj.meshes) {
+                mesh.blasIndex = static_cast<uint32_t>(allBlas.size());
+                allBlas.emplace_back(objectToVkGeometryKHR(obj, mesh)); } }
+        else {
+            obj.blasIndex = static_cast<uint32_t>(allBlas.size());
+            allBlas.emplace_back(instancesToVkGeometryKHR(o)); } }
+
+    m_rtBuilder.buildBlas(allBlas, blasFlags());
+
+    // TLAS (Top-Level Acceleration Structure).  Updatable, so that
+    // rebuildModelAS and updateSceneGraph can refit it.
+    buildTlas(true);
+
+    m_blasMemory = m_rtBuilder.blasMemorySize();
+    printf("  %s layout: %zd BLAS (%.2f MB), %d TLAS instances (%.2f MB)\n",
+           m_splitBlas ? "Split" : "Monolithic", allBlas.size(), m_blasMemory/(1024.0*1024.0),
+           m_tlasInstances.size(), m_tlasMemory/(1024.0*1024.0));
     m_scratch1.destroy(m_device);
-    m_scratch2.destroy(m_device);
-    printf("End of VkApp::createRtAccelerationStructure\n\n");
+    TRACE("End of VkApp::createRtAccelerationStructure\n\n");
+    RaytracingBuilderKHR::verbose = app->verbose;
 
 }
 
-
+/*********************************************************************
+ * param:  objIndices, the objects whose buffers were replaced
+ * param:  oldBlas, the BLASes built from their old buffers
+ *
+ * brief:  Rebuilds the BLASes of some objects, leaving all others
+ *         alone, then refits the TLAS, which picks up the new BLAS
+ *         addresses.  If the instance count changed the TLAS can not
+ *         be refit, and is rebuilt instead.  Nothing may be using the
+ *         old BLASes (or the TLAS) any more.
+ **********************************************************************/
+void VkApp::rebuildModelAS(const std::vector<uint32_t>& objIndices,
+                           const std::vector<uint32_t>& oldBlas)
+{
+    // m_objInst may have changed.  Built BLASes have their transforms
+    // applied already; later refits read the new buffer.
+    if (!m_splitBlas)
+        createAsTransformBuffer();
+
+    std::vector<BlasInput> blas;
+    for (uint32_t objIndex : objIndices) {
+        const ObjData& obj = m_objData[objIndex];
+        if (m_splitBlas)
+            for (const auto& mesh : obj.meshes)
+                blas.emplace_back(objectToVkGeometryKHR(obj, mesh));
+        else
+            blas.emplace_back(instancesToVkGeometryKHR(objIndex)); }
+
+    std::vector<uint32_t> ids = m_rtBuilder.replaceBlas(oldBlas, blas, blasFlags());
+    size_t id = 0;
+    for (uint32_t objIndex : objIndices) {
+        ObjData& obj = m_objData[objIndex];
+        if (m_splitBlas)
+            for (auto& mesh : obj.meshes)
+                mesh.blasIndex = ids[id++];
+        else
+            obj.blasIndex = ids[id++]; }
+
+    bool refit = buildTlas(true);
+    if (!refit)
+        m_rtDesc.write(m_device, 0, m_rtBuilder.getAccelerationStructure());  // A new TLAS
+
+    m_blasMemory = m_rtBuilder.blasMemorySize();
+    TRACE("  Rebuilt %zd BLAS; TLAS %s\n", blas.size(), refit ? "refit" : "rebuilt");
+    m_scratch1.destroy(m_device);
+}
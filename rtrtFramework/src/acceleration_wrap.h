@@ -37,6 +37,42 @@ inline VkTransformMatrixKHR toTransformMatrixKHR(glm::mat4 matrix)
     return out_matrix;
 }
 
+// The TLAS's instances, field by field (structure of arrays), and
+// their packing into the VkAccelerationStructureInstanceKHR array the
+// TLAS builds read in place (a persistently mapped buffer; see
+// VkApp::buildTlas).  Setting an entry marks it, and write() packs only
+// the marked entries, so moving a few instances out of many costs a
+// few stores rather than a new array.
+class TlasInstances
+{
+public:
+    // New entries are zero; every entry is marked
+    void resize(uint32_t count);
+    uint32_t size() const { return static_cast<uint32_t>(m_blas.size()); }
+
+    void set(uint32_t i, const glm::mat4& transform, VkDeviceAddress blas, uint32_t customIndex,
+             uint8_t mask, uint32_t sbtOffset, VkGeometryInstanceFlagsKHR flags);
+    void setTransform(uint32_t i, const glm::mat4& transform);
+    void markAll();
+
+    // Packs the marked entries into out (of at least size() entries)
+    // and unmarks them.  Returns how many were written.
+    uint32_t write(VkAccelerationStructureInstanceKHR* out);
+
+private:
+    std::vector<VkTransformMatrixKHR> m_transform;
+    std::vector<VkDeviceAddress>      m_blas;
+    std::vector<uint32_t>             m_customIndex;  // 24 bits
+    std::vector<uint32_t>             m_sbtOffset;    // 24 bits
+    std::vector<uint8_t>              m_mask;
+    std::vector<uint8_t>              m_flags;
+    std::vector<uint8_t>              m_marked;
+    std::vector<uint32_t>             m_markedList;   // Unless m_allMarked
+    bool                              m_allMarked{true};
+
+    void mark(uint32_t i);
+};
+
 struct WrapAccelerationStructure
 {
     VkAccelerationStructureKHR accel;
@@ -61,6 +97,10 @@ class RaytracingBuilderKHR
 {
 public:
     VkApp* VK;
+    // Print each step of every build.  On while the scene is first
+    // built; after that (reloads, streaming) only with -v.
+    static bool verbose;
+
     // Initializing the allocator and querying the raytracing properties
     void setup(VkApp* _VK, const VkDevice& device, uint32_t queueIndex);
 
@@ -73,26 +113,54 @@ public:
     // Return the Acceleration Structure Device Address of a BLAS Id
     VkDeviceAddress getBlasDeviceAddress(uint32_t blasId);
 
+    // Device memory used by all the BLASes, and by the TLAS
+    VkDeviceSize blasMemorySize();
+    VkDeviceSize tlasMemorySize();
+
     // Create all the BLAS from the vector of BlasInput
     void buildBlas(const std::vector<BlasInput>&        input,
                    VkBuildAccelerationStructureFlagsKHR flags
                        = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR);
 
-    // Refit BLAS number blasIdx from updated buffer contents.
-    void updateBlas(uint32_t blasIdx, BlasInput& blas, VkBuildAccelerationStructureFlagsKHR flags);
-
-    // Build TLAS from an array of VkAccelerationStructureInstanceKHR
+    // Build new BLASes in place of those in blasIds (see the definition)
+    std::vector<uint32_t> replaceBlas(const std::vector<uint32_t>&        blasIds,
+                                      const std::vector<BlasInput>&        input,
+                                      VkBuildAccelerationStructureFlagsKHR flags
+                                          = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR);
+
+    // Record a refit of the BLASes in blasIds from updated buffer
+    // contents (see the definition)
+    void cmdUpdateBlas(VkCommandBuffer                      cmdBuf,
+                       const std::vector<uint32_t>&         blasIds,
+                       const std::vector<BlasInput>&        input,
+                       VkBuildAccelerationStructureFlagsKHR flags);
+
+    // Build TLAS from count VkAccelerationStructureInstanceKHR at the
+    // device address instances, read in place; they must stay there,
+    // unchanged, until this returns (the build is waited on).
     // - Use motion=true with VkAccelerationStructureMotionInstanceNV
     // - The resulting TLAS will be stored in m_tlas
-    // - update is to rebuild the Tlas with updated matrices, flag must have the 'allow_update'
+    // - flags must have 'allow_update' for cmdUpdateTlas to refit it
 
-    void buildTlas(const std::vector<VkAccelerationStructureInstanceKHR>& instances,
+    void buildTlas(VkDeviceAddress                      instances,
+                   uint32_t                             count,
                    VkBuildAccelerationStructureFlagsKHR flags
                        = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR,
-                   bool                                 update = false,
                    bool                                 motion = false);
 
-    // Creating the TLAS, called by buildTlas
+    // Record a refit of the TLAS, with updated matrices, into cmdBuf,
+    // and a barrier before the ray tracing shaders.  The instances are
+    // read when cmdBuf runs; the count and flags must be the last build's.
+    void cmdUpdateTlas(VkCommandBuffer                      cmdBuf,
+                       VkDeviceAddress                      instances,
+                       uint32_t                             count,
+                       VkBuildAccelerationStructureFlagsKHR flags,
+                       bool                                 motion = false);
+
+    // Instances in the TLAS as last built; an update must keep the count
+    uint32_t tlasInstanceCount() const { return m_tlasInstances; }
+
+    // Creating or refitting the TLAS, called by buildTlas and cmdUpdateTlas
     void cmdCreateTlas(VkCommandBuffer                      cmdBuf,          // Command buffer
                        uint32_t                             countInstance,   // number of instances
                        VkDeviceAddress                      instBufferAddr,  // Buffer address of instances
@@ -104,7 +172,16 @@ public:
 
 protected:
     std::vector<WrapAccelerationStructure> m_blas;  // Bottom-level acceleration structure
-    WrapAccelerationStructure              m_tlas;  // Top-level acceleration structure
+    std::vector<uint32_t>                  m_freeBlas;  // Empty m_blas slots, for replaceBlas
+    WrapAccelerationStructure              m_tlas{};  // Top-level acceleration structure
+    uint32_t                               m_tlasInstances{0};
+    BufferWrap                             m_tlasScratch{};  // For builds and refits, kept
+    VkDeviceSize                           m_tlasScratchSize{0};
+    VkDeviceAddress                        m_tlasScratchAddress{0};
+    BufferWrap                             m_blasScratch{};  // For BLAS refits, kept
+    VkDeviceSize                           m_blasScratchSize{0};
+    VkDeviceAddress                        m_blasScratchAddress{0};
+    VkDeviceSize                           m_scratchAlignment{1};
     
     // Setup
     VkDevice                 m_device{VK_NULL_HANDLE};
@@ -43,6 +43,10 @@ void drawGUI(App* app, VkApp& VK)
     // Accumulate paths
     ImGui::Checkbox("Accumulate", &VK.m_pcRay.accumulate);
 
+    // Explicit light connection (next event estimation)
+    if (ImGui::Checkbox("Light Sampling", &VK.m_pcRay.explicitLight))
+        VK.m_pcRay.clear = true;
+
     // History Tracking
     ImGui::Checkbox("History", &VK.m_pcRay.history);
 
@@ -64,6 +68,58 @@ void drawGUI(App* app, VkApp& VK)
 
 
     ImGui::Text("Frame Count: %i", VK.frameCount);
+
+    // Acceleration structure layout and its cost
+    ImGui::Text("BLAS layout: %s", VK.m_splitBlas ? "per mesh" : "monolithic");
+    ImGui::Text("AS memory: BLAS %.2f MB, TLAS %.2f MB",
+                VK.m_blasMemory/(1024.0*1024.0), VK.m_tlasMemory/(1024.0*1024.0));
+    if (VK.useRaytracer)
+        ImGui::Text("Trace time: %.3f ms", VK.m_traceTimeMs);
+
+    // Device memory: each heap's use against the driver's budget, and
+    // what the allocations are for
+    if (ImGui::CollapsingHeader("Memory")) {
+        std::vector<MemoryAllocator::HeapBudget> heaps = VK.m_allocator.heapBudgets();
+        for (size_t i = 0; i < heaps.size(); i++)
+            ImGui::Text("Heap %d (%s): %.1f of %.1f MB, %.1f MB ours", int(i),
+                        heaps[i].deviceLocal ? "device" : "host", heaps[i].usage/1048576.0,
+                        heaps[i].budget/1048576.0, heaps[i].allocated/1048576.0);
+        if (!VK.m_allocator.hasMemoryBudget())
+            ImGui::Text("(no VK_EXT_memory_budget: heap sizes and our use only)");
+        MemoryAllocator::Stats memory = VK.m_allocator.stats();
+        for (int c = 0; c < MEM_CATEGORIES; c++)
+            if (memory.categoryCount[c] > 0)
+                ImGui::Text("  %-12s %5d %9.2f MB", memoryCategoryName(MemoryCategory(c)),
+                            memory.categoryCount[c], memory.categoryBytes[c]/1048576.0);
+        if (ImGui::Button("Write memory_report.json"))
+            VK.writeMemoryReport("memory_report.json"); }
+
+    // Raster levels of detail (0 draws every mesh in full)
+    if (!VK.useRaytracer) {
+        ImGui::SliderFloat("LOD error (px)", &VK.m_lodPixels, 0.0f, 8.0f, "%.1f");
+        ImGui::Text("Raster triangles: %.2fM of %.2fM", VK.m_rasterTriangles/1e6,
+                    VK.m_rasterFullTriangles/1e6); }
+
+    // Out-of-core geometry
+    if (VK.m_streamer.nbChunks() > 0)
+        ImGui::Text("Chunks: %d resident, %d loading of %d (%.1f / %.1f MB)",
+                    VK.m_streamer.count(GeometryStreamer::RESIDENT),
+                    VK.m_streamer.count(GeometryStreamer::LOADING), VK.m_streamer.nbChunks(),
+                    VK.m_streamer.usedBytes()/1048576.0, VK.m_streamer.budget()/1048576.0);
+
+    // Scene graph: nudging a node moves its whole subtree
+    if (VK.m_sceneGraph.size() > 0) {
+        static int node = 0;
+        static glm::vec3 nudge(0.0f);
+        ImGui::Text("Scene nodes: %d (%d updated)", VK.m_sceneGraph.size(),
+                    VK.m_sceneGraph.nbChanged());
+        ImGui::SliderInt("Node", &node, 0, VK.m_sceneGraph.size() - 1);
+        node = std::clamp(node, 0, int(VK.m_sceneGraph.size()) - 1);  // Reloads may drop nodes
+        if (ImGui::DragFloat3("Nudge node", &nudge.x, 0.01f)) {
+            glm::mat4 local = VK.m_sceneGraph.local(node);
+            local[3] += glm::vec4(nudge, 0.0f);  // In its parent's space
+            VK.m_sceneGraph.setLocal(node, local); }
+        nudge = glm::vec3(0.0f); }
 }
 
 //////////////////////////////////////////////////////////////////////////
@@ -228,6 +284,12 @@ App::App(int argc, char** argv)
         std::string arg = argv[argi++];
         if (arg == "-d")
             doApiDump = true;
+        else if (arg == "-m")
+            monolithicBlas = true;
+        else if (arg == "-v")
+            verbose = true;
+        else if (arg == "-s" && argi < argc)
+            sceneFile = argv[argi++];
         else {
             printf("Unknown argument: %s\n", arg.c_str());
             exit(-1); } }
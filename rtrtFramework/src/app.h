@@ -1,3 +1,4 @@
+#include <string>
 
 #include "camera.h"
 
@@ -7,6 +8,9 @@ public:
     GLFWwindow* GLFW_window;
     App(int argc, char** argv);
     bool doApiDump;
+    bool monolithicBlas = false;  // -m: one BLAS for each whole object
+    bool verbose = false;         // -v: trace acceleration structure builds after startup
+    std::string sceneFile;        // -s file: scene description (see scene_file.h)
     
     bool m_show_gui = true;
     Camera myCamera;
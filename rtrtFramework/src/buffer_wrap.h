@@ -1,14 +1,16 @@
 
 # pragma once
 
+#include "memory_allocator.h"
+
 struct BufferWrap
 {
-    VkBuffer buffer;
-    VkDeviceMemory memory;
+    VkBuffer buffer{};
+    MemoryAllocation allocation;  // From VkApp::m_allocator
     
     void destroy(VkDevice& device)
     {
         vkDestroyBuffer(device, buffer, nullptr);
-        vkFreeMemory(device, memory, nullptr);
+        allocation.free();
     }
 };
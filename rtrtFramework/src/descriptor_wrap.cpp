@@ -2,9 +2,10 @@
 #include "descriptor_wrap.h"
 #include <assert.h>
 
-void DescriptorWrap::setBindings(const VkDevice device, std::vector<VkDescriptorSetLayoutBinding> _bt)
+void DescriptorWrap::setBindings(const VkDevice device, std::vector<VkDescriptorSetLayoutBinding> _bt,
+                                 uint nbSets)
 {
-    uint maxSets = 1;  // 1 is good enough for us.  In general, may want more;
+    uint maxSets = nbSets;  // Sets alike but for what is written into each
     bindingTable = _bt;
 
     // Build descSetLayout
@@ -44,16 +45,24 @@ void DescriptorWrap::setBindings(const VkDevice device, std::vector<VkDescriptor
 
     vkCreateDescriptorPool(device, &descrPoolInfo, nullptr, &descPool);
 
-    // Allocate DescriptorSet
+    // Allocate the DescriptorSets, all of the one layout
+    std::vector<VkDescriptorSetLayout> layouts(nbSets, descSetLayout);
     VkDescriptorSetAllocateInfo allocInfo = {VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO};
     allocInfo.descriptorPool              = descPool;
-    allocInfo.descriptorSetCount          = 1;
-    allocInfo.pSetLayouts                 = &descSetLayout;
+    allocInfo.descriptorSetCount          = nbSets;
+    allocInfo.pSetLayouts                 = layouts.data();
 
-    // Warning: The next line creates a single descriptor set from the
-    // above pool since that's all our program needs.  This is too
-    // restrictive in general, but fine for this program.
-    vkAllocateDescriptorSets(device, &allocInfo, &descSet);
+    descSets.resize(nbSets);
+    vkAllocateDescriptorSets(device, &allocInfo, descSets.data());
+    descSet = descSets[0];
+}
+
+void DescriptorWrap::update(VkDevice device, VkWriteDescriptorSet& writeSet, int set)
+{
+    for (uint s = 0; s < descSets.size(); s++) {
+        if (set == ALL_SETS || set == int(s)) {
+            writeSet.dstSet = descSets[s];
+            vkUpdateDescriptorSets(device, 1, &writeSet, 0, nullptr); } }
 }
 
 void DescriptorWrap::destroy(VkDevice device)
@@ -64,9 +73,13 @@ void DescriptorWrap::destroy(VkDevice device)
 
 void DescriptorWrap::write(VkDevice& device, uint index, const VkBuffer& buffer)
 {
-    VkDescriptorBufferInfo desBuf{buffer, 0, VK_WHOLE_SIZE};
+    write(device, index, buffer, VK_WHOLE_SIZE);
+}
+
+void DescriptorWrap::write(VkDevice& device, uint index, const VkBuffer& buffer, VkDeviceSize range)
+{
+    VkDescriptorBufferInfo desBuf{buffer, 0, range};
     VkWriteDescriptorSet writeSet{VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET};
-    writeSet.dstSet          = descSet;
     writeSet.dstBinding      = index;
     writeSet.dstArrayElement = 0;
     writeSet.descriptorCount = 1;
@@ -80,16 +93,15 @@ void DescriptorWrap::write(VkDevice& device, uint index, const VkBuffer& buffer)
            writeSet.descriptorType == VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER ||
            writeSet.descriptorType == VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC);
     
-    vkUpdateDescriptorSets(device, 1, &writeSet, 0, nullptr);
+    update(device, writeSet, ALL_SETS);
 
 }
 
-void DescriptorWrap::write(VkDevice& device, uint index, const VkDescriptorImageInfo& textureDesc)
+void DescriptorWrap::write(VkDevice& device, uint index, const VkDescriptorImageInfo& textureDesc, int set)
 {
     //VkDescriptorBufferInfo desBuf{nvbuffer.buffer, 0, VK_WHOLE_SIZE};
 
     VkWriteDescriptorSet writeSet{VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET};
-    writeSet.dstSet          = descSet;
     writeSet.dstBinding      = index;
     writeSet.dstArrayElement = 0;
     writeSet.descriptorCount = 1;
@@ -104,7 +116,7 @@ void DescriptorWrap::write(VkDevice& device, uint index, const VkDescriptorImage
            writeSet.descriptorType == VK_DESCRIPTOR_TYPE_STORAGE_IMAGE  ||
            writeSet.descriptorType == VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT);
     
-    vkUpdateDescriptorSets(device, 1, &writeSet, 0, nullptr);
+    update(device, writeSet, set);
 }
 
 void DescriptorWrap::write(VkDevice& device, uint index, const std::vector<ImageWrap>& textures)
@@ -115,7 +127,6 @@ void DescriptorWrap::write(VkDevice& device, uint index, const std::vector<Image
         des.emplace_back(texture.Descriptor());
 
     VkWriteDescriptorSet writeSet{VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET};
-    writeSet.dstSet          = descSet;
     writeSet.dstBinding      = index;
     writeSet.dstArrayElement = 0;
     writeSet.descriptorCount = des.size();
@@ -130,7 +141,7 @@ void DescriptorWrap::write(VkDevice& device, uint index, const std::vector<Image
            writeSet.descriptorType == VK_DESCRIPTOR_TYPE_STORAGE_IMAGE  ||
            writeSet.descriptorType == VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT);
     
-    vkUpdateDescriptorSets(device, 1, &writeSet, 0, nullptr);
+    update(device, writeSet, ALL_SETS);
 }
 
 void DescriptorWrap::write(VkDevice& device, uint index, const VkAccelerationStructureKHR& tlas)
@@ -141,7 +152,6 @@ void DescriptorWrap::write(VkDevice& device, uint index, const VkAccelerationStr
     descASInfo.pAccelerationStructures    = &tlas;
   
     VkWriteDescriptorSet writeSet{VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET};
-    writeSet.dstSet          = descSet;
     writeSet.dstBinding      = index;
     writeSet.dstArrayElement = 0;
     writeSet.descriptorCount = 1;
@@ -152,5 +162,5 @@ void DescriptorWrap::write(VkDevice& device, uint index, const VkAccelerationStr
 
     assert(writeSet.descriptorType == VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR);
     
-    vkUpdateDescriptorSets(device, 1, &writeSet, 0, nullptr);
+    update(device, writeSet, ALL_SETS);
 }
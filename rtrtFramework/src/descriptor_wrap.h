@@ -13,14 +13,25 @@ public:
     
     VkDescriptorSetLayout descSetLayout;
     VkDescriptorPool descPool;
-    VkDescriptorSet descSet;    // Could be  vector<VkDescriptorSet> for multiple sets;
+    VkDescriptorSet descSet;    // The first (often only) of descSets
+    std::vector<VkDescriptorSet> descSets;  // Of the one layout, e.g. one per ping-pong parity
+
+    static const int ALL_SETS = -1;
     
-    void setBindings(const VkDevice device, std::vector<VkDescriptorSetLayoutBinding> _bt);
+    void setBindings(const VkDevice device, std::vector<VkDescriptorSetLayoutBinding> _bt,
+                     uint nbSets=1);
     void destroy(VkDevice device);
 
-    // Any data can be written into a descriptor set.  Apparently I need only these few types:
+    // Any data can be written into a descriptor set.  Apparently I need only these few types.
+    // Each goes into every set, except images, which may go into one set only:
     void write(VkDevice& device, uint index, const VkBuffer& buffer);
-    void write(VkDevice& device, uint index, const VkDescriptorImageInfo& textureDesc);
+    // A range of buffer; for the *_DYNAMIC types, the window the dynamic offset moves
+    void write(VkDevice& device, uint index, const VkBuffer& buffer, VkDeviceSize range);
+    void write(VkDevice& device, uint index, const VkDescriptorImageInfo& textureDesc,
+               int set=ALL_SETS);
     void write(VkDevice& device, uint index, const std::vector<ImageWrap>& textures);
     void write(VkDevice& device, uint index, const VkAccelerationStructureKHR& tlas);
+
+private:
+    void update(VkDevice device, VkWriteDescriptorSet& writeSet, int set);
 };
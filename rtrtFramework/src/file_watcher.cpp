@@ -0,0 +1,38 @@
+//////////////////////////////////////////////////////////////////////
+// Polling file watcher.  See file_watcher.h.
+////////////////////////////////////////////////////////////////////////
+
+#include "file_watcher.h"
+
+namespace fs = std::filesystem;
+
+void FileWatcher::watch(const std::string& path)
+{
+    std::error_code ec;
+    Entry entry;
+    entry.time = fs::last_write_time(path, ec);  // A missing file reads as the epoch
+    m_files[path] = entry;
+}
+
+std::vector<std::string> FileWatcher::changed()
+{
+    std::vector<std::string> result;
+    auto now = std::chrono::steady_clock::now();
+    if (now - m_lastPoll < m_interval)
+        return result;
+    m_lastPoll = now;
+
+    for (auto& file : m_files) {
+        std::error_code ec;
+        fs::file_time_type time = fs::last_write_time(file.first, ec);
+        if (ec)
+            continue;  // Mid save (removed, not yet replaced); look again next poll
+        Entry& entry = file.second;
+        if (time != entry.time) {
+            entry.time = time;
+            entry.settling = true; }
+        else if (entry.settling) {
+            entry.settling = false;
+            result.push_back(file.first); } }
+    return result;
+}
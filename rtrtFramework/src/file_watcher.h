@@ -0,0 +1,39 @@
+
+#pragma once
+
+#include <chrono>
+#include <filesystem>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Watches a set of files for changes by polling their modification
+// times, which needs nothing platform specific and costs one stat per
+// file per poll.  A change is reported once the time has stopped
+// moving for a poll, so a file still being written (or replaced by an
+// editor's save) is not picked up half done.
+class FileWatcher
+{
+public:
+    explicit FileWatcher(std::chrono::milliseconds interval = std::chrono::milliseconds(250))
+        : m_interval(interval) {}
+
+    // Starts watching path (again, if it was); its current version
+    // counts as seen.
+    void watch(const std::string& path);
+
+    // The watched files that changed since they were last reported (or
+    // watched).  Polls at most once an interval; empty in between.
+    std::vector<std::string> changed();
+
+private:
+    struct Entry
+    {
+        std::filesystem::file_time_type time{};
+        bool settling{false};  // Changed at the last poll; reported at the next if unchanged
+    };
+
+    std::chrono::milliseconds m_interval;
+    std::chrono::steady_clock::time_point m_lastPoll{};
+    std::unordered_map<std::string, Entry> m_files;
+};
@@ -0,0 +1,61 @@
+//////////////////////////////////////////////////////////////////////
+// Per-frame dynamic data in a mapped buffer.  See frame_arena.h.
+////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "frame_arena.h"
+
+void FrameArena::init(VkPhysicalDevice physicalDevice, VkDevice device, MemoryAllocator& allocator,
+                      uint32_t frames)
+{
+    m_device = device;
+    m_frames = frames;
+
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+    m_alignment = std::max(properties.limits.minUniformBufferOffsetAlignment,
+                           properties.limits.minStorageBufferOffsetAlignment);
+
+    VkBufferCreateInfo bufferInfo{VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO};
+    bufferInfo.size = FRAME_SIZE*frames;
+    bufferInfo.usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+    bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    if (vkCreateBuffer(m_device, &bufferInfo, nullptr, &m_buffer) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create frame arena!"); }
+
+    VkMemoryPropertyFlags hostFlags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
+        | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+    try {
+        m_allocation = allocator.allocate(m_buffer, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | hostFlags,
+                                          {MEM_UNIFORM, "frame arena"});
+        m_deviceLocal = true; }
+    catch (const std::runtime_error&) {
+        m_allocation = allocator.allocate(m_buffer, hostFlags, {MEM_UNIFORM, "frame arena"});
+        m_deviceLocal = false; }
+
+    begin(0);
+}
+
+void FrameArena::destroy()
+{
+    vkDestroyBuffer(m_device, m_buffer, nullptr);
+    m_allocation.free();
+    m_buffer = VK_NULL_HANDLE;
+}
+
+void FrameArena::begin(uint32_t frame)
+{
+    m_frameStart = FRAME_SIZE*(frame % m_frames);
+    m_head = m_frameStart;
+}
+
+FrameArena::Slice FrameArena::alloc(VkDeviceSize size)
+{
+    VkDeviceSize offset = (m_head + m_alignment - 1) / m_alignment * m_alignment;
+    if (offset + size > m_frameStart + FRAME_SIZE) {
+        throw std::runtime_error("frame arena is full!"); }
+    m_head = offset + size;
+    return Slice{uint32_t(offset), (char*)m_allocation.mapped + offset};
+}
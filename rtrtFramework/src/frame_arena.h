@@ -0,0 +1,57 @@
+
+#pragma once
+
+#include <string.h>
+#include <vulkan/vulkan_core.h>
+#include "memory_allocator.h"
+
+// Per-frame dynamic data (uniforms and the like), bump allocated out
+// of one persistently mapped buffer.  The buffer is split into a
+// region per frame in flight; begin() starts a frame's region over,
+// once the frame that last used it has completed, and alloc() hands
+// out slices of it at the device's uniform/storage offset alignment.
+// Shaders see a slice through a *_DYNAMIC descriptor bound with its
+// offset, so nothing is copied and no transfer barrier is needed: the
+// host writes are visible to the queue submit that follows them.
+//
+// The memory is device local and host visible (resizable BAR) when
+// the device has such, and plain host visible otherwise.
+class FrameArena
+{
+public:
+    static constexpr VkDeviceSize FRAME_SIZE = 256 << 10;
+
+    struct Slice
+    {
+        uint32_t offset;  // Into buffer(), as a dynamic offset
+        void*    data;
+    };
+
+    void init(VkPhysicalDevice physicalDevice, VkDevice device, MemoryAllocator& allocator,
+              uint32_t frames);
+    void destroy();
+
+    void begin(uint32_t frame);
+    // Throws std::runtime_error when the frame's region is full
+    Slice alloc(VkDeviceSize size);
+    template<typename T> uint32_t push(const T& value)
+    {
+        Slice slice = alloc(sizeof(T));
+        memcpy(slice.data, &value, sizeof(T));
+        return slice.offset;
+    }
+
+    VkBuffer     buffer() const     { return m_buffer; }
+    bool         deviceLocal() const { return m_deviceLocal; }
+    VkDeviceSize used() const       { return m_head - m_frameStart; }  // This frame
+
+private:
+    VkDevice         m_device{VK_NULL_HANDLE};
+    VkBuffer         m_buffer{VK_NULL_HANDLE};
+    MemoryAllocation m_allocation;
+    bool             m_deviceLocal{false};
+    uint32_t         m_frames{0};
+    VkDeviceSize     m_alignment{1};
+    VkDeviceSize     m_frameStart{0};
+    VkDeviceSize     m_head{0};
+};
@@ -0,0 +1,350 @@
+//////////////////////////////////////////////////////////////////////
+// Chunked model files for out-of-core geometry.  See geometry_chunks.h.
+////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include <float.h>
+#include <fstream>
+#include <stdexcept>
+#include <string.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <filesystem>
+namespace fs = std::filesystem;
+
+#include "geometry_chunks.h"
+#include "model_cache.h"
+
+namespace {
+
+const char MAGIC[4] = {'R', 'T', 'G', 'C'};
+
+struct ChunkHeader
+{
+    char     magic[4];
+    uint32_t version;
+    uint32_t vertexSize;      // sizeof(Vertex) when written
+    uint32_t chunkInfoSize;   // sizeof(ChunkInfo) when written
+    uint32_t chunkTriangles;  // CHUNK_TRIANGLES when written
+    uint32_t proxyGrid;       // PROXY_GRID when written
+    uint64_t sourceSize;      // Size of the model file when written
+    int64_t  sourceTime;      // Modification time of the model file when written
+
+    uint32_t nbChunks;
+    uint32_t pad;
+    uint64_t directoryOffset;
+    uint64_t fileSize;
+};
+
+uint64_t alignUp(uint64_t x) { return (x + 15) & ~uint64_t(15); }
+
+// One triangle of one of the model's instances, while partitioning.
+struct TriangleRef
+{
+    uint32_t instance;
+    uint32_t triangle;  // Within the instance's mesh
+    vec3     centroid;  // Model space
+};
+
+// Splits refs[first, last) at the median of the longest axis of the
+// centroids, recursively, until no piece holds more than maxTriangles.
+// The pieces are appended to leaves in order, so that consecutive
+// chunks are near each other.
+void partition(std::vector<TriangleRef>& refs, size_t first, size_t last, uint32_t maxTriangles,
+               std::vector<std::pair<size_t, size_t>>& leaves)
+{
+    if (last - first <= maxTriangles) {
+        leaves.emplace_back(first, last);
+        return; }
+
+    vec3 lo(FLT_MAX), hi(-FLT_MAX);
+    for (size_t i = first; i < last; i++) {
+        lo = glm::min(lo, refs[i].centroid);
+        hi = glm::max(hi, refs[i].centroid); }
+    vec3 extent = hi - lo;
+    int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : extent.y >= extent.z ? 1 : 2;
+
+    size_t mid = first + (last - first)/2;
+    std::nth_element(refs.begin() + first, refs.begin() + mid, refs.begin() + last,
+                     [axis](const TriangleRef& a, const TriangleRef& b) {
+                         return a.centroid[axis] < b.centroid[axis]; });
+    partition(refs, first, mid, maxTriangles, leaves);
+    partition(refs, mid, last, maxTriangles, leaves);
+}
+
+// The triangles of one leaf, with their vertices placed in model space
+// and renumbered from 0.  Fills in the chunk's bounds.
+ChunkGeometry gatherChunk(const ModelView& model, const std::vector<glm::mat3>& normalMatrices,
+                          const TriangleRef* refs, size_t count, vec3& bmin, vec3& bmax)
+{
+    ChunkGeometry chunk;
+    std::unordered_map<uint64_t, uint32_t> local;  // (instance, model vertex) -> chunk vertex
+    bmin = vec3( FLT_MAX);
+    bmax = vec3(-FLT_MAX);
+    for (size_t r = 0; r < count; r++) {
+        const TriangleRef&  ref  = refs[r];
+        const MeshInstance& inst = model.instances[ref.instance];
+        uint32_t t = model.meshes[inst.mesh].firstIndex/3 + ref.triangle;
+        for (uint32_t k = 0; k < 3; k++) {
+            uint32_t v = model.indices[3*t + k];
+            auto found = local.emplace((uint64_t(ref.instance) << 32) | v,
+                                       static_cast<uint32_t>(chunk.vertices.size()));
+            if (found.second) {
+                const Vertex& src = model.vertices[v];
+                vec3 pos = vec3(inst.transform*vec4(src.pos, 1.0f));
+                vec3 nrm = normalMatrices[ref.instance]*VertexNormal(src);
+                chunk.vertices.push_back(makeVertex(pos, nrm, VertexTexCoord(src)));
+                bmin = glm::min(bmin, pos);
+                bmax = glm::max(bmax, pos); }
+            chunk.indices.push_back(found.first->second); }
+        chunk.matIndx.push_back(model.matIndx[t]); }
+    return chunk;
+}
+
+void writeGeometry(std::ofstream& out, const ChunkGeometry& g)
+{
+    out.write(reinterpret_cast<const char*>(g.vertices.data()), g.vertices.size()*sizeof(Vertex));
+    out.write(reinterpret_cast<const char*>(g.indices.data()), g.indices.size()*sizeof(uint32_t));
+    out.write(reinterpret_cast<const char*>(g.matIndx.data()), g.matIndx.size()*sizeof(int32_t));
+}
+
+}
+
+std::string ChunkedModel::chunkPath(const std::string& modelPath)
+{
+    return modelPath + ".rtg";
+}
+
+bool ChunkedModel::open(const std::string& modelPath)
+{
+    m_chunks.clear();
+
+    uint64_t srcSize;
+    int64_t  srcTime;
+    if (!ModelCache::sourceStamp(modelPath, srcSize, srcTime))
+        return false;
+
+    std::string path = chunkPath(modelPath);
+    std::error_code ec;
+    uint64_t size = fs::file_size(path, ec);
+    if (ec)
+        return false;
+    std::ifstream in(path, std::ios::binary);
+    ChunkHeader h;
+    if (!in.read(reinterpret_cast<char*>(&h), sizeof(h)))
+        return false;
+
+    bool valid = memcmp(h.magic, MAGIC, sizeof(MAGIC)) == 0
+        && h.version        == VERSION
+        && h.vertexSize     == sizeof(Vertex)
+        && h.chunkInfoSize  == sizeof(ChunkInfo)
+        && h.chunkTriangles == CHUNK_TRIANGLES
+        && h.proxyGrid      == PROXY_GRID
+        && h.sourceSize     == srcSize
+        && h.sourceTime     == srcTime
+        && h.fileSize       == size
+        && h.directoryOffset + uint64_t(h.nbChunks)*sizeof(ChunkInfo) <= size;
+    if (!valid)
+        return false;
+
+    std::vector<ChunkInfo> chunks(h.nbChunks);
+    in.seekg(h.directoryOffset);
+    if (!in.read(reinterpret_cast<char*>(chunks.data()), chunks.size()*sizeof(ChunkInfo)))
+        return false;
+    for (const auto& c : chunks)
+        if (c.offset + c.bytes() > size || c.proxyOffset + c.proxyBytes() > size)
+            return false;
+
+    m_path   = path;
+    m_chunks = std::move(chunks);
+    printf("Read geometry chunks %s: %zd chunks\n", path.c_str(), m_chunks.size());
+    return true;
+}
+
+bool ChunkedModel::write(const std::string& modelPath, const ModelView& model)
+{
+    ChunkHeader h{};
+    memcpy(h.magic, MAGIC, sizeof(MAGIC));
+    h.version        = VERSION;
+    h.vertexSize     = sizeof(Vertex);
+    h.chunkInfoSize  = sizeof(ChunkInfo);
+    h.chunkTriangles = CHUNK_TRIANGLES;
+    h.proxyGrid      = PROXY_GRID;
+    if (!ModelCache::sourceStamp(modelPath, h.sourceSize, h.sourceTime))
+        return false;
+
+    // Every triangle of every instance, by its model space centroid
+    std::vector<TriangleRef> refs;
+    std::vector<glm::mat3> normalMatrices;
+    for (uint32_t i = 0; i < model.nbInstances; i++) {
+        const MeshInstance& inst = model.instances[i];
+        const MeshRange&    mesh = model.meshes[inst.mesh];
+        normalMatrices.push_back(glm::transpose(glm::inverse(glm::mat3(inst.transform))));
+        for (uint32_t t = 0; t < mesh.nbIndices/3; t++) {
+            const uint32_t* tri = &model.indices[mesh.firstIndex + 3*t];
+            vec3 sum(0.0f);
+            for (uint32_t k = 0; k < 3; k++)
+                sum += vec3(inst.transform*vec4(model.vertices[tri[k]].pos, 1.0f));
+            refs.push_back({i, t, sum/3.0f}); } }
+    if (refs.empty())
+        return false;
+
+    std::vector<std::pair<size_t, size_t>> leaves;
+    partition(refs, 0, refs.size(), CHUNK_TRIANGLES, leaves);
+
+    h.nbChunks        = static_cast<uint32_t>(leaves.size());
+    h.directoryOffset = alignUp(sizeof(ChunkHeader));
+    std::vector<ChunkInfo> directory(leaves.size());
+
+    // Write to a temporary and rename, so an interrupted run never
+    // leaves a truncated file behind.  Chunks are built and written one
+    // at a time; the header and directory go in last.
+    std::string path = chunkPath(modelPath);
+    std::string temp = path + ".tmp";
+    {
+        std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+        if (!out)
+            return false;
+
+        const char zeros[16] = {};
+        uint64_t at = alignUp(h.directoryOffset + directory.size()*sizeof(ChunkInfo));
+        for (uint64_t pad = 0; pad < at; pad += sizeof(zeros))  // Header and directory, for now
+            out.write(zeros, std::min<uint64_t>(sizeof(zeros), at - pad));
+        for (size_t c = 0; c < leaves.size(); c++) {
+            ChunkInfo& info = directory[c];
+            ChunkGeometry chunk = gatherChunk(model, normalMatrices, &refs[leaves[c].first],
+                                              leaves[c].second - leaves[c].first,
+                                              info.bmin, info.bmax);
+            ChunkGeometry proxy = simplifyChunk(chunk, info.bmin, info.bmax, PROXY_GRID);
+            info.nbVertices    = static_cast<uint32_t>(chunk.vertices.size());
+            info.nbIndices     = static_cast<uint32_t>(chunk.indices.size());
+            info.proxyVertices = static_cast<uint32_t>(proxy.vertices.size());
+            info.proxyIndices  = static_cast<uint32_t>(proxy.indices.size());
+
+            info.offset = at;
+            writeGeometry(out, chunk);
+            at = alignUp(at + chunk.bytes());
+            out.write(zeros, at - static_cast<uint64_t>(out.tellp()));
+
+            info.proxyOffset = at;
+            writeGeometry(out, proxy);
+            at = alignUp(at + proxy.bytes());
+            out.write(zeros, at - static_cast<uint64_t>(out.tellp())); }
+
+        h.fileSize = at;
+        out.seekp(0);
+        out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+        out.seekp(h.directoryOffset);
+        out.write(reinterpret_cast<const char*>(directory.data()), directory.size()*sizeof(ChunkInfo));
+
+        if (!out) {
+            out.close();
+            fs::remove(temp);
+            return false; }
+    }
+
+    std::error_code ec;
+    fs::rename(temp, path, ec);
+    if (ec) {
+        fs::remove(temp, ec);
+        return false; }
+
+    printf("Wrote geometry chunks %s: %zd chunks\n", path.c_str(), leaves.size());
+    return true;
+}
+
+ChunkGeometry ChunkedModel::read(uint32_t chunk, bool proxy) const
+{
+    const ChunkInfo& info = m_chunks.at(chunk);
+    uint32_t nbVertices = proxy ? info.proxyVertices : info.nbVertices;
+    uint32_t nbIndices  = proxy ? info.proxyIndices : info.nbIndices;
+
+    ChunkGeometry g;
+    g.vertices.resize(nbVertices);
+    g.indices.resize(nbIndices);
+    g.matIndx.resize(nbIndices/3);
+
+    std::ifstream in(m_path, std::ios::binary);
+    in.seekg(proxy ? info.proxyOffset : info.offset);
+    in.read(reinterpret_cast<char*>(g.vertices.data()), g.vertices.size()*sizeof(Vertex));
+    in.read(reinterpret_cast<char*>(g.indices.data()), g.indices.size()*sizeof(uint32_t));
+    in.read(reinterpret_cast<char*>(g.matIndx.data()), g.matIndx.size()*sizeof(int32_t));
+    if (!in)
+        throw std::runtime_error("failed to read chunk " + std::to_string(chunk) + " of " + m_path + "!");
+    return g;
+}
+
+ChunkGeometry simplifyChunk(const ChunkGeometry& chunk, const vec3& bmin, const vec3& bmax,
+                            uint32_t gridSize)
+{
+    // Each vertex goes to the cluster of its grid cell
+    vec3 scale = float(gridSize)/glm::max(bmax - bmin, vec3(1e-20f));
+    struct Cluster
+    {
+        vec3     pos{0.0f};
+        vec3     nrm{0.0f};
+        vec2     texCoord{0.0f};  // The first vertex's
+        uint32_t count{0};
+        int32_t  index{-1};       // In the result, once used
+    };
+    std::unordered_map<uint32_t, uint32_t> clusterOfCell;
+    std::vector<Cluster>  clusters;
+    std::vector<uint32_t> clusterOf(chunk.vertices.size());
+    for (size_t v = 0; v < chunk.vertices.size(); v++) {
+        const Vertex& vertex = chunk.vertices[v];
+        glm::uvec3 c = glm::uvec3(glm::clamp((vertex.pos - bmin)*scale, vec3(0.0f),
+                                             vec3(float(gridSize - 1))));
+        uint32_t cell = c.x + gridSize*(c.y + gridSize*c.z);
+        auto found = clusterOfCell.emplace(cell, static_cast<uint32_t>(clusters.size()));
+        if (found.second) {
+            clusters.emplace_back();
+            clusters.back().texCoord = VertexTexCoord(vertex); }
+        Cluster& cluster = clusters[found.first->second];
+        cluster.pos += vertex.pos;
+        cluster.nrm += VertexNormal(vertex);
+        cluster.count++;
+        clusterOf[v] = found.first->second; }
+
+    // The triangles whose corners stayed apart, each once
+    ChunkGeometry proxy;
+    std::unordered_set<uint64_t> seen;
+    for (size_t t = 0; t < chunk.matIndx.size(); t++) {
+        uint32_t c[3] = {clusterOf[chunk.indices[3*t]], clusterOf[chunk.indices[3*t + 1]],
+                         clusterOf[chunk.indices[3*t + 2]]};
+        if (c[0] == c[1] || c[1] == c[2] || c[2] == c[0])
+            continue;
+        uint32_t s[3] = {c[0], c[1], c[2]};
+        std::sort(s, s + 3);
+        uint64_t key = (uint64_t(s[0]) << 42) ^ (uint64_t(s[1]) << 21) ^ s[2];
+        if (!seen.insert(key).second)
+            continue;
+        for (uint32_t k = 0; k < 3; k++) {
+            Cluster& cluster = clusters[c[k]];
+            if (cluster.index < 0) {
+                cluster.index = static_cast<int32_t>(proxy.vertices.size());
+                float len = glm::length(cluster.nrm);
+                proxy.vertices.push_back(makeVertex(cluster.pos/float(cluster.count),
+                                                    len > 0.0f ? cluster.nrm/len : vec3(0, 0, 1),
+                                                    cluster.texCoord)); }
+            proxy.indices.push_back(static_cast<uint32_t>(cluster.index)); }
+        proxy.matIndx.push_back(chunk.matIndx[t]); }
+
+    // Everything collapsed: keep the largest triangle as it is
+    if (proxy.indices.empty() && !chunk.matIndx.empty()) {
+        size_t best = 0;
+        float bestArea = -1.0f;
+        for (size_t t = 0; t < chunk.matIndx.size(); t++) {
+            const vec3& a = chunk.vertices[chunk.indices[3*t]].pos;
+            const vec3& b = chunk.vertices[chunk.indices[3*t + 1]].pos;
+            const vec3& c = chunk.vertices[chunk.indices[3*t + 2]].pos;
+            float area = glm::length(glm::cross(b - a, c - a));
+            if (area > bestArea) {
+                bestArea = area;
+                best = t; } }
+        for (uint32_t k = 0; k < 3; k++) {
+            proxy.vertices.push_back(chunk.vertices[chunk.indices[3*best + k]]);
+            proxy.indices.push_back(k); }
+        proxy.matIndx.push_back(chunk.matIndx[best]); }
+
+    return proxy;
+}
@@ -0,0 +1,106 @@
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "model_data.h"
+
+// Out-of-core geometry: a model cut into spatially compact chunks, each
+// of which can be uploaded (and given a BLAS) on its own.  The chunks
+// are written once, next to the model file (as <model>.rtg), and read
+// back one at a time by the worker threads as the residency manager
+// (see geometry_streamer.h) asks for them.  Only the chunk directory
+// is held in memory.
+//
+// Every chunk also carries a proxy: a coarse version of itself made by
+// vertex clustering, small enough to keep on the GPU for good and used
+// whenever the chunk itself is not resident.
+//
+// The model's instances are baked into the chunks (in model space), so
+// a mesh placed many times is stored many times; chunks are about
+// space, not meshes.  Material indices are the model's own.
+//
+// The file is a header, the chunk directory, then each chunk's
+// vertices, triangle indices (relative to the chunk) and triangle
+// material indices, followed by the same three for its proxy.  It is
+// rebuilt if its version, sizeof(Vertex), the chunk size, or the size
+// and modification time of the model file differ from what was
+// recorded.
+
+// A chunk's geometry, as read from the file (or built for it).
+struct ChunkGeometry
+{
+    std::vector<Vertex>   vertices;
+    std::vector<uint32_t> indices;
+    std::vector<int32_t>  matIndx;  // One per triangle
+
+    uint64_t bytes() const
+    {
+        return vertices.size()*sizeof(Vertex) + indices.size()*sizeof(uint32_t)
+            + matIndx.size()*sizeof(int32_t);
+    }
+};
+
+// A chunk's directory entry.
+struct ChunkInfo
+{
+    vec3     bmin{0};  // Model space bounding box
+    vec3     bmax{0};
+    uint32_t nbVertices{0};
+    uint32_t nbIndices{0};
+    uint32_t proxyVertices{0};
+    uint32_t proxyIndices{0};
+    uint64_t offset{0};       // Of its vertices, in the file
+    uint64_t proxyOffset{0};  // Of its proxy's vertices
+
+    // Device memory (in buffer contents) of the chunk and of its proxy
+    uint64_t bytes() const { return geometryBytes(nbVertices, nbIndices); }
+    uint64_t proxyBytes() const { return geometryBytes(proxyVertices, proxyIndices); }
+
+    // Indices are uploaded as 16 bits when they fit (see VkApp::indexTypeFor)
+    static uint64_t geometryBytes(uint32_t nbVertices, uint32_t nbIndices)
+    {
+        uint64_t indexSize = nbVertices <= 0x10000 ? sizeof(uint16_t) : sizeof(uint32_t);
+        return uint64_t(nbVertices)*sizeof(Vertex) + uint64_t(nbIndices)*indexSize
+            + uint64_t(nbIndices/3)*sizeof(int32_t);
+    }
+};
+
+class ChunkedModel
+{
+public:
+    // Bump whenever the layout of the file changes.
+    static const uint32_t VERSION = 1;
+
+    static const uint32_t CHUNK_TRIANGLES = 1 << 16;  // Most triangles in a chunk
+    static const uint32_t PROXY_GRID = 16;            // Clustering cells along each axis
+
+    static std::string chunkPath(const std::string& modelPath);
+
+    // Reads the directory of modelPath's chunk file; false if there is
+    // no valid one for the current version of the model file.
+    bool open(const std::string& modelPath);
+
+    // Cuts model into chunks and writes them as the chunk file of
+    // modelPath; false on failure.
+    static bool write(const std::string& modelPath, const ModelView& model);
+
+    const std::vector<ChunkInfo>& chunks() const { return m_chunks; }
+
+    // Reads a chunk's geometry, or its proxy's, from the file.  Safe to
+    // call from several threads at once.  Throws std::runtime_error if
+    // the file can not be read.
+    ChunkGeometry read(uint32_t chunk, bool proxy) const;
+
+private:
+    std::string            m_path;
+    std::vector<ChunkInfo> m_chunks;
+};
+
+// The coarse stand-in for a chunk: its vertices merged on a grid of
+// gridSize^3 cells over its bounding box, dropping the triangles that
+// collapse.  Never empty if the chunk is not.
+ChunkGeometry simplifyChunk(const ChunkGeometry& chunk, const vec3& bmin, const vec3& bmax,
+                            uint32_t gridSize);
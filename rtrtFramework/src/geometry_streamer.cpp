@@ -0,0 +1,88 @@
+//////////////////////////////////////////////////////////////////////
+// Residency policy of out-of-core geometry.  See geometry_streamer.h.
+////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include <float.h>
+
+#include "geometry_streamer.h"
+
+void GeometryStreamer::init(uint64_t budget)
+{
+    m_chunks.clear();
+    m_order.clear();
+    m_budget = budget;
+    m_used = 0;
+}
+
+uint32_t GeometryStreamer::add(const std::vector<std::pair<glm::vec3, glm::vec3>>& boxes,
+                               uint64_t bytes)
+{
+    Chunk chunk;
+    chunk.boxes = boxes;
+    chunk.bytes = bytes;
+    m_chunks.push_back(chunk);
+    m_order.push_back(static_cast<uint32_t>(m_chunks.size() - 1));
+    return static_cast<uint32_t>(m_chunks.size() - 1);
+}
+
+void GeometryStreamer::update(const glm::vec3& eye, uint32_t maxRequests,
+                              std::vector<uint32_t>& requests, std::vector<uint32_t>& evictions)
+{
+    // Distance to the nearest placement of each chunk (0 inside it)
+    for (auto& chunk : m_chunks) {
+        chunk.distance = FLT_MAX;
+        for (const auto& box : chunk.boxes) {
+            glm::vec3 d = glm::max(glm::max(box.first - eye, eye - box.second), glm::vec3(0.0f));
+            chunk.distance = std::min(chunk.distance, glm::length(d)); } }
+    std::sort(m_order.begin(), m_order.end(), [this](uint32_t a, uint32_t b) {
+        return m_chunks[a].distance < m_chunks[b].distance; });
+
+    // Nearest first.  far walks back from the farthest chunk, over the
+    // resident chunks that may be evicted for the one at i.
+    size_t far = m_order.size();
+    for (size_t i = 0; i < m_order.size() && requests.size() < maxRequests; i++) {
+        Chunk& chunk = m_chunks[m_order[i]];
+        if (chunk.state != PROXY || chunk.failed || chunk.bytes > m_budget)
+            continue;
+
+        while (m_used + chunk.bytes > m_budget) {
+            while (far > i + 1 && m_chunks[m_order[far - 1]].state != RESIDENT)
+                far--;
+            if (far <= i + 1)
+                break;
+            Chunk& victim = m_chunks[m_order[far - 1]];
+            if (victim.distance <= chunk.distance*HYSTERESIS)
+                break;
+            victim.state = PROXY;
+            m_used -= victim.bytes;
+            evictions.push_back(m_order[--far]); }
+
+        // What is left is all nearer (or as near); the budget is spent
+        if (m_used + chunk.bytes > m_budget)
+            break;
+        chunk.state = LOADING;
+        m_used += chunk.bytes;
+        requests.push_back(m_order[i]); }
+}
+
+void GeometryStreamer::loaded(uint32_t chunk)
+{
+    m_chunks[chunk].state = RESIDENT;
+}
+
+void GeometryStreamer::failed(uint32_t chunk)
+{
+    m_chunks[chunk].state  = PROXY;
+    m_chunks[chunk].failed = true;
+    m_used -= m_chunks[chunk].bytes;
+}
+
+uint32_t GeometryStreamer::count(State state) const
+{
+    uint32_t n = 0;
+    for (const auto& chunk : m_chunks)
+        if (chunk.state == state)
+            n++;
+    return n;
+}
@@ -0,0 +1,69 @@
+
+#pragma once
+
+#include <utility>
+#include <vector>
+#include <stdint.h>
+
+#define GLM_FORCE_RADIANS
+#include <glm/glm.hpp>
+
+// The residency policy of out-of-core geometry (see geometry_chunks.h).
+// Each chunk is either PROXY (only its coarse proxy is on the GPU),
+// LOADING (being read and uploaded) or RESIDENT.  Once a frame,
+// update() looks at the chunks nearest the camera first and asks for
+// those not yet resident, as long as the chunks resident or loading
+// fit in the budget.  When they do not, the farthest resident chunks
+// are given up for nearer ones -- but only for ones sufficiently
+// nearer, so that a camera hovering at the edge of the budget does not
+// swap the same chunks back and forth.
+//
+// Nothing here touches Vulkan: VkApp reads, uploads and swaps chunks
+// as told, and reports back with loaded() or failed().
+class GeometryStreamer
+{
+public:
+    enum State : uint8_t { PROXY, LOADING, RESIDENT };
+
+    // A resident chunk is only evicted for one this many times nearer
+    static constexpr float HYSTERESIS = 1.25f;
+
+    // Clears everything.  budget is the device memory, in bytes, that
+    // resident (and loading) chunks may take.
+    void init(uint64_t budget);
+
+    // Adds a chunk placed at each of boxes (world space min, max), for
+    // each instance of its model; bytes is what making it resident
+    // costs.  Returns its id.  It starts as PROXY.
+    uint32_t add(const std::vector<std::pair<glm::vec3, glm::vec3>>& boxes, uint64_t bytes);
+
+    // Appends to requests up to maxRequests chunks to be loaded (they
+    // become LOADING), and to evictions the chunks that must make way
+    // for them (they become PROXY at once).
+    void update(const glm::vec3& eye, uint32_t maxRequests,
+                std::vector<uint32_t>& requests, std::vector<uint32_t>& evictions);
+
+    void loaded(uint32_t chunk);  // LOADING -> RESIDENT
+    void failed(uint32_t chunk);  // LOADING -> PROXY, for good
+
+    uint32_t nbChunks() const { return static_cast<uint32_t>(m_chunks.size()); }
+    State    state(uint32_t chunk) const { return m_chunks[chunk].state; }
+    uint64_t budget() const { return m_budget; }
+    uint64_t usedBytes() const { return m_used; }  // By resident and loading chunks
+    uint32_t count(State state) const;
+
+private:
+    struct Chunk
+    {
+        std::vector<std::pair<glm::vec3, glm::vec3>> boxes;
+        uint64_t bytes{0};
+        State    state{PROXY};
+        float    distance{0.0f};  // From the eye, at the last update
+        bool     failed{false};   // Could not be loaded; not asked for again
+    };
+
+    std::vector<Chunk>    m_chunks;
+    std::vector<uint32_t> m_order;  // By distance, at the last update
+    uint64_t m_budget{0};
+    uint64_t m_used{0};
+};
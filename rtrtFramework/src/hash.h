@@ -0,0 +1,16 @@
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// FNV-1a hash of a byte range, continuing from h.  Used for content
+// keys (cached files, deduplicated meshes and materials) and welding.
+inline uint64_t hashBytes(const void* data, size_t size, uint64_t h=14695981039346656037ull)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; i++) {
+        h ^= p[i];
+        h *= 1099511628211ull; }
+    return h;
+}
@@ -1,10 +1,13 @@
 
 # pragma once
 
+#include "memory_allocator.h"
+
 struct ImageWrap
 {
     VkImage          image{};
-    VkDeviceMemory   memory{};
+    MemoryAllocation allocation;  // From VkApp::m_allocator
+    VkFormat         format{};
     VkSampler        sampler{};
     VkImageView      imageView{};
     VkImageLayout    imageLayout{};
@@ -12,7 +15,7 @@ struct ImageWrap
     void destroy(VkDevice device)
     {
         vkDestroyImage(device, image, nullptr);
-        vkFreeMemory(device, memory, nullptr);
+        allocation.free();
         vkDestroyImageView(device, imageView, nullptr);
         vkDestroySampler(device, sampler, nullptr);
     }
@@ -0,0 +1,142 @@
+//////////////////////////////////////////////////////////////////////
+// Emissive triangle light table and its alias table.  See
+// light_table.h.
+////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <math.h>
+#include <algorithm>
+#include <future>
+
+#include "light_table.h"
+
+const float PI = 3.14159265f;
+
+void gatherLights(const ModelView& model, const mat4& transform, ThreadPool& pool,
+                  std::vector<Light>& lights)
+{
+    // The emissive triangles of each mesh (mesh-local triangle numbers),
+    // found once however many times the mesh is instanced.
+    std::vector<std::vector<uint32_t>> emissive(model.nbMeshes);
+    bool any = false;
+    for (uint32_t m = 0; m < model.nbMeshes; m++) {
+        const MeshRange& range = model.meshes[m];
+        for (uint32_t t = 0; t < range.nbIndices/3; t++) {
+            const Material& mat = model.materials[model.matIndx[range.firstIndex/3 + t]];
+            if (mat.emission.r > 0.0f || mat.emission.g > 0.0f || mat.emission.b > 0.0f) {
+                emissive[m].push_back(t);
+                any = true; } } }
+    if (!any)
+        return;
+
+    auto gather = [&](uint32_t first, uint32_t last) {
+        std::vector<Light> part;
+        for (uint32_t i = first; i < last; i++) {
+            const MeshInstance& inst = model.instances[i];
+            const MeshRange& range   = model.meshes[inst.mesh];
+            mat4 M = transform * inst.transform;
+            for (uint32_t t : emissive[inst.mesh]) {
+                const uint32_t* tri = &model.indices[range.firstIndex + 3*t];
+                const Material& mat = model.materials[model.matIndx[range.firstIndex/3 + t]];
+                Light light;
+                light.v0 = vec3(M * vec4(model.vertices[tri[0]].pos, 1.0f));
+                light.v1 = vec3(M * vec4(model.vertices[tri[1]].pos, 1.0f));
+                light.v2 = vec3(M * vec4(model.vertices[tri[2]].pos, 1.0f));
+                light.emission = mat.emission;
+                light.area  = 0.5f * glm::length(glm::cross(light.v1 - light.v0, light.v2 - light.v0));
+                light.power = PI * luminance(mat.emission) * light.area;
+                light.prob  = 1.0f;
+                light.alias = 0;
+                if (light.power > 0.0f)  // Skip degenerate triangles
+                    part.push_back(light); } }
+        return part; };
+
+    // A few chunks per worker to even out meshes of different sizes.
+    uint32_t chunks = std::min(model.nbInstances, 4*pool.size());
+    std::vector<std::future<std::vector<Light>>> parts;
+    for (uint32_t c = 0; c < chunks; c++) {
+        uint32_t first = uint64_t(model.nbInstances) * c / chunks;
+        uint32_t last  = uint64_t(model.nbInstances) * (c+1) / chunks;
+        parts.push_back(pool.submit([&gather, first, last] { return gather(first, last); })); }
+    for (auto& part : parts) {
+        std::vector<Light> found = part.get();
+        lights.insert(lights.end(), found.begin(), found.end()); }
+}
+
+namespace {
+
+// Vose's pairing: every entry of small is topped up by an entry of
+// large, until one list runs out.  Entries left over keep their
+// (partly used) scaled value.
+void pairAliases(std::vector<Light>& lights, std::vector<double>& scaled,
+                 std::vector<uint32_t>& small, std::vector<uint32_t>& large)
+{
+    while (!small.empty() && !large.empty()) {
+        uint32_t s = small.back();  small.pop_back();
+        uint32_t l = large.back();
+        lights[s].prob  = float(scaled[s]);
+        lights[s].alias = l;
+        scaled[l] -= 1.0 - scaled[s];
+        if (scaled[l] < 1.0) {
+            large.pop_back();
+            small.push_back(l); } }
+}
+
+}
+
+float buildAliasTable(std::vector<Light>& lights, ThreadPool& pool)
+{
+    const uint32_t n = static_cast<uint32_t>(lights.size());
+    if (n == 0)
+        return 0.0f;
+
+    // Contiguous blocks, one job each; small tables are not worth it
+    const uint32_t MIN_BLOCK = 16384;
+    uint32_t blocks = std::max(1u, std::min(pool.size(), n / MIN_BLOCK));
+    auto first = [&](uint32_t b) { return uint32_t(uint64_t(n) * b / blocks); };
+    auto forBlocks = [&](auto job) {
+        if (blocks == 1) {
+            job(0u);
+            return; }
+        std::vector<std::future<void>> done;
+        for (uint32_t b = 0; b < blocks; b++)
+            done.push_back(pool.submit([&job, b] { job(b); }));
+        for (auto& d : done)
+            d.get(); };
+
+    // The total power, summed per block (in a fixed order, so the
+    // result does not depend on timing)
+    std::vector<double> sums(blocks, 0.0);
+    forBlocks([&](uint32_t b) {
+        for (uint32_t i = first(b); i < first(b+1); i++)
+            sums[b] += lights[i].power; });
+    double total = 0.0;
+    for (double sum : sums)
+        total += sum;
+    if (total <= 0.0)
+        return 0.0f;
+
+    // Scale each probability so that the average over the whole table
+    // is 1, then pair every under-full entry with an over-full one
+    // that tops it up.  Any pairing is valid, so each block first
+    // pairs its own entries, and only what a block can not settle
+    // (all small or all large) is paired across blocks afterwards.
+    std::vector<double> scaled(n);
+    std::vector<std::vector<uint32_t>> small(blocks), large(blocks);
+    forBlocks([&](uint32_t b) {
+        for (uint32_t i = first(b); i < first(b+1); i++) {
+            scaled[i] = lights[i].power * n / total;
+            (scaled[i] < 1.0 ? small[b] : large[b]).push_back(i); }
+        pairAliases(lights, scaled, small[b], large[b]); });
+
+    for (uint32_t b = 1; b < blocks; b++) {
+        small[0].insert(small[0].end(), small[b].begin(), small[b].end());
+        large[0].insert(large[0].end(), large[b].begin(), large[b].end()); }
+    pairAliases(lights, scaled, small[0], large[0]);
+
+    // Whatever is left is full (up to round-off).
+    for (uint32_t i : large[0]) { lights[i].prob = 1.0f;  lights[i].alias = i; }
+    for (uint32_t i : small[0]) { lights[i].prob = 1.0f;  lights[i].alias = i; }
+
+    return float(total);
+}
@@ -0,0 +1,28 @@
+
+#pragma once
+
+#include <vector>
+#include <stdint.h>
+
+#include "model_data.h"
+#include "thread_pool.h"
+
+// The table of emissive triangles the path tracer samples for
+// explicit light connections.  Each entry is a world space triangle
+// with its emission, area and power, plus one slot of an alias table
+// (Vose's method) so that a light can be chosen in proportion to its
+// power with one random index and one coin flip.
+
+// Luminance used to weigh emitters (and in the shader's pdf; keep both the same).
+inline float luminance(const vec3& c) { return 0.2126f*c.r + 0.7152f*c.g + 0.0722f*c.b; }
+
+// Appends a Light for every emissive triangle of every instance in
+// model, placed by transform.  The instances are split among the
+// pool's workers; the result is in instance order regardless.
+void gatherLights(const ModelView& model, const mat4& transform, ThreadPool& pool,
+                  std::vector<Light>& lights);
+
+// Fills in prob and alias of every light from the lights' powers, in
+// O(n), with large tables split in blocks among the pool's workers.
+// Returns the total power.  Not to be called from one of pool's jobs.
+float buildAliasTable(std::vector<Light>& lights, ThreadPool& pool);
@@ -0,0 +1,50 @@
+//////////////////////////////////////////////////////////////////////
+// The global, deduplicated material table.  See material_table.h.
+////////////////////////////////////////////////////////////////////////
+
+#include <string.h>
+
+#include "material_table.h"
+#include "hash.h"
+
+uint32_t MaterialTable::flags(const Material& material)
+{
+    uint32_t flags = 0;
+    if (material.emission.r > 0.0f || material.emission.g > 0.0f || material.emission.b > 0.0f)
+        flags |= MATERIAL_EMISSIVE;
+    if (material.textureId >= 0)
+        flags |= MATERIAL_TEXTURED;
+    if (material.specular.r > 0.0f || material.specular.g > 0.0f || material.specular.b > 0.0f)
+        flags |= MATERIAL_SPECULAR;
+    return flags;
+}
+
+uint32_t MaterialTable::add(const Material& material)
+{
+    // Built field by field, so that padding never differs
+    MaterialHot hot{};
+    uint32_t f = flags(material);
+    hot.diffuse = material.diffuse;
+    hot.flagsTexture = f;
+    if (f & MATERIAL_TEXTURED)
+        hot.flagsTexture |= uint32_t(material.textureId) << MATERIAL_FLAG_BITS;
+
+    MaterialCold cold{};
+    cold.specular  = material.specular;
+    cold.shininess = material.shininess;
+    cold.emission  = material.emission;
+
+    uint64_t h = hashBytes(&hot, sizeof(hot));
+    h = hashBytes(&cold, sizeof(cold), h);
+    auto candidates = m_byHash.equal_range(h);
+    for (auto it = candidates.first; it != candidates.second; ++it)
+        if (memcmp(&m_hot[it->second], &hot, sizeof(hot)) == 0
+            && memcmp(&m_cold[it->second], &cold, sizeof(cold)) == 0)
+            return it->second;
+
+    uint32_t index = size();
+    m_hot.push_back(hot);
+    m_cold.push_back(cold);
+    m_byHash.emplace(h, index);
+    return index;
+}
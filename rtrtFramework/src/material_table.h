@@ -0,0 +1,34 @@
+
+#pragma once
+
+#include <stdint.h>
+#include <unordered_map>
+#include <vector>
+
+#include "shaders/shared_structs.h"
+
+// The scene's global material table.  Materials are added model by
+// model (with their texture ids already scene wide); identical ones,
+// from the same model or any other, share one entry.  The table is
+// kept as the two arrays the shaders read (see MaterialHot and
+// MaterialCold), ready to upload as they are.
+//
+// Entries are never removed; a reloaded model's materials are simply
+// added again, and only its changed ones make new entries.
+class MaterialTable
+{
+public:
+    // The table index of material, adding it if it is new.
+    uint32_t add(const Material& material);
+
+    uint32_t size() const { return static_cast<uint32_t>(m_hot.size()); }
+    const std::vector<MaterialHot>&  hot() const { return m_hot; }
+    const std::vector<MaterialCold>& cold() const { return m_cold; }
+
+    static uint32_t flags(const Material& material);
+
+private:
+    std::vector<MaterialHot>  m_hot;
+    std::vector<MaterialCold> m_cold;
+    std::unordered_multimap<uint64_t, uint32_t> m_byHash;
+};
@@ -0,0 +1,527 @@
+//////////////////////////////////////////////////////////////////////
+// Pooled device memory.  See memory_allocator.h.
+////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include <stdexcept>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#include "memory_allocator.h"
+
+namespace {
+
+constexpr uint32_t NIL       = ~0u;
+constexpr uint32_t SL_LOG2   = 4;                   // Second level: 16 lists per power of two
+constexpr uint32_t SL_COUNT  = 1u << SL_LOG2;
+constexpr uint32_t SMALL_LOG2 = 8;                  // Sizes below 256 share the first list
+constexpr uint32_t FL_COUNT  = 64 - SMALL_LOG2 + 1;
+
+uint32_t lowestBit(uint64_t x)
+{
+#ifdef _MSC_VER
+    unsigned long i;
+    _BitScanForward64(&i, x);
+    return i;
+#else
+    return __builtin_ctzll(x);
+#endif
+}
+
+uint32_t highestBit(uint64_t x)
+{
+#ifdef _MSC_VER
+    unsigned long i;
+    _BitScanReverse64(&i, x);
+    return i;
+#else
+    return 63 - __builtin_clzll(x);
+#endif
+}
+
+// The free list a range of size belongs in: its power of two, and
+// which sixteenth of it.
+void mapping(VkDeviceSize size, uint32_t& fl, uint32_t& sl)
+{
+    if (size < (1ull << SMALL_LOG2)) {
+        fl = 0;
+        sl = uint32_t(size >> (SMALL_LOG2 - SL_LOG2)); }
+    else {
+        uint32_t msb = highestBit(size);
+        fl = msb - SMALL_LOG2 + 1;
+        sl = uint32_t(size >> (msb - SL_LOG2)) - SL_COUNT; }
+}
+
+VkDeviceSize alignUp(VkDeviceSize value, VkDeviceSize alignment)
+{
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+}
+
+// One vkAllocateMemory, split into ranges.  Ranges are nodes in
+// m_nodes, linked in address order (prevPhys/nextPhys) and, when
+// free, into the free list of their size class (prevFree/nextFree).
+struct MemoryBlock
+{
+    struct Node
+    {
+        VkDeviceSize offset;
+        VkDeviceSize size;
+        uint32_t prevPhys, nextPhys;
+        uint32_t prevFree, nextFree;
+        bool     free;
+    };
+
+    VkDeviceMemory memory{VK_NULL_HANDLE};
+    VkDeviceSize   size{0};
+    void*          mapped{nullptr};
+    uint32_t       memoryType{0};
+    bool           forImages{false};
+    uint32_t       allocations{0};
+
+    std::vector<Node>     m_nodes;
+    std::vector<uint32_t> m_unusedNodes;
+    uint64_t m_flBitmap{0};
+    uint32_t m_slBitmap[FL_COUNT]{};
+    uint32_t m_heads[FL_COUNT][SL_COUNT];
+
+    MemoryBlock(VkDeviceSize size)
+        : size(size)
+    {
+        std::fill(&m_heads[0][0], &m_heads[0][0] + FL_COUNT*SL_COUNT, NIL);
+        uint32_t whole = newNode(0, size, NIL, NIL);
+        insertFree(whole);
+    }
+
+    uint32_t newNode(VkDeviceSize offset, VkDeviceSize size, uint32_t prevPhys, uint32_t nextPhys)
+    {
+        uint32_t n;
+        if (m_unusedNodes.empty()) {
+            n = uint32_t(m_nodes.size());
+            m_nodes.emplace_back(); }
+        else {
+            n = m_unusedNodes.back();
+            m_unusedNodes.pop_back(); }
+        m_nodes[n] = Node{offset, size, prevPhys, nextPhys, NIL, NIL, false};
+        return n;
+    }
+
+    void insertFree(uint32_t n)
+    {
+        uint32_t fl, sl;
+        mapping(m_nodes[n].size, fl, sl);
+        Node& node = m_nodes[n];
+        node.free = true;
+        node.prevFree = NIL;
+        node.nextFree = m_heads[fl][sl];
+        if (node.nextFree != NIL) {
+            m_nodes[node.nextFree].prevFree = n; }
+        m_heads[fl][sl] = n;
+        m_flBitmap |= 1ull << fl;
+        m_slBitmap[fl] |= 1u << sl;
+    }
+
+    void removeFree(uint32_t n)
+    {
+        Node& node = m_nodes[n];
+        if (node.prevFree != NIL) {
+            m_nodes[node.prevFree].nextFree = node.nextFree; }
+        else {
+            uint32_t fl, sl;
+            mapping(node.size, fl, sl);
+            m_heads[fl][sl] = node.nextFree;
+            if (node.nextFree == NIL) {
+                m_slBitmap[fl] &= ~(1u << sl);
+                if (m_slBitmap[fl] == 0) {
+                    m_flBitmap &= ~(1ull << fl); } } }
+        if (node.nextFree != NIL) {
+            m_nodes[node.nextFree].prevFree = node.prevFree; }
+        node.free = false;
+    }
+
+    // Splits the range [offset, offset+size) of free node n off into
+    // a node of its own, which is returned not free.  What is left on
+    // either side goes back on the free lists.
+    uint32_t carve(uint32_t n, VkDeviceSize offset, VkDeviceSize size)
+    {
+        removeFree(n);
+        Node node = m_nodes[n];
+        if (offset > node.offset) {
+            uint32_t front = newNode(node.offset, offset - node.offset, node.prevPhys, n);
+            if (node.prevPhys != NIL) {
+                m_nodes[node.prevPhys].nextPhys = front; }
+            m_nodes[n].prevPhys = front;
+            insertFree(front); }
+        VkDeviceSize end = node.offset + node.size;
+        if (offset + size < end) {
+            uint32_t back = newNode(offset + size, end - offset - size, n, node.nextPhys);
+            if (node.nextPhys != NIL) {
+                m_nodes[node.nextPhys].prevPhys = back; }
+            m_nodes[n].nextPhys = back;
+            insertFree(back); }
+        m_nodes[n].offset = offset;
+        m_nodes[n].size = size;
+        return n;
+    }
+
+    // A node of at least size at alignment, or NIL.  The search rounds
+    // size up to the next size class, so that any range on the list it
+    // finds is large enough, and asks for the worst case padding.
+    uint32_t allocate(VkDeviceSize size, VkDeviceSize alignment)
+    {
+        VkDeviceSize search = size + (alignment > 1 ? alignment - 1 : 0);
+        search += search < (1ull << SMALL_LOG2) ? (1ull << (SMALL_LOG2 - SL_LOG2)) - 1
+            : (1ull << (highestBit(search) - SL_LOG2)) - 1;
+        if (search > this->size) {
+            return NIL; }
+
+        uint32_t fl, sl;
+        mapping(search, fl, sl);
+        uint32_t slMap = sl < SL_COUNT ? m_slBitmap[fl] & (~0u << sl) : 0;
+        if (slMap == 0) {
+            uint64_t flMap = fl + 1 < 64 ? m_flBitmap & (~0ull << (fl + 1)) : 0;
+            if (flMap == 0) {
+                return NIL; }
+            fl = lowestBit(flMap);
+            slMap = m_slBitmap[fl]; }
+        uint32_t n = m_heads[fl][lowestBit(slMap)];
+
+        allocations++;
+        return carve(n, alignUp(m_nodes[n].offset, alignment), size);
+    }
+
+    void free(uint32_t n)
+    {
+        allocations--;
+        Node& node = m_nodes[n];
+        uint32_t prev = node.prevPhys;
+        if (prev != NIL && m_nodes[prev].free) {
+            removeFree(prev);
+            node.offset = m_nodes[prev].offset;
+            node.size += m_nodes[prev].size;
+            node.prevPhys = m_nodes[prev].prevPhys;
+            if (node.prevPhys != NIL) {
+                m_nodes[node.prevPhys].nextPhys = n; }
+            m_unusedNodes.push_back(prev); }
+        uint32_t next = node.nextPhys;
+        if (next != NIL && m_nodes[next].free) {
+            removeFree(next);
+            node.size += m_nodes[next].size;
+            node.nextPhys = m_nodes[next].nextPhys;
+            if (node.nextPhys != NIL) {
+                m_nodes[node.nextPhys].prevPhys = n; }
+            m_unusedNodes.push_back(next); }
+        insertFree(n);
+    }
+};
+
+void MemoryAllocation::free()
+{
+    if (allocator) {
+        allocator->free(*this); }
+    *this = MemoryAllocation{};
+}
+
+MemoryAllocator::MemoryAllocator() {}
+MemoryAllocator::~MemoryAllocator() {}
+
+const char* memoryCategoryName(MemoryCategory category)
+{
+    static const char* names[MEM_CATEGORIES] = {
+        "geometry", "texture", "acceleration", "gbuffer", "scratch", "scene", "uniform", "other" };
+    return category < MEM_CATEGORIES ? names[category] : "?";
+}
+
+void MemoryAllocator::init(VkPhysicalDevice physicalDevice, VkDevice device, bool memoryBudget)
+{
+    m_physicalDevice = physicalDevice;
+    m_device = device;
+    m_memoryBudget = memoryBudget;
+    vkGetPhysicalDeviceMemoryProperties(m_physicalDevice, &m_memProperties);
+}
+
+void MemoryAllocator::destroy()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (auto& block : m_blocks) {
+        vkFreeMemory(m_device, block->memory, nullptr); }  // Freeing the memory unmaps it
+    m_blocks.clear();
+    m_stats = Stats{};
+    std::fill(std::begin(m_heapBytes), std::end(m_heapBytes), 0);
+    m_records.clear();
+}
+
+uint32_t MemoryAllocator::findMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags properties) const
+{
+    for (uint32_t i = 0; i < m_memProperties.memoryTypeCount; i++) {
+        if ((typeFilter & (1 << i))
+            && (m_memProperties.memoryTypes[i].propertyFlags & properties) == properties) {
+            return i; } }
+
+    throw std::runtime_error("failed to find suitable memory type!");
+}
+
+MemoryAllocation MemoryAllocator::allocate(VkBuffer buffer, VkMemoryPropertyFlags properties,
+                                           const MemoryTag& tag)
+{
+    VkMemoryDedicatedRequirements dedicatedReq{VK_STRUCTURE_TYPE_MEMORY_DEDICATED_REQUIREMENTS};
+    VkMemoryRequirements2 req{VK_STRUCTURE_TYPE_MEMORY_REQUIREMENTS_2};
+    req.pNext = &dedicatedReq;
+    VkBufferMemoryRequirementsInfo2 info{VK_STRUCTURE_TYPE_BUFFER_MEMORY_REQUIREMENTS_INFO_2};
+    info.buffer = buffer;
+    vkGetBufferMemoryRequirements2(m_device, &info, &req);
+
+    uint32_t memoryType = findMemoryType(req.memoryRequirements.memoryTypeBits, properties);
+    bool dedicated = dedicatedReq.prefersDedicatedAllocation || dedicatedReq.requiresDedicatedAllocation;
+    MemoryAllocation allocation = allocate(req.memoryRequirements, dedicated, memoryType,
+                                           buffer, VK_NULL_HANDLE);
+    record(allocation, tag, memoryType);
+    vkBindBufferMemory(m_device, buffer, allocation.memory, allocation.offset);
+    return allocation;
+}
+
+MemoryAllocation MemoryAllocator::allocate(VkImage image, VkMemoryPropertyFlags properties,
+                                           const MemoryTag& tag)
+{
+    VkMemoryDedicatedRequirements dedicatedReq{VK_STRUCTURE_TYPE_MEMORY_DEDICATED_REQUIREMENTS};
+    VkMemoryRequirements2 req{VK_STRUCTURE_TYPE_MEMORY_REQUIREMENTS_2};
+    req.pNext = &dedicatedReq;
+    VkImageMemoryRequirementsInfo2 info{VK_STRUCTURE_TYPE_IMAGE_MEMORY_REQUIREMENTS_INFO_2};
+    info.image = image;
+    vkGetImageMemoryRequirements2(m_device, &info, &req);
+
+    uint32_t memoryType = findMemoryType(req.memoryRequirements.memoryTypeBits, properties);
+    bool dedicated = dedicatedReq.prefersDedicatedAllocation || dedicatedReq.requiresDedicatedAllocation
+        || req.memoryRequirements.size >= DEDICATED_IMAGE_SIZE;
+    MemoryAllocation allocation = allocate(req.memoryRequirements, dedicated, memoryType,
+                                           VK_NULL_HANDLE, image);
+    record(allocation, tag, memoryType);
+    vkBindImageMemory(m_device, image, allocation.memory, allocation.offset);
+    return allocation;
+}
+
+MemoryAllocation MemoryAllocator::allocate(const VkMemoryRequirements& req, bool dedicated,
+                                           uint32_t memoryType, VkBuffer buffer, VkImage image)
+{
+    // Small heaps (a BAR window, say) get proportionally small blocks
+    VkDeviceSize heapSize = m_memProperties.memoryHeaps[m_memProperties.memoryTypes[memoryType].heapIndex].size;
+    VkDeviceSize blockSize = std::min(BLOCK_SIZE, heapSize / 8);
+    if (dedicated || req.size > blockSize / 2) {
+        return allocateDedicated(req, memoryType, buffer, image); }
+
+    bool forImages = image != VK_NULL_HANDLE;
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    MemoryBlock* block = nullptr;
+    uint32_t node = NIL;
+    for (auto& b : m_blocks) {
+        if (b->memoryType == memoryType && b->forImages == forImages) {
+            node = b->allocate(req.size, req.alignment);
+            if (node != NIL) {
+                block = b.get();
+                break; } } }
+
+    if (!block) {
+        VkMemoryAllocateFlagsInfo flagsInfo{VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_FLAGS_INFO};
+        flagsInfo.flags = VK_MEMORY_ALLOCATE_DEVICE_ADDRESS_BIT;
+        VkMemoryAllocateInfo allocInfo{VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO};
+        allocInfo.pNext = forImages ? nullptr : &flagsInfo;
+        allocInfo.allocationSize = blockSize;
+        allocInfo.memoryTypeIndex = memoryType;
+        VkDeviceMemory memory;
+        if (vkAllocateMemory(m_device, &allocInfo, nullptr, &memory) != VK_SUCCESS) {
+            throw std::runtime_error("failed to allocate memory block!"); }
+
+        m_blocks.emplace_back(new MemoryBlock(blockSize));
+        block = m_blocks.back().get();
+        block->memory = memory;
+        block->memoryType = memoryType;
+        block->forImages = forImages;
+        if (m_memProperties.memoryTypes[memoryType].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+            vkMapMemory(m_device, memory, 0, VK_WHOLE_SIZE, 0, &block->mapped); }
+        m_stats.blocks++;
+        m_stats.blockBytes += blockSize;
+        m_heapBytes[m_memProperties.memoryTypes[memoryType].heapIndex] += blockSize;
+        node = block->allocate(req.size, req.alignment); }
+
+    MemoryAllocation allocation;
+    allocation.memory = block->memory;
+    allocation.offset = block->m_nodes[node].offset;
+    allocation.size = req.size;
+    allocation.mapped = block->mapped ? (char*)block->mapped + allocation.offset : nullptr;
+    allocation.allocator = this;
+    allocation.block = block;
+    allocation.node = node;
+    m_stats.allocations++;
+    m_stats.usedBytes += req.size;
+    return allocation;
+}
+
+MemoryAllocation MemoryAllocator::allocateDedicated(const VkMemoryRequirements& req, uint32_t memoryType,
+                                                    VkBuffer buffer, VkImage image)
+{
+    VkMemoryDedicatedAllocateInfo dedicatedInfo{VK_STRUCTURE_TYPE_MEMORY_DEDICATED_ALLOCATE_INFO};
+    dedicatedInfo.buffer = buffer;
+    dedicatedInfo.image = image;
+    VkMemoryAllocateFlagsInfo flagsInfo{VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_FLAGS_INFO};
+    flagsInfo.flags = VK_MEMORY_ALLOCATE_DEVICE_ADDRESS_BIT;
+    flagsInfo.pNext = &dedicatedInfo;
+
+    VkMemoryAllocateInfo allocInfo{VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO};
+    allocInfo.pNext = buffer != VK_NULL_HANDLE ? (void*)&flagsInfo : (void*)&dedicatedInfo;
+    allocInfo.allocationSize = req.size;
+    allocInfo.memoryTypeIndex = memoryType;
+
+    MemoryAllocation allocation;
+    if (vkAllocateMemory(m_device, &allocInfo, nullptr, &allocation.memory) != VK_SUCCESS) {
+        throw std::runtime_error("failed to allocate memory!"); }
+    if (m_memProperties.memoryTypes[memoryType].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+        vkMapMemory(m_device, allocation.memory, 0, VK_WHOLE_SIZE, 0, &allocation.mapped); }
+    allocation.size = req.size;
+    allocation.allocator = this;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stats.dedicated++;
+    m_stats.dedicatedBytes += req.size;
+    m_heapBytes[m_memProperties.memoryTypes[memoryType].heapIndex] += req.size;
+    return allocation;
+}
+
+void MemoryAllocator::record(MemoryAllocation& allocation, const MemoryTag& tag, uint32_t memoryType)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    allocation.id = m_nextId++;
+    m_records[allocation.id] = Record{tag, allocation.size, memoryType, allocation.block == nullptr};
+    m_stats.categoryCount[tag.category]++;
+    m_stats.categoryBytes[tag.category] += allocation.size;
+}
+
+void MemoryAllocator::free(MemoryAllocation& allocation)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto rec = m_records.find(allocation.id);
+    if (rec != m_records.end()) {
+        m_stats.categoryCount[rec->second.tag.category]--;
+        m_stats.categoryBytes[rec->second.tag.category] -= allocation.size; }
+
+    if (!allocation.block) {
+        vkFreeMemory(m_device, allocation.memory, nullptr);  // Freeing the memory unmaps it
+        m_stats.dedicated--;
+        m_stats.dedicatedBytes -= allocation.size;
+        if (rec != m_records.end()) {
+            m_heapBytes[m_memProperties.memoryTypes[rec->second.memoryType].heapIndex] -= allocation.size;
+            m_records.erase(rec); }
+        return; }
+
+    if (rec != m_records.end()) {
+        m_records.erase(rec); }
+    MemoryBlock* block = allocation.block;
+    block->free(allocation.node);
+    m_stats.allocations--;
+    m_stats.usedBytes -= allocation.size;
+
+    // An empty block goes back to the device, unless it is the last of
+    // its kind; keeping one avoids churn when a resource is recreated.
+    if (block->allocations == 0) {
+        bool another = false;
+        for (auto& b : m_blocks) {
+            another |= b.get() != block && b->memoryType == block->memoryType
+                && b->forImages == block->forImages; }
+        if (another) {
+            vkFreeMemory(m_device, block->memory, nullptr);
+            m_stats.blocks--;
+            m_stats.blockBytes -= block->size;
+            m_heapBytes[m_memProperties.memoryTypes[block->memoryType].heapIndex] -= block->size;
+            m_blocks.erase(std::find_if(m_blocks.begin(), m_blocks.end(),
+                                        [block](const std::unique_ptr<MemoryBlock>& b) { return b.get() == block; })); } }
+}
+
+MemoryAllocator::Stats MemoryAllocator::stats()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_stats;
+}
+
+std::vector<MemoryAllocator::HeapBudget> MemoryAllocator::heapBudgets()
+{
+    VkPhysicalDeviceMemoryBudgetPropertiesEXT budgetProps{VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT};
+    VkPhysicalDeviceMemoryProperties2 props{VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2};
+    if (m_memoryBudget) {
+        props.pNext = &budgetProps;
+        vkGetPhysicalDeviceMemoryProperties2(m_physicalDevice, &props); }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::vector<HeapBudget> heaps(m_memProperties.memoryHeapCount);
+    for (uint32_t i = 0; i < m_memProperties.memoryHeapCount; i++) {
+        HeapBudget& heap = heaps[i];
+        heap.size = m_memProperties.memoryHeaps[i].size;
+        heap.allocated = m_heapBytes[i];
+        heap.deviceLocal = m_memProperties.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT;
+        heap.budget = m_memoryBudget ? budgetProps.heapBudget[i] : heap.size;
+        heap.usage = m_memoryBudget ? budgetProps.heapUsage[i] : heap.allocated; }
+    return heaps;
+}
+
+namespace {
+
+void writeJsonString(std::ostream& out, const std::string& s)
+{
+    static const char* hex = "0123456789abcdef";
+    out << '"';
+    for (unsigned char c : s) {
+        if (c == '"' || c == '\\') {
+            out << '\\' << c; }
+        else if (c < 0x20) {
+            out << "\\u00" << hex[c >> 4] << hex[c & 15]; }
+        else {
+            out << c; } }
+    out << '"';
+}
+
+}
+
+void MemoryAllocator::writeReport(std::ostream& out)
+{
+    std::vector<HeapBudget> heaps = heapBudgets();
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    out << "{\n  \"memoryBudget\": " << (m_memoryBudget ? "true" : "false") << ",\n";
+    out << "  \"heaps\": [";
+    for (size_t i = 0; i < heaps.size(); i++) {
+        const HeapBudget& heap = heaps[i];
+        out << (i ? ",\n" : "\n") << "    {\"index\": " << i
+            << ", \"deviceLocal\": " << (heap.deviceLocal ? "true" : "false")
+            << ", \"size\": " << heap.size << ", \"budget\": " << heap.budget
+            << ", \"usage\": " << heap.usage << ", \"allocated\": " << heap.allocated << "}"; }
+    out << "\n  ],\n";
+
+    out << "  \"blocks\": " << m_stats.blocks << ", \"blockBytes\": " << m_stats.blockBytes
+        << ", \"usedBytes\": " << m_stats.usedBytes << ",\n"
+        << "  \"dedicated\": " << m_stats.dedicated << ", \"dedicatedBytes\": " << m_stats.dedicatedBytes << ",\n";
+
+    out << "  \"categories\": {";
+    for (int c = 0; c < MEM_CATEGORIES; c++) {
+        out << (c ? ",\n" : "\n") << "    \"" << memoryCategoryName(MemoryCategory(c)) << "\": {\"count\": "
+            << m_stats.categoryCount[c] << ", \"bytes\": " << m_stats.categoryBytes[c] << "}"; }
+    out << "\n  },\n";
+
+    // Largest first, which is the order they matter in
+    std::vector<const Record*> records;
+    for (const auto& rec : m_records) {
+        records.push_back(&rec.second); }
+    std::sort(records.begin(), records.end(),
+              [](const Record* a, const Record* b) { return a->size > b->size; });
+    out << "  \"allocations\": [";
+    for (size_t i = 0; i < records.size(); i++) {
+        const Record& rec = *records[i];
+        out << (i ? ",\n" : "\n") << "    {\"category\": \"" << memoryCategoryName(rec.tag.category)
+            << "\", \"owner\": ";
+        writeJsonString(out, rec.tag.owner);
+        out << ", \"size\": " << rec.size
+            << ", \"heap\": " << m_memProperties.memoryTypes[rec.memoryType].heapIndex
+            << ", \"memoryType\": " << rec.memoryType
+            << ", \"dedicated\": " << (rec.dedicated ? "true" : "false") << "}"; }
+    out << "\n  ]\n}\n";
+}
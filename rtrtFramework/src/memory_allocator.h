@@ -0,0 +1,158 @@
+
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+#include <vulkan/vulkan_core.h>
+
+class  MemoryAllocator;
+struct MemoryBlock;
+
+// What an allocation is for, and who holds it, in MemoryAllocator's
+// accounting (see MemoryAllocator::writeReport)
+enum MemoryCategory : uint8_t {
+    MEM_GEOMETRY,      // Vertex, index and material index buffers
+    MEM_TEXTURE,       // Material textures, and the virtual texturing cache and tables
+    MEM_ACCELERATION,  // BLASes, the TLAS, and their build inputs
+    MEM_GBUFFER,       // Render targets: ray tracing history, denoiser, depth
+    MEM_SCRATCH,       // Acceleration structure build scratch
+    MEM_SCENE,         // Object, instance, material and light tables
+    MEM_UNIFORM,       // The frame arena
+    MEM_OTHER,
+    MEM_CATEGORIES };
+
+const char* memoryCategoryName(MemoryCategory category);
+
+struct MemoryTag
+{
+    MemoryCategory category{MEM_OTHER};
+    std::string    owner;
+};
+
+// Where a buffer's or an image's memory lives: a range of one of
+// MemoryAllocator's blocks, or an allocation of its own.  Host visible
+// memory stays mapped for as long as it exists, and mapped points at
+// the range.
+struct MemoryAllocation
+{
+    VkDeviceMemory memory{VK_NULL_HANDLE};
+    VkDeviceSize   offset{0};
+    VkDeviceSize   size{0};
+    void*          mapped{nullptr};
+    MemoryAllocator* allocator{nullptr};
+    MemoryBlock*   block{nullptr};  // nullptr for a dedicated allocation
+    uint32_t       node{0};         // The range, within block
+    uint32_t       id{0};           // Its MemoryAllocator::Record
+
+    // Gives the memory back, to its block or to the device, and resets
+    // this.  Nothing bound to it may be in use any more.
+    void free();
+};
+
+// Pooled device memory.  Rather than one vkAllocateMemory per buffer
+// and image (slow, and capped by maxMemoryAllocationCount), memory is
+// taken from the device in large blocks, one set of blocks per memory
+// type, and handed out in ranges.  Buffers and images keep to blocks
+// of their own, so that linear and optimal resources never share a
+// bufferImageGranularity page.
+//
+// Within a block, free ranges are kept by a two-level segregated fit
+// (TLSF): a first level by power of two and a second splitting each of
+// those 16 ways, with a bitmap of the non-empty lists at each level.
+// Finding a free range of a size is then a couple of bit scans, and a
+// freed range is merged with its free neighbours at once.  Alignment
+// is met by splitting the padding off the front of the range found.
+//
+// Images at least DEDICATED_IMAGE_SIZE (render targets), anything
+// larger than half a block, and whatever the driver says wants it get
+// a dedicated allocation.
+//
+// Every allocation is recorded with its MemoryTag, and the totals kept
+// by category and by heap.  With VK_EXT_memory_budget, heapBudgets
+// also reports what the driver says each heap can take and what the
+// whole process uses of it, which covers memory taken outside this
+// allocator (swapchain, staging rings, query pools).
+class MemoryAllocator
+{
+public:
+    static constexpr VkDeviceSize BLOCK_SIZE           = 64ull << 20;
+    static constexpr VkDeviceSize DEDICATED_IMAGE_SIZE = 16ull << 20;
+
+    struct Stats
+    {
+        uint32_t     blocks{0};
+        uint32_t     dedicated{0};       // Dedicated allocations
+        uint32_t     allocations{0};     // Ranges in use in the blocks
+        VkDeviceSize blockBytes{0};      // Taken from the device for blocks
+        VkDeviceSize usedBytes{0};       // In use within them
+        VkDeviceSize dedicatedBytes{0};
+        uint32_t     categoryCount[MEM_CATEGORIES]{};
+        VkDeviceSize categoryBytes[MEM_CATEGORIES]{};
+    };
+
+    struct HeapBudget
+    {
+        VkDeviceSize size{0};
+        VkDeviceSize budget{0};     // The heap's size without VK_EXT_memory_budget
+        VkDeviceSize usage{0};      // Ours alone without VK_EXT_memory_budget
+        VkDeviceSize allocated{0};  // By this allocator: blocks plus dedicated
+        bool         deviceLocal{false};
+    };
+
+    struct Record
+    {
+        MemoryTag    tag;
+        VkDeviceSize size{0};
+        uint32_t     memoryType{0};
+        bool         dedicated{false};
+    };
+
+    MemoryAllocator();
+    ~MemoryAllocator();
+
+    // memoryBudget: VK_EXT_memory_budget is enabled on device
+    void init(VkPhysicalDevice physicalDevice, VkDevice device, bool memoryBudget);
+    // Frees the blocks; everything allocated from them must be gone
+    void destroy();
+
+    // Allocate memory for a buffer (which can have its device address
+    // taken) or an image, and bind it.  Throws std::runtime_error.
+    MemoryAllocation allocate(VkBuffer buffer, VkMemoryPropertyFlags properties,
+                              const MemoryTag& tag = {});
+    MemoryAllocation allocate(VkImage image, VkMemoryPropertyFlags properties,
+                              const MemoryTag& tag = {});
+
+    Stats stats();
+    std::vector<HeapBudget> heapBudgets();
+    bool hasMemoryBudget() const { return m_memoryBudget; }
+
+    // The stats, the heap budgets and every live allocation, as JSON
+    void writeReport(std::ostream& out);
+
+private:
+    friend struct MemoryAllocation;
+
+    VkPhysicalDevice m_physicalDevice{VK_NULL_HANDLE};
+    VkDevice         m_device{VK_NULL_HANDLE};
+    VkPhysicalDeviceMemoryProperties m_memProperties{};
+    std::vector<std::unique_ptr<MemoryBlock>> m_blocks;
+    std::mutex       m_mutex;
+    Stats            m_stats;
+    bool             m_memoryBudget{false};
+    VkDeviceSize     m_heapBytes[VK_MAX_MEMORY_HEAPS]{};
+    std::unordered_map<uint32_t, Record> m_records;
+    uint32_t         m_nextId{1};
+
+    uint32_t findMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags properties) const;
+    MemoryAllocation allocate(const VkMemoryRequirements& req, bool dedicated, uint32_t memoryType,
+                              VkBuffer buffer, VkImage image);
+    MemoryAllocation allocateDedicated(const VkMemoryRequirements& req, uint32_t memoryType,
+                                       VkBuffer buffer, VkImage image);
+    void record(MemoryAllocation& allocation, const MemoryTag& tag, uint32_t memoryType);
+    void free(MemoryAllocation& allocation);
+};
@@ -0,0 +1,272 @@
+//////////////////////////////////////////////////////////////////////
+// Vertex welding and cache/fetch-friendly reordering of a model's
+// index and vertex arrays.  See mesh_optimize.h.
+////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <unordered_map>
+
+#include "mesh_optimize.h"
+#include "hash.h"
+
+float computeACMR(const uint32_t* indices, size_t nbIndices, uint32_t nbVertices,
+                  uint32_t cacheSize)
+{
+    if (nbIndices < 3)
+        return 0.0f;
+
+    // Timestamp based FIFO: a vertex is in the cache if it was
+    // inserted fewer than cacheSize misses ago.
+    std::vector<uint32_t> insertedAt(nbVertices, 0);
+    uint32_t misses = 0;
+    for (size_t i = 0; i < nbIndices; i++) {
+        uint32_t v = indices[i];
+        if (insertedAt[v] == 0 || misses + 1 - insertedAt[v] > cacheSize) {
+            misses++;
+            insertedAt[v] = misses; } }
+
+    return float(misses) / float(nbIndices/3);
+}
+
+namespace {
+
+struct VertexHash
+{
+    size_t operator()(const Vertex& v) const
+    {
+        return static_cast<size_t>(hashBytes(&v, sizeof(Vertex)));
+    }
+};
+
+struct VertexEqual
+{
+    bool operator()(const Vertex& a, const Vertex& b) const
+    {
+        return memcmp(&a, &b, sizeof(Vertex)) == 0;
+    }
+};
+
+// Forsyth's vertex scoring, with the constants from his paper.
+const int   MAX_CACHE    = 32;
+const float CACHE_DECAY  = 1.5f;
+const float LAST_TRI     = 0.75f;
+const float VALENCE_BOOST_SCALE = 2.0f;
+const float VALENCE_BOOST_POWER = 0.5f;
+
+float vertexScore(int cachePos, uint32_t remaining)
+{
+    if (remaining == 0)
+        return -1.0f;  // No triangles left need this vertex
+
+    float score = 0.0f;
+    if (cachePos >= 0) {
+        if (cachePos < 3)
+            score = LAST_TRI;  // Used by the last triangle; no boost to keep it
+        else
+            score = powf(1.0f - float(cachePos - 3)/float(MAX_CACHE - 3), CACHE_DECAY); }
+
+    // Favor vertices with few triangles left, to finish them off
+    score += VALENCE_BOOST_SCALE * powf(float(remaining), -VALENCE_BOOST_POWER);
+    return score;
+}
+
+}
+
+void weldVertices(ModelData& data)
+{
+    std::unordered_map<Vertex, uint32_t, VertexHash, VertexEqual> unique;
+    unique.reserve(data.vertices.size());
+
+    std::vector<uint32_t> remap(data.vertices.size());
+    std::vector<Vertex>   welded;
+    welded.reserve(data.vertices.size());
+
+    for (size_t i = 0; i < data.vertices.size(); i++) {
+        auto found = unique.emplace(data.vertices[i], static_cast<uint32_t>(welded.size()));
+        if (found.second)
+            welded.push_back(data.vertices[i]);
+        remap[i] = found.first->second; }
+
+    for (auto& index : data.indices)
+        index = remap[index];
+    data.vertices.swap(welded);
+}
+
+void optimizeVertexCache(ModelData& data)
+{
+    const uint32_t nbTriangles = static_cast<uint32_t>(data.indices.size()/3);
+    const uint32_t nbVertices  = static_cast<uint32_t>(data.vertices.size());
+    if (nbTriangles == 0)
+        return;
+
+    // Per-vertex list of the triangles using it (compressed rows).
+    std::vector<uint32_t> remaining(nbVertices, 0);
+    for (auto index : data.indices)
+        remaining[index]++;
+    std::vector<uint32_t> firstTri(nbVertices+1, 0);
+    for (uint32_t v = 0; v < nbVertices; v++)
+        firstTri[v+1] = firstTri[v] + remaining[v];
+    std::vector<uint32_t> vertTris(data.indices.size());
+    {
+        std::vector<uint32_t> fill(firstTri.begin(), firstTri.end()-1);
+        for (uint32_t t = 0; t < nbTriangles; t++)
+            for (int k = 0; k < 3; k++)
+                vertTris[fill[data.indices[3*t+k]]++] = t;
+    }
+
+    std::vector<int>   cachePos(nbVertices, -1);
+    std::vector<float> vScore(nbVertices);
+    for (uint32_t v = 0; v < nbVertices; v++)
+        vScore[v] = vertexScore(-1, remaining[v]);
+
+    std::vector<float> tScore(nbTriangles);
+    std::vector<bool>  emitted(nbTriangles, false);
+    for (uint32_t t = 0; t < nbTriangles; t++)
+        tScore[t] = vScore[data.indices[3*t]] + vScore[data.indices[3*t+1]]
+            + vScore[data.indices[3*t+2]];
+
+    std::vector<uint32_t> cache, newCache;
+    cache.reserve(MAX_CACHE+3);
+    newCache.reserve(MAX_CACHE+3);
+
+    std::vector<uint32_t> order;
+    order.reserve(nbTriangles);
+    uint32_t cursor = 0;  // Restart point when the cache has nothing left to offer
+    int64_t  best   = -1;
+
+    while (order.size() < nbTriangles) {
+        if (best < 0) {
+            // Dead end: take the next triangle not yet emitted.
+            while (emitted[cursor]) cursor++;
+            best = cursor; }
+
+        uint32_t t = static_cast<uint32_t>(best);
+        emitted[t] = true;
+        order.push_back(t);
+
+        // Retire this triangle from its vertices' lists.
+        const uint32_t* tri = &data.indices[3*t];
+        for (int k = 0; k < 3; k++) {
+            uint32_t v = tri[k];
+            uint32_t* list = &vertTris[firstTri[v]];
+            for (uint32_t j = 0; j < remaining[v]; j++)
+                if (list[j] == t) {
+                    list[j] = list[remaining[v]-1];
+                    break; }
+            remaining[v]--; }
+
+        // The triangle's vertices move to the front of the LRU cache.
+        newCache.assign(tri, tri+3);
+        for (auto v : cache)
+            if (v != tri[0] && v != tri[1] && v != tri[2])
+                newCache.push_back(v);
+        for (size_t i = 0; i < newCache.size(); i++)
+            cachePos[newCache[i]] = i < MAX_CACHE ? int(i) : -1;
+
+        // Rescore everything that was or is in the cache, and the
+        // triangles touching it; the best of those is next.
+        best = -1;
+        float bestScore = -1.0f;
+        for (auto v : newCache) {
+            vScore[v] = vertexScore(cachePos[v], remaining[v]);
+        }
+        for (auto v : newCache) {
+            const uint32_t* list = &vertTris[firstTri[v]];
+            for (uint32_t j = 0; j < remaining[v]; j++) {
+                uint32_t u = list[j];
+                const uint32_t* ut = &data.indices[3*u];
+                tScore[u] = vScore[ut[0]] + vScore[ut[1]] + vScore[ut[2]];
+                if (tScore[u] > bestScore) {
+                    bestScore = tScore[u];
+                    best = u; } } }
+
+        if (newCache.size() > MAX_CACHE)
+            newCache.resize(MAX_CACHE);
+        cache.swap(newCache);
+    }
+
+    std::vector<uint32_t> indices(data.indices.size());
+    std::vector<int32_t>  matIndx(data.matIndx.size());
+    for (uint32_t i = 0; i < nbTriangles; i++) {
+        uint32_t t = order[i];
+        indices[3*i]   = data.indices[3*t];
+        indices[3*i+1] = data.indices[3*t+1];
+        indices[3*i+2] = data.indices[3*t+2];
+        if (t < data.matIndx.size())
+            matIndx[i] = data.matIndx[t]; }
+
+    data.indices.swap(indices);
+    data.matIndx.swap(matIndx);
+}
+
+void optimizeVertexFetch(ModelData& data)
+{
+    const uint32_t unused = 0xffffffffu;
+    std::vector<uint32_t> remap(data.vertices.size(), unused);
+    std::vector<Vertex>   vertices;
+    vertices.reserve(data.vertices.size());
+
+    // Vertices never referenced by a triangle are dropped.
+    for (auto& index : data.indices) {
+        if (remap[index] == unused) {
+            remap[index] = static_cast<uint32_t>(vertices.size());
+            vertices.push_back(data.vertices[index]); }
+        index = remap[index]; }
+
+    data.vertices.swap(vertices);
+}
+
+// Optimize each mesh of data on its own, so vertices are never welded
+// across meshes and every mesh stays a contiguous index and vertex
+// range (as its BLAS and draw calls expect).
+void optimizeModel(ModelData& data)
+{
+    size_t before = data.vertices.size();
+    float acmrBefore = computeACMR(data.indices.data(), data.indices.size(),
+                                   static_cast<uint32_t>(data.vertices.size()));
+
+    if (data.meshes.empty())
+        data.meshes.push_back({0, uint32_t(data.indices.size()), 0, uint32_t(data.vertices.size()),
+                               vec3(0), vec3(0)});
+
+    std::vector<Vertex>   vertices;
+    std::vector<uint32_t> indices;
+    std::vector<int32_t>  matIndx;
+    vertices.reserve(data.vertices.size());
+    indices.reserve(data.indices.size());
+    matIndx.reserve(data.matIndx.size());
+
+    for (auto& range : data.meshes) {
+        ModelData part;
+        part.vertices.assign(data.vertices.begin() + range.firstVertex,
+                             data.vertices.begin() + range.firstVertex + range.nbVertices);
+        part.indices.resize(range.nbIndices);
+        for (uint32_t i = 0; i < range.nbIndices; i++)
+            part.indices[i] = data.indices[range.firstIndex + i] - range.firstVertex;
+        part.matIndx.assign(data.matIndx.begin() + range.firstIndex/3,
+                            data.matIndx.begin() + (range.firstIndex + range.nbIndices)/3);
+
+        weldVertices(part);
+        optimizeVertexCache(part);
+        optimizeVertexFetch(part);
+
+        range.firstIndex  = static_cast<uint32_t>(indices.size());
+        range.firstVertex = static_cast<uint32_t>(vertices.size());
+        range.nbVertices  = static_cast<uint32_t>(part.vertices.size());
+        for (auto index : part.indices)
+            indices.push_back(index + range.firstVertex);
+        vertices.insert(vertices.end(), part.vertices.begin(), part.vertices.end());
+        matIndx.insert(matIndx.end(), part.matIndx.begin(), part.matIndx.end()); }
+
+    data.vertices.swap(vertices);
+    data.indices.swap(indices);
+    data.matIndx.swap(matIndx);
+
+    float acmrAfter = computeACMR(data.indices.data(), data.indices.size(),
+                                  static_cast<uint32_t>(data.vertices.size()));
+    printf("Mesh optimize: %zd meshes, vertices %zd -> %zd, ACMR %.3f -> %.3f\n",
+           data.meshes.size(), before, data.vertices.size(), acmrBefore, acmrAfter);
+}
@@ -0,0 +1,352 @@
+//////////////////////////////////////////////////////////////////////
+// Quadric error metric simplification and the levels of detail built
+// with it.  See mesh_simplify.h.
+////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <queue>
+#include <unordered_map>
+
+#include "mesh_simplify.h"
+#include "mesh_optimize.h"
+
+namespace {
+
+const uint32_t LOD_MIN_TRIANGLES = 512;  // No level coarser than this
+const uint32_t MAX_LODS          = 8;
+const float    MIN_REDUCTION     = 0.8f;  // A level keeping more than this of the last is dropped
+const double   FLIP_COS          = 0.2;   // Least cosine between a triangle's normals across a collapse
+const float    MAX_LOD_ERROR     = 0.05f; // Of the mesh's bounding box diagonal; coarser is useless
+
+// The symmetric 4x4 matrix of a sum of squared distances to planes
+struct Quadric
+{
+    double a2{0}, ab{0}, ac{0}, ad{0}, b2{0}, bc{0}, bd{0}, c2{0}, cd{0}, d2{0};
+
+    void addPlane(const glm::dvec3& n, double d)
+    {
+        a2 += n.x*n.x;  ab += n.x*n.y;  ac += n.x*n.z;  ad += n.x*d;
+        b2 += n.y*n.y;  bc += n.y*n.z;  bd += n.y*d;
+        c2 += n.z*n.z;  cd += n.z*d;
+        d2 += d*d;
+    }
+
+    void add(const Quadric& q)
+    {
+        a2 += q.a2;  ab += q.ab;  ac += q.ac;  ad += q.ad;
+        b2 += q.b2;  bc += q.bc;  bd += q.bd;
+        c2 += q.c2;  cd += q.cd;
+        d2 += q.d2;
+    }
+
+    double eval(const glm::dvec3& p) const
+    {
+        double e = a2*p.x*p.x + 2*ab*p.x*p.y + 2*ac*p.x*p.z + 2*ad*p.x
+                 + b2*p.y*p.y + 2*bc*p.y*p.z + 2*bd*p.y
+                 + c2*p.z*p.z + 2*cd*p.z
+                 + d2;
+        return std::max(e, 0.0);  // Rounding
+    }
+};
+
+// A candidate collapse of vertex from onto vertex to.  It is stale if
+// either vertex has changed since (see m_stamp).
+struct Collapse
+{
+    double   cost;
+    uint32_t from, to;
+    uint32_t fromStamp, toStamp;
+
+    bool operator<(const Collapse& c) const { return cost > c.cost; }  // Cheapest on top
+};
+
+struct PositionHash
+{
+    size_t operator()(const vec3& p) const
+    {
+        uint32_t b[3];
+        memcpy(b, &p, sizeof(b));
+        return size_t(b[0])*73856093u ^ size_t(b[1])*19349663u ^ size_t(b[2])*83492791u;
+    }
+};
+
+class Simplifier
+{
+public:
+    Simplifier(const Vertex* vertices, uint32_t nbVertices, std::vector<uint32_t>& indices,
+               std::vector<int32_t>& matIndx)
+        : m_indices(indices), m_matIndx(matIndx), m_pos(nbVertices), m_quadric(nbVertices),
+          m_tris(nbVertices), m_locked(nbVertices, false), m_removed(nbVertices, false),
+          m_stamp(nbVertices, 0), m_mark(nbVertices, 0)
+    {
+        for (uint32_t v = 0; v < nbVertices; v++)
+            m_pos[v] = glm::dvec3(vertices[v].pos);
+
+        uint32_t nbTriangles = static_cast<uint32_t>(m_indices.size()/3);
+        m_live = nbTriangles;
+        m_alive.assign(nbTriangles, true);
+
+        // Each triangle's plane goes into its vertices' quadrics
+        for (uint32_t t = 0; t < nbTriangles; t++) {
+            const uint32_t* tri = &m_indices[3*t];
+            glm::dvec3 n = glm::cross(m_pos[tri[1]] - m_pos[tri[0]], m_pos[tri[2]] - m_pos[tri[0]]);
+            double len = glm::length(n);
+            if (len > 0.0) {
+                n /= len;
+                double d = -glm::dot(n, m_pos[tri[0]]);
+                for (int k = 0; k < 3; k++)
+                    m_quadric[tri[k]].addPlane(n, d); }
+            for (int k = 0; k < 3; k++)
+                m_tris[tri[k]].push_back(t); }
+
+        lockVertices(vertices, nbVertices);
+    }
+
+    float run(size_t targetIndices, float maxError)
+    {
+        std::priority_queue<Collapse> heap;
+        // An inner edge is in two triangles, in opposite directions;
+        // a border edge joins locked vertices, so nothing is lost.
+        for (uint32_t t = 0; t < m_alive.size(); t++)
+            for (int k = 0; k < 3; k++) {
+                uint32_t a = m_indices[3*t + k], b = m_indices[3*t + (k+1)%3];
+                if (a < b) {
+                    pushEdge(heap, a, b);
+                    pushEdge(heap, b, a); } }
+
+        double maxCost = 0.0;
+        double costLimit = double(maxError)*maxError;
+        while (!heap.empty() && 3*size_t(m_live) > targetIndices) {
+            Collapse c = heap.top();
+            heap.pop();
+            if (c.cost > costLimit)
+                break;
+            if (m_removed[c.from] || m_removed[c.to]
+                || c.fromStamp != m_stamp[c.from] || c.toStamp != m_stamp[c.to])
+                continue;
+            if (!collapsible(c.from, c.to))
+                continue;
+            collapse(c.from, c.to);
+            maxCost = std::max(maxCost, c.cost);
+
+            // Everything around to has changed
+            for (uint32_t t : m_tris[c.to])
+                for (int k = 0; k < 3; k++) {
+                    uint32_t w = m_indices[3*t + k];
+                    if (w != c.to) {
+                        pushEdge(heap, c.to, w);
+                        pushEdge(heap, w, c.to); } } }
+
+        compact();
+        return static_cast<float>(sqrt(maxCost));
+    }
+
+private:
+    std::vector<uint32_t>&  m_indices;
+    std::vector<int32_t>&   m_matIndx;
+    std::vector<glm::dvec3> m_pos;
+    std::vector<Quadric>    m_quadric;
+    std::vector<std::vector<uint32_t>> m_tris;  // Triangles of each vertex (some maybe dead)
+    std::vector<bool>       m_alive;            // Of each triangle
+    std::vector<bool>       m_locked;
+    std::vector<bool>       m_removed;          // Collapsed onto another vertex
+    std::vector<uint32_t>   m_stamp;            // Bumped whenever a vertex changes
+    std::vector<uint32_t>   m_mark;             // Scratch for collapsible
+    uint32_t m_markValue{0};
+    uint32_t m_live{0};
+
+    void lockVertices(const Vertex* vertices, uint32_t nbVertices)
+    {
+        // Open border: an edge used by one triangle only
+        std::vector<uint64_t> edges;
+        edges.reserve(m_indices.size());
+        for (size_t t = 0; t < m_indices.size()/3; t++)
+            for (int k = 0; k < 3; k++) {
+                uint64_t a = m_indices[3*t + k], b = m_indices[3*t + (k+1)%3];
+                edges.push_back(std::min(a, b) << 32 | std::max(a, b)); }
+        std::sort(edges.begin(), edges.end());
+        for (size_t i = 0; i < edges.size(); ) {
+            size_t j = i + 1;
+            while (j < edges.size() && edges[j] == edges[i])
+                j++;
+            if (j - i == 1) {
+                m_locked[uint32_t(edges[i] >> 32)] = true;
+                m_locked[uint32_t(edges[i])] = true; }
+            i = j; }
+
+        // Attribute seam: vertices sharing a position
+        std::unordered_map<vec3, uint32_t, PositionHash> first;
+        first.reserve(nbVertices);
+        for (uint32_t v = 0; v < nbVertices; v++) {
+            auto found = first.emplace(vertices[v].pos, v);
+            if (!found.second) {
+                m_locked[v] = true;
+                m_locked[found.first->second] = true; } }
+
+        // Material boundary
+        std::vector<int32_t> material(nbVertices, -1);
+        for (size_t t = 0; t < m_indices.size()/3; t++)
+            for (int k = 0; k < 3; k++) {
+                uint32_t v = m_indices[3*t + k];
+                if (material[v] == -1)
+                    material[v] = m_matIndx[t];
+                else if (material[v] != m_matIndx[t])
+                    m_locked[v] = true; }
+    }
+
+    void pushEdge(std::priority_queue<Collapse>& heap, uint32_t from, uint32_t to)
+    {
+        if (m_locked[from])
+            return;
+        Quadric q = m_quadric[from];
+        q.add(m_quadric[to]);
+        heap.push({q.eval(m_pos[to]), from, to, m_stamp[from], m_stamp[to]});
+    }
+
+    bool contains(uint32_t t, uint32_t v) const
+    {
+        return m_indices[3*t] == v || m_indices[3*t + 1] == v || m_indices[3*t + 2] == v;
+    }
+
+    // Whether collapsing from onto to keeps the surface a manifold
+    // (the two share no neighbours but those of their shared
+    // triangles) and turns no triangle over.
+    bool collapsible(uint32_t from, uint32_t to)
+    {
+        m_markValue++;
+        uint32_t shared = 0;
+        for (uint32_t t : m_tris[to])
+            if (m_alive[t])
+                for (int k = 0; k < 3; k++)
+                    m_mark[m_indices[3*t + k]] = m_markValue;
+        uint32_t common = 0;
+        m_markValue++;
+        for (uint32_t t : m_tris[from]) {
+            if (!m_alive[t])
+                continue;
+            if (contains(t, to))
+                shared++;
+            for (int k = 0; k < 3; k++) {
+                uint32_t w = m_indices[3*t + k];
+                if (w != from && w != to && m_mark[w] == m_markValue - 1) {
+                    m_mark[w] = m_markValue;  // Count once
+                    common++; } } }
+        if (shared == 0 || common != shared)
+            return false;
+
+        for (uint32_t t : m_tris[from]) {
+            if (!m_alive[t] || contains(t, to))
+                continue;
+            const uint32_t* tri = &m_indices[3*t];
+            glm::dvec3 p[3], q[3];
+            for (int k = 0; k < 3; k++) {
+                p[k] = m_pos[tri[k]];
+                q[k] = tri[k] == from ? m_pos[to] : p[k]; }
+            glm::dvec3 before = glm::cross(p[1] - p[0], p[2] - p[0]);
+            glm::dvec3 after  = glm::cross(q[1] - q[0], q[2] - q[0]);
+            double lb = glm::length(before), la = glm::length(after);
+            if (la == 0.0 || glm::dot(before, after) < FLIP_COS*lb*la)
+                return false; }
+        return true;
+    }
+
+    void collapse(uint32_t from, uint32_t to)
+    {
+        for (uint32_t t : m_tris[from]) {
+            if (!m_alive[t])
+                continue;
+            if (contains(t, to)) {
+                m_alive[t] = false;
+                m_live--;
+                continue; }
+            for (int k = 0; k < 3; k++)
+                if (m_indices[3*t + k] == from)
+                    m_indices[3*t + k] = to;
+            m_tris[to].push_back(t); }
+
+        // Other vertices keep their dead triangles until they collapse
+        auto& list = m_tris[to];
+        list.erase(std::remove_if(list.begin(), list.end(),
+                                  [this](uint32_t t) { return !m_alive[t]; }), list.end());
+
+        m_quadric[to].add(m_quadric[from]);
+        m_tris[from].clear();
+        m_removed[from] = true;
+        m_stamp[to]++;
+    }
+
+    // Drops the collapsed triangles, keeping the order of the others
+    void compact()
+    {
+        size_t n = 0;
+        for (size_t t = 0; t < m_alive.size(); t++) {
+            if (!m_alive[t])
+                continue;
+            for (int k = 0; k < 3; k++)
+                m_indices[3*n + k] = m_indices[3*t + k];
+            m_matIndx[n++] = m_matIndx[t]; }
+        m_indices.resize(3*n);
+        m_matIndx.resize(n);
+    }
+};
+
+}
+
+float simplifyMesh(const Vertex* vertices, uint32_t nbVertices, std::vector<uint32_t>& indices,
+                   std::vector<int32_t>& matIndx, size_t targetIndices, float maxError)
+{
+    if (indices.size() <= targetIndices)
+        return 0.0f;
+    Simplifier simplifier(vertices, nbVertices, indices, matIndx);
+    return simplifier.run(targetIndices, maxError);
+}
+
+// Each level is made from the one before (which is much faster than
+// from the full mesh), so its error is the sum of theirs.
+void buildLods(ModelData& data)
+{
+    size_t nbMeshes = 0, triangles = 0;
+    for (auto& range : data.meshes) {
+        if (range.nbIndices/3 < 2*LOD_MIN_TRIANGLES)
+            continue;
+
+        // The mesh on its own, for optimizeVertexCache
+        ModelData part;
+        part.vertices.assign(data.vertices.begin() + range.firstVertex,
+                             data.vertices.begin() + range.firstVertex + range.nbVertices);
+        part.indices.resize(range.nbIndices);
+        for (uint32_t i = 0; i < range.nbIndices; i++)
+            part.indices[i] = data.indices[range.firstIndex + i] - range.firstVertex;
+        part.matIndx.assign(data.matIndx.begin() + range.firstIndex/3,
+                            data.matIndx.begin() + (range.firstIndex + range.nbIndices)/3);
+
+        range.firstLod = static_cast<uint32_t>(data.lods.size());
+        float maxError = MAX_LOD_ERROR*glm::length(range.bmax - range.bmin);
+        float error = 0.0f;
+        while (range.nbLods < MAX_LODS && part.indices.size()/3 >= 2*LOD_MIN_TRIANGLES) {
+            size_t before = part.indices.size();
+            error += simplifyMesh(part.vertices.data(), range.nbVertices, part.indices,
+                                  part.matIndx, (before/6)*3, maxError - error);
+            if (part.indices.size() > before*MIN_REDUCTION)
+                break;  // Stuck on locked vertices
+            optimizeVertexCache(part);
+
+            MeshLod lod;
+            lod.firstIndex = static_cast<uint32_t>(data.indices.size());
+            lod.nbIndices  = static_cast<uint32_t>(part.indices.size());
+            lod.error      = error;
+            for (auto index : part.indices)
+                data.indices.push_back(index + range.firstVertex);
+            data.matIndx.insert(data.matIndx.end(), part.matIndx.begin(), part.matIndx.end());
+            data.lods.push_back(lod);
+            range.nbLods++;
+            triangles += lod.nbIndices/3; }
+        if (range.nbLods > 0)
+            nbMeshes++; }
+
+    printf("Mesh LODs: %zd levels over %zd meshes, %zd triangles\n",
+           data.lods.size(), nbMeshes, triangles);
+}
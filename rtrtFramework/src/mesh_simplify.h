@@ -0,0 +1,31 @@
+
+#pragma once
+
+#include <vector>
+#include <stdint.h>
+
+#include "model_data.h"
+
+// Mesh simplification by quadric error metrics (Garland and Heckbert),
+// for the raster path's levels of detail.  Edges are collapsed onto
+// one of their two vertices, cheapest first, so a simplified mesh uses
+// a subset of the original vertices and needs no vertex data of its
+// own.  Vertices on open borders, on attribute seams (another vertex
+// at the same position) and between materials never move, which keeps
+// silhouettes, texture seams and material edges in place.  A collapse
+// that would flip a triangle is skipped.
+
+// Simplifies the triangles in indices (into vertices[0, nbVertices))
+// until at most targetIndices indices are left, or no collapse within
+// maxError (a distance in the vertices' space) is possible.  matIndx
+// holds each triangle's material and follows its triangle.  Returns
+// the largest deviation introduced.
+float simplifyMesh(const Vertex* vertices, uint32_t nbVertices, std::vector<uint32_t>& indices,
+                   std::vector<int32_t>& matIndx, size_t targetIndices, float maxError);
+
+// Builds a chain of levels of detail for each of data.meshes, each
+// with about half the triangles of the one before, and appends them to
+// data.indices, data.matIndx and data.lods.  The chain stops where a
+// level would stray too far from the mesh (for its size) or gain too
+// little; meshes too small to gain from it get none.
+void buildLods(ModelData& data);
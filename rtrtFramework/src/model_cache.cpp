@@ -0,0 +1,299 @@
+//////////////////////////////////////////////////////////////////////
+// A versioned binary cache of the flattened model data produced by
+// ModelData::readAssimpFile.  The file is a fixed header followed by
+// the raw vertex, index, material, material-index, mesh-range,
+// mesh-instance and mesh-LOD arrays (each 16 byte aligned) and a list of
+// length-prefixed texture paths.  It is read back through a memory
+// mapping, so a warm start costs little more than the page faults of
+// the upload.
+////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <string.h>
+#include <fstream>
+#include <filesystem>
+namespace fs = std::filesystem;
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "model_cache.h"
+
+namespace {
+
+const char MAGIC[4] = {'R', 'T', 'M', 'C'};
+
+struct CacheHeader
+{
+    char     magic[4];
+    uint32_t version;
+    uint32_t vertexSize;     // sizeof(Vertex) when written
+    uint32_t materialSize;   // sizeof(Material) when written
+    uint32_t variant;        // Caller specific tag (e.g. extra geometry added after reading)
+    uint32_t nbTextures;
+    uint64_t sourceSize;     // Size of the model file when written
+    int64_t  sourceTime;     // Modification time of the model file when written
+
+    uint32_t nbVertices;
+    uint32_t nbIndices;
+    uint32_t nbMaterials;
+    uint32_t nbMatIndx;
+    uint32_t nbMeshes;
+    uint32_t meshSize;       // sizeof(MeshRange) when written
+    uint32_t nbInstances;
+    uint32_t instanceSize;   // sizeof(MeshInstance) when written
+    uint32_t nbLods;
+    uint32_t lodSize;        // sizeof(MeshLod) when written
+    uint32_t nbNodes;
+    uint32_t nodeSize;       // sizeof(ModelNode) when written
+    uint64_t vertexOffset;
+    uint64_t indexOffset;
+    uint64_t materialOffset;
+    uint64_t matIndxOffset;
+    uint64_t meshOffset;
+    uint64_t instanceOffset;
+    uint64_t lodOffset;
+    uint64_t nodeOffset;
+    uint64_t textureOffset;
+    uint64_t fileSize;
+};
+
+uint64_t alignUp(uint64_t x) { return (x + 15) & ~uint64_t(15); }
+
+}
+
+bool ModelCache::sourceStamp(const std::string& modelPath, uint64_t& size, int64_t& time)
+{
+    std::error_code ec;
+    size = fs::file_size(modelPath, ec);
+    if (ec) return false;
+    auto t = fs::last_write_time(modelPath, ec);
+    if (ec) return false;
+    time = static_cast<int64_t>(t.time_since_epoch().count());
+    return true;
+}
+
+std::string ModelCache::cachePath(const std::string& modelPath)
+{
+    return modelPath + ".rtc";
+}
+
+bool ModelCache::open(const std::string& modelPath, ModelView& view, uint32_t variant)
+{
+    close();
+
+    uint64_t srcSize;
+    int64_t  srcTime;
+    if (!sourceStamp(modelPath, srcSize, srcTime))
+        return false;
+
+    std::string path = cachePath(modelPath);
+
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                              OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart < (LONGLONG)sizeof(CacheHeader)) {
+        CloseHandle(file);
+        return false; }
+    HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!mapping) {
+        CloseHandle(file);
+        return false; }
+    void* base = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!base) {
+        CloseHandle(mapping);
+        CloseHandle(file);
+        return false; }
+    m_file    = file;
+    m_mapping = mapping;
+    m_base    = static_cast<const uint8_t*>(base);
+    m_size    = static_cast<size_t>(fileSize.QuadPart);
+#else
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(CacheHeader)) {
+        ::close(fd);
+        return false; }
+    void* base = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);  // The mapping stays valid after the descriptor is closed
+    if (base == MAP_FAILED)
+        return false;
+    m_base = static_cast<const uint8_t*>(base);
+    m_size = static_cast<size_t>(st.st_size);
+#endif
+
+    CacheHeader h;
+    memcpy(&h, m_base, sizeof(h));
+
+    bool valid = memcmp(h.magic, MAGIC, sizeof(MAGIC)) == 0
+        && h.version      == VERSION
+        && h.vertexSize   == sizeof(Vertex)
+        && h.materialSize == sizeof(Material)
+        && h.meshSize     == sizeof(MeshRange)
+        && h.instanceSize == sizeof(MeshInstance)
+        && h.lodSize      == sizeof(MeshLod)
+        && h.nodeSize     == sizeof(ModelNode)
+        && h.variant      == variant
+        && h.sourceSize   == srcSize
+        && h.sourceTime   == srcTime
+        && h.fileSize     == m_size
+        && h.vertexOffset   + uint64_t(h.nbVertices)*sizeof(Vertex)    <= m_size
+        && h.indexOffset    + uint64_t(h.nbIndices)*sizeof(uint32_t)   <= m_size
+        && h.materialOffset + uint64_t(h.nbMaterials)*sizeof(Material) <= m_size
+        && h.matIndxOffset  + uint64_t(h.nbMatIndx)*sizeof(int32_t)    <= m_size
+        && h.meshOffset     + uint64_t(h.nbMeshes)*sizeof(MeshRange)   <= m_size
+        && h.instanceOffset + uint64_t(h.nbInstances)*sizeof(MeshInstance) <= m_size
+        && h.lodOffset      + uint64_t(h.nbLods)*sizeof(MeshLod)       <= m_size
+        && h.nodeOffset     + uint64_t(h.nbNodes)*sizeof(ModelNode)    <= m_size
+        && h.textureOffset <= m_size;
+    if (!valid) {
+        close();
+        return false; }
+
+    view.vertices    = reinterpret_cast<const Vertex*>(m_base + h.vertexOffset);
+    view.indices     = reinterpret_cast<const uint32_t*>(m_base + h.indexOffset);
+    view.materials   = reinterpret_cast<const Material*>(m_base + h.materialOffset);
+    view.matIndx     = reinterpret_cast<const int32_t*>(m_base + h.matIndxOffset);
+    view.meshes      = reinterpret_cast<const MeshRange*>(m_base + h.meshOffset);
+    view.instances   = reinterpret_cast<const MeshInstance*>(m_base + h.instanceOffset);
+    view.lods        = reinterpret_cast<const MeshLod*>(m_base + h.lodOffset);
+    view.nodes       = reinterpret_cast<const ModelNode*>(m_base + h.nodeOffset);
+    view.nbVertices  = h.nbVertices;
+    view.nbIndices   = h.nbIndices;
+    view.nbMaterials = h.nbMaterials;
+    view.nbMatIndx   = h.nbMatIndx;
+    view.nbMeshes    = h.nbMeshes;
+    view.nbInstances = h.nbInstances;
+    view.nbLods      = h.nbLods;
+    view.nbNodes     = h.nbNodes;
+
+    // The texture list is tiny, so it is the only thing copied out.
+    view.textures.clear();
+    uint64_t at = h.textureOffset;
+    for (uint32_t i = 0; i < h.nbTextures; i++) {
+        uint32_t len;
+        if (at + sizeof(len) > m_size) { close(); return false; }
+        memcpy(&len, m_base + at, sizeof(len));
+        at += sizeof(len);
+        if (at + len > m_size) { close(); return false; }
+        view.textures.emplace_back(reinterpret_cast<const char*>(m_base + at), len);
+        at += len; }
+
+    printf("Read model cache %s\n", path.c_str());
+    return true;
+}
+
+void ModelCache::close()
+{
+    if (!m_base)
+        return;
+#ifdef _WIN32
+    UnmapViewOfFile(m_base);
+    CloseHandle(m_mapping);
+    CloseHandle(m_file);
+    m_mapping = nullptr;
+    m_file    = nullptr;
+#else
+    munmap(const_cast<uint8_t*>(m_base), m_size);
+#endif
+    m_base = nullptr;
+    m_size = 0;
+}
+
+bool ModelCache::write(const std::string& modelPath, const ModelData& data, uint32_t variant)
+{
+    CacheHeader h{};
+    memcpy(h.magic, MAGIC, sizeof(MAGIC));
+    h.version      = VERSION;
+    h.vertexSize   = sizeof(Vertex);
+    h.materialSize = sizeof(Material);
+    h.meshSize     = sizeof(MeshRange);
+    h.instanceSize = sizeof(MeshInstance);
+    h.lodSize      = sizeof(MeshLod);
+    h.nodeSize     = sizeof(ModelNode);
+    h.variant      = variant;
+    h.nbTextures   = static_cast<uint32_t>(data.textures.size());
+    if (!sourceStamp(modelPath, h.sourceSize, h.sourceTime))
+        return false;
+
+    h.nbVertices  = static_cast<uint32_t>(data.vertices.size());
+    h.nbIndices   = static_cast<uint32_t>(data.indices.size());
+    h.nbMaterials = static_cast<uint32_t>(data.materials.size());
+    h.nbMatIndx   = static_cast<uint32_t>(data.matIndx.size());
+    h.nbMeshes    = static_cast<uint32_t>(data.meshes.size());
+    h.nbInstances = static_cast<uint32_t>(data.instances.size());
+    h.nbLods      = static_cast<uint32_t>(data.lods.size());
+    h.nbNodes     = static_cast<uint32_t>(data.nodes.size());
+
+    h.vertexOffset   = alignUp(sizeof(CacheHeader));
+    h.indexOffset    = alignUp(h.vertexOffset   + uint64_t(h.nbVertices)*sizeof(Vertex));
+    h.materialOffset = alignUp(h.indexOffset    + uint64_t(h.nbIndices)*sizeof(uint32_t));
+    h.matIndxOffset  = alignUp(h.materialOffset + uint64_t(h.nbMaterials)*sizeof(Material));
+    h.meshOffset     = alignUp(h.matIndxOffset  + uint64_t(h.nbMatIndx)*sizeof(int32_t));
+    h.instanceOffset = alignUp(h.meshOffset     + uint64_t(h.nbMeshes)*sizeof(MeshRange));
+    h.lodOffset      = alignUp(h.instanceOffset + uint64_t(h.nbInstances)*sizeof(MeshInstance));
+    h.nodeOffset     = alignUp(h.lodOffset      + uint64_t(h.nbLods)*sizeof(MeshLod));
+    h.textureOffset  = alignUp(h.nodeOffset     + uint64_t(h.nbNodes)*sizeof(ModelNode));
+    h.fileSize       = h.textureOffset;
+    for (const auto& t : data.textures)
+        h.fileSize += sizeof(uint32_t) + t.size();
+
+    // Write to a temporary and rename, so an interrupted run never
+    // leaves a truncated cache behind.
+    std::string path = cachePath(modelPath);
+    std::string temp = path + ".tmp";
+    {
+        std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+        if (!out)
+            return false;
+
+        const char zeros[16] = {};
+        auto section = [&](uint64_t offset, const void* src, size_t bytes) {
+            out.write(zeros, offset - static_cast<uint64_t>(out.tellp()));
+            out.write(static_cast<const char*>(src), bytes); };
+
+        out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+        section(h.vertexOffset,   data.vertices.data(),  data.vertices.size()*sizeof(Vertex));
+        section(h.indexOffset,    data.indices.data(),   data.indices.size()*sizeof(uint32_t));
+        section(h.materialOffset, data.materials.data(), data.materials.size()*sizeof(Material));
+        section(h.matIndxOffset,  data.matIndx.data(),   data.matIndx.size()*sizeof(int32_t));
+        section(h.meshOffset,     data.meshes.data(),    data.meshes.size()*sizeof(MeshRange));
+        section(h.instanceOffset, data.instances.data(), data.instances.size()*sizeof(MeshInstance));
+        section(h.lodOffset,      data.lods.data(),      data.lods.size()*sizeof(MeshLod));
+        section(h.nodeOffset,     data.nodes.data(),     data.nodes.size()*sizeof(ModelNode));
+        section(h.textureOffset,  nullptr, 0);
+        for (const auto& t : data.textures) {
+            uint32_t len = static_cast<uint32_t>(t.size());
+            out.write(reinterpret_cast<const char*>(&len), sizeof(len));
+            out.write(t.data(), len); }
+
+        if (!out) {
+            out.close();
+            fs::remove(temp);
+            return false; }
+    }
+
+    std::error_code ec;
+    fs::rename(temp, path, ec);
+    if (ec) {
+        fs::remove(temp, ec);
+        return false; }
+
+    printf("Wrote model cache %s\n", path.c_str());
+    return true;
+}
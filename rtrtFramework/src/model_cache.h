@@ -0,0 +1,65 @@
+
+#pragma once
+
+#include <memory>
+#include <string>
+#include <stdint.h>
+
+#include "model_data.h"
+
+// A binary cache of a model's flattened ModelData, written next to
+// the model file (as <model>.rtc) the first time the model is read
+// through Assimp.  On later runs the file is memory mapped and the
+// arrays are used in place, skipping Assimp entirely.
+//
+// The cache is rejected (and rewritten) if its version, the sizes of
+// the shared Vertex/Material structures, or the size and modification
+// time of the source model differ from what was recorded.
+class ModelCache
+{
+public:
+    // Bump whenever the layout of the file or of ModelData changes.
+    static const uint32_t VERSION = 7;
+
+    ~ModelCache() { close(); }
+
+    static std::string cachePath(const std::string& modelPath);
+
+    // Identifies the current version of a model file, by its size and
+    // modification time; false if it can not be read.
+    static bool sourceStamp(const std::string& modelPath, uint64_t& size, int64_t& time);
+
+    // Map the cache of modelPath and fill in view; false if there is
+    // no valid cache for the current version of the model file.
+    // variant distinguishes caches of the same file holding different
+    // data (it must match the value given to write).
+    bool open(const std::string& modelPath, ModelView& view, uint32_t variant=0);
+    void close();
+
+    // Write data as the cache of modelPath; false on failure.
+    static bool write(const std::string& modelPath, const ModelData& data, uint32_t variant=0);
+
+private:
+    const uint8_t* m_base{nullptr};
+    size_t         m_size{0};
+#ifdef _WIN32
+    void* m_file{nullptr};
+    void* m_mapping{nullptr};
+#endif
+};
+
+// A model as read by importModel: the mapping of its cache (or the
+// data freshly read through Assimp) and a view of its arrays.
+struct ImportedModel
+{
+    ModelCache cache;
+    ModelData  meshdata;
+    ModelView  model;
+};
+
+// Reads a model from its cache, or through Assimp (writing the cache
+// for next time); throws std::runtime_error if it can not be read.
+// Touches nothing shared, so it may run on worker threads, including
+// pool's (which packs the meshes).  Defined with the Assimp reader, in
+// vkapp_loadModel.cpp.
+std::unique_ptr<ImportedModel> importModel(const std::string& filename, ThreadPool& pool);
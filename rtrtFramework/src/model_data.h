@@ -0,0 +1,122 @@
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#define GLM_FORCE_RADIANS
+#define GLM_SWIZZLE
+#include <glm/glm.hpp>
+
+#include "shaders/shared_structs.h"
+
+class ThreadPool;
+
+// One Assimp mesh within the flattened arrays, in its own (untransformed)
+// coordinates.  Its indices refer only to its own vertex range.
+struct MeshRange
+{
+    uint32_t firstIndex{0};
+    uint32_t nbIndices{0};
+    uint32_t firstVertex{0};
+    uint32_t nbVertices{0};
+    vec3     bmin{0};  // Mesh space bounding box
+    vec3     bmax{0};
+    uint32_t firstLod{0};  // Its levels of detail in lods, finest first
+    uint32_t nbLods{0};
+};
+
+// One level of detail of a mesh (see mesh_simplify.h): a simplified
+// copy of its triangles over the same vertices.  The levels of every
+// mesh follow all the meshes' own triangles in the index and material
+// index arrays, so ray tracing never sees them.
+struct MeshLod
+{
+    uint32_t firstIndex{0};
+    uint32_t nbIndices{0};
+    float    error{0.0f};  // Largest deviation from the full mesh, in mesh space
+};
+
+// One node of the model's hierarchy: its transform relative to its
+// parent.  Nodes are in depth-first order, so a node's parent comes
+// before it and its descendants directly follow it.
+struct ModelNode
+{
+    int32_t parent{-1};     // Index into nodes; -1 for the root
+    mat4    local{1.0f};    // Node to parent space
+};
+
+// One placement of a mesh by the model's node hierarchy.  A mesh used
+// by many nodes (or several identical meshes) is stored once, with one
+// of these for each place it appears.
+struct MeshInstance
+{
+    uint32_t mesh{0};        // Index into meshes
+    mat4     transform{1.0f}; // Mesh to model space
+    uint32_t node{0};        // Index into nodes of the node placing it
+};
+
+// The flattened contents of a model file, as produced by reading it
+// through Assimp: every distinct mesh concatenated into single arrays,
+// plus the list of its placements in model space and the node
+// hierarchy that makes them.
+struct ModelData
+{
+    std::vector<Vertex> vertices;
+    std::vector<uint32_t> indices;
+    std::vector<Material> materials;
+    std::vector<int32_t>     matIndx;
+    std::vector<std::string> textures;
+    std::vector<MeshRange>   meshes;
+    std::vector<MeshInstance> instances;
+    std::vector<MeshLod>     lods;
+    std::vector<ModelNode>   nodes;
+
+    // Meshes are packed on pool's workers, if given
+    void readAssimpFile(const std::string& path, const mat4& M, ThreadPool* pool=nullptr);
+};
+
+// A read-only view of the same arrays.  Filled in either from a
+// ModelData, or directly from a memory mapped ModelCache so that
+// nothing is copied on the way to the GPU.
+struct ModelView
+{
+    const Vertex*   vertices{nullptr};
+    const uint32_t* indices{nullptr};
+    const Material* materials{nullptr};
+    const int32_t*  matIndx{nullptr};
+    const MeshRange* meshes{nullptr};
+    const MeshInstance* instances{nullptr};
+    const MeshLod*  lods{nullptr};
+    const ModelNode* nodes{nullptr};
+    uint32_t nbVertices{0};
+    uint32_t nbIndices{0};
+    uint32_t nbMaterials{0};
+    uint32_t nbMatIndx{0};
+    uint32_t nbMeshes{0};
+    uint32_t nbInstances{0};
+    uint32_t nbLods{0};
+    uint32_t nbNodes{0};
+    std::vector<std::string> textures;
+
+    void set(const ModelData& data)
+    {
+        vertices    = data.vertices.data();
+        indices     = data.indices.data();
+        materials   = data.materials.data();
+        matIndx     = data.matIndx.data();
+        meshes      = data.meshes.data();
+        instances   = data.instances.data();
+        lods        = data.lods.data();
+        nodes       = data.nodes.data();
+        nbVertices  = static_cast<uint32_t>(data.vertices.size());
+        nbIndices   = static_cast<uint32_t>(data.indices.size());
+        nbMaterials = static_cast<uint32_t>(data.materials.size());
+        nbMatIndx   = static_cast<uint32_t>(data.matIndx.size());
+        nbMeshes    = static_cast<uint32_t>(data.meshes.size());
+        nbInstances = static_cast<uint32_t>(data.instances.size());
+        nbLods      = static_cast<uint32_t>(data.lods.size());
+        nbNodes     = static_cast<uint32_t>(data.nodes.size());
+        textures    = data.textures;
+    }
+};
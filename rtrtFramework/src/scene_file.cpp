@@ -0,0 +1,158 @@
+//////////////////////////////////////////////////////////////////////
+// Reading scene description files.  See scene_file.h for the format.
+////////////////////////////////////////////////////////////////////////
+
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <filesystem>
+namespace fs = std::filesystem;
+
+#include "scene_file.h"
+
+#include <glm/gtx/transform.hpp>
+
+SceneDesc defaultScene()
+{
+    SceneDesc scene;
+    scene.models.push_back({"models/living_room/living_room.obj", {glm::mat4(1.0f)}});
+    return scene;
+}
+
+namespace {
+
+// Reads up to count numbers, stopping (without error) at the end of
+// the line or at anything else; returns how many were read.
+int readFloats(std::istringstream& in, float* values, int count)
+{
+    int n = 0;
+    for (; n < count; n++) {
+        std::streampos at = in.tellg();
+        if (!(in >> values[n])) {
+            in.clear();
+            in.seekg(at);
+            break; } }
+    return n;
+}
+
+void readExactly(std::istringstream& in, float* values, int count)
+{
+    if (readFloats(in, values, count) != count)
+        throw std::runtime_error("expected " + std::to_string(count) + " numbers");
+}
+
+glm::mat4 readInstance(std::istringstream& in)
+{
+    glm::mat4 transform(1.0f);
+    std::string op;
+    while (in >> op) {
+        float v[4];
+        if (op == "translate") {
+            readExactly(in, v, 3);
+            transform = transform * glm::translate(glm::vec3(v[0], v[1], v[2])); }
+        else if (op == "rotate") {
+            readExactly(in, v, 4);
+            transform = transform * glm::rotate(glm::radians(v[0]), glm::vec3(v[1], v[2], v[3])); }
+        else if (op == "scale") {
+            int n = readFloats(in, v, 3);
+            if (n == 1)
+                transform = transform * glm::scale(glm::vec3(v[0]));
+            else if (n == 3)
+                transform = transform * glm::scale(glm::vec3(v[0], v[1], v[2]));
+            else
+                throw std::runtime_error("scale takes 1 or 3 numbers"); }
+        else
+            throw std::runtime_error("unknown instance operation " + op); }
+    return transform;
+}
+
+}
+
+SceneDesc readScene(const std::string& path)
+{
+    std::ifstream file(path);
+    if (!file)
+        throw std::runtime_error("failed to open scene file " + path + "!");
+    fs::path dir = fs::path(path).parent_path();
+
+    SceneDesc scene;
+    SceneModel* model = nullptr;  // The one instance lines apply to
+    bool placed = false;          // Whether an instance line followed its model line
+
+    // A model line without instance lines places the model once, as it is
+    auto endModel = [&] {
+        if (model && !placed)
+            model->instances.push_back(glm::mat4(1.0f)); };
+
+    std::string line;
+    for (int lineNo = 1; std::getline(file, line); lineNo++) {
+        line = line.substr(0, line.find('#'));
+        std::istringstream in(line);
+        std::string keyword;
+        if (!(in >> keyword))
+            continue;
+
+        try {
+            float v[6];
+            if (keyword == "model") {
+                std::string name;
+                if (!(in >> name))
+                    throw std::runtime_error("model needs a path");
+                std::string modelPath = (dir / name).lexically_normal().generic_string();
+                bool streamed = false;
+                std::string option;
+                if (in >> option) {
+                    if (option != "streamed")
+                        throw std::runtime_error("unexpected " + option);
+                    streamed = true; }
+                endModel();
+                model = nullptr;
+                placed = false;
+                for (auto& m : scene.models)
+                    if (m.path == modelPath)
+                        model = &m;
+                if (!model) {
+                    scene.models.push_back({modelPath, {}});
+                    model = &scene.models.back(); }
+                model->streamed = model->streamed || streamed; }
+            else if (keyword == "instance") {
+                if (!model)
+                    throw std::runtime_error("instance before any model");
+                model->instances.push_back(readInstance(in));
+                placed = true; }
+            else if (keyword == "camera") {
+                readExactly(in, v, 3);
+                scene.eye = glm::vec3(v[0], v[1], v[2]);
+                int n = readFloats(in, v, 6);
+                if (n != 0 && n != 3 && n != 6)
+                    throw std::runtime_error("camera takes 3, 6 or 9 numbers");
+                if (n >= 3) { scene.rate = v[0]; scene.spin = v[1]; scene.tilt = v[2]; }
+                if (n == 6) { scene.ry = v[3]; scene.front = v[4]; scene.back = v[5]; } }
+            else if (keyword == "light") {
+                readExactly(in, v, 3);
+                scene.lightPosition = glm::vec3(v[0], v[1], v[2]);
+                int n = readFloats(in, v, 2);
+                if (n >= 1) scene.lightIntensity = v[0];
+                if (n == 2) scene.lightAmbient = v[1]; }
+            else if (keyword == "exposure") {
+                readExactly(in, v, 1);
+                scene.exposure = v[0]; }
+            else if (keyword == "streaming") {
+                readExactly(in, v, 1);
+                if (v[0] <= 0.0f)
+                    throw std::runtime_error("streaming needs a positive budget");
+                scene.streamBudget = v[0]; }
+            else
+                throw std::runtime_error("unknown statement " + keyword);
+
+            std::string extra;
+            if (in >> extra)
+                throw std::runtime_error("unexpected " + extra); }
+        catch (const std::runtime_error& e) {
+            throw std::runtime_error(path + ":" + std::to_string(lineNo) + ": " + e.what()); } }
+
+    endModel();
+    if (scene.models.empty())
+        throw std::runtime_error(path + ": no models in the scene!");
+    return scene;
+}
@@ -0,0 +1,66 @@
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#define GLM_FORCE_RADIANS
+#include <glm/glm.hpp>
+
+// A scene: the models to load, each with the transforms of its
+// instances, and the starting camera, scanline light and exposure.
+// Scene files (app's -s flag) are plain text, one statement a line:
+//
+//   # Comments run to the end of the line
+//   model <path> [streamed] Model file, relative to the scene file;
+//                           the instance lines that follow place it
+//                           (no instance lines: once, untransformed).
+//                           A streamed model is cut into chunks that
+//                           are kept on the GPU only near the camera
+//                           (see geometry_chunks.h)
+//   instance <op>...        One instance; ops apply left to right:
+//                           translate x y z | rotate degrees x y z
+//                           | scale s | scale x y z
+//   camera x y z [rate spin tilt [ry front back]]
+//   light x y z [intensity [ambient]]
+//   exposure e
+//   streaming megabytes     Device memory streamed chunks may use
+//
+// A model listed more than once is loaded once, with all of the
+// instances.
+
+struct SceneModel
+{
+    std::string path;
+    std::vector<glm::mat4> instances;
+    bool streamed{false};
+};
+
+struct SceneDesc
+{
+    std::vector<SceneModel> models;
+
+    // Camera::reset's arguments
+    glm::vec3 eye{2.28f, 1.68f, 6.64f};
+    float rate{0.7f};
+    float spin{-20.0f};
+    float tilt{10.66f};
+    float ry{0.57f};
+    float front{0.1f};
+    float back{1000.0f};
+
+    // The scanline renderer's light, and the tone mapper's exposure
+    glm::vec3 lightPosition{0.5f, 2.5f, 3.0f};
+    float lightIntensity{1.0f};
+    float lightAmbient{0.2f};
+    float exposure{2.0f};
+
+    // The out-of-core geometry budget, in megabytes
+    float streamBudget{512.0f};
+};
+
+// The scene used when none is given: the living room.
+SceneDesc defaultScene();
+
+// Throws std::runtime_error, naming the file and line, on any error.
+SceneDesc readScene(const std::string& path);
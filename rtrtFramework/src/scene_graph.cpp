@@ -0,0 +1,122 @@
+//////////////////////////////////////////////////////////////////////
+// Scene graph with incremental transform updates.  See scene_graph.h.
+////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "scene_graph.h"
+
+void SceneGraph::clear()
+{
+    m_parent.clear();
+    m_end.clear();
+    m_local.clear();
+    m_world.clear();
+    m_dirty.clear();
+    m_dirtyRoots.clear();
+    m_changed.clear();
+}
+
+uint32_t SceneGraph::add(uint32_t parent, const glm::mat4& local)
+{
+    uint32_t node = size();
+    if (parent != NONE && (parent >= node || m_end[parent] != node))
+        throw std::runtime_error("failed to add scene node: out of depth-first order!");
+
+    m_parent.push_back(parent);
+    m_end.push_back(node + 1);
+    m_local.push_back(local);
+    m_world.push_back(local);
+    m_dirty.push_back(0);
+    for (uint32_t p = parent; p != NONE; p = m_parent[p])
+        m_end[p] = node + 1;
+    markDirty(node);
+    return node;
+}
+
+int32_t SceneGraph::setChildren(uint32_t node, const ModelNode* nodes, uint32_t count)
+{
+    uint32_t first  = node + 1;
+    uint32_t oldEnd = m_end[node];
+    int32_t  shift  = static_cast<int32_t>(count) - static_cast<int32_t>(oldEnd - first);
+
+    // Out with the old descendants, and their dirty marks
+    m_dirtyRoots.erase(std::remove_if(m_dirtyRoots.begin(), m_dirtyRoots.end(),
+                                      [&](uint32_t n) { return n >= first && n < oldEnd; }),
+                       m_dirtyRoots.end());
+    m_parent.erase(m_parent.begin() + first, m_parent.begin() + oldEnd);
+    m_end.erase(m_end.begin() + first, m_end.begin() + oldEnd);
+    m_local.erase(m_local.begin() + first, m_local.begin() + oldEnd);
+    m_world.erase(m_world.begin() + first, m_world.begin() + oldEnd);
+    m_dirty.erase(m_dirty.begin() + first, m_dirty.begin() + oldEnd);
+
+    // Everything after them moves
+    for (uint32_t i = first; i < size(); i++) {
+        if (m_parent[i] != NONE && m_parent[i] >= oldEnd)
+            m_parent[i] += shift;
+        m_end[i] += shift; }
+    for (uint32_t& n : m_dirtyRoots)
+        if (n >= oldEnd)
+            n += shift;
+    for (uint32_t p = node; p != NONE; p = m_parent[p])
+        m_end[p] += shift;
+
+    // In with the new, their ends found bottom up
+    std::vector<uint32_t>  parents(count);
+    std::vector<uint32_t>  ends(count);
+    std::vector<glm::mat4> locals(count);
+    for (uint32_t k = 0; k < count; k++) {
+        if (nodes[k].parent >= static_cast<int32_t>(k))
+            throw std::runtime_error("failed to set scene nodes: out of depth-first order!");
+        parents[k] = nodes[k].parent < 0 ? node : first + nodes[k].parent;
+        ends[k]    = first + k + 1;
+        locals[k]  = nodes[k].local; }
+    for (uint32_t k = count; k-- > 0; )
+        if (nodes[k].parent >= 0)
+            ends[nodes[k].parent] = std::max(ends[nodes[k].parent], ends[k]);
+    m_parent.insert(m_parent.begin() + first, parents.begin(), parents.end());
+    m_end.insert(m_end.begin() + first, ends.begin(), ends.end());
+    m_local.insert(m_local.begin() + first, locals.begin(), locals.end());
+    m_world.insert(m_world.begin() + first, locals.begin(), locals.end());
+    m_dirty.insert(m_dirty.begin() + first, count, 0);
+
+    markDirty(node);  // Which covers the new nodes
+    return shift;
+}
+
+void SceneGraph::setLocal(uint32_t node, const glm::mat4& local)
+{
+    m_local[node] = local;
+    markDirty(node);
+}
+
+void SceneGraph::markDirty(uint32_t node)
+{
+    if (!m_dirty[node]) {
+        m_dirty[node] = 1;
+        m_dirtyRoots.push_back(node); }
+}
+
+const std::vector<uint32_t>& SceneGraph::update()
+{
+    m_changed.clear();
+    if (m_dirtyRoots.empty())
+        return m_changed;
+
+    // In order, a dirty node inside a subtree already done is skipped:
+    // that pass saw its new local transform.
+    std::sort(m_dirtyRoots.begin(), m_dirtyRoots.end());
+    uint32_t done = 0;  // Nodes before this are up to date
+    for (uint32_t root : m_dirtyRoots) {
+        if (root < done)
+            continue;
+        for (uint32_t i = root; i < m_end[root]; i++) {
+            uint32_t p = m_parent[i];
+            m_world[i] = p == NONE ? m_local[i] : m_world[p]*m_local[i];
+            m_dirty[i] = 0;
+            m_changed.push_back(i); }
+        done = m_end[root]; }
+    m_dirtyRoots.clear();
+    return m_changed;
+}
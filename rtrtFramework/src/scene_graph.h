@@ -0,0 +1,69 @@
+
+#pragma once
+
+#include <vector>
+#include <stdint.h>
+
+#define GLM_FORCE_RADIANS
+#include <glm/glm.hpp>
+
+#include "model_data.h"
+
+// The scene's node hierarchy, kept after loading so that any subtree
+// (a door, a chair, a whole model) can be moved between frames.  Each
+// placement of a model is a root node with the model's own nodes (see
+// ModelNode) below it; instances hang off nodes.
+//
+// Nodes live in flat arrays in depth-first order: a node's parent
+// comes before it, and its descendants are the nodes right after it,
+// up to end(node).  Moving a node marks it dirty; update() recomputes
+// the world transforms of the dirty subtrees only, each in a single
+// forward pass over its range, so a frame costs what changed rather
+// than the size of the scene.
+//
+// Nothing here touches Vulkan: VkApp takes the changed nodes from
+// update() to its instances, the TLAS and the raster push constants.
+class SceneGraph
+{
+public:
+    static constexpr uint32_t NONE = ~0u;
+
+    void clear();
+
+    // Adds a node below parent (NONE for a new root), after every
+    // node added so far; parent must be the last node added or one of
+    // its ancestors, which keeps the depth-first order.  Returns its
+    // index.  Its world transform is computed by the next update().
+    uint32_t add(uint32_t parent, const glm::mat4& local);
+
+    // Replaces the descendants of node with nodes[0, count), whose
+    // parents index among themselves, -1 standing for node.  Later
+    // nodes move by the change in size, which is returned.
+    int32_t setChildren(uint32_t node, const ModelNode* nodes, uint32_t count);
+
+    // Moves node, and with it its subtree, at the next update()
+    void setLocal(uint32_t node, const glm::mat4& local);
+
+    // Recomputes the dirty subtrees' world transforms.  Returns the
+    // nodes whose world transform was recomputed, in increasing order;
+    // valid until the next call.
+    const std::vector<uint32_t>& update();
+
+    uint32_t size() const { return static_cast<uint32_t>(m_parent.size()); }
+    uint32_t parent(uint32_t node) const { return m_parent[node]; }
+    uint32_t end(uint32_t node) const { return m_end[node]; }  // Past its last descendant
+    const glm::mat4& local(uint32_t node) const { return m_local[node]; }
+    const glm::mat4& world(uint32_t node) const { return m_world[node]; }
+    uint32_t nbChanged() const { return static_cast<uint32_t>(m_changed.size()); }  // At the last update
+
+private:
+    std::vector<uint32_t>  m_parent;
+    std::vector<uint32_t>  m_end;
+    std::vector<glm::mat4> m_local;
+    std::vector<glm::mat4> m_world;
+    std::vector<uint8_t>   m_dirty;      // Moved since the last update
+    std::vector<uint32_t>  m_dirtyRoots; // The nodes with m_dirty set
+    std::vector<uint32_t>  m_changed;
+
+    void markDirty(uint32_t node);
+};
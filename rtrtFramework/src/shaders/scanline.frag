@@ -28,11 +28,16 @@ layout(location = 0) out vec4 fragColor;
 
 layout(buffer_reference, scalar) buffer Vertices {Vertex v[]; };    // Positions of an object
 layout(buffer_reference, scalar) buffer Indices {uint i[]; };       // Triangle indices
-layout(buffer_reference, scalar) buffer Materials {Material m[]; }; // Array of materials
-layout(buffer_reference, scalar) buffer MatIndices {int i[]; };     // Material ID for each triangle
+layout(buffer_reference, scalar) buffer MatIndices {int i[]; };     // Material table index for each triangle
 
 layout(binding=eObjDescs, scalar) buffer ObjDesc_ { ObjDesc i[]; } objDesc;
+layout(binding=eMaterials, scalar) buffer MaterialHot_ { MaterialHot m[]; } materialHot;
+#ifdef VIRTUAL_TEXTURES
+#define VT_SET 0
+#include "virtual_texture.glsl"
+#else
 layout(binding=eTextures) uniform sampler2D[] textureSamplers;
+#endif
 
 float pi = 3.14159;
 void main()
@@ -40,10 +45,9 @@ void main()
   // Material of the object
   ObjDesc    obj = objDesc.i[pcRaster.objIndex];
   MatIndices matIndices  = MatIndices(obj.materialIndexAddress);
-  Materials  materials   = Materials(obj.materialAddress);
   
-  int               matIndex = matIndices.i[gl_PrimitiveID];
-  Material mat      = materials.m[matIndex];
+  int               matIndex = matIndices.i[gl_PrimitiveID + pcRaster.primOffset];
+  MaterialHot mat   = materialHot.m[matIndex];
   
   vec3 N = normalize(worldNrm);
   vec3 V = normalize(viewDir);
@@ -54,14 +58,21 @@ void main()
 
   
   vec3 Kd = mat.diffuse;
-  vec3 Ks = mat.specular;
-  const float alpha = mat.shininess;
   
-  if (mat.textureId >= 0)
+#ifdef VIRTUAL_TEXTURES
+  // Derivatives are taken here, in uniform control flow
+  vec2 dx = dFdx(texCoord);
+  vec2 dy = dFdy(texCoord);
+#endif
+  if ((MaterialFlags(mat) & MATERIAL_TEXTURED) != 0)
   {
     int  txtOffset  = obj.txtOffset;
-    uint txtId      = txtOffset + mat.textureId;
+    uint txtId      = txtOffset + MaterialTexture(mat);
+#ifdef VIRTUAL_TEXTURES
+    Kd = VtSampleGrad(txtId, texCoord, dx, dy).xyz;
+#else
     Kd = texture(textureSamplers[nonuniformEXT(txtId)], texCoord).xyz;
+#endif
   }
   
   // This very minimal lighting calculation should be replaced with a modern BRDF calculation. 
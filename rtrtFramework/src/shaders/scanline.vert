@@ -17,9 +17,15 @@ layout(push_constant) uniform _PushConstantRaster
   PushConstantRaster pcRaster;
 };
 
+layout(binding = eInstDescs, scalar) buffer InstDesc_ { InstDesc i[]; } instDesc;
+
 layout(location = 0) in vec3 i_position;
+#ifdef COMPACT_VERTEX
+layout(location = 1) in vec2 i_normal;    // Octahedral; R16G16_SNORM
+#else
 layout(location = 1) in vec3 i_normal;
-layout(location = 2) in vec2 i_texCoord;
+#endif
+layout(location = 2) in vec2 i_texCoord;  // R16G16_SFLOAT when compact
 
 
 layout(location = 1) out vec3 worldPos;
@@ -40,7 +46,12 @@ void main()
   worldPos = vec3(pcRaster.modelMatrix * vec4(i_position, 1.0));
   viewDir  = vec3(eye - worldPos);
   texCoord = i_texCoord;
-  worldNrm = mat3(pcRaster.modelMatrix) * i_normal;
+  mat3 normalMatrix = mat3(instDesc.i[pcRaster.instIndex].normalMatrix);
+#ifdef COMPACT_VERTEX
+  worldNrm = normalMatrix * octDecode(i_normal);
+#else
+  worldNrm = normalMatrix * i_normal;
+#endif
 
   gl_Position = mats.viewProj * vec4(worldPos, 1.0);
 }
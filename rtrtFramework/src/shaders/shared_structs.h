@@ -19,6 +19,54 @@ using mat4 = glm::mat4;
 using uint = unsigned int;
 #endif
 
+// Define to store vertices in a compact 20 byte layout (full
+// precision position, octahedral encoded normal, half float texture
+// coordinates) instead of 32 bytes of floats.  Read vertex normals
+// and texture coordinates through VertexNormal and VertexTexCoord
+// (below) so either layout works.
+// #define COMPACT_VERTEX
+
+// Define to sample textures through the virtual texturing system
+// (virtual_texture.h) instead of a fully resident textureSamplers[]
+// array.  Only the pages the shaders ask for are kept on the GPU, in
+// a fixed size page cache.
+// #define VIRTUAL_TEXTURES
+
+// G-buffer formats.  Only the path tracer's accumulation buffers
+// (colCurr, colPrev) are rgba32f; the displayed image (scImage) and
+// the denoiser's output are rgba16f.  The albedo buffers (kd) are
+// rgba16f, or r11f_g11f_b10f with GBUFFER_KD_R11G11B10 (which needs
+// the device to support storage images of that format).  The
+// normal:depth buffers (nd) pack an octahedral encoded normal and the
+// hit distance into one texel: two snorm16 and a float in rg32ui, or,
+// with GBUFFER_ND_32BIT, two snorm8 and a half float in r32ui.  Write
+// and read them through PackNd and UnpackNd (below).
+// #define GBUFFER_KD_R11G11B10
+// #define GBUFFER_ND_32BIT
+
+#define GBUFFER_COLOR_FORMAT VK_FORMAT_R16G16B16A16_SFLOAT
+#define GBUFFER_COLOR_LAYOUT rgba16f
+#ifdef GBUFFER_KD_R11G11B10
+ #define GBUFFER_KD_FORMAT VK_FORMAT_B10G11R11_UFLOAT_PACK32
+ #define GBUFFER_KD_LAYOUT r11f_g11f_b10f
+#else
+ #define GBUFFER_KD_FORMAT VK_FORMAT_R16G16B16A16_SFLOAT
+ #define GBUFFER_KD_LAYOUT rgba16f
+#endif
+#ifdef GBUFFER_ND_32BIT
+ #define GBUFFER_ND_FORMAT VK_FORMAT_R32_UINT
+ #define GBUFFER_ND_LAYOUT r32ui
+#else
+ #define GBUFFER_ND_FORMAT VK_FORMAT_R32G32_UINT
+ #define GBUFFER_ND_LAYOUT rg32ui
+#endif
+
+#define VT_PAGE_SIZE   128  // Texels per side of a page
+#define VT_PAGE_BORDER 4    // Texels of its neighbors kept around each page, for filtering
+#define VT_TILE_SIZE   (VT_PAGE_SIZE + 2*VT_PAGE_BORDER)  // Page plus border, in the cache
+#define VT_CACHE_TILES 32   // The page cache is VT_CACHE_TILES x VT_CACHE_TILES tiles
+#define VT_NOT_RESIDENT 0xffffffffu  // Page table entry of a page not in the cache
+
 // clang-format off
 #ifdef __cplusplus // Descriptor binding helper for C++ and GLSL
  #define START_ENUM(a) enum a {
@@ -31,7 +79,14 @@ using uint = unsigned int;
 START_ENUM(ScBindings)
   eMatrices  = 0,  // Global uniform containing camera matrices
   eObjDescs = 1,  // Access to the object descriptions
-  eTextures = 2   // Access to textures
+  eTextures = 2,  // Access to textures
+  eInstDescs = 3, // Access to the instance descriptions
+  eVtTextures = 4,  // Virtual texture descriptions (VIRTUAL_TEXTURES only)
+  eVtPageTable = 5, // Page table: the cache tile of each resident page
+  eVtFeedback = 6,  // Pages requested by the shaders since the last frame
+  eVtCache = 7,     // The page cache image
+  eMaterials = 8,   // The material table's MaterialHot array
+  eMaterialsCold = 9  // and its MaterialCold array
 END_ENUM();
 
 START_ENUM(RtBindings)
@@ -47,10 +102,18 @@ END_ENUM();
 struct ObjDesc
 {
   int      txtOffset;             // Texture index offset in the array of textures
-  uint64_t vertexAddress;         // Address of the Vertex buffer
-  uint64_t indexAddress;          // Address of the index buffer
-  uint64_t materialAddress;       // Address of the material buffer
-  uint64_t materialIndexAddress;  // Address of the triangle material index buffer
+  uint64_t vertexAddress;         // Address of the mesh's first Vertex
+  uint64_t indexAddress;          // Address of the mesh's indices (relative to its first vertex)
+  uint64_t materialIndexAddress;  // Address of the triangle material index buffer (into the material table)
+  uint     indexSize;             // Bytes per index: 2 or 4
+};
+
+// Information of a mesh instance when referenced in a shader
+// (indexed by instance custom index + geometry index of a hit)
+struct InstDesc
+{
+  mat4 normalMatrix;  // Inverse transpose of the instance transform
+  uint objDesc;       // Index of the instanced mesh's ObjDesc
 };
 
 
@@ -70,6 +133,8 @@ struct PushConstantRaster
     vec3  lightPosition;
     float lightIntensity;
     uint  objIndex;     // index of instance
+    uint  primOffset;   // First triangle drawn, past the mesh's first (levels of detail)
+    uint  instIndex;    // Its InstDesc, for the normal matrix
 };
 
 
@@ -124,16 +189,137 @@ struct PushConstantRay
   ALIGNAS(4) bool history;
   ALIGNAS(4) float dThresh;
   ALIGNAS(4) float nThresh;
+
+  // Explicit light connection
+  ALIGNAS(4) bool explicitLight;
+  ALIGNAS(4) int nbLights;       // Entries in the light table
+  ALIGNAS(4) float lightPower;   // Sum of the lights' power
 };
 
+#ifdef COMPACT_VERTEX
+struct Vertex  // Created by readModel; used in shaders
+{
+  vec3 pos;
+  uint nrm;       // Octahedral encoded unit normal, as two snorm16
+  uint texCoord;  // Two half floats
+};
+#else
 struct Vertex  // Created by readModel; used in shaders
 {
   vec3 pos;
   vec3 nrm;
   vec2 texCoord;
 };
+#endif
+
+// Octahedral mapping of unit vectors to [-1,1]^2 and back.
+#ifdef __cplusplus
+inline vec2 octEncode(vec3 n)
+{
+  n /= glm::abs(n.x) + glm::abs(n.y) + glm::abs(n.z);
+  vec2 e(n.x, n.y);
+  if (n.z < 0.0f)
+    e = (1.0f - glm::abs(vec2(n.y, n.x))) * vec2(n.x >= 0.0f ? 1.0f : -1.0f, n.y >= 0.0f ? 1.0f : -1.0f);
+  return e;
+}
+
+inline vec3 octDecode(vec2 e)
+{
+  vec3 n(e.x, e.y, 1.0f - glm::abs(e.x) - glm::abs(e.y));
+  float t = glm::max(-n.z, 0.0f);
+  n.x += n.x >= 0.0f ? -t : t;
+  n.y += n.y >= 0.0f ? -t : t;
+  return glm::normalize(n);
+}
+
+inline Vertex makeVertex(vec3 pos, vec3 nrm, vec2 texCoord)
+{
+#ifdef COMPACT_VERTEX
+  float len = glm::length(nrm);
+  return {pos, glm::packSnorm2x16(octEncode(len > 0.0f ? nrm/len : vec3(0,0,1))),
+          glm::packHalf2x16(texCoord)};
+#else
+  return {pos, nrm, texCoord};
+#endif
+}
+
+inline vec3 VertexNormal(const Vertex& v)
+{
+#ifdef COMPACT_VERTEX
+  return octDecode(glm::unpackSnorm2x16(v.nrm));
+#else
+  return v.nrm;
+#endif
+}
+
+inline vec2 VertexTexCoord(const Vertex& v)
+{
+#ifdef COMPACT_VERTEX
+  return glm::unpackHalf2x16(v.texCoord);
+#else
+  return v.texCoord;
+#endif
+}
+#else
+vec2 octEncode(vec3 n)
+{
+  n /= max(abs(n.x) + abs(n.y) + abs(n.z), 1e-20);  // A zero normal encodes as +z
+  vec2 e = n.xy;
+  if (n.z < 0.0)
+    e = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+  return e;
+}
+
+vec3 octDecode(vec2 e)
+{
+  vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+  float t = max(-n.z, 0.0);
+  n.x += n.x >= 0.0 ? -t : t;
+  n.y += n.y >= 0.0 ? -t : t;
+  return normalize(n);
+}
+
+vec3 VertexNormal(Vertex v)
+{
+#ifdef COMPACT_VERTEX
+  return octDecode(unpackSnorm2x16(v.nrm));
+#else
+  return v.nrm;
+#endif
+}
+
+vec2 VertexTexCoord(Vertex v)
+{
+#ifdef COMPACT_VERTEX
+  return unpackHalf2x16(v.texCoord);
+#else
+  return v.texCoord;
+#endif
+}
+
+// An nd texel (see GBUFFER_ND_FORMAT), and back to the normal in xyz
+// and the depth in w
+uvec4 PackNd(vec3 nrm, float depth)
+{
+#ifdef GBUFFER_ND_32BIT
+  return uvec4((packSnorm4x8(vec4(octEncode(nrm), 0, 0)) & 0xffffu)
+               | (packHalf2x16(vec2(min(depth, 65504.0), 0)) << 16), 0, 0, 0);
+#else
+  return uvec4(packSnorm2x16(octEncode(nrm)), floatBitsToUint(depth), 0, 0);
+#endif
+}
+
+vec4 UnpackNd(uvec4 texel)
+{
+#ifdef GBUFFER_ND_32BIT
+  return vec4(octDecode(unpackSnorm4x8(texel.x).xy), unpackHalf2x16(texel.x >> 16).x);
+#else
+  return vec4(octDecode(unpackSnorm2x16(texel.x)), uintBitsToFloat(texel.y));
+#endif
+}
+#endif
 
-struct Material  // Created by readModel; used in shaders
+struct Material  // Created by readModel; also the shaders' unpacked form
 {
   vec3  diffuse;
   vec3  specular;
@@ -142,6 +328,62 @@ struct Material  // Created by readModel; used in shaders
   int   textureId;
 };
 
+// The scene's materials, deduplicated across all models into one
+// table (material_table.h) that each triangle's material index points
+// into.  The table is split in two arrays by how often each part is
+// read: every hit reads the 16 byte MaterialHot entry, whose flags
+// tell whether the MaterialCold entry is needed at all.
+#define MATERIAL_EMISSIVE 0x1u  // Non-zero emission
+#define MATERIAL_TEXTURED 0x2u  // The diffuse color comes from a texture
+#define MATERIAL_SPECULAR 0x4u  // Non-zero specular; else purely diffuse
+#define MATERIAL_FLAG_BITS 8    // The texture id is in the bits above the flags
+
+struct MaterialHot
+{
+  vec3 diffuse;
+  uint flagsTexture;  // Flags, and the texture id << MATERIAL_FLAG_BITS if textured
+};
+
+struct MaterialCold
+{
+  vec3  specular;
+  float shininess;
+  vec3  emission;
+  float pad;  // To 32 bytes, so that no entry straddles a cache line
+};
+
+#ifndef __cplusplus
+uint MaterialFlags(MaterialHot m)   { return m.flagsTexture & ((1u << MATERIAL_FLAG_BITS) - 1u); }
+int  MaterialTexture(MaterialHot m) { return int(m.flagsTexture >> MATERIAL_FLAG_BITS); }
+#endif
+
+
+// A texture seen through the virtual texturing system.  Its pages
+// (level by level, largest level first, row major within a level)
+// occupy firstPage onwards in the page table and feedback buffers.
+struct VtTexture
+{
+  uint width;
+  uint height;
+  uint levels;
+  uint firstPage;
+};
+
+
+// An emissive triangle, in world space, as listed in the light table.
+// prob and alias are this entry's slot of the table's alias table.
+struct Light
+{
+  vec3  v0;
+  vec3  v1;
+  vec3  v2;
+  vec3  emission;
+  float area;
+  float power;  // pi * luminance(emission) * area
+  float prob;   // Probability of choosing this entry when its slot is picked,
+  uint  alias;  //   and the entry chosen otherwise
+};
+
 
 // Push constant structure for the ray tracer
 struct PushConstantDenoise
@@ -0,0 +1,99 @@
+// Virtual texture lookups (see virtual_texture.h).  Define VT_SET to
+// the descriptor set holding the ScBindings before including this.
+// Requires shared_structs.h and GL_EXT_scalar_block_layout.
+
+layout(set=VT_SET, binding=eVtTextures, scalar) buffer VtTextures_ { VtTexture t[]; } vtTextures;
+layout(set=VT_SET, binding=eVtPageTable) buffer VtPageTable_ { uint p[]; } vtPageTable;
+layout(set=VT_SET, binding=eVtFeedback) buffer VtFeedback_ { uint f[]; } vtFeedback;
+layout(set=VT_SET, binding=eVtCache) uniform sampler2D vtCache;
+
+const uint  vtPageSize  = uint(VT_PAGE_SIZE);
+const float vtTileSize  = float(VT_TILE_SIZE);
+const float vtBorder    = float(VT_PAGE_BORDER);
+const float vtCacheSize = float(VT_CACHE_TILES*VT_TILE_SIZE);
+
+uvec2 VtLevelSize(VtTexture t, uint level)
+{
+    return max(uvec2(t.width, t.height) >> level, uvec2(1));
+}
+
+uvec2 VtLevelPages(VtTexture t, uint level)
+{
+    return (VtLevelSize(t, level) + vtPageSize - 1u) / vtPageSize;
+}
+
+// Index of a page in the page table and feedback buffers; must match
+// VirtualTextures::add.
+uint VtPageIndex(VtTexture t, uint level, uvec2 page)
+{
+    uint index = t.firstPage;
+    for (uint l = 0u; l < level; l++) {
+        uvec2 pages = VtLevelPages(t, l);
+        index += pages.x*pages.y; }
+    return index + page.y*VtLevelPages(t, level).x + page.x;
+}
+
+// The texture's first level that fits in one page, which is pinned
+// in the cache (VirtualTextures::pinnedPages); the coarser ones are
+// never read.
+uint VtPinnedLevel(VtTexture t)
+{
+    uint level = 0u;
+    while (level + 1u < t.levels && VtLevelPages(t, level) != uvec2(1))
+        level++;
+    return level;
+}
+
+// Samples virtual texture id at a given level of detail, at most the
+// pinned level.  The page that level wants is recorded for streaming,
+// and the finest resident level at or above it is what is actually
+// read.
+vec4 VtSampleLod(uint id, vec2 uv, float lod)
+{
+    VtTexture t = vtTextures.t[id];
+    uint pinned = VtPinnedLevel(t);
+    uint want = uint(clamp(lod, 0.0, float(pinned)));
+    uv = fract(uv);
+
+    for (uint level = want; level <= pinned; level++) {
+        uvec2 size  = VtLevelSize(t, level);
+        vec2  texel = uv*vec2(size);
+        uvec2 page  = min(uvec2(texel) / vtPageSize, VtLevelPages(t, level) - 1u);
+        uint  index = VtPageIndex(t, level, page);
+        if (level == want)
+            vtFeedback.f[index] = 1u;
+
+        uint entry = vtPageTable.p[index];
+        if (entry != VT_NOT_RESIDENT) {
+            vec2 tile = vec2(entry & 0xffffu, entry >> 16);
+            vec2 pos  = tile*vtTileSize + vtBorder + (texel - vec2(page*vtPageSize));
+            return textureLod(vtCache, pos / vtCacheSize, 0.0); } }
+
+    return vec4(1, 0, 1, 1);  // Unreachable: the pinned level is always resident
+}
+
+// As above, with the level of detail from texture coordinate
+// derivatives (as texture() would compute it in a fragment shader).
+vec4 VtSampleGrad(uint id, vec2 uv, vec2 dx, vec2 dy)
+{
+    VtTexture t = vtTextures.t[id];
+    vec2 size = vec2(t.width, t.height);
+    float rho = max(length(dx*size), length(dy*size));
+    return VtSampleLod(id, uv, log2(max(rho, 1e-8)));
+}
+
+// Ray cone level of detail (Akenine-Moller et al., "Texture Level of
+// Detail Strategies for Real-Time Ray Tracing"): the triangle's ratio
+// of texel area to surface area, and the width of the pixel's cone
+// where it hits the surface.  The positions are in mesh space and the
+// cone in world space; normalMatrix, the instance transform M's
+// inverse transpose, takes the area to world space (M a x M b is
+// det(M) normalMatrix (a x b)).
+float VtTriangleLod(uint id, vec3 p0, vec3 p1, vec3 p2, vec2 t0, vec2 t1, vec2 t2,
+                    mat3 normalMatrix, float coneWidth)
+{
+    VtTexture t = vtTextures.t[id];
+    float ta = float(t.width*t.height) * abs((t1.x - t0.x)*(t2.y - t0.y) - (t2.x - t0.x)*(t1.y - t0.y));
+    float pa = length(normalMatrix*cross(p1 - p0, p2 - p0)) / max(abs(determinant(normalMatrix)), 1e-12);
+    return 0.5*log2(max(ta, 1e-12)/max(pa, 1e-12)) + log2(max(coneWidth, 1e-12));
+}
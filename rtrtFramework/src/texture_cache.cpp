@@ -0,0 +1,430 @@
+//////////////////////////////////////////////////////////////////////
+// A content-hashed disk cache of mipmapped, block compressed textures.
+// Each entry is a KTX2 file (identifier, header, level index and a
+// key/value block holding the cache version) followed by the levels,
+// smallest first and 16 byte aligned, as the KTX2 layout requires.
+// No data format descriptor is written: vkFormat alone says everything
+// this reader needs.  See texture_cache.h.
+////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <stdexcept>
+#include <filesystem>
+namespace fs = std::filesystem;
+
+#include "stb_image.h"
+
+#include "texture_cache.h"
+#include "hash.h"
+
+namespace {
+
+const uint8_t KTX2_IDENTIFIER[12] = {0xAB, 'K', 'T', 'X', ' ', '2', '0', 0xBB, '\r', '\n', 0x1A, '\n'};
+const char    VERSION_KEY[] = "rtrtTextureCache";
+
+struct Ktx2Header
+{
+    uint8_t  identifier[12];
+    uint32_t vkFormat;
+    uint32_t typeSize;
+    uint32_t pixelWidth;
+    uint32_t pixelHeight;
+    uint32_t pixelDepth;
+    uint32_t layerCount;
+    uint32_t faceCount;
+    uint32_t levelCount;
+    uint32_t supercompressionScheme;
+    uint32_t dfdByteOffset;
+    uint32_t dfdByteLength;
+    uint32_t kvdByteOffset;
+    uint32_t kvdByteLength;
+    uint64_t sgdByteOffset;
+    uint64_t sgdByteLength;
+};
+
+struct Ktx2Level
+{
+    uint64_t byteOffset;
+    uint64_t byteLength;
+    uint64_t uncompressedByteLength;
+};
+
+uint64_t alignUp(uint64_t x) { return (x + 15) & ~uint64_t(15); }
+
+bool readFile(const std::string& path, std::vector<uint8_t>& bytes)
+{
+    std::ifstream in(path, std::ios::binary | std::ios::ate);
+    if (!in)
+        return false;
+    std::streamoff size = in.tellg();
+    if (size < 0)
+        return false;
+    bytes.resize(static_cast<size_t>(size));
+    in.seekg(0);
+    in.read(reinterpret_cast<char*>(bytes.data()), size);
+    return bool(in);
+}
+
+uint32_t blockBytes(uint32_t format)
+{
+    return format == TextureCache::FORMAT_BC1 ? 8 : 16;
+}
+
+uint64_t levelSize(uint32_t format, uint32_t w, uint32_t h)
+{
+    if (format == TextureCache::FORMAT_RGBA8)
+        return uint64_t(w)*h*4;
+    return uint64_t((w+3)/4) * ((h+3)/4) * blockBytes(format);
+}
+
+////////////////////////////////////////////////////////////////////////
+// BC1/BC3 block encoding.  Color endpoints are the extremes of the
+// block's pixels along their principal axis; every pixel then takes
+// the nearest of the four palette entries.  Alpha (BC3) uses the
+// block's min and max with the eight entry palette.
+////////////////////////////////////////////////////////////////////////
+
+uint16_t to565(const float c[3])
+{
+    auto q = [](float v, int bits) {
+        int m = (1 << bits) - 1;
+        return std::clamp(int(v * m / 255.0f + 0.5f), 0, m); };
+    return uint16_t((q(c[0], 5) << 11) | (q(c[1], 6) << 5) | q(c[2], 5));
+}
+
+void from565(uint16_t c, int out[3])
+{
+    int r = (c >> 11) & 31, g = (c >> 5) & 63, b = c & 31;
+    out[0] = (r << 3) | (r >> 2);
+    out[1] = (g << 2) | (g >> 4);
+    out[2] = (b << 3) | (b >> 2);
+}
+
+// block is 16 RGBA8 pixels, row major.  Always produces the four
+// color mode, as BC3 requires.
+void encodeColorBlock(const uint8_t block[64], uint8_t out[8])
+{
+    float mean[3] = {0, 0, 0};
+    for (int i = 0; i < 16; i++)
+        for (int k = 0; k < 3; k++)
+            mean[k] += block[4*i+k] / 16.0f;
+
+    float cov[6] = {0, 0, 0, 0, 0, 0};
+    for (int i = 0; i < 16; i++) {
+        float r = block[4*i] - mean[0], g = block[4*i+1] - mean[1], b = block[4*i+2] - mean[2];
+        cov[0] += r*r; cov[1] += r*g; cov[2] += r*b;
+        cov[3] += g*g; cov[4] += g*b; cov[5] += b*b; }
+
+    // Principal axis by a few rounds of power iteration
+    float axis[3] = {1, 1, 1};
+    for (int it = 0; it < 8; it++) {
+        float x = cov[0]*axis[0] + cov[1]*axis[1] + cov[2]*axis[2];
+        float y = cov[1]*axis[0] + cov[3]*axis[1] + cov[4]*axis[2];
+        float z = cov[2]*axis[0] + cov[4]*axis[1] + cov[5]*axis[2];
+        float len = std::max(std::max(fabsf(x), fabsf(y)), fabsf(z));
+        if (len < 1e-6f) break;
+        axis[0] = x/len; axis[1] = y/len; axis[2] = z/len; }
+
+    float lo = 1e30f, hi = -1e30f;
+    for (int i = 0; i < 16; i++) {
+        float t = (block[4*i]-mean[0])*axis[0] + (block[4*i+1]-mean[1])*axis[1]
+            + (block[4*i+2]-mean[2])*axis[2];
+        lo = std::min(lo, t);
+        hi = std::max(hi, t); }
+    float len2 = axis[0]*axis[0] + axis[1]*axis[1] + axis[2]*axis[2];
+    float cmax[3], cmin[3];
+    for (int k = 0; k < 3; k++) {
+        cmax[k] = mean[k] + axis[k]*hi/len2;
+        cmin[k] = mean[k] + axis[k]*lo/len2; }
+
+    uint16_t c0 = to565(cmax), c1 = to565(cmin);
+    if (c0 < c1) std::swap(c0, c1);
+
+    uint32_t indices = 0;
+    if (c0 != c1) {
+        int p[4][3];
+        from565(c0, p[0]);
+        from565(c1, p[1]);
+        for (int k = 0; k < 3; k++) {
+            p[2][k] = (2*p[0][k] + p[1][k]) / 3;
+            p[3][k] = (p[0][k] + 2*p[1][k]) / 3; }
+        for (int i = 0; i < 16; i++) {
+            int best = 0, bestDist = 1 << 30;
+            for (int j = 0; j < 4; j++) {
+                int dr = block[4*i]-p[j][0], dg = block[4*i+1]-p[j][1], db = block[4*i+2]-p[j][2];
+                int d = dr*dr + dg*dg + db*db;
+                if (d < bestDist) { bestDist = d; best = j; } }
+            indices |= uint32_t(best) << (2*i); } }
+
+    out[0] = uint8_t(c0); out[1] = uint8_t(c0 >> 8);
+    out[2] = uint8_t(c1); out[3] = uint8_t(c1 >> 8);
+    memcpy(out+4, &indices, 4);
+}
+
+void encodeAlphaBlock(const uint8_t block[64], uint8_t out[8])
+{
+    int a0 = 0, a1 = 255;
+    for (int i = 0; i < 16; i++) {
+        a0 = std::max(a0, int(block[4*i+3]));
+        a1 = std::min(a1, int(block[4*i+3])); }
+
+    uint64_t indices = 0;
+    if (a0 > a1) {
+        int p[8] = {a0, a1};
+        for (int j = 1; j < 7; j++)
+            p[j+1] = ((7-j)*a0 + j*a1) / 7;
+        for (int i = 0; i < 16; i++) {
+            int best = 0, bestDist = 1 << 30;
+            for (int j = 0; j < 8; j++) {
+                int d = abs(int(block[4*i+3]) - p[j]);
+                if (d < bestDist) { bestDist = d; best = j; } }
+            indices |= uint64_t(best) << (3*i); } }
+
+    out[0] = uint8_t(a0);
+    out[1] = uint8_t(a1);
+    for (int k = 0; k < 6; k++)
+        out[2+k] = uint8_t(indices >> (8*k));
+}
+
+void compressLevel(const uint8_t* rgba, uint32_t w, uint32_t h, uint32_t format, uint8_t* out)
+{
+    uint8_t block[64];
+    for (uint32_t by = 0; by < (h+3)/4; by++)
+        for (uint32_t bx = 0; bx < (w+3)/4; bx++) {
+            // Edge blocks repeat their last row and column
+            for (uint32_t y = 0; y < 4; y++)
+                for (uint32_t x = 0; x < 4; x++) {
+                    uint32_t sx = std::min(4*bx + x, w-1), sy = std::min(4*by + y, h-1);
+                    memcpy(block + 4*(4*y+x), rgba + 4*(uint64_t(sy)*w + sx), 4); }
+            if (format == TextureCache::FORMAT_BC3) {
+                encodeAlphaBlock(block, out);
+                out += 8; }
+            encodeColorBlock(block, out);
+            out += 8; }
+}
+
+}
+
+void buildMipChain(const uint8_t* rgba, uint32_t width, uint32_t height, TextureData& texture)
+{
+    texture.format = TextureCache::FORMAT_RGBA8;
+    texture.width  = width;
+    texture.height = height;
+    texture.levels.clear();
+
+    uint64_t total = 0;
+    for (uint32_t w = width, h = height; ; w = std::max(1u, w/2), h = std::max(1u, h/2)) {
+        texture.levels.push_back({w, h, total, uint64_t(w)*h*4});
+        total += uint64_t(w)*h*4;
+        if (w == 1 && h == 1) break; }
+
+    texture.data.resize(total);
+    memcpy(texture.data.data(), rgba, texture.levels[0].size);
+
+    // Each level is a 2x2 box filter of the one above (1x2 or 2x1 once
+    // one side reaches a single pixel).
+    for (size_t l = 1; l < texture.levels.size(); l++) {
+        const TextureLevel& src = texture.levels[l-1];
+        const TextureLevel& dst = texture.levels[l];
+        const uint8_t* s = texture.data.data() + src.offset;
+        uint8_t*       d = texture.data.data() + dst.offset;
+        for (uint32_t y = 0; y < dst.height; y++)
+            for (uint32_t x = 0; x < dst.width; x++) {
+                uint32_t x0 = std::min(2*x, src.width-1),  x1 = std::min(2*x+1, src.width-1);
+                uint32_t y0 = std::min(2*y, src.height-1), y1 = std::min(2*y+1, src.height-1);
+                for (int k = 0; k < 4; k++) {
+                    uint32_t sum = s[4*(y0*src.width + x0) + k] + s[4*(y0*src.width + x1) + k]
+                        + s[4*(y1*src.width + x0) + k] + s[4*(y1*src.width + x1) + k];
+                    d[4*(y*dst.width + x) + k] = uint8_t((sum + 2) / 4); } } }
+}
+
+void compressTexture(TextureData& texture)
+{
+    if (texture.format != TextureCache::FORMAT_RGBA8 || texture.levels.empty())
+        return;
+
+    // BC1 unless some pixel of the full size level is not opaque.
+    const TextureLevel& top = texture.levels[0];
+    uint32_t format = TextureCache::FORMAT_BC1;
+    for (uint64_t i = 3; i < top.size; i += 4)
+        if (texture.data[top.offset + i] != 255) {
+            format = TextureCache::FORMAT_BC3;
+            break; }
+
+    std::vector<TextureLevel> levels;
+    uint64_t total = 0;
+    for (const auto& level : texture.levels) {
+        uint64_t size = levelSize(format, level.width, level.height);
+        levels.push_back({level.width, level.height, total, size});
+        total += size; }
+
+    std::vector<uint8_t> data(total);
+    for (size_t l = 0; l < levels.size(); l++)
+        compressLevel(texture.data.data() + texture.levels[l].offset,
+                      levels[l].width, levels[l].height, format, data.data() + levels[l].offset);
+
+    texture.format = format;
+    texture.levels.swap(levels);
+    texture.data.swap(data);
+}
+
+std::string TextureCache::cachePath(uint64_t hash) const
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx%s.ktx2", (unsigned long long)hash,
+             m_compress ? "" : "-rgba");
+    return (fs::path(m_dir) / name).string();
+}
+
+TextureData TextureCache::load(const std::string& fileName) const
+{
+    std::string path = fileName;
+    for (size_t i=0;  i<path.size();  i++)
+        if (path[i] == '\\') path[i] = '/';
+
+    std::vector<uint8_t> bytes;
+    if (!readFile(path, bytes))
+        throw std::runtime_error("failed to load texture image!");
+    uint64_t hash = hashBytes(bytes.data(), bytes.size());
+
+    TextureData texture;
+    std::string cached = cachePath(hash);
+    if (read(cached, texture)) {
+        texture.hash = hash;
+        return texture; }
+
+    int width, height, channels;
+    stbi_uc* pixels = stbi_load_from_memory(bytes.data(), static_cast<int>(bytes.size()),
+                                            &width, &height, &channels, STBI_rgb_alpha);
+    if (!pixels)
+        throw std::runtime_error("failed to load texture image!");
+    buildMipChain(pixels, width, height, texture);
+    stbi_image_free(pixels);
+
+    if (m_compress)
+        compressTexture(texture);
+    texture.hash = hash;
+
+    std::error_code ec;
+    fs::create_directories(m_dir, ec);
+    if (write(cached, texture))
+        printf("Wrote texture cache %s for %s\n", cached.c_str(), path.c_str());
+    return texture;
+}
+
+bool TextureCache::read(const std::string& path, TextureData& texture) const
+{
+    std::vector<uint8_t> bytes;
+    if (!readFile(path, bytes) || bytes.size() < sizeof(Ktx2Header))
+        return false;
+
+    Ktx2Header h;
+    memcpy(&h, bytes.data(), sizeof(h));
+    if (memcmp(h.identifier, KTX2_IDENTIFIER, sizeof(KTX2_IDENTIFIER)) != 0
+        || (h.vkFormat != FORMAT_RGBA8 && h.vkFormat != FORMAT_BC1 && h.vkFormat != FORMAT_BC3)
+        || (h.vkFormat != FORMAT_RGBA8) != m_compress
+        || h.levelCount == 0 || h.levelCount > 32
+        || h.supercompressionScheme != 0
+        || sizeof(h) + uint64_t(h.levelCount)*sizeof(Ktx2Level) > bytes.size())
+        return false;
+
+    // The version lives in the key/value data: one entry, key then value.
+    uint32_t version = 0;
+    uint64_t kvdEnd = uint64_t(h.kvdByteOffset) + h.kvdByteLength;
+    if (kvdEnd > bytes.size() || h.kvdByteLength < 4 + sizeof(VERSION_KEY) + sizeof(version)
+        || memcmp(bytes.data() + h.kvdByteOffset + 4, VERSION_KEY, sizeof(VERSION_KEY)) != 0)
+        return false;
+    memcpy(&version, bytes.data() + h.kvdByteOffset + 4 + sizeof(VERSION_KEY), sizeof(version));
+    if (version != VERSION)
+        return false;
+
+    texture.format = h.vkFormat;
+    texture.width  = h.pixelWidth;
+    texture.height = h.pixelHeight;
+    texture.levels.resize(h.levelCount);
+
+    uint64_t total = 0;
+    std::vector<Ktx2Level> index(h.levelCount);
+    memcpy(index.data(), bytes.data() + sizeof(h), h.levelCount*sizeof(Ktx2Level));
+    for (uint32_t l = 0; l < h.levelCount; l++) {
+        uint32_t w = std::max(1u, h.pixelWidth >> l), ht = std::max(1u, h.pixelHeight >> l);
+        if (index[l].byteLength != levelSize(h.vkFormat, w, ht)
+            || index[l].byteOffset + index[l].byteLength > bytes.size())
+            return false;
+        texture.levels[l] = {w, ht, total, index[l].byteLength};
+        total += index[l].byteLength; }
+
+    texture.data.resize(total);
+    for (uint32_t l = 0; l < h.levelCount; l++)
+        memcpy(texture.data.data() + texture.levels[l].offset, bytes.data() + index[l].byteOffset,
+               index[l].byteLength);
+    return true;
+}
+
+bool TextureCache::write(const std::string& path, const TextureData& texture) const
+{
+    uint32_t levelCount = static_cast<uint32_t>(texture.levels.size());
+
+    Ktx2Header h{};
+    memcpy(h.identifier, KTX2_IDENTIFIER, sizeof(KTX2_IDENTIFIER));
+    h.vkFormat      = texture.format;
+    h.typeSize      = 1;
+    h.pixelWidth    = texture.width;
+    h.pixelHeight   = texture.height;
+    h.faceCount     = 1;
+    h.levelCount    = levelCount;
+    h.kvdByteOffset = static_cast<uint32_t>(sizeof(h) + levelCount*sizeof(Ktx2Level));
+
+    std::vector<uint8_t> kvd(4);
+    kvd.insert(kvd.end(), VERSION_KEY, VERSION_KEY + sizeof(VERSION_KEY));
+    uint32_t version = VERSION;
+    kvd.insert(kvd.end(), reinterpret_cast<const uint8_t*>(&version),
+               reinterpret_cast<const uint8_t*>(&version) + sizeof(version));
+    uint32_t entryLength = static_cast<uint32_t>(kvd.size() - 4);
+    memcpy(kvd.data(), &entryLength, 4);
+    kvd.resize((kvd.size() + 3) & ~size_t(3));
+    h.kvdByteLength = static_cast<uint32_t>(kvd.size());
+
+    // Levels are stored smallest first, but indexed largest first.
+    std::vector<Ktx2Level> index(levelCount);
+    uint64_t at = alignUp(h.kvdByteOffset + h.kvdByteLength);
+    for (uint32_t l = levelCount; l-- > 0; ) {
+        index[l] = {at, texture.levels[l].size, texture.levels[l].size};
+        at = alignUp(at + texture.levels[l].size); }
+
+    // Write to a temporary and rename.  Every call gets its own
+    // temporary, since two workers may be filling the same entry at once.
+    static std::atomic<uint32_t> serial{0};
+    std::string temp = path + "." + std::to_string(serial++) + ".tmp";
+    {
+        std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+        if (!out)
+            return false;
+
+        const char zeros[16] = {};
+        out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+        out.write(reinterpret_cast<const char*>(index.data()), levelCount*sizeof(Ktx2Level));
+        out.write(reinterpret_cast<const char*>(kvd.data()), kvd.size());
+        for (uint32_t l = levelCount; l-- > 0; ) {
+            out.write(zeros, index[l].byteOffset - static_cast<uint64_t>(out.tellp()));
+            out.write(reinterpret_cast<const char*>(texture.data.data() + texture.levels[l].offset),
+                      texture.levels[l].size); }
+
+        if (!out) {
+            out.close();
+            fs::remove(temp);
+            return false; }
+    }
+
+    std::error_code ec;
+    fs::rename(temp, path, ec);
+    if (ec) {
+        fs::remove(temp, ec);
+        return false; }
+    return true;
+}
@@ -0,0 +1,71 @@
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+// A texture's full mip chain, ready to be copied into an image.
+// Level i is levels[i] (largest first); its bytes are at
+// data[offset, offset+size).
+struct TextureLevel
+{
+    uint32_t width{0};
+    uint32_t height{0};
+    uint64_t offset{0};
+    uint64_t size{0};
+};
+
+struct TextureData
+{
+    uint32_t format{0};  // A VkFormat value; see TextureCache::FORMAT_*
+    uint32_t width{0};
+    uint32_t height{0};
+    uint64_t hash{0};    // Of the source file's contents
+    std::vector<TextureLevel> levels;
+    std::vector<uint8_t> data;
+};
+
+// An on-disk cache of processed textures, keyed by a hash of each
+// source file's contents (so copies of one image under different
+// names share an entry).  A miss decodes the image, builds its mip
+// chain on the CPU, block compresses every level (BC1 if opaque, BC3
+// if it has alpha) and writes the result as a KTX2 file.  A hit reads
+// the levels back, ready to upload, with no decoding at all.
+//
+// load() touches no shared state and may run on worker threads.  The
+// vertical flip must already be set with stbi_set_flip_vertically_on_load.
+class TextureCache
+{
+public:
+    static const uint32_t VERSION = 1;  // Bump when the mip filter or encoder changes
+
+    // Formats produced (the values of the matching VkFormat)
+    static const uint32_t FORMAT_RGBA8 = 37;   // VK_FORMAT_R8G8B8A8_UNORM
+    static const uint32_t FORMAT_BC1   = 131;  // VK_FORMAT_BC1_RGB_UNORM_BLOCK
+    static const uint32_t FORMAT_BC3   = 137;  // VK_FORMAT_BC3_UNORM_BLOCK
+
+    // With compress false (no device support for BC formats) the
+    // levels are kept as RGBA8.
+    explicit TextureCache(bool compress=true, const std::string& dir="texcache")
+        : m_compress(compress), m_dir(dir) {}
+
+    TextureData load(const std::string& path) const;
+
+    std::string cachePath(uint64_t hash) const;
+
+private:
+    bool        m_compress;
+    std::string m_dir;
+
+    bool read(const std::string& path, TextureData& texture) const;
+    bool write(const std::string& path, const TextureData& texture) const;
+};
+
+// The individual processing steps, exposed for reuse.
+
+// Box filtered RGBA8 mip chain of an image, down to 1x1.
+void buildMipChain(const uint8_t* rgba, uint32_t width, uint32_t height, TextureData& texture);
+
+// Block compresses every level of an RGBA8 texture to BC1 or BC3.
+void compressTexture(TextureData& texture);
@@ -0,0 +1,136 @@
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+// A fixed set of worker threads pulling jobs off a shared queue.
+// submit() returns a std::future for the job's result; an exception
+// thrown by the job is rethrown by that future's get().
+class ThreadPool
+{
+public:
+    explicit ThreadPool(unsigned int count = std::thread::hardware_concurrency())
+    {
+        if (count == 0) count = 1;
+        for (unsigned int i = 0; i < count; i++)
+            m_workers.emplace_back([this] { workerLoop(); });
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_wake.notify_all();
+        for (auto& w : m_workers)
+            w.join();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    unsigned int size() const { return static_cast<unsigned int>(m_workers.size()); }
+
+    template <typename F>
+    auto submit(F&& f) -> std::future<decltype(f())>
+    {
+        using R = decltype(f());
+        auto task = std::make_shared<std::packaged_task<R()>>(std::forward<F>(f));
+        std::future<R> result = task->get_future();
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_jobs.emplace([task] { (*task)(); });
+        }
+        m_wake.notify_one();
+        return result;
+    }
+
+    // Runs f(i) for every i < count, on the calling thread and on any
+    // workers free to help.  The caller waits only for items a worker
+    // has started, never for a queued job, so a job of this pool may
+    // call it (all workers busy just means the caller does it all).
+    // The first exception thrown by f is rethrown here.
+    template <typename F>
+    void parallelFor(uint32_t count, const F& f)
+    {
+        struct Shared
+        {
+            std::atomic<uint32_t>   next{0};
+            uint32_t                done{0};
+            std::exception_ptr      error;
+            std::mutex              mutex;
+            std::condition_variable allDone;
+        };
+        // A helper may only start after the caller is done; it then
+        // finds nothing left and never touches f.
+        auto shared = std::make_shared<Shared>();
+        const F* fn = &f;
+        auto work = [shared, fn, count] {
+            for (uint32_t i; (i = shared->next++) < count; ) {
+                std::exception_ptr error;
+                try { (*fn)(i); }
+                catch (...) { error = std::current_exception(); }
+                std::lock_guard<std::mutex> lock(shared->mutex);
+                if (error && !shared->error)
+                    shared->error = error;
+                if (++shared->done == count)
+                    shared->allDone.notify_all(); } };
+
+        uint32_t helpers = std::min(size(), count > 0 ? count - 1 : 0u);
+        if (helpers > 0) {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                for (uint32_t h = 0; h < helpers; h++)
+                    m_jobs.emplace(work);
+            }
+            m_wake.notify_all(); }
+        work();
+
+        std::unique_lock<std::mutex> lock(shared->mutex);
+        shared->allDone.wait(lock, [&] { return shared->done == count; });
+        if (shared->error)
+            std::rethrow_exception(shared->error);
+    }
+
+private:
+    std::vector<std::thread>          m_workers;
+    std::queue<std::function<void()>> m_jobs;
+    std::mutex                        m_mutex;
+    std::condition_variable           m_wake;
+    bool                              m_stop{false};
+
+    void workerLoop()
+    {
+        for (;;) {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_wake.wait(lock, [this] { return m_stop || !m_jobs.empty(); });
+                if (m_stop && m_jobs.empty())
+                    return;
+                job = std::move(m_jobs.front());
+                m_jobs.pop();
+            }
+            job();
+        }
+    }
+};
+
+// Is a job's result in, without waiting for it?
+template <typename T>
+bool isReady(const std::future<T>& f)
+{
+    return f.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+}
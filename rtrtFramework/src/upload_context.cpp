@@ -0,0 +1,266 @@
+//////////////////////////////////////////////////////////////////////
+// Batched uploads through a staging ring.  See upload_context.h.
+////////////////////////////////////////////////////////////////////////
+
+#include <string.h>
+#include <algorithm>
+#include <stdexcept>
+
+#include "upload_context.h"
+
+namespace {
+
+uint32_t findHostMemoryType(VkPhysicalDevice physicalDevice, uint32_t typeFilter)
+{
+    VkMemoryPropertyFlags properties = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
+        | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+    VkPhysicalDeviceMemoryProperties memProperties;
+    vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memProperties);
+    for (uint32_t i = 0; i < memProperties.memoryTypeCount; i++) {
+        if ((typeFilter & (1 << i))
+            && (memProperties.memoryTypes[i].propertyFlags & properties) == properties) {
+            return i; } }
+
+    throw std::runtime_error("failed to find suitable memory type!");
+}
+
+VkDeviceMemory allocateStaging(VkDevice device, VkBuffer buffer, uint32_t memoryType, void** data)
+{
+    VkMemoryRequirements memRequirements;
+    vkGetBufferMemoryRequirements(device, buffer, &memRequirements);
+
+    VkMemoryAllocateInfo allocInfo{VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO};
+    allocInfo.allocationSize = memRequirements.size;
+    allocInfo.memoryTypeIndex = memoryType;
+    VkDeviceMemory memory;
+    if (vkAllocateMemory(device, &allocInfo, nullptr, &memory) != VK_SUCCESS) {
+        throw std::runtime_error("failed to allocate staging memory!"); }
+
+    vkBindBufferMemory(device, buffer, memory, 0);
+    vkMapMemory(device, memory, 0, VK_WHOLE_SIZE, 0, data);
+    return memory;
+}
+
+VkBuffer createStagingBuffer(VkDevice device, VkDeviceSize size)
+{
+    VkBufferCreateInfo bufferInfo{VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO};
+    bufferInfo.size = size;
+    bufferInfo.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+    bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    VkBuffer buffer;
+    if (vkCreateBuffer(device, &bufferInfo, nullptr, &buffer) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create staging buffer!"); }
+    return buffer;
+}
+
+}
+
+void UploadContext::init(VkPhysicalDevice physicalDevice, VkDevice device, VkQueue queue,
+                         uint32_t queueFamily, VkDeviceSize ringSize)
+{
+    m_device = device;
+    m_queue = queue;
+    m_queueFamily = queueFamily;
+    m_ringSize = ringSize;
+
+    VkCommandPoolCreateInfo poolCreateInfo{VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO};
+    poolCreateInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+    poolCreateInfo.queueFamilyIndex = queueFamily;
+    if (vkCreateCommandPool(m_device, &poolCreateInfo, nullptr, &m_cmdPool) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create command pool!"); }
+
+    m_ring = createStagingBuffer(m_device, m_ringSize);
+    VkMemoryRequirements memRequirements;
+    vkGetBufferMemoryRequirements(m_device, m_ring, &memRequirements);
+    m_memoryType = findHostMemoryType(physicalDevice, memRequirements.memoryTypeBits);
+    m_ringMemory = allocateStaging(m_device, m_ring, m_memoryType, (void**)&m_ringData);
+
+    // @@ Destroy with destroy(); (DONE)
+}
+
+void UploadContext::destroy()
+{
+    finish();
+    for (Batch& batch : m_free)
+        vkDestroyFence(m_device, batch.fence, nullptr);
+    m_free.clear();
+
+    vkDestroyBuffer(m_device, m_ring, nullptr);
+    vkFreeMemory(m_device, m_ringMemory, nullptr);  // Freeing the memory unmaps it
+    vkDestroyCommandPool(m_device, m_cmdPool, nullptr);  // Frees the command buffers
+}
+
+VkCommandBuffer UploadContext::cmdBuf()
+{
+    if (m_open.cmdBuf)
+        return m_open.cmdBuf;
+
+    retire(false);
+    if (!m_free.empty()) {
+        m_open = std::move(m_free.back());
+        m_free.pop_back(); }
+    else {
+        VkCommandBufferAllocateInfo allocateInfo{VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO};
+        allocateInfo.commandBufferCount = 1;
+        allocateInfo.commandPool        = m_cmdPool;
+        allocateInfo.level              = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        vkAllocateCommandBuffers(m_device, &allocateInfo, &m_open.cmdBuf);
+
+        VkFenceCreateInfo fenceCreateInfo{VK_STRUCTURE_TYPE_FENCE_CREATE_INFO};
+        vkCreateFence(m_device, &fenceCreateInfo, nullptr, &m_open.fence); }
+
+    // Beginning implicitly resets a recycled command buffer
+    VkCommandBufferBeginInfo beginInfo{VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO};
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    vkBeginCommandBuffer(m_open.cmdBuf, &beginInfo);
+    return m_open.cmdBuf;
+}
+
+bool UploadContext::fits(VkDeviceSize size, VkDeviceSize align, uint64_t& position) const
+{
+    position = (m_head + align - 1) / align * align;
+    VkDeviceSize offset = position % m_ringSize;
+    if (offset + size > m_ringSize)
+        position += m_ringSize - offset;  // Would straddle the end; start over at 0
+    return position + size - m_tail <= m_ringSize;
+}
+
+bool UploadContext::makeRoom(VkDeviceSize size, VkDeviceSize align, bool flushOpen)
+{
+    uint64_t position;
+    while (!fits(size, align, position)) {
+        if (m_tail == m_head && m_head % m_ringSize != 0)
+            m_tail = m_head = (m_head / m_ringSize + 1)*m_ringSize;  // Empty; start over at 0
+        else if (!m_inFlight.empty())
+            retireOldest(true);
+        else if (flushOpen && m_open.cmdBuf && m_tail != m_head)
+            flush();
+        else
+            return false; }
+    return true;
+}
+
+UploadContext::Staging UploadContext::alloc(VkDeviceSize size, VkDeviceSize align)
+{
+    cmdBuf();  // The allocation belongs to the open batch
+    m_stats.bytes += size;
+    if (size > m_ringSize || !makeRoom(size, align, false))
+        return overflow(size);
+
+    uint64_t position;
+    fits(size, align, position);
+    m_head = position + size;
+
+    Staging staging;
+    staging.buffer = m_ring;
+    staging.offset = position % m_ringSize;
+    staging.data = m_ringData + staging.offset;
+    return staging;
+}
+
+UploadContext::Staging UploadContext::overflow(VkDeviceSize size)
+{
+    m_stats.overflows++;
+
+    Staging staging;
+    staging.buffer = createStagingBuffer(m_device, size);
+    VkDeviceMemory memory = allocateStaging(m_device, staging.buffer, m_memoryType, &staging.data);
+    m_open.overflow.emplace_back(staging.buffer, memory);
+    return staging;
+}
+
+UploadContext::Staging UploadContext::stage(const void* data, VkDeviceSize size, VkDeviceSize align)
+{
+    Staging staging = alloc(size, align);
+    memcpy(staging.data, data, size);
+    return staging;
+}
+
+void UploadContext::copyToBuffer(const void* data, VkDeviceSize size, VkBuffer dst, VkDeviceSize dstOffset)
+{
+    if (size <= m_ringSize)
+        makeRoom(size, 16, true);
+    Staging staging = stage(data, size);
+
+    VkBufferCopy copyRegion{};
+    copyRegion.srcOffset = staging.offset;
+    copyRegion.dstOffset = dstOffset;
+    copyRegion.size = size;
+    vkCmdCopyBuffer(cmdBuf(), staging.buffer, dst, 1, &copyRegion);
+}
+
+void UploadContext::copyToImage(const void* data, VkDeviceSize size, VkImage image,
+                                std::vector<VkBufferImageCopy> regions)
+{
+    // 16 covers every texel block size in use
+    if (size <= m_ringSize)
+        makeRoom(size, 16, true);
+    Staging staging = stage(data, size, 16);
+
+    for (auto& region : regions)
+        region.bufferOffset += staging.offset;
+    vkCmdCopyBufferToImage(cmdBuf(), staging.buffer, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                           static_cast<uint32_t>(regions.size()), regions.data());
+}
+
+uint64_t UploadContext::flush(bool wait)
+{
+    if (m_open.cmdBuf) {
+        // Make the batch's writes visible to everything submitted after it
+        VkMemoryBarrier barrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER};
+        barrier.srcAccessMask = VK_ACCESS_MEMORY_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT | VK_ACCESS_MEMORY_WRITE_BIT;
+        vkCmdPipelineBarrier(m_open.cmdBuf, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+                             VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0,
+                             1, &barrier, 0, nullptr, 0, nullptr);
+        vkEndCommandBuffer(m_open.cmdBuf);
+
+        VkSubmitInfo submitInfo{VK_STRUCTURE_TYPE_SUBMIT_INFO};
+        submitInfo.commandBufferCount = 1;
+        submitInfo.pCommandBuffers    = &m_open.cmdBuf;
+        if (vkQueueSubmit(m_queue, 1, &submitInfo, m_open.fence) != VK_SUCCESS) {
+            throw std::runtime_error("failed to submit upload batch!"); }
+        m_stats.submits++;
+
+        m_open.ringEnd = m_head;
+        m_open.serial = ++m_submitted;
+        m_inFlight.push_back(std::move(m_open));
+        m_open = Batch(); }
+
+    retire(wait);
+    return m_submitted;
+}
+
+bool UploadContext::complete(uint64_t serial)
+{
+    retire(false);
+    return m_completed >= serial;
+}
+
+bool UploadContext::retireOldest(bool wait)
+{
+    Batch& batch = m_inFlight.front();
+    if (vkGetFenceStatus(m_device, batch.fence) != VK_SUCCESS) {
+        if (!wait)
+            return false;
+        vkWaitForFences(m_device, 1, &batch.fence, VK_TRUE, UINT64_MAX);
+        m_stats.fenceWaits++; }
+
+    m_tail = std::max(m_tail, batch.ringEnd);
+    m_completed = batch.serial;
+    for (auto& buffer : batch.overflow) {
+        vkDestroyBuffer(m_device, buffer.first, nullptr);
+        vkFreeMemory(m_device, buffer.second, nullptr); }
+    batch.overflow.clear();
+    vkResetFences(m_device, 1, &batch.fence);
+
+    m_free.push_back(std::move(batch));
+    m_inFlight.pop_front();
+    return true;
+}
+
+void UploadContext::retire(bool wait)
+{
+    // Batches complete in submission order
+    while (!m_inFlight.empty() && retireOldest(wait)) {}
+}
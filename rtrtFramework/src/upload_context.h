@@ -0,0 +1,110 @@
+
+#pragma once
+
+#include <deque>
+#include <vector>
+#include <vulkan/vulkan_core.h>
+
+// Batches host to device uploads.  Data is copied into a large,
+// persistently mapped staging ring, and the copies (and whatever
+// layout transitions go with them) are recorded into the open batch's
+// command buffer.  A batch is submitted with its own fence when
+// flushed; nothing waits on it unless asked to, or until the ring
+// needs the space it occupies back.  Each batch ends with a full
+// memory barrier, so anything submitted to the queue afterwards sees
+// its writes.
+//
+// Staging requests that do not fit in the ring get a buffer of their
+// own, freed when their batch completes.
+//
+// The queue may belong to another family than the one that will use
+// the uploads (a dedicated transfer queue); ownership transfers are
+// then up to the caller, and complete() tells when a batch is done.
+class UploadContext
+{
+public:
+    struct Staging
+    {
+        VkBuffer     buffer{VK_NULL_HANDLE};
+        VkDeviceSize offset{0};
+        void*        data{nullptr};  // Mapped; valid until the batch is flushed
+    };
+
+    struct Stats
+    {
+        uint32_t     submits{0};     // Batches submitted
+        uint32_t     fenceWaits{0};  // Times the host blocked on a batch
+        uint32_t     overflows{0};   // Staging requests too large for the ring
+        VkDeviceSize bytes{0};       // Total bytes staged
+    };
+
+    void init(VkPhysicalDevice physicalDevice, VkDevice device, VkQueue queue,
+              uint32_t queueFamily, VkDeviceSize ringSize);
+    void destroy();
+
+    // The open batch's command buffer, begun on first use.  It stays
+    // valid until flush(), finish(), copyToBuffer() or copyToImage().
+    VkCommandBuffer cmdBuf();
+
+    // Reserves staging memory for the open batch.  Never flushes it,
+    // so a command buffer obtained from cmdBuf() stays valid.
+    Staging alloc(VkDeviceSize size, VkDeviceSize align=16);
+    Staging stage(const void* data, VkDeviceSize size, VkDeviceSize align=16);
+
+    // Stages data and records its copy.  If the ring is full, the open
+    // batch is flushed first.  For copyToImage, the image must be in
+    // TRANSFER_DST_OPTIMAL layout, and the regions' bufferOffsets are
+    // relative to data.
+    void copyToBuffer(const void* data, VkDeviceSize size, VkBuffer dst, VkDeviceSize dstOffset=0);
+    void copyToImage(const void* data, VkDeviceSize size, VkImage image,
+                     std::vector<VkBufferImageCopy> regions);
+
+    // Submits the open batch, if any; wait blocks until everything
+    // submitted so far has completed.  Returns the serial number of
+    // the last batch submitted (0 if none ever was).
+    uint64_t flush(bool wait=false);
+    void finish() { flush(true); }
+
+    // Whether batch serial (as returned by flush) has completed.
+    bool complete(uint64_t serial);
+
+    uint32_t queueFamily() const { return m_queueFamily; }
+
+    const Stats& stats() const { return m_stats; }
+
+private:
+    struct Batch
+    {
+        VkCommandBuffer cmdBuf{VK_NULL_HANDLE};
+        VkFence         fence{VK_NULL_HANDLE};
+        uint64_t        ringEnd{0};  // Ring position after its last allocation
+        uint64_t        serial{0};
+        std::vector<std::pair<VkBuffer, VkDeviceMemory>> overflow;
+    };
+
+    VkDevice       m_device{VK_NULL_HANDLE};
+    VkQueue        m_queue{VK_NULL_HANDLE};
+    VkCommandPool  m_cmdPool{VK_NULL_HANDLE};
+    uint32_t       m_memoryType{0};
+    uint32_t       m_queueFamily{0};
+    uint64_t       m_submitted{0};  // Serial of the last batch submitted
+    uint64_t       m_completed{0};  // and of the last one known complete
+
+    VkBuffer       m_ring{VK_NULL_HANDLE};
+    VkDeviceMemory m_ringMemory{VK_NULL_HANDLE};
+    uint8_t*       m_ringData{nullptr};
+    VkDeviceSize   m_ringSize{0};
+    uint64_t       m_head{0};  // Positions grow forever; the offset is position % m_ringSize
+    uint64_t       m_tail{0};  // Oldest position still in use
+
+    Batch               m_open;
+    std::deque<Batch>   m_inFlight;
+    std::vector<Batch>  m_free;  // Completed batches' command buffers and fences
+    Stats               m_stats;
+
+    bool     fits(VkDeviceSize size, VkDeviceSize align, uint64_t& position) const;
+    bool     makeRoom(VkDeviceSize size, VkDeviceSize align, bool flushOpen);
+    bool     retireOldest(bool wait);
+    void     retire(bool wait);
+    Staging  overflow(VkDeviceSize size);
+};
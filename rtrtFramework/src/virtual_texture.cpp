@@ -0,0 +1,184 @@
+//////////////////////////////////////////////////////////////////////
+// Page bookkeeping and tile building for virtual texturing.  See
+// virtual_texture.h.  The page layout here must match the shader's
+// (VtPageIndex in shaders/virtual_texture.glsl).
+////////////////////////////////////////////////////////////////////////
+
+#include <string.h>
+#include <algorithm>
+#include <stdexcept>
+
+#include "virtual_texture.h"
+
+namespace {
+
+uint32_t levelSize(uint32_t size, uint32_t level) { return std::max(1u, size >> level); }
+uint32_t pagesOf(uint32_t size) { return (size + VT_PAGE_SIZE - 1) / VT_PAGE_SIZE; }
+
+uint32_t levelPages(const VtTexture& t, uint32_t level)
+{
+    return pagesOf(levelSize(t.width, level)) * pagesOf(levelSize(t.height, level));
+}
+
+int wrap(int i, int n) { return ((i % n) + n) % n; }
+
+uint32_t packTile(uint32_t tile) { return (tile % VT_CACHE_TILES) | ((tile / VT_CACHE_TILES) << 16); }
+uint32_t unpackTile(uint32_t entry) { return (entry & 0xffff) + (entry >> 16)*VT_CACHE_TILES; }
+
+}
+
+void VirtualTextures::init(bool compressed)
+{
+    m_textures.clear();
+    m_data.clear();
+    m_pageTable.clear();
+    m_pending.clear();
+    m_tiles.assign(VT_CACHE_TILES*VT_CACHE_TILES, Tile());
+    m_format = compressed ? TextureCache::FORMAT_BC3 : TextureCache::FORMAT_RGBA8;
+}
+
+uint32_t VirtualTextures::add(TextureData&& texture)
+{
+    if ((texture.format == TextureCache::FORMAT_RGBA8) != (m_format == TextureCache::FORMAT_RGBA8))
+        throw std::runtime_error("texture format does not match the virtual texture cache!");
+
+    VtTexture t;
+    t.width     = texture.width;
+    t.height    = texture.height;
+    t.levels    = static_cast<uint32_t>(texture.levels.size());
+    t.firstPage = nbPages();
+
+    uint32_t pages = 0;
+    for (uint32_t l = 0; l < t.levels; l++)
+        pages += levelPages(t, l);
+    m_pageTable.resize(m_pageTable.size() + pages, VT_NOT_RESIDENT);
+    m_pending.resize(m_pageTable.size(), 0);
+
+    m_textures.push_back(t);
+    m_data.push_back(std::move(texture));
+    return nbTextures() - 1;
+}
+
+uint64_t VirtualTextures::tileBytes() const
+{
+    if (m_format == TextureCache::FORMAT_RGBA8)
+        return uint64_t(VT_TILE_SIZE)*VT_TILE_SIZE*4;
+    return uint64_t(VT_TILE_SIZE/4)*(VT_TILE_SIZE/4)*16;
+}
+
+std::vector<uint32_t> VirtualTextures::pinnedPages() const
+{
+    std::vector<uint32_t> pinned;
+    for (const auto& t : m_textures) {
+        uint32_t page = t.firstPage;
+        for (uint32_t l = 0; l < t.levels; l++) {
+            if (levelPages(t, l) == 1) {
+                pinned.push_back(page);
+                break; }
+            page += levelPages(t, l); } }
+    return pinned;
+}
+
+VirtualTextures::PageSource VirtualTextures::locate(uint32_t page) const
+{
+    // Last texture starting at or before page
+    auto it = std::upper_bound(m_textures.begin(), m_textures.end(), page,
+                               [](uint32_t p, const VtTexture& t) { return p < t.firstPage; });
+    uint32_t texture = static_cast<uint32_t>(it - m_textures.begin()) - 1;
+    const VtTexture& t = m_textures[texture];
+
+    uint32_t at = page - t.firstPage;
+    uint32_t level = 0;
+    while (at >= levelPages(t, level))
+        at -= levelPages(t, level++);
+    uint32_t pagesX = pagesOf(levelSize(t.width, level));
+    return {texture, level, at % pagesX, at / pagesX};
+}
+
+void VirtualTextures::collectRequests(const uint32_t* feedback, uint64_t frame,
+                                      uint32_t maxRequests, std::vector<uint32_t>& requests)
+{
+    std::vector<std::pair<uint32_t, uint32_t>> wanted;  // (level, page)
+    for (uint32_t page = 0; page < nbPages(); page++) {
+        if (!feedback[page])
+            continue;
+        if (m_pageTable[page] != VT_NOT_RESIDENT)
+            m_tiles[unpackTile(m_pageTable[page])].lastUsed = frame;
+        else if (!m_pending[page])
+            wanted.emplace_back(locate(page).level, page); }
+
+    // Coarse levels first: they cover the most screen for a tile, and
+    // are what the finer ones fall back to.
+    std::stable_sort(wanted.begin(), wanted.end(),
+                     [](const auto& a, const auto& b) { return a.first > b.first; });
+    if (wanted.size() > maxRequests)
+        wanted.resize(maxRequests);
+    for (const auto& w : wanted) {
+        m_pending[w.second] = 1;
+        requests.push_back(w.second); }
+}
+
+void VirtualTextures::buildTile(uint32_t page, uint8_t* out) const
+{
+    PageSource src = locate(page);
+    const TextureData&  texture = m_data[src.texture];
+    const TextureLevel& level   = texture.levels[src.level];
+    const uint8_t*      base    = texture.data.data() + level.offset;
+
+    // Work in blocks: 4x4 texels for the compressed formats, single
+    // texels for RGBA8.  Page and border sizes are multiples of 4, so
+    // a tile is a whole number of blocks either way.
+    bool     rgba      = texture.format == TextureCache::FORMAT_RGBA8;
+    int      block     = rgba ? 1 : 4;
+    uint32_t srcBytes  = rgba ? 4 : (texture.format == TextureCache::FORMAT_BC1 ? 8 : 16);
+    uint32_t dstBytes  = rgba ? 4 : 16;
+    int      blocksX   = (level.width + block - 1) / block;
+    int      blocksY   = (level.height + block - 1) / block;
+    int      tileBlocks = VT_TILE_SIZE / block;
+    int      border    = VT_PAGE_BORDER / block;
+    int      originX   = src.x*VT_PAGE_SIZE/block - border;
+    int      originY   = src.y*VT_PAGE_SIZE/block - border;
+
+    // Levels smaller than a page repeat across the whole tile, so the
+    // border around their actual texels is the wrapped texture too.
+    for (int by = 0; by < tileBlocks; by++) {
+        const uint8_t* row = base + uint64_t(wrap(originY + by, blocksY))*blocksX*srcBytes;
+        for (int bx = 0; bx < tileBlocks; bx++) {
+            const uint8_t* s = row + uint64_t(wrap(originX + bx, blocksX))*srcBytes;
+            uint8_t*       d = out + (uint64_t(by)*tileBlocks + bx)*dstBytes;
+            if (texture.format == TextureCache::FORMAT_BC1) {
+                // BC3 block: constant 255 alpha, then the BC1 color block
+                memset(d, 0, 8);
+                d[0] = d[1] = 255;
+                memcpy(d + 8, s, 8); }
+            else
+                memcpy(d, s, dstBytes); } }
+}
+
+uint32_t VirtualTextures::place(uint32_t page, uint64_t frame, bool pin)
+{
+    m_pending[page] = 0;
+    if (m_pageTable[page] != VT_NOT_RESIDENT)
+        return unpackTile(m_pageTable[page]);
+
+    uint32_t victim = VT_NOT_RESIDENT;
+    for (uint32_t i = 0; i < m_tiles.size(); i++) {
+        const Tile& tile = m_tiles[i];
+        if (tile.page == VT_NOT_RESIDENT) {
+            victim = i;
+            break; }
+        if (!tile.pinned && tile.lastUsed < frame
+            && (victim == VT_NOT_RESIDENT || tile.lastUsed < m_tiles[victim].lastUsed))
+            victim = i; }
+    if (victim == VT_NOT_RESIDENT)
+        return VT_NOT_RESIDENT;
+
+    Tile& tile = m_tiles[victim];
+    if (tile.page != VT_NOT_RESIDENT)
+        m_pageTable[tile.page] = VT_NOT_RESIDENT;
+    tile.page     = page;
+    tile.lastUsed = frame;
+    tile.pinned   = pin;
+    m_pageTable[page] = packTile(victim);
+    return victim;
+}
@@ -0,0 +1,91 @@
+
+#pragma once
+
+#include <vector>
+#include <stdint.h>
+
+#include "shaders/shared_structs.h"
+#include "texture_cache.h"
+
+// The CPU side of virtual texturing.  Every texture is cut into
+// VT_PAGE_SIZE square pages, level by level, and the shaders see it
+// only through a page table that maps each page to a tile of a single
+// fixed size page cache image (or to VT_NOT_RESIDENT, in which case
+// they fall back to the next coarser resident level).  The shaders
+// record each page they wanted in a feedback buffer; each frame that
+// list is turned into requests here, the requested tiles are built by
+// worker threads (buildTile) and, once uploaded, placed in the cache
+// (place), evicting the least recently used ones.
+//
+// Each texture's first level that fits in a single page is pinned in
+// the cache, and lookups go no coarser than it, so a lookup always
+// finds something.  The textures' mip chains stay in host memory;
+// only the page cache uses device memory.
+//
+// Tiles are the page plus a VT_PAGE_BORDER wide ring of the texels
+// around it (wrapping at the texture's edges), so bilinear filtering
+// in the cache matches filtering the texture itself.  With block
+// compressed textures the cache is BC3 (BC1 blocks gain an opaque
+// alpha block on the way in); otherwise it is RGBA8.
+class VirtualTextures
+{
+public:
+    // Clears everything; compressed selects the cache's format.
+    void init(bool compressed);
+
+    // Takes over a texture's mip chain.  Returns its virtual texture
+    // id (its index in textures()).  Not to be called while tiles are
+    // being built.
+    uint32_t add(TextureData&& texture);
+
+    uint32_t nbTextures() const { return static_cast<uint32_t>(m_textures.size()); }
+    uint32_t nbPages() const { return static_cast<uint32_t>(m_pageTable.size()); }
+    const std::vector<VtTexture>& textures() const { return m_textures; }
+    const std::vector<uint32_t>&  pageTable() const { return m_pageTable; }
+
+    uint32_t cacheFormat() const { return m_format; }  // A VkFormat; see TextureCache::FORMAT_*
+    uint64_t tileBytes() const;
+
+    // The page of each texture that must always be resident.
+    std::vector<uint32_t> pinnedPages() const;
+
+    // Reads one frame's feedback (nonzero for each page the shaders
+    // wanted).  Resident pages are marked as used in frame; up to
+    // maxRequests of the others, coarsest level first, are appended to
+    // requests and considered pending until placed.
+    void collectRequests(const uint32_t* feedback, uint64_t frame, uint32_t maxRequests,
+                         std::vector<uint32_t>& requests);
+
+    // Fills out (tileBytes() long) with a page's tile.  Safe to call
+    // from several threads at once.
+    void buildTile(uint32_t page, uint8_t* out) const;
+
+    // Assigns a built page a cache tile, evicting the least recently
+    // used unpinned tile not used in frame, and updates the page
+    // table.  Returns the tile (index x + y*VT_CACHE_TILES), or
+    // VT_NOT_RESIDENT if every tile is in use (the page may then be
+    // requested again).
+    uint32_t place(uint32_t page, uint64_t frame, bool pin=false);
+
+private:
+    struct Tile
+    {
+        uint32_t page{VT_NOT_RESIDENT};
+        uint64_t lastUsed{0};
+        bool     pinned{false};
+    };
+
+    struct PageSource
+    {
+        uint32_t texture, level, x, y;
+    };
+
+    std::vector<VtTexture>   m_textures;
+    std::vector<TextureData> m_data;
+    std::vector<uint32_t>    m_pageTable;  // Packed tile x | y<<16, or VT_NOT_RESIDENT
+    std::vector<uint8_t>     m_pending;    // Per page: requested but not yet placed
+    std::vector<Tile>        m_tiles;
+    uint32_t m_format{TextureCache::FORMAT_BC3};
+
+    PageSource locate(uint32_t page) const;
+};
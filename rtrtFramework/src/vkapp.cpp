@@ -8,6 +8,7 @@
  *********************************************************************/
 
 #include <array>
+#include <chrono>
 #include <iostream>     // std::cout
 #include <fstream>      // std::ifstream
 
@@ -30,6 +31,9 @@
 
 VkApp::VkApp(App* _app) : app(_app)
 {
+    auto start = std::chrono::high_resolution_clock::now();
+    m_splitBlas = !app->monolithicBlas;
+    
     createInstance(app->doApiDump);	// -> m_instance
     assert (m_instance);
     createPhysicalDevice();		// -> m_physicalDevice i.e. the GPU
@@ -55,15 +59,26 @@ VkApp::VkApp(App* _app) : app(_app)
     initGUI();
     #endif
     
-    myloadModel("models/living_room/living_room.obj", glm::mat4(1.0f));
+    m_scene = app->sceneFile.empty() ? defaultScene() : readScene(app->sceneFile);
+    m_streamer.init(uint64_t(m_scene.streamBudget*1048576.0));
+    loadModels(m_scene.models);
+    m_sceneGraph.update();  // The instances already have the loaded transforms
+    // The acceleration structures are built from these right away
+    acquireAsyncUploads(m_upload.cmdBuf(), true);
      
-    app->myCamera.reset(glm::vec3(2.28, 1.68, 6.64), 0.7, -20.0, 10.66, 0.57, 0.1, 1000.0);
-    nonrtLightAmbient = 0.2;
-    nonrtLightIntensity = 1.0f;
-    nonrtLightPosition = vec3(0.5f, 2.5f, 3.0f);
+    app->myCamera.reset(m_scene.eye, m_scene.rate, m_scene.spin, m_scene.tilt,
+                        m_scene.ry, m_scene.front, m_scene.back);
+    nonrtLightAmbient = m_scene.lightAmbient;
+    nonrtLightIntensity = m_scene.lightIntensity;
+    nonrtLightPosition = m_scene.lightPosition;
     
-    createMatrixBuffer();
+    m_frameArena.init(m_physicalDevice, m_device, m_allocator, 1);  // One frame in flight
     createObjDescriptionBuffer();
+    createMaterialBuffers();
+    createLightBuffer();
+    #ifdef VIRTUAL_TEXTURES
+    createVirtualTextures();
+    #endif
     
     createScanlineRenderPass();
     createScDescriptorSet();
@@ -72,6 +87,7 @@ VkApp::VkApp(App* _app) : app(_app)
     // @@ Raycasting ...: Initialize ray tracing capabilities
     createRtBuffers();
     initRayTracing();
+    createTimestampQueries();
     createRtAccelerationStructure();
     createRtDescriptorSet();
     createRtPipeline();
@@ -82,16 +98,38 @@ VkApp::VkApp(App* _app) : app(_app)
     createDenoiseDescriptorSet();
     createDenoiseCompPipeline();
 
+    // Everything uploaded above is in place before the first frame
+    m_upload.finish();
+    auto end = std::chrono::high_resolution_clock::now();
+    const UploadContext::Stats& stats = m_upload.stats();
+    const UploadContext::Stats& transfer = m_transfer.stats();
+    printf("Startup in %.1f ms: %d upload batches, %d fence waits, %.1f MB staged (%d overflows)\n",
+           std::chrono::duration<double, std::milli>(end - start).count(),
+           stats.submits, stats.fenceWaits, stats.bytes/1048576.0, stats.overflows);
+    printf("  transfer queue: %d batches, %d fence waits, %.1f MB staged (%d overflows)\n",
+           transfer.submits, transfer.fenceWaits, transfer.bytes/1048576.0, transfer.overflows);
+    MemoryAllocator::Stats memory = m_allocator.stats();
+    printf("  device memory: %d allocations in %d blocks (%.1f of %.1f MB), %d dedicated (%.1f MB)\n",
+           memory.allocations, memory.blocks, memory.usedBytes/1048576.0, memory.blockBytes/1048576.0,
+           memory.dedicated, memory.dedicatedBytes/1048576.0);
 }
 
 void VkApp::drawFrame()
 {
   prepareFrame();
+  pollAssetChanges();  // Swaps in edited models and textures
+  updateGeometryStreaming();  // Swaps chunks in and out by camera distance
+  updateSceneGraph();  // Carries moved nodes' instances along
+  #ifdef VIRTUAL_TEXTURES
+  updateVirtualTextures();
+  #endif
 
   VkCommandBufferBeginInfo beginInfo{ VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO };
   beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
   vkBeginCommandBuffer(m_commandBuffer, &beginInfo);
   {   // Extra indent for code clarity
+    acquireAsyncUploads(m_commandBuffer);  // Whatever the transfer queue has finished
+    recordRefits(m_commandBuffer);  // Instances moved or BLASes replaced above
     updateCameraBuffer();
 
     // Draw scene
@@ -110,35 +148,36 @@ void VkApp::drawFrame()
   }   // Done recording;  Execute!
 
   vkEndCommandBuffer(m_commandBuffer);
+  m_upload.flush();  // Uploads recorded this frame go ahead of it
   submitFrame();  // Submit for display
 }
 
+// Every allocation with its tag, and the heap budgets, as JSON (see
+// MemoryAllocator::writeReport)
+void VkApp::writeMemoryReport(const std::string& filename)
+{
+    std::ofstream out(filename, std::ios::trunc);
+    if (!out) {
+        printf("Could not write %s\n", filename.c_str());
+        return; }
+    m_allocator.writeReport(out);
+    printf("Memory report written to %s\n", filename.c_str());
+}
+
 
+// A temporary command buffer is a batch of m_upload's of its own
+// (pending uploads go out first), and submitting it waits on its
+// fence, for callers that need the results right away.  Uploads that
+// need not be waited on should use m_upload.cmdBuf() instead.
 VkCommandBuffer VkApp::createTempCmdBuffer()
 {
-    VkCommandBufferAllocateInfo allocateInfo{VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO};
-    allocateInfo.commandBufferCount = 1;
-    allocateInfo.commandPool        = m_cmdPool;
-    allocateInfo.level              = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-    VkCommandBuffer cmdBuffer;
-    vkAllocateCommandBuffers(m_device, &allocateInfo, &cmdBuffer);
-
-    VkCommandBufferBeginInfo beginInfo{VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO};
-    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-    vkBeginCommandBuffer(cmdBuffer, &beginInfo);
-    return cmdBuffer;
+    m_upload.flush();
+    return m_upload.cmdBuf();
 }
 
 void VkApp::submitTempCmdBuffer(VkCommandBuffer cmdBuffer)
 {
-    vkEndCommandBuffer(cmdBuffer);
-
-    VkSubmitInfo submitInfo{VK_STRUCTURE_TYPE_SUBMIT_INFO};
-    submitInfo.commandBufferCount = 1;
-    submitInfo.pCommandBuffers    = &cmdBuffer;
-    vkQueueSubmit(m_queue, 1, &submitInfo, {});
-    vkQueueWaitIdle(m_queue);
-    vkFreeCommandBuffers(m_device, m_cmdPool, 1, &cmdBuffer);
+    m_upload.finish();  // cmdBuffer is the open batch's
 }
 
 void VkApp::prepareFrame()
@@ -147,6 +186,7 @@ void VkApp::prepareFrame()
   while (VK_TIMEOUT == vkWaitForFences(m_device, 1, &m_waitFence, VK_TRUE, 1'000'000))
   {
   }
+  m_frameArena.begin(0);  // Which the completed frame was reading
 
   // Acquire the next image from the swap chain --> m_swapchainIndex
   VkResult result = vkAcquireNextImageKHR(m_device, m_swapchain, UINT64_MAX, m_readSemaphore,
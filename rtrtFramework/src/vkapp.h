@@ -2,6 +2,10 @@
 #pragma once
 
 #include <algorithm>
+#include <functional>
+#include <future>
+#include <memory>
+#include <unordered_map>
 #include "vulkan/vulkan_core.h"
 //#include <vulkan/vulkan.hpp>  // A modern C++ API for Vulkan. Beware 14K lines of code
 
@@ -28,6 +32,18 @@
 #include "image_wrap.h"
 #include "descriptor_wrap.h"
 #include "acceleration_wrap.h"
+#include "thread_pool.h"
+#include "memory_allocator.h"
+#include "frame_arena.h"
+#include "upload_context.h"
+#include "texture_cache.h"
+#include "virtual_texture.h"
+#include "scene_file.h"
+#include "file_watcher.h"
+#include "material_table.h"
+#include "geometry_chunks.h"
+#include "geometry_streamer.h"
+#include "scene_graph.h"
 
 //#include "raytracing_wrap.h"
 #define GLM_FORCE_CTOR_INIT  // May be needed by recent versions of GLM;
@@ -37,6 +53,26 @@
 #define GLM_SWIZZLE
 #include <glm/glm.hpp>
 
+// One mesh of an OBJ model: a range of its index buffer with an
+// ObjDesc of its own, so that it can be given its own BLAS.  Its
+// indices are relative to its first vertex, and 16 bit if it has few
+// enough vertices.
+struct ObjMesh
+{
+    uint32_t firstIndex{0};   // In the model's (32 bit) index array
+    uint32_t nbIndices{0};
+    uint32_t firstVertex{0};
+    uint32_t nbVertices{0};
+    VkDeviceSize indexOffset{0};  // Of its indices in the index buffer, in bytes
+    VkIndexType  indexType{VK_INDEX_TYPE_UINT32};
+    uint32_t descIndex{0};  // Index into m_objDesc
+    uint32_t blasIndex{0};  // Index into the BLASes (split layout)
+    glm::vec3 bmin{0.0f};   // Mesh space bounding box
+    glm::vec3 bmax{0.0f};
+    std::vector<MeshLod> lods;  // Raster levels of detail, finest first
+    std::vector<VkDeviceSize> lodOffsets;  // Of each level's indices, as indexOffset
+};
+
 // The OBJ model: Vulkan buffers of object data
 struct ObjData
 {
@@ -44,8 +80,16 @@ struct ObjData
     uint32_t     nbVertices{0};
     BufferWrap vertexBuffer;    // Buffer of vertices 
     BufferWrap indexBuffer;     // Buffer of triangle indices
-    BufferWrap matColorBuffer;  // Buffer of materials
-    BufferWrap matIndexBuffer;  // Buffer of each triangle's material index
+    BufferWrap matIndexBuffer;  // Buffer of each triangle's index into m_materials
+    uint32_t blasIndex{0};      // Its BLAS (monolithic layout)
+    std::vector<ObjMesh> meshes;
+
+    // Where it came from, for reloading it
+    std::string path;
+    std::vector<glm::mat4> transforms;  // Of each instance of the whole model
+    std::vector<uint32_t>  nodes;       // m_sceneGraph root of each instance of the whole model
+    uint32_t firstLight{0};             // Its range of m_lightList
+    uint32_t nbLights{0};
 };
 
 #define NAME(handle, objType, name)  { \
@@ -63,9 +107,52 @@ struct ObjInst
 {
     glm::mat4 transform;    // Matrix of the instance
     uint32_t  objIndex;     // Model index
+    uint32_t  meshIndex{0}; // Index into that model's meshes
+    uint32_t  node{0};      // m_sceneGraph node whose world transform it is
+};
+
+// What VkApp::makeModel makes of a model, before it joins the scene
+struct ModelParts
+{
+    ObjData              object;
+    std::vector<ObjDesc> descs;      // One per mesh
+    std::vector<ObjInst> instances;  // Each mesh placement, for each transform
+    std::vector<Light>   lights;
+};
+
+// A chunk's buffers on the device
+struct ChunkBuffers
+{
+    BufferWrap vertexBuffer{};
+    BufferWrap indexBuffer{};
+    BufferWrap matIndexBuffer{};
+    uint32_t   nbVertices{0};
+    uint32_t   nbIndices{0};
+    VkIndexType indexType{VK_INDEX_TYPE_UINT32};
+};
+
+// One chunk of a streamed model (see vkapp_stream.cpp).  It is an
+// m_objData entry of its own, with a single mesh, whose buffers are
+// borrowed from proxy or full, whichever is current.
+struct StreamedChunk
+{
+    uint32_t     objIndex{0};
+    uint32_t     model{0};  // Into m_streamedModels
+    uint32_t     chunk{0};  // Into its file's chunks
+    ChunkBuffers proxy;     // Always there
+    ChunkBuffers full;      // Only while resident (or being uploaded)
+};
+
+// A model whose geometry is streamed from its chunk file
+struct StreamedModel
+{
+    ChunkedModel         file;
+    std::vector<int32_t> materialIndex;  // Its materials' m_materials entries
 };
 
 class App;
+struct ModelView;
+struct ImportedModel;
 
 class VkApp
 {
@@ -111,12 +198,14 @@ public:
     void createPhysicalDevice();
 
     uint32_t m_graphicsQueueIndex{VK_QUEUE_FAMILY_IGNORED};
+    uint32_t m_transferQueueIndex{VK_QUEUE_FAMILY_IGNORED};  // Same as graphics if no dedicated one
     void chooseQueueIndex();
 
     VkDevice m_device{};
     void createDevice();
 
     VkQueue m_queue{};
+    VkQueue m_transferQueue{};
     void getCommandQueue();
     
     void loadExtensions();
@@ -126,8 +215,38 @@ public:
     
     VkCommandPool m_cmdPool{VK_NULL_HANDLE};
     VkCommandBuffer m_commandBuffer{};
+    MemoryAllocator m_allocator;  // Pooled memory for every BufferWrap and ImageWrap
+    bool m_memoryBudget{false};   // VK_EXT_memory_budget is enabled
+    void writeMemoryReport(const std::string& filename);
+    UploadContext m_upload;  // Batches staging copies and one-off commands
     void createCommandPool();
 
+    // Background uploads on m_transferQueue (see vkapp_transfer.cpp).
+    // Resources created with createAsync* are released by the transfer
+    // queue and acquired by the graphics queue once their batch is
+    // done; only then may commands use them.
+    struct AsyncUpload
+    {
+        uint64_t serial{0};                          // m_transfer batch carrying it
+        std::vector<VkBufferMemoryBarrier> buffers;  // Acquire halves of the
+        std::vector<VkImageMemoryBarrier>  images;   // ownership transfers
+        std::function<void()> onReady;               // Called once acquired
+    };
+    UploadContext             m_transfer;
+    AsyncUpload               m_asyncOpen{};     // Being recorded
+    std::vector<AsyncUpload>  m_asyncPending{};  // Submitted, not yet acquired
+    BufferWrap createAsyncBufferWrap(VkDeviceSize size, const void* data, VkBufferUsageFlags usage,
+                                     const MemoryTag& tag={});
+    template <typename T>
+    BufferWrap createAsyncBufferWrap(const std::vector<T>& data, VkBufferUsageFlags usage,
+                                     const MemoryTag& tag={})
+    {
+        return createAsyncBufferWrap(sizeof(T)*data.size(), data.data(), usage, tag);
+    }
+    ImageWrap createAsyncTextureImage(const TextureData& texture, const std::string& owner);
+    void submitAsyncUploads(std::function<void()> onReady=nullptr);
+    void acquireAsyncUploads(VkCommandBuffer cmdBuf, bool wait=false);
+
     VkSwapchainKHR m_swapchain{VK_NULL_HANDLE};
     uint32_t       m_imageCount{0};
     std::vector<VkImage>     m_swapchainImages{};  // from vkGetSwapchainImagesKHR
@@ -176,6 +295,12 @@ public:
     
     ImageWrap m_rtNdCurrBuffer{};
     ImageWrap m_rtNdPrevBuffer{};
+
+    // Curr and Prev swap roles each ray traced frame rather than being
+    // copied; the descriptor sets come in pairs, and m_rtParity picks
+    // the one whose Curr is the current m_rt*CurrBuffer.
+    uint32_t m_rtParity{0};
+    void swapRtBuffers();
     
     void createRtBuffers();
     
@@ -193,10 +318,87 @@ public:
     std::vector<ImageWrap>  m_objText{}; // All textures of the scene
     std::vector<ObjInst>  m_objInst{}; // Instances paring an object and a transform
     BufferWrap m_lightBuff{};          // Buffer of light list
-    std::vector<std::pair<std::vector<Vertex>, Material>> m_lightList; // Light Triangles and associated Material
+    std::vector<Light> m_lightList;    // Emissive triangles, with their alias table
+    void createLightBuffer();
+    SceneDesc m_scene{};  // What the constructor loads (app's -s flag)
+    void loadModels(const std::vector<SceneModel>& models);
+    void addModel(const std::string& filename, const ModelView& model,
+                  const std::vector<glm::mat4>& transforms);
+    ModelParts makeModel(const std::string& filename, const ModelView& model,
+                         const std::vector<glm::mat4>& transforms,
+                         uint32_t objIndex, uint32_t firstDesc, bool newTextures);
+    std::vector<int> loadTextures(const ModelView& model, bool newTextures);
+    std::vector<int32_t> addMaterials(const ModelView& model, bool newTextures);
+    static VkIndexType indexTypeFor(uint32_t nbVertices);
+    static VkDeviceSize packIndices(std::vector<uint8_t>& packed, const uint32_t* indices,
+                                    uint32_t nbIndices, uint32_t firstVertex, VkIndexType type);
     void myloadModel(const std::string& filename, glm::mat4 transform);
 
+    ThreadPool m_workers{};  // CPU side loading work (texture decoding, ...)
+    TextureCache m_textureCache{};  // Recreated in createDevice once BC support is known
+    std::unordered_map<uint64_t, uint32_t> m_textureByHash;  // Content hash -> m_objText index
+    std::unordered_map<std::string, uint32_t> m_textureByPath;  // File -> m_objText index
+
+    // Hot reloading (see vkapp_reload.cpp): the model and texture files
+    // in use are watched, and one that changes is read again on the
+    // workers and swapped in between frames.
+    FileWatcher m_watcher{};
+    std::vector<std::pair<uint32_t, std::future<std::shared_ptr<ImportedModel>>>> m_modelReloads;
+    std::vector<std::pair<std::string, std::future<TextureData>>> m_textureReloads;
+    void pollAssetChanges();
+    void reloadModel(uint32_t objIndex, const ModelView& model);
+    void reloadTexture(const std::string& path, const TextureData& texture);
+
+    // Out-of-core geometry (see vkapp_stream.cpp): models marked
+    // streamed in the scene file are cut into chunks, each drawn from
+    // its proxy until m_streamer asks for it, then read on the workers
+    // and uploaded on the transfer queue.
+    static const uint32_t MAX_CHUNK_REQUESTS = 4;  // New chunk reads per frame
+    std::vector<StreamedModel> m_streamedModels;
+    std::vector<StreamedChunk> m_streamedChunks;  // In m_streamer's chunk order
+    GeometryStreamer m_streamer{};
+    std::vector<std::pair<uint32_t, std::future<ChunkGeometry>>> m_chunkLoads;  // Being read
+    std::vector<uint32_t> m_chunksUploaded;  // Uploaded and acquired; not yet swapped in
+    void addStreamedModel(const std::string& filename, const ModelView& model,
+                          const std::vector<glm::mat4>& transforms);
+    ChunkBuffers uploadChunk(const ChunkGeometry& geometry, const std::string& owner);
+    void setChunkBuffers(uint32_t chunk, const ChunkBuffers& buffers);
+    void updateGeometryStreaming();
+    void destroyGeometryStreaming();
+
+    // The node hierarchy of all the models (see vkapp_scene.cpp).
+    // Nodes moved between frames carry their instances along.
+    SceneGraph m_sceneGraph{};
+    std::vector<std::pair<uint32_t, uint32_t>> m_nodeInstances;  // (node, m_objInst index), sorted; empty when stale
+    void updateSceneGraph();
+
+    #ifdef VIRTUAL_TEXTURES
+    // Virtual texturing replaces m_objText (see virtual_texture.h);
+    // m_textureByHash then holds virtual texture ids.
+    VirtualTextures m_vt{};
+    ImageWrap  m_vtCache{};        // The page cache
+    BufferWrap m_vtTexturesBW{};   // A VtTexture per virtual texture
+    BufferWrap m_vtPageTableBW{};  // Host visible; rewritten as pages come and go
+    BufferWrap m_vtFeedbackBW{};   // Host visible; pages the shaders asked for
+    uint32_t*  m_vtPageTableMap{nullptr};
+    uint32_t*  m_vtFeedbackMap{nullptr};
+    uint64_t   m_vtFrame{0};
+    std::vector<std::pair<uint32_t, std::future<std::vector<uint8_t>>>> m_vtLoads;  // Tiles being built
+    void createVirtualTextures();
+    void updateVirtualTextures();
+    std::vector<uint8_t> buildVtTile(uint32_t page);
+    void uploadVtTiles(const std::vector<std::pair<uint32_t, std::vector<uint8_t>>>& tiles,
+                       bool pin=false);
+    void destroyVirtualTextures();
+    #endif
+
+    MaterialTable m_materials{};    // Every model's materials, deduplicated
+    BufferWrap m_materialBW{};      // Its MaterialHot array
+    BufferWrap m_materialColdBW{};  // and MaterialCold array
+    void createMaterialBuffers();
+
     BufferWrap m_objDescriptionBW{};  // Device buffer of the OBJ descriptions
+    BufferWrap m_instDescriptionBW{}; // Device buffer of an InstDesc per m_objInst
     void createObjDescriptionBuffer();
 
     DescriptorWrap m_scDesc{};
@@ -206,8 +408,8 @@ public:
     VkPipeline                  m_scanlinePipeline{};
     void createScPipeline();
 
-    BufferWrap m_matrixBW{};  // Device-Host of the camera matrices
-    void   createMatrixBuffer();
+    FrameArena m_frameArena;       // Per-frame uniforms, bound at dynamic offsets
+    uint32_t   m_matrixOffset{0};  // Of this frame's MatrixUniforms in m_frameArena
     
     float m_maxAnis = 0;
     PushConstantRay m_pcRay{};  // Push constant for ray tracer
@@ -220,12 +422,35 @@ public:
 
     // Acceleration structure objects and functions
     BufferWrap m_scratch1;
-    BufferWrap m_scratch2;
     RaytracingBuilderKHR m_rtBuilder{};
-    BlasInput objectToVkGeometryKHR(const ObjData& model);
+    bool m_splitBlas = true;  // One BLAS per mesh; else one per object (app's -m flag)
+    BlasInput objectToVkGeometryKHR(const ObjData& model, const ObjMesh& mesh);
+    BlasInput instancesToVkGeometryKHR(uint32_t objIndex);
+    // Monolithic layout: every instance's transform, which the BLASes
+    // are built and refit from, and the objects to refit next frame
+    BufferWrap m_asTransformBW{};
+    VkDeviceAddress m_asTransformAddress{0};
+    std::vector<uint32_t> m_blasRefits;
+    void createAsTransformBuffer();
+    VkBuildAccelerationStructureFlagsKHR blasFlags() const
+    {
+        return VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR
+            | (m_splitBlas ? 0 : VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR);
+    }
+    // The TLAS's instances, and the mapped buffer its builds read them from
+    TlasInstances m_tlasInstances{};
+    BufferWrap m_tlasInstanceBW{};
+    VkAccelerationStructureInstanceKHR* m_tlasInstanceMap{nullptr};
+    uint32_t m_tlasInstanceCapacity{0};
+    VkDeviceAddress m_tlasInstanceAddress{0};
+    bool m_tlasRefit{false};  // Left by buildTlas for recordRefits
+    void fillTlasInstances();
+    bool buildTlas(bool fill);
+    void recordRefits(VkCommandBuffer cmdBuf);
     void createBottomLevelAS();
     void createTopLevelAS();
     void createRtAccelerationStructure();
+    void rebuildModelAS(const std::vector<uint32_t>& objIndices, const std::vector<uint32_t>& oldBlas);
 
     // Raytrace descriptor set objects and functions
     DescriptorWrap m_rtDesc{};
@@ -242,6 +467,15 @@ public:
     VkStridedDeviceAddressRegionKHR m_callRegion{};
     void createRtShaderBindingTable();
 
+    // GPU timestamps around the trace, read back a frame later
+    VkQueryPool m_timestampPool{VK_NULL_HANDLE};
+    float  m_timestampPeriod{1.0f};  // Nanoseconds per timestamp tick
+    bool   m_timestampsWritten = false;
+    double m_traceTimeMs{0.0};
+    VkDeviceSize m_blasMemory{0};
+    VkDeviceSize m_tlasMemory{0};
+    void createTimestampQueries();
+
     DescriptorWrap m_postDesc{};
     void createPostDescriptor();
 
@@ -265,6 +499,13 @@ public:
     void ResetRtAccumulation();
     
     glm::mat4 m_priorViewProj{};
+
+    // Raster levels of detail: each instance is drawn with the coarsest
+    // level whose error projects to no more than m_lodPixels pixels.
+    float    m_lodPixels{1.0f};
+    uint64_t m_rasterTriangles{0};      // Drawn in the last rasterize()
+    uint64_t m_rasterFullTriangles{0};  // It would have drawn without LODs
+    uint32_t selectLod(const ObjInst& inst, const ObjMesh& mesh, float pixelsPerUnit) const;
     void updateCameraBuffer();
     void rasterize();
     void raytrace();
@@ -283,40 +524,39 @@ public:
     BufferWrap createStagedBufferWrap(const VkCommandBuffer& cmdBuf,
                                       const VkDeviceSize&    size,
                                       const void*            data,
-                                      VkBufferUsageFlags     usage);
+                                      VkBufferUsageFlags     usage,
+                                      const MemoryTag&       tag={});
     template <typename T>
     BufferWrap createStagedBufferWrap(const VkCommandBuffer& cmdBuf,
                                       const std::vector<T>&  data,
-                                      VkBufferUsageFlags     usage)
+                                      VkBufferUsageFlags     usage,
+                                      const MemoryTag&       tag={})
     {
-        return createStagedBufferWrap(cmdBuf, sizeof(T)*data.size(), data.data(), usage);
+        return createStagedBufferWrap(cmdBuf, sizeof(T)*data.size(), data.data(), usage, tag);
     }
     
 
+    // tag: what the memory is for, for m_allocator's report
     BufferWrap createBufferWrap(VkDeviceSize size, VkBufferUsageFlags usage,
-                                VkMemoryPropertyFlags properties);
+                                VkMemoryPropertyFlags properties, const MemoryTag& tag={});
 
-     void copyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size);
-    
-    
     void transitionImageLayout(VkImage image, VkFormat format,
                                VkImageLayout oldLayout, VkImageLayout newLayout,
                                uint32_t mipLevels=1);
-    void copyBufferToImage(VkBuffer buffer, VkImage image, uint32_t width, uint32_t height);
     
     ImageWrap createTextureImage(std::string fileName);
-    ImageWrap createBufferImage(VkExtent2D& size);
+    ImageWrap createTextureImage(const TextureData& texture, const std::string& owner);
+    ImageWrap createBufferImage(VkExtent2D& size, VkFormat format, const std::string& owner);
     
     ImageWrap createImageWrap(uint32_t width, uint32_t height,
                               VkFormat format,
                               VkImageUsageFlags usage,
                               VkMemoryPropertyFlags properties,
-                              uint32_t mipLevels=1);
+                              uint32_t mipLevels=1,
+                              const MemoryTag& tag={});
 
     VkImageView createImageView(VkImage image, VkFormat format,
-                                VkImageAspectFlagBits aspect=VK_IMAGE_ASPECT_COLOR_BIT);
+                                VkImageAspectFlagBits aspect=VK_IMAGE_ASPECT_COLOR_BIT,
+                                uint32_t mipLevels=1);
     VkSampler createTextureSampler();
-    
-    void generateMipmaps(VkImage image, VkFormat imageFormat,
-                         int32_t texWidth, int32_t texHeight, uint32_t mipLevels);
 };
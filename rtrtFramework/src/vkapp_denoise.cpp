@@ -20,8 +20,8 @@ using namespace glm;
 
 void VkApp::createDenoiseBuffer()
 {
-    m_denoiseBuffer = createBufferImage(m_windowSize);
-    transitionImageLayout(m_denoiseBuffer.image, VK_FORMAT_R32G32B32A32_SFLOAT,
+    m_denoiseBuffer = createBufferImage(m_windowSize, GBUFFER_COLOR_FORMAT, "denoise image");
+    transitionImageLayout(m_denoiseBuffer.image, m_denoiseBuffer.format,
                           VK_IMAGE_LAYOUT_UNDEFINED,
                           VK_IMAGE_LAYOUT_GENERAL, 1);
     // @@ destroy m_denoiseBuffer (DONE)
@@ -31,19 +31,33 @@ void VkApp::createDenoiseBuffer()
     m_pcDenoise.depthFactor = .007;
 }
 
+// The passes ping-pong between m_scImageBuffer and m_denoiseBuffer,
+// the first reading colCurr.  Each parity (see swapRtBuffers) has a
+// set for each input:output pair of a pass:
+enum DenoisePass { eColToSc, eColToDenoise, eScToDenoise, eDenoiseToSc, eDenoisePasses };
+
 void VkApp::createDenoiseDescriptorSet()
 {
     m_denoiseDesc.setBindings(m_device, {
-            {0, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1, VK_SHADER_STAGE_COMPUTE_BIT},
+            {0, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1, VK_SHADER_STAGE_COMPUTE_BIT},
             {1, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1, VK_SHADER_STAGE_COMPUTE_BIT},
             {2, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1, VK_SHADER_STAGE_COMPUTE_BIT},
             {3, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1, VK_SHADER_STAGE_COMPUTE_BIT}
-        });
-
-    m_denoiseDesc.write(m_device, 0, m_scImageBuffer.Descriptor());   // The input image
-    m_denoiseDesc.write(m_device, 1, m_denoiseBuffer.Descriptor());   // The output image
-    m_denoiseDesc.write(m_device, 2, m_rtKdCurrBuffer.Descriptor());  // The color buffer
-    m_denoiseDesc.write(m_device, 3, m_rtNdCurrBuffer.Descriptor());  // The normal:depth buffer
+        }, 2*eDenoisePasses);
+
+    ImageWrap* col[2] = {&m_rtColCurrBuffer, &m_rtColPrevBuffer};
+    ImageWrap* kd[2]  = {&m_rtKdCurrBuffer, &m_rtKdPrevBuffer};
+    ImageWrap* nd[2]  = {&m_rtNdCurrBuffer, &m_rtNdPrevBuffer};
+    for (int parity = 0; parity < 2; parity++) {
+        ImageWrap* in[eDenoisePasses]  = {col[parity], col[parity], &m_scImageBuffer, &m_denoiseBuffer};
+        ImageWrap* out[eDenoisePasses] = {&m_scImageBuffer, &m_denoiseBuffer, &m_denoiseBuffer, &m_scImageBuffer};
+        for (int pass = 0; pass < eDenoisePasses; pass++) {
+            // The input and output images, the color buffer, and the normal:depth buffer
+            int set = parity*eDenoisePasses + pass;
+            m_denoiseDesc.write(m_device, 0, in[pass]->Descriptor(), set);
+            m_denoiseDesc.write(m_device, 1, out[pass]->Descriptor(), set);
+            m_denoiseDesc.write(m_device, 2, kd[parity]->Descriptor(), set);
+            m_denoiseDesc.write(m_device, 3, nd[parity]->Descriptor(), set); } }
 
     // @@ destroy m_denoiseDesc (DONE)
 }
@@ -73,20 +87,10 @@ void VkApp::createDenoiseCompPipeline()
 
 void VkApp::denoise()
 {
-
-    // Wait for RT to finish
-    VkImageSubresourceRange range{VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1};
-    VkImageMemoryBarrier    imgMemBarrier{VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER};
-    imgMemBarrier.srcAccessMask    = VK_ACCESS_SHADER_WRITE_BIT;
-    imgMemBarrier.dstAccessMask    = VK_ACCESS_SHADER_READ_BIT;
-    imgMemBarrier.image            = m_scImageBuffer.image;
-    imgMemBarrier.oldLayout        = VK_IMAGE_LAYOUT_GENERAL;
-    imgMemBarrier.newLayout        = VK_IMAGE_LAYOUT_GENERAL;
-    imgMemBarrier.subresourceRange = range;
-
-    vkCmdPipelineBarrier(m_commandBuffer, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
-                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
-                         VK_DEPENDENCY_DEVICE_GROUP_BIT, 0, nullptr, 0, nullptr, 1, &imgMemBarrier);
+    // raytrace's barrier covers its writes of the images read here
+    VkMemoryBarrier barrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER};
+    barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
 
     int stepwidth = 1;
     for (int a=0; a < m_num_atrous_iterations; a++) {
@@ -95,11 +99,17 @@ void VkApp::denoise()
         m_pcDenoise.stepwidth = stepwidth;
         stepwidth *= 2;
 
+        // No copies: the passes alternate their output image so that
+        // the last one writes m_scImageBuffer, which postProcess shows
+        bool toSc = (m_num_atrous_iterations-1 - a) % 2 == 0;
+        int pass = a == 0 ? (toSc ? eColToSc : eColToDenoise) : (toSc ? eDenoiseToSc : eScToDenoise);
+        VkDescriptorSet descSet = m_denoiseDesc.descSets[m_rtParity*eDenoisePasses + pass];
+
         // Select the compute shader, and its descriptor set and push constant
         vkCmdBindPipeline(m_commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, m_denoisePipeline);
         vkCmdBindDescriptorSets(m_commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
                                 m_denoiseCompPipelineLayout, 0, 1,
-                                &m_denoiseDesc.descSet, 0, nullptr);
+                                &descSet, 0, nullptr);
         vkCmdPushConstants(m_commandBuffer, m_denoiseCompPipelineLayout,
                            VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(PushConstantDenoise),
                            &m_pcDenoise);
@@ -111,17 +121,11 @@ void VkApp::denoise()
                       (m_windowSize.width + GROUP_SIZE-1) / GROUP_SIZE,
                       m_windowSize.height, 1);
 
-        // Wait until denoise shader is done writing to m_denoiseBuffer
-        imgMemBarrier.image = m_denoiseBuffer.image;
+        // Wait until this pass is done writing before the next reads
+        // it (or postProcess samples it), and done reading before the
+        // next but one overwrites it
         vkCmdPipelineBarrier(m_commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
-                             VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
-                             VK_DEPENDENCY_DEVICE_GROUP_BIT,
-                             0, nullptr, 0, nullptr, 1, &imgMemBarrier);
-
-        // @@ Copy the denoised results (in m_denoiseBuffer) back to
-        // the input buffer (m_scImageBuffer) for the next denoising
-        // loop pass.  See VkApp::raytrace for 4 examples of using
-        // VkApp::CmdCopyImage to copy an image. (DONE)
-        CmdCopyImage(m_denoiseBuffer, m_scImageBuffer);
+                             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                             0, 1, &barrier, 0, nullptr, 0, nullptr);
     }
 }
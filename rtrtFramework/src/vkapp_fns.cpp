@@ -34,6 +34,10 @@ void VkApp::destroyAllVulkanResources()
     // @@
     vkDeviceWaitIdle(m_device);  // Uncomment this when you have an m_device created.
 
+    // Reloads still being read use m_textureCache; let them finish
+    for (auto& reload : m_modelReloads) reload.second.wait();
+    for (auto& reload : m_textureReloads) reload.second.wait();
+
     // Destroy ImGUI
     vkDestroyDescriptorPool(m_device, m_imguiDescPool, nullptr);
     ImGui_ImplVulkan_Shutdown();
@@ -56,6 +60,10 @@ void VkApp::destroyAllVulkanResources()
 
     m_rtDesc.destroy(m_device);
     m_rtBuilder.destroy();
+    if (m_tlasInstanceMap)
+        m_tlasInstanceBW.destroy(m_device);
+    m_asTransformBW.destroy(m_device);
+    vkDestroyQueryPool(m_device, m_timestampPool, nullptr);
 
     m_rtColCurrBuffer.destroy(m_device);
     m_rtColPrevBuffer.destroy(m_device);
@@ -74,13 +82,17 @@ void VkApp::destroyAllVulkanResources()
     vkDestroyFramebuffer(m_device, m_scanlineFramebuffer, nullptr);
 
     m_objDescriptionBW.destroy(m_device);
-    m_matrixBW.destroy(m_device);
+    m_instDescriptionBW.destroy(m_device);
+    m_lightBuff.destroy(m_device);
+    m_materialBW.destroy(m_device);
+    m_materialColdBW.destroy(m_device);
+    m_frameArena.destroy();
 
+    destroyGeometryStreaming();  // Chunk objects only borrow their buffers
     for (auto& ob : m_objData) 
     {
       ob.vertexBuffer.destroy(m_device); 
       ob.matIndexBuffer.destroy(m_device);
-      ob.matColorBuffer.destroy(m_device);
       ob.indexBuffer.destroy(m_device);
     }
 
@@ -88,6 +100,9 @@ void VkApp::destroyAllVulkanResources()
     {
       tex.destroy(m_device);
     }
+    #ifdef VIRTUAL_TEXTURES
+    destroyVirtualTextures();
+    #endif
 
     m_postDesc.destroy(m_device);
     m_scImageBuffer.destroy(m_device);
@@ -104,6 +119,9 @@ void VkApp::destroyAllVulkanResources()
     vkDestroyRenderPass(m_device, m_postRenderPass, nullptr);
     m_depthImage.destroy(m_device);
     destroySwapchain();
+    m_transfer.destroy();
+    m_upload.destroy();
+    m_allocator.destroy();
     vkDestroyCommandPool(m_device, m_cmdPool, nullptr);
     vkDestroySurfaceKHR(m_instance, m_surface, nullptr);
     vkDestroyDevice(m_device, nullptr);
@@ -330,6 +348,12 @@ void VkApp::createPhysicalDevice()
           //printf("GPU Accepted\n");
           //printf("%s\n", GPUproperties.deviceName);
           m_physicalDevice = physicalDevice;
+
+          // Optional: per-heap budgets for the memory report
+          m_memoryBudget = false;
+          for (const VkExtensionProperties& properties : extensionProperties)
+            if (strcmp(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME, properties.extensionName) == 0)
+              m_memoryBudget = true;
         }
         // GPU was not compatible
         /*else
@@ -345,6 +369,9 @@ void VkApp::createPhysicalDevice()
         // each required extension.
     }
     
+    if (m_memoryBudget)
+        reqDeviceExtensions.push_back(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+
     // @@ Document the GPU accepted, and any GPUs rejected. (DONE)
     // Oddly, there is nothing to destroy here.
   
@@ -392,6 +419,25 @@ void VkApp::chooseQueueIndex()
     throw std::runtime_error("queue family with required flags not found!");
   }
 
+  // Uploads prefer a transfer only family (the GPU's copy engines),
+  // then any other non graphics family that can transfer; failing
+  // both they share the graphics queue.
+  m_transferQueueIndex = m_graphicsQueueIndex;
+  int best = 0;
+  for (uint32_t i = 0; i < mpCount; ++i)
+  {
+    VkQueueFlags flags = queueProperties[i].queueFlags;
+    if (!(flags & VK_QUEUE_TRANSFER_BIT) || (flags & VK_QUEUE_GRAPHICS_BIT))
+      continue;
+    int score = (flags & VK_QUEUE_COMPUTE_BIT) ? 1 : 2;
+    if (score > best)
+    {
+      m_transferQueueIndex = i;
+      best = score;
+    }
+  }
+  printf("Queue families: graphics %d, transfer %d\n", m_graphicsQueueIndex, m_transferQueueIndex);
+
   // Nothing to destroy as m_graphicsQueueIndex is just an integer.
 }
 
@@ -432,17 +478,27 @@ void VkApp::createDevice()
     // @@ If you are curious, document the whole filled in pNext chain
     // using an api_dump and examine all the many features.  (DONE)
 
+    // Textures are cached block compressed only if they can be sampled that way.
+    m_textureCache = TextureCache(features2.features.textureCompressionBC == VK_TRUE);
+    #ifdef VIRTUAL_TEXTURES
+    m_vt.init(features2.features.textureCompressionBC == VK_TRUE);
+    #endif
+
     float priority = 1.0;
-    VkDeviceQueueCreateInfo queueInfo{VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO};
-    queueInfo.queueFamilyIndex = m_graphicsQueueIndex;
-    queueInfo.queueCount       = 1;
-    queueInfo.pQueuePriorities = &priority;
+    VkDeviceQueueCreateInfo queueInfo[2] = {{VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO},
+                                            {VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO}};
+    queueInfo[0].queueFamilyIndex = m_graphicsQueueIndex;
+    queueInfo[0].queueCount       = 1;
+    queueInfo[0].pQueuePriorities = &priority;
+    queueInfo[1].queueFamilyIndex = m_transferQueueIndex;
+    queueInfo[1].queueCount       = 1;
+    queueInfo[1].pQueuePriorities = &priority;
     
     VkDeviceCreateInfo deviceCreateInfo{VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO};
     deviceCreateInfo.pNext            = &features2; // This is the whole pNext chain
   
-    deviceCreateInfo.queueCreateInfoCount = 1;
-    deviceCreateInfo.pQueueCreateInfos    = &queueInfo;
+    deviceCreateInfo.queueCreateInfoCount = m_transferQueueIndex != m_graphicsQueueIndex ? 2 : 1;
+    deviceCreateInfo.pQueueCreateInfos    = queueInfo;
     
     deviceCreateInfo.enabledExtensionCount   = static_cast<uint32_t>(reqDeviceExtensions.size());
     deviceCreateInfo.ppEnabledExtensionNames = reqDeviceExtensions.data();
@@ -457,6 +513,8 @@ void VkApp::createDevice()
     {
       throw std::runtime_error("failed to create logical device!");
     }
+
+    m_allocator.init(m_physicalDevice, m_device, m_memoryBudget);
 }
 
 /*********************************************************************
@@ -467,6 +525,7 @@ void VkApp::createDevice()
 void VkApp::getCommandQueue()
 {
     vkGetDeviceQueue(m_device, m_graphicsQueueIndex, 0, &m_queue);
+    vkGetDeviceQueue(m_device, m_transferQueueIndex, 0, &m_transferQueue);
     // Returns void -- nothing to verify
     // Nothing to destroy -- the queue is owned by the device.
 }
@@ -548,6 +607,14 @@ void VkApp::createCommandPool()
     {
       throw std::runtime_error("failed to allocate command buffers!");
     }
+
+    // Uploads and one-off commands go through a 64 MB staging ring
+    m_upload.init(m_physicalDevice, m_device, m_queue, m_graphicsQueueIndex, 64ull << 20);
+    // @@ Destroy with m_upload.destroy(); (DONE)
+
+    // and background uploads through a ring of their own
+    m_transfer.init(m_physicalDevice, m_device, m_transferQueue, m_transferQueueIndex, 64ull << 20);
+    // @@ Destroy with m_transfer.destroy(); (DONE)
 }
  
 /*********************************************************************
@@ -756,13 +823,12 @@ void VkApp::createSwapchain()
         m_barriers[i] = memBarrier;
     }
 
-    // Create a temporary command buffer. submit the layout conversion
-    // command, submit and destroy the command buffer.
-    VkCommandBuffer cmd = createTempCmdBuffer();
+    // Record the layout conversion into the upload batch; it is
+    // submitted before the first frame.
+    VkCommandBuffer cmd = m_upload.cmdBuf();
     vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
                          VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, 0, 0, nullptr, 0,
                          nullptr, m_imageCount, m_barriers.data());
-    submitTempCmdBuffer(cmd);
 
     // Create the three synchronization objects.  These are not
     // technically part of the swap chain, but they are used
@@ -828,7 +894,7 @@ void VkApp::createDepthResource()
     VK_FORMAT_X8_D24_UNORM_PACK32, 
     VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT,
     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-    mipLevels);
+    mipLevels, {MEM_GBUFFER, "depth"});
 
   m_depthImage.imageView = createImageView(m_depthImage.image,
     VK_FORMAT_X8_D24_UNORM_PACK32,
@@ -876,7 +942,8 @@ uint32_t VkApp::findMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags proper
 ImageWrap VkApp::createImageWrap(uint32_t width, uint32_t height,
                                  VkFormat format,
                                  VkImageUsageFlags usage,
-                                 VkMemoryPropertyFlags properties, uint mipLevels)
+                                 VkMemoryPropertyFlags properties, uint mipLevels,
+                                 const MemoryTag& tag)
 {
     ImageWrap myImage;
     
@@ -901,26 +968,10 @@ ImageWrap VkApp::createImageWrap(uint32_t width, uint32_t height,
       throw std::runtime_error("failed to create image!");
     }
 
-    VkMemoryRequirements memRequirements;
-    vkGetImageMemoryRequirements(m_device, myImage.image, &memRequirements);
-
-    VkMemoryAllocateInfo allocInfo{VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO};
-    allocInfo.allocationSize = memRequirements.size;
-    allocInfo.memoryTypeIndex = findMemoryType(memRequirements.memoryTypeBits, properties);
-
-    result = vkAllocateMemory(m_device, &allocInfo, nullptr, &myImage.memory);
-
-    if (result != VK_SUCCESS)
-    {
-      throw std::runtime_error("failed to allocate memory!");
-    }
-    
-    result = vkBindImageMemory(m_device, myImage.image, myImage.memory, 0);
-
-    if (result != VK_SUCCESS)
-    {
-      throw std::runtime_error("failed to bind image memory!");
-    }
+    // Large images (render targets) get dedicated memory, the rest a
+    // range of one of the allocator's blocks
+    myImage.allocation = m_allocator.allocate(myImage.image, properties, tag);
+    myImage.format = format;
 
     myImage.imageView = VK_NULL_HANDLE;
     myImage.sampler = VK_NULL_HANDLE;
@@ -935,7 +986,8 @@ ImageWrap VkApp::createImageWrap(uint32_t width, uint32_t height,
  * brief:  Wrapper to create image view
  **********************************************************************/
 VkImageView VkApp::createImageView(VkImage image, VkFormat format,
-                                         VkImageAspectFlagBits aspect)
+                                         VkImageAspectFlagBits aspect,
+                                         uint32_t mipLevels)
 {
     VkImageViewCreateInfo viewInfo{VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO};
     viewInfo.image = image;
@@ -943,7 +995,7 @@ VkImageView VkApp::createImageView(VkImage image, VkFormat format,
     viewInfo.format = format;
     viewInfo.subresourceRange.aspectMask = aspect;
     viewInfo.subresourceRange.baseMipLevel = 0;
-    viewInfo.subresourceRange.levelCount = 1;
+    viewInfo.subresourceRange.levelCount = mipLevels;
     viewInfo.subresourceRange.baseArrayLayer = 0;
     viewInfo.subresourceRange.layerCount = 1;
     
@@ -1243,8 +1295,10 @@ void VkApp::postProcess()
             / static_cast<float>(m_windowSize.height);
         vkCmdBindPipeline(m_commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, m_postPipeline);
         // Eventually uncomment this
+        VkDescriptorSet descSet = useRaytracer && !denoiser
+            ? m_postDesc.descSets[1 + m_rtParity] : m_postDesc.descSet;
         vkCmdBindDescriptorSets(m_commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-                                m_postPipelineLayout, 0, 1, &m_postDesc.descSet, 0, nullptr);
+                                m_postPipelineLayout, 0, 1, &descSet, 0, nullptr);
 
         // Weird! This draws 3 vertices but with no vertices/triangles buffers bound in.
         // Hint: The vertex shader fabricates vertices from gl_VertexIndex
@@ -8,7 +8,15 @@
 #include <string>
 #include <vector>
 #include <array>
+#include <algorithm>
+#include <chrono>
 #include <math.h>
+#include <float.h>
+#include <string.h>
+#include <unordered_map>
+#include <memory>
+#include <future>
+#include <stdexcept>
 
 #include <filesystem>
 namespace fs = std::filesystem;
@@ -31,23 +39,48 @@ using namespace glm;
 #include "app.h"
 #include "shaders/shared_structs.h"
 
+#include "model_data.h"
+#include "model_cache.h"
+#include "mesh_optimize.h"
+#include "mesh_simplify.h"
+#include "texture_cache.h"
+#include "light_table.h"
+#include "thread_pool.h"
+#include "hash.h"
+
+// Vertex packing uses SSE2 (every x64 target) or NEON where there is
+// one, and plain C++ otherwise; see packVertices.
+#ifndef COMPACT_VERTEX
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PACK_SSE
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#define PACK_NEON
+#include <arm_neon.h>
+#endif
+#endif
+
 // Local objects and procedures defined and used here:
-struct ModelData
-{
-    std::vector<Vertex> vertices;
-    std::vector<uint32_t> indices;
-    std::vector<Material> materials;
-    std::vector<int32_t>     matIndx;
-    std::vector<std::string> textures;
 
-    void readAssimpFile(const std::string& path, const mat4& M);
+// Bookkeeping for instancing while walking the node hierarchy: the
+// Assimp meshes used, and each use by a node; then (see storeMeshes)
+// which stored mesh each Assimp mesh became.
+struct MeshImport
+{
+    std::vector<int> meshOfAiMesh;    // -2 until used; then -1 until stored
+    std::vector<unsigned int> used;   // Assimp meshes, in the order first used
+    std::vector<MeshInstance> uses;   // Each use, by its Assimp mesh index
 };
 
 void recurseModelNodes(ModelData* meshdata,
+                       MeshImport& meshImport,
                        const  aiScene* aiscene,
                        const  aiNode* node,
                        const aiMatrix4x4& parentTr,
+                       const int32_t parentNode=-1,
                        const int level=0);
+static void storeMeshes(ModelData* meshdata, MeshImport& meshImport, const aiScene* aiscene,
+                        ThreadPool* pool);
 
 
 // Returns an address (as VkDeviceAddress=uint64_t) of a buffer on the GPU.
@@ -59,146 +92,412 @@ VkDeviceAddress getBufferDeviceAddress(VkDevice device, VkBuffer buffer) {
 
 /*********************************************************************
  * param:  filename, specified file to read from
- * param:  transform, mat4 used when specifying the instance transform
- *
  *
- * brief:  Loads a model from the passed in filename
+ * brief:  Reads a model from its cache, or through Assimp (writing the
+ *         cache for next time).  Touches nothing of VkApp's, so any
+ *         number of these run on the worker threads at once.
  **********************************************************************/
-void VkApp::myloadModel(const std::string& filename, glm::mat4 transform)
+std::unique_ptr<ImportedModel> importModel(const std::string& filename, ThreadPool& pool)
 {
-    ModelData meshdata;
-    meshdata.readAssimpFile(filename.c_str(), glm::mat4(1.0f));
-
-    printf("vertices: %zd\n", meshdata.vertices.size());
-    printf("indices: %zd (%zd)\n", meshdata.indices.size(), meshdata.indices.size()/3);
-    printf("materials: %zd\n", meshdata.materials.size());
-    printf("matIndx: %zd\n", meshdata.matIndx.size());
-    printf("textures: %zd\n", meshdata.textures.size());
+    auto imported = std::make_unique<ImportedModel>();
+    ModelCache& cache    = imported->cache;
+    ModelData&  meshdata = imported->meshdata;
+    ModelView&  model    = imported->model;
 
 #ifdef SANM
+    const uint32_t cacheVariant = 1;  // The sky quad added below is baked into the cache
 #else
+    const uint32_t cacheVariant = 0;
 #endif
-                
+
+    // Use the binary cache of this model if there is a valid one;
+    // otherwise read it through Assimp and write the cache for next time.
+    if (!cache.open(filename, model, cacheVariant)) {
+        meshdata.readAssimpFile(filename.c_str(), glm::mat4(1.0f), &pool);
+        optimizeModel(meshdata);  // Weld and reorder before anything is cached or uploaded
+
 #ifdef SANM
-    vec3 T0(0,0,1);
-    vec3 T1( 0.866, 0, -0.5);
-    vec3 T2(-0.866, 0, -0.5);
-    vec3 Z(0,0,0);
-    vec3 LC(21.50, 20.39, 2.29);
-    int Nv = meshdata.vertices.size();
-    int Nm = meshdata.materials.size();
-    
-    // vec3 Sun(200,200,200);
-    // meshdata.vertices.push_back({LC+T0, vec3(0,1,0), vec2(1,0)});
-    // meshdata.vertices.push_back({LC+T1, vec3(0,1,0), vec2(0,1)});
-    // meshdata.vertices.push_back({LC+T2, vec3(0,1,0), vec2(1,1)});
-    // meshdata.indices.push_back(Nv+0);
-    // meshdata.indices.push_back(Nv+1);
-    // meshdata.indices.push_back(Nv+2);
-    // meshdata.materials.push_back({Z, Z, Sun, 0.0, -1});
-    // meshdata.matIndx.push_back(Nm);
-
-    // LC += vec3(0,1,0);
-    // Nv += 3;
-    // Nm += 1;
-    float s = 50;
-    vec3 Sky(5,5,5);
-    meshdata.vertices.push_back({vec3( 6.5,15, 0), vec3(0,1,0), vec2(0,0)});
-    meshdata.vertices.push_back({vec3( 6.5,15,13), vec3(0,1,0), vec2(0,0)});
-    meshdata.vertices.push_back({vec3(23.0,15, 0), vec3(0,1,0), vec2(0,0)});
-    meshdata.vertices.push_back({vec3(23.0,15,13), vec3(0,1,0), vec2(0,0)});
-    meshdata.indices.push_back(Nv+0);
-    meshdata.indices.push_back(Nv+1);
-    meshdata.indices.push_back(Nv+2);
-    meshdata.indices.push_back(Nv+2);
-    meshdata.indices.push_back(Nv+1);
-    meshdata.indices.push_back(Nv+3);
-    meshdata.materials.push_back({Z, Z, Sky, 0.0, -1});
-    meshdata.matIndx.push_back(Nm);                       
-    meshdata.matIndx.push_back(Nm);                             
+        vec3 T0(0,0,1);
+        vec3 T1( 0.866, 0, -0.5);
+        vec3 T2(-0.866, 0, -0.5);
+        vec3 Z(0,0,0);
+        vec3 LC(21.50, 20.39, 2.29);
+        int Nv = meshdata.vertices.size();
+        int Nm = meshdata.materials.size();
     
-    printf("vertices: %zd\n", meshdata.vertices.size());
-    printf("indices: %zd (%zd)\n", meshdata.indices.size(), meshdata.indices.size()/3);
-    printf("materials: %zd\n", meshdata.materials.size());
-    printf("matIndx: %zd\n", meshdata.matIndx.size());
-    printf("textures: %zd\n", meshdata.textures.size());
-
+        // vec3 Sun(200,200,200);
+        // meshdata.vertices.push_back({LC+T0, vec3(0,1,0), vec2(1,0)});
+        // meshdata.vertices.push_back({LC+T1, vec3(0,1,0), vec2(0,1)});
+        // meshdata.vertices.push_back({LC+T2, vec3(0,1,0), vec2(1,1)});
+        // meshdata.indices.push_back(Nv+0);
+        // meshdata.indices.push_back(Nv+1);
+        // meshdata.indices.push_back(Nv+2);
+        // meshdata.materials.push_back({Z, Z, Sun, 0.0, -1});
+        // meshdata.matIndx.push_back(Nm);
+
+        // LC += vec3(0,1,0);
+        // Nv += 3;
+        // Nm += 1;
+        float s = 50;
+        vec3 Sky(5,5,5);
+        meshdata.vertices.push_back(makeVertex(vec3( 6.5,15, 0), vec3(0,1,0), vec2(0,0)));
+        meshdata.vertices.push_back(makeVertex(vec3( 6.5,15,13), vec3(0,1,0), vec2(0,0)));
+        meshdata.vertices.push_back(makeVertex(vec3(23.0,15, 0), vec3(0,1,0), vec2(0,0)));
+        meshdata.vertices.push_back(makeVertex(vec3(23.0,15,13), vec3(0,1,0), vec2(0,0)));
+        meshdata.indices.push_back(Nv+0);
+        meshdata.indices.push_back(Nv+1);
+        meshdata.indices.push_back(Nv+2);
+        meshdata.indices.push_back(Nv+2);
+        meshdata.indices.push_back(Nv+1);
+        meshdata.indices.push_back(Nv+3);
+        meshdata.materials.push_back({Z, Z, Sky, 0.0, -1});
+        meshdata.matIndx.push_back(Nm);                       
+        meshdata.matIndx.push_back(Nm);                             
+        meshdata.meshes.push_back({uint32_t(meshdata.indices.size()-6), 6, uint32_t(Nv), 4,
+                                   vec3(6.5,15,0), vec3(23.0,15,13)});
+        meshdata.instances.push_back({uint32_t(meshdata.meshes.size()-1), mat4(1.0f)});
 #endif
-    
+        buildLods(meshdata);  // For the raster path; cached with the rest
+
+        if (!ModelCache::write(filename, meshdata, cacheVariant))
+            printf("Could not write model cache %s\n", ModelCache::cachePath(filename).c_str());
+        model.set(meshdata); }
+
+    return imported;
+}
+
+/*********************************************************************
+ * param:  models, each model file with its instances' transforms
+ *
+ * brief:  Imports all the models at once on the worker threads, and
+ *         adds each to the scene (in order) as soon as it is read.
+ **********************************************************************/
+void VkApp::loadModels(const std::vector<SceneModel>& models)
+{
+    auto start = std::chrono::high_resolution_clock::now();
+
+    std::vector<std::future<std::unique_ptr<ImportedModel>>> imports;
+    for (const auto& m : models) {
+        std::string path = m.path;
+        imports.push_back(m_workers.submit([this, path] { return importModel(path, m_workers); })); }
+
+    // Adding a model puts its texture and light work on the same
+    // workers; it queues behind the imports, which wait on nothing.
+    for (size_t i = 0; i < models.size(); i++) {
+        std::unique_ptr<ImportedModel> imported = imports[i].get();
+        if (models[i].streamed)
+            addStreamedModel(models[i].path, imported->model, models[i].instances);
+        else
+            addModel(models[i].path, imported->model, models[i].instances); }  // Then unmapped
+
+    auto end = std::chrono::high_resolution_clock::now();
+    printf("%zd models loaded in %.1f ms\n", models.size(),
+           std::chrono::duration<double, std::milli>(end - start).count());
+}
+
+/*********************************************************************
+ * param:  filename, specified file to read from
+ * param:  transform, mat4 used when specifying the instance transform
+ *
+ *
+ * brief:  Loads a model from the passed in filename
+ **********************************************************************/
+void VkApp::myloadModel(const std::string& filename, glm::mat4 transform)
+{
+    loadModels({{filename, {transform}}});
+}
+
+/*********************************************************************
+ * param:  filename, the model's file
+ * param:  model, the model as imported; read only until this returns
+ * param:  transforms, one for each instance of the whole model
+ *
+ * brief:  Adds an imported model to the scene: its lights, textures,
+ *         buffers, descriptions and instances.
+ **********************************************************************/
+void VkApp::addModel(const std::string& filename, const ModelView& model,
+                     const std::vector<glm::mat4>& transforms)
+{
+    ModelParts parts = makeModel(filename, model, transforms,
+                                 static_cast<uint32_t>(m_objData.size()),
+                                 static_cast<uint32_t>(m_objDesc.size()), true);
 
     // @@ The raytracer will eventually need a list of lights, that is
     // a list of triangle indices whose associated material type has a
     // non-zero emission vec3.  Create such a list.  The vkapp.h header
     // file has no data member for this, so create your own. (DONE)
     //
-    // Hint: The triangle at index i has:
-    //   vertices in meshdata.vertices, indexed by [3*i], [3*i+1], [3*i+2]
-    //   and a material in meshdata.materials, indexed by meshdata.matIndx[i]
-    uint32_t indices = meshdata.vertices.size() / 3;
-    m_lightList.resize(indices);
-    for (uint32_t i = 0; i < indices; ++i)
-    {
-      std::vector<Vertex> vertices(3);
-      vertices[0] = meshdata.vertices[3 * i];
-      vertices[1] = meshdata.vertices[3 * i + 1];
-      vertices[2] = meshdata.vertices[3 * i + 2];
-      Material material = meshdata.materials[meshdata.matIndx[i]];
-      m_lightList[i] = std::pair(vertices, material);
-    }
-    
-    ObjData object;
-    object.nbIndices  = static_cast<uint32_t>(meshdata.indices.size());
-    object.nbVertices = static_cast<uint32_t>(meshdata.vertices.size());
+    // The alias table over the whole list is built (and uploaded) by
+    // createLightBuffer once all models are loaded.
+    // Each transform places the model as a root of the scene graph,
+    // with the model's own nodes below it.
+    for (size_t p = 0; p < transforms.size(); p++) {
+        uint32_t root = m_sceneGraph.add(SceneGraph::NONE, transforms[p]);
+        m_sceneGraph.setChildren(root, model.nodes, model.nbNodes);
+        parts.object.nodes.push_back(root);
+        for (uint32_t i = 0; i < model.nbInstances; i++)
+            parts.instances[p*model.nbInstances + i].node += root; }
+    m_nodeInstances.clear();
+
+    parts.object.firstLight = static_cast<uint32_t>(m_lightList.size());
+    parts.object.nbLights   = static_cast<uint32_t>(parts.lights.size());
+    m_lightList.insert(m_lightList.end(), parts.lights.begin(), parts.lights.end());
+
+    // The instances of an object are kept together in m_objInst.
+    m_objInst.insert(m_objInst.end(), parts.instances.begin(), parts.instances.end());
+    m_objDesc.insert(m_objDesc.end(), parts.descs.begin(), parts.descs.end());
+    m_objData.emplace_back(std::move(parts.object));
+    m_watcher.watch(filename);
+
+    // @@ At shutdown:
+    //   Destroy all textures with:  for (t:m_objText) t.destroy(m_device); (DONE)
+    // Destroy the 3 buffers containing each object's data with:
+    // for (auto& ob : m_objData) {
+    // ob.vertexBuffer.destroy(m_device); 
+    // and similar for ob.indexBuffer, ob.matIndexBuffer ... } (DONE)
+}
+
+/*********************************************************************
+ * param:  model, the model whose textures are wanted
+ * param:  newTextures, whether files not seen before may be added
+ *
+ * brief:  Returns the m_objText index (or virtual texture id) of each
+ *         of the model's textures.  A file seen before, by path or by
+ *         contents, reuses its image.  Others are loaded from
+ *         m_textureCache on the workers (already mipmapped and block
+ *         compressed, unless this is their first use) and queued on
+ *         the transfer queue as each is ready -- unless newTextures is
+ *         false, when they get -1 (no texture).
+ **********************************************************************/
+std::vector<int> VkApp::loadTextures(const ModelView& model, bool newTextures)
+{
+    stbi_set_flip_vertically_on_load(true);  // A global; set before any worker reads it
+    std::vector<int> textureIndex(model.textures.size(), -1);  // model.textures index -> m_objText index
+    std::vector<std::future<TextureData>> loaded(model.textures.size());
+    for (size_t i = 0; i < model.textures.size(); i++) {
+        std::string texName = model.textures[i];
+        auto known = m_textureByPath.find(texName);
+        if (known != m_textureByPath.end())
+            textureIndex[i] = known->second;
+        else
+            loaded[i] = m_workers.submit([this, texName] { return m_textureCache.load(texName); }); }
+
+    size_t nbTextures = m_objText.size();
+    for (size_t i = 0; i < model.textures.size(); i++) {
+        if (!loaded[i].valid())
+            continue;
+        TextureData texture = loaded[i].get();
+        auto known = m_textureByHash.find(texture.hash);
+        if (known == m_textureByHash.end()) {
+            if (!newTextures) {
+                printf("New texture %s left out; it needs a restart\n", model.textures[i].c_str());
+                continue; }
+#ifdef VIRTUAL_TEXTURES
+            // Handed to the virtual texturing system, which uploads pages on demand
+            known = m_textureByHash.emplace(texture.hash, m_vt.nbTextures()).first;
+            m_vt.add(std::move(texture));
+#else
+            known = m_textureByHash.emplace(texture.hash, static_cast<uint32_t>(m_objText.size())).first;
+            m_objText.push_back(createAsyncTextureImage(texture, model.textures[i]));
+#endif
+        }
+        textureIndex[i] = known->second;
+        m_textureByPath[model.textures[i]] = known->second;
+        m_watcher.watch(model.textures[i]); }
+#ifdef VIRTUAL_TEXTURES
+    printf("virtual textures: %d\n", m_vt.nbTextures());
+#else
+    printf("textures uploaded: %zd of %zd\n", m_objText.size() - nbTextures, model.textures.size());
+#endif
+    return textureIndex;
+}
+
+/*********************************************************************
+ * param:  nbVertices, the vertex count of a mesh
+ *
+ * brief:  The narrowest index type able to address every vertex.
+ **********************************************************************/
+VkIndexType VkApp::indexTypeFor(uint32_t nbVertices)
+{
+    return nbVertices <= 0x10000 ? VK_INDEX_TYPE_UINT16 : VK_INDEX_TYPE_UINT32;
+}
+
+/*********************************************************************
+ * param:  packed, the index buffer's contents so far
+ * param:  indices, nbIndices, a mesh's (or level of detail's) indices
+ * param:  firstVertex, subtracted from each of them
+ * param:  type, the index type to store them as
+ *
+ * brief:  Appends the indices to packed, starting at a multiple of 4
+ *         bytes (as the BLAS builds need, and so the shaders can read
+ *         16 bit indices as words), and returns where they start.
+ **********************************************************************/
+VkDeviceSize VkApp::packIndices(std::vector<uint8_t>& packed, const uint32_t* indices,
+                                uint32_t nbIndices, uint32_t firstVertex, VkIndexType type)
+{
+    size_t offset = (packed.size() + 3) & ~size_t(3);
+    size_t size   = type == VK_INDEX_TYPE_UINT16 ? sizeof(uint16_t) : sizeof(uint32_t);
+    packed.resize(offset + ((nbIndices*size + 3) & ~size_t(3)), 0);
+    if (type == VK_INDEX_TYPE_UINT16) {
+        uint16_t* out = reinterpret_cast<uint16_t*>(packed.data() + offset);
+        for (uint32_t i = 0; i < nbIndices; i++)
+            out[i] = static_cast<uint16_t>(indices[i] - firstVertex); }
+    else {
+        uint32_t* out = reinterpret_cast<uint32_t*>(packed.data() + offset);
+        for (uint32_t i = 0; i < nbIndices; i++)
+            out[i] = indices[i] - firstVertex; }
+    return offset;
+}
 
-    // Create the buffers on Device and copy vertices, indices and materials
-    VkCommandBuffer    cmdBuf = createTempCmdBuffer();
+/*********************************************************************
+ * param:  model, the model whose materials are wanted
+ * param:  newTextures, as for loadTextures
+ *
+ * brief:  Adds the model's materials (and their textures) to the
+ *         scene's material table, and returns the table index of each.
+ *         The materials refer to m_objText (or virtual texture ids)
+ *         directly, so txtOffset is 0.
+ **********************************************************************/
+std::vector<int32_t> VkApp::addMaterials(const ModelView& model, bool newTextures)
+{
+    std::vector<int> textureIndex = loadTextures(model, newTextures);
+    std::vector<int32_t> materialIndex(model.nbMaterials);
+    for (uint32_t m = 0; m < model.nbMaterials; m++) {
+        Material material = model.materials[m];
+        if (material.textureId >= 0)
+            material.textureId = textureIndex[material.textureId];
+        materialIndex[m] = static_cast<int32_t>(m_materials.add(material)); }
+    printf("material table: %d entries\n", m_materials.size());
+    return materialIndex;
+}
 
+/*********************************************************************
+ * param:  filename, the model's file
+ * param:  model, the model as imported; read only until this returns
+ * param:  transforms, one for each instance of the whole model
+ * param:  objIndex, the m_objData index the model will have
+ * param:  firstDesc, the m_objDesc index its descriptions will start at
+ * param:  newTextures, as for loadTextures
+ *
+ * brief:  Creates everything of the model that goes into the scene,
+ *         leaving the scene itself alone: its textures, buffers and
+ *         lights, and the descriptions and instances to be put at
+ *         objIndex and firstDesc.  The buffers are uploaded on the
+ *         transfer queue.
+ **********************************************************************/
+ModelParts VkApp::makeModel(const std::string& filename, const ModelView& model,
+                            const std::vector<glm::mat4>& transforms,
+                            uint32_t objIndex, uint32_t firstDesc, bool newTextures)
+{
+    auto start = std::chrono::high_resolution_clock::now();
+
+    printf("Model %s\n", filename.c_str());
+    printf("vertices: %d\n", model.nbVertices);
+    printf("indices: %d (%d)\n", model.nbIndices, model.nbIndices/3);
+    printf("materials: %d\n", model.nbMaterials);
+    printf("matIndx: %d\n", model.nbMatIndx);
+    printf("textures: %zd\n", model.textures.size());
+    printf("meshes: %d, instances: %d\n", model.nbMeshes, model.nbInstances);
+
+    ModelParts parts;
+
+    // Every emissive triangle of every instance, in world space.
+    for (const auto& transform : transforms)
+        gatherLights(model, transform, m_workers, parts.lights);
+    printf("lights: %zd\n", parts.lights.size());
+
+    // The triangles' material indices are translated to the table's
+    std::vector<int32_t> materialIndex = addMaterials(model, newTextures);
+    std::vector<int32_t> matIndx(model.nbMatIndx);
+    for (uint32_t t = 0; t < model.nbMatIndx; t++)
+        matIndx[t] = materialIndex[model.matIndx[t]];
+
+    ObjData& object = parts.object;
+    object.nbIndices  = model.nbIndices;
+    object.nbVertices = model.nbVertices;
+    object.path       = filename;
+    object.transforms = transforms;
+
+    // Create the buffers on Device and copy vertices, indices and
+    // material indices on the transfer queue, along with the textures.
     VkBufferUsageFlags flag = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
         | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT;
     VkBufferUsageFlags rtFlags = flag
         | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR;
   
-    object.vertexBuffer = createStagedBufferWrap(cmdBuf, meshdata.vertices,
-                                         VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | rtFlags);
-    object.indexBuffer = createStagedBufferWrap(cmdBuf, meshdata.indices,
-                                        VK_BUFFER_USAGE_INDEX_BUFFER_BIT | rtFlags);
-    object.matColorBuffer = createStagedBufferWrap(cmdBuf, meshdata.materials, flag);
-    object.matIndexBuffer = createStagedBufferWrap(cmdBuf, meshdata.matIndx, flag);
-  
-    submitTempCmdBuffer(cmdBuf);
+    // Each mesh's indices (then those of its levels of detail) are
+    // made relative to its first vertex, in 16 bits when they fit.
+    std::vector<uint8_t> indices;
+    for (uint32_t m = 0; m < model.nbMeshes; m++) {
+        const MeshRange& range = model.meshes[m];
+        ObjMesh mesh;
+        mesh.firstIndex  = range.firstIndex;
+        mesh.nbIndices   = range.nbIndices;
+        mesh.firstVertex = range.firstVertex;
+        mesh.nbVertices  = range.nbVertices;
+        mesh.indexType   = indexTypeFor(range.nbVertices);
+        mesh.indexOffset = packIndices(indices, model.indices + range.firstIndex, range.nbIndices,
+                                       range.firstVertex, mesh.indexType);
+        mesh.descIndex   = firstDesc + m;
+        mesh.bmin        = range.bmin;
+        mesh.bmax        = range.bmax;
+        mesh.lods.assign(model.lods + range.firstLod, model.lods + range.firstLod + range.nbLods);
+        for (const auto& lod : mesh.lods)
+            mesh.lodOffsets.push_back(packIndices(indices, model.indices + lod.firstIndex,
+                                                  lod.nbIndices, range.firstVertex, mesh.indexType));
+        object.meshes.push_back(mesh); }
+    printf("index buffer: %.2f MB (%.2f MB at 32 bits)\n", indices.size()/1048576.0,
+           sizeof(uint32_t)*model.nbIndices/1048576.0);
+
+    // Vertices are copied straight from the cache mapping (or the
+    // freshly read arrays).
+    MemoryTag tag{MEM_GEOMETRY, filename};
+    object.vertexBuffer = createAsyncBufferWrap(sizeof(Vertex)*model.nbVertices, model.vertices,
+                                        VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | rtFlags, tag);
+    object.indexBuffer = createAsyncBufferWrap(indices, VK_BUFFER_USAGE_INDEX_BUFFER_BIT | rtFlags, tag);
+    object.matIndexBuffer = createAsyncBufferWrap(matIndx, flag, tag);
+    submitAsyncUploads();
+
+    auto end = std::chrono::high_resolution_clock::now();
+    printf("Model %s added in %.1f ms\n", filename.c_str(),
+           std::chrono::duration<double, std::milli>(end - start).count());
     
-    // Creates all textures on the GPU
-    auto txtOffset = static_cast<uint32_t>(m_objText.size());  // Offset is current size
-    for(const auto& texName : meshdata.textures)
-        m_objText.push_back(createTextureImage(texName));
-
-    // Assuming one instance of an object with its supplied transform.
-    // Could provide multiple transform here to make a vector of instances of this object.
-    ObjInst instance;
-    instance.transform = transform;
-    instance.objIndex  = static_cast<uint32_t>(m_objData.size()); // Index of current object
-    m_objInst.push_back(instance);
+    // One instance for each placement of a mesh within the model, for
+    // each of the model's supplied transforms.  Its node is counted
+    // from the transform's root node (the model's nodes follow it),
+    // which the caller adds to the scene graph.
+    for (const auto& transform : transforms)
+        for (uint32_t i = 0; i < model.nbInstances; i++) {
+            ObjInst instance;
+            instance.transform = transform * model.instances[i].transform;
+            instance.objIndex  = objIndex;
+            instance.meshIndex = model.instances[i].mesh;
+            instance.node      = model.nbNodes > 0 ? model.instances[i].node + 1 : 0;
+            parts.instances.push_back(instance); }
 
     // Creating information for device access
     ObjDesc desc;
-    desc.txtOffset            = txtOffset;
+    desc.txtOffset            = 0;
     desc.vertexAddress        = getBufferDeviceAddress(m_device, object.vertexBuffer.buffer);
     desc.indexAddress         = getBufferDeviceAddress(m_device, object.indexBuffer.buffer);
-    desc.materialAddress      = getBufferDeviceAddress(m_device, object.matColorBuffer.buffer);
     desc.materialIndexAddress = getBufferDeviceAddress(m_device, object.matIndexBuffer.buffer);
 
-    m_objData.emplace_back(object);
-    m_objDesc.emplace_back(desc);
-
-    // @@ At shutdown:
-    //   Destroy all textures with:  for (t:m_objText) t.destroy(m_device); (DONE)
-    // Destroy the 4 buffers containing each object's data with:
-    // for (auto& ob : m_objData) {
-    // ob.vertexBuffer.destroy(m_device); 
-    // and similar for ob.indexBuffer, ob.matColorBuffer, ob.matIndexBuffer ... } (DONE)
+    // Each mesh gets a description of its own, pointing into the
+    // shared buffers at its first vertex, index and triangle.  The
+    // shaders index these by the mesh-local gl_PrimitiveID.  Every
+    // instance of a mesh shares its description.
+    for (const ObjMesh& mesh : object.meshes) {
+        ObjDesc meshDesc = desc;
+        meshDesc.vertexAddress        += sizeof(Vertex)*mesh.firstVertex;
+        meshDesc.indexAddress         += mesh.indexOffset;
+        meshDesc.materialIndexAddress += sizeof(int32_t)*(mesh.firstIndex/3);
+        meshDesc.indexSize = mesh.indexType == VK_INDEX_TYPE_UINT16 ? 2 : 4;
+        parts.descs.push_back(meshDesc); }
+
+    return parts;
 }
 
-void ModelData::readAssimpFile(const std::string& path, const mat4& M)
+void ModelData::readAssimpFile(const std::string& path, const mat4& M, ThreadPool* pool)
 {
     printf("ReadAssimpFile File:  %s \n", path.c_str());
   
@@ -209,9 +508,8 @@ void ModelData::readAssimpFile(const std::string& path, const mat4& M)
 
     // Does the file exist?
     std::ifstream find_it(path.c_str());
-    if (find_it.fail()) {
-        std::cerr << "File not found: "  << path << std::endl;
-        exit(-1); }
+    if (find_it.fail())
+        throw std::runtime_error("failed to find model " + path + "!");
 
     // Invoke assimp to read the file.
     printf("Assimp %d.%d Reading %s\n", aiGetVersionMajor(), aiGetVersionMinor(), path.c_str());
@@ -219,18 +517,18 @@ void ModelData::readAssimpFile(const std::string& path, const mat4& M)
     const aiScene* aiscene = importer.ReadFile(path.c_str(),
                                                aiProcess_Triangulate|aiProcess_GenSmoothNormals);
     
-    if (!aiscene) {
-        printf("... Failed to read.\n");
-        exit(-1); }
+    if (!aiscene)
+        throw std::runtime_error("failed to read model " + path + ": " + importer.GetErrorString());
 
-    if (!aiscene->mRootNode) {
-        printf("Scene has no rootnode.\n");
-        exit(-1); }
+    if (!aiscene->mRootNode)
+        throw std::runtime_error("failed to read model " + path + ": it has no root node!");
 
     printf("Assimp mNumMeshes: %d\n", aiscene->mNumMeshes);
     printf("Assimp mNumMaterials: %d\n", aiscene->mNumMaterials);
     printf("Assimp mNumTextures: %d\n", aiscene->mNumTextures);
 
+    // Materials sharing an image file share its textures entry.
+    std::unordered_map<std::string, int> textureOfPath;
     for (int i=0;  i<aiscene->mNumMaterials;  i++) {
         aiMaterial* mtl = aiscene->mMaterials[i];
         aiString name;
@@ -268,28 +566,258 @@ void ModelData::readAssimpFile(const std::string& path, const mat4& M)
         if (AI_SUCCESS == mtl->GetTexture(aiTextureType_DIFFUSE, 0, &texPath)) {
             fs::path fullPath = path;
             fullPath.replace_filename(texPath.C_Str());
-            printf("Texture: %s\n", fullPath.c_str());
-            newmat.textureId = textures.size();
             auto xxx = fullPath.u8string();
-            textures.push_back(std::string(xxx));
+            auto found = textureOfPath.emplace(std::string(xxx), int(textures.size()));
+            if (found.second) {
+                printf("Texture: %s\n", fullPath.c_str());
+                textures.push_back(std::string(xxx)); }
+            newmat.textureId = found.first->second;
         }
         
         materials.push_back(newmat);
     }
     
-    recurseModelNodes(this, aiscene, aiscene->mRootNode, modelTr);
+    MeshImport meshImport;
+    meshImport.meshOfAiMesh.assign(aiscene->mNumMeshes, -2);
+    recurseModelNodes(this, meshImport, aiscene, aiscene->mRootNode, modelTr);
+    storeMeshes(this, meshImport, aiscene, pool);
+
+    instances.reserve(instances.size() + meshImport.uses.size());
+    for (const MeshInstance& use : meshImport.uses) {
+        int mesh = meshImport.meshOfAiMesh[use.mesh];
+        if (mesh >= 0)
+            instances.push_back({uint32_t(mesh), use.transform, use.node}); }
+
+    printf("Meshes: %zd stored, %zd instances, %zd nodes\n", meshes.size(), instances.size(),
+           nodes.size());
+
+}
+
+// Do two stored meshes hold the same triangles, vertices and materials?
+static bool sameMesh(const ModelData* meshdata, const MeshRange& a, const MeshRange& b)
+{
+    if (a.nbIndices != b.nbIndices || a.nbVertices != b.nbVertices)
+        return false;
+    if (memcmp(&meshdata->vertices[a.firstVertex], &meshdata->vertices[b.firstVertex],
+               a.nbVertices*sizeof(Vertex)) != 0)
+        return false;
+    if (memcmp(&meshdata->matIndx[a.firstIndex/3], &meshdata->matIndx[b.firstIndex/3],
+               (a.nbIndices/3)*sizeof(int32_t)) != 0)
+        return false;
+    for (uint32_t i=0;  i<a.nbIndices;  i++)
+        if (meshdata->indices[a.firstIndex+i]-a.firstVertex
+            != meshdata->indices[b.firstIndex+i]-b.firstVertex)
+            return false;
+    return true;
+}
+
+// The size of each used Assimp mesh's slice of the flattened arrays:
+// its vertices, and its triangles once fanned out.
+static MeshRange countMesh(const aiMesh* aimesh)
+{
+    MeshRange range;
+    range.nbVertices = aimesh->mNumVertices;
+    for (unsigned int t=0;  t<aimesh->mNumFaces;  ++t)
+        if (aimesh->mFaces[t].mNumIndices >= 3)
+            range.nbIndices += 3*(aimesh->mFaces[t].mNumIndices-2);
+    return range;
+}
+
+// Writes n vertices from Assimp's position, normal and texture
+// coordinate arrays into out, widening lo and hi to the positions.
+// A missing attribute (HAS_N, HAS_T false) is a constant instead, in a
+// loop of its own, so each loop reads only contiguous arrays.  With
+// SSE or NEON each vertex is three unaligned 16 byte loads, two
+// shuffles and two 16 byte stores; a load reads 4 bytes past its
+// aiVector3D, so the last vertex goes through the scalar tail.
+template <bool HAS_N, bool HAS_T>
+static void packVertices(Vertex* out, const aiVector3D* P, const aiVector3D* N,
+                         const aiVector3D* T, uint32_t n, vec3& lo, vec3& hi)
+{
+    uint32_t t = 0;
+#if defined(PACK_SSE) || defined(PACK_NEON)
+    static_assert(sizeof(Vertex) == 8*sizeof(float), "packVertices writes pos, nrm, texCoord");
+    static_assert(sizeof(aiVector3D) == 3*sizeof(float), "packVertices reads x, y, z");
+    if (n > 1) {
+        float l[4], h[4];
+#if defined(PACK_SSE)
+        const __m128 up = _mm_setr_ps(0.0f, 0.0f, 1.0f, 0.0f);
+        const __m128 zero = _mm_setzero_ps();
+        __m128 vlo = _mm_set1_ps( FLT_MAX);
+        __m128 vhi = _mm_set1_ps(-FLT_MAX);
+        for (; t+1 < n; ++t) {
+            __m128 p  = _mm_loadu_ps(&P[t].x);                     // px py pz -
+            __m128 nv = HAS_N ? _mm_loadu_ps(&N[t].x) : up;        // nx ny nz -
+            __m128 uv = HAS_T ? _mm_loadu_ps(&T[t].x) : zero;      // u  v  -  -
+            vlo = _mm_min_ps(vlo, p);
+            vhi = _mm_max_ps(vhi, p);
+            __m128 pzNx = _mm_shuffle_ps(p, nv, _MM_SHUFFLE(0,0,2,2));  // pz pz nx nx
+            float* o = &out[t].pos.x;
+            _mm_storeu_ps(o,   _mm_shuffle_ps(p, pzNx, _MM_SHUFFLE(2,0,1,0)));  // px py pz nx
+            _mm_storeu_ps(o+4, _mm_shuffle_ps(nv, uv, _MM_SHUFFLE(1,0,2,1))); } // ny nz u  v
+        _mm_storeu_ps(l, vlo);
+        _mm_storeu_ps(h, vhi);
+#else
+        const float32x4_t up = {0.0f, 0.0f, 1.0f, 0.0f};
+        const float32x4_t zero = vdupq_n_f32(0.0f);
+        float32x4_t vlo = vdupq_n_f32( FLT_MAX);
+        float32x4_t vhi = vdupq_n_f32(-FLT_MAX);
+        for (; t+1 < n; ++t) {
+            float32x4_t p  = vld1q_f32(&P[t].x);
+            float32x4_t nv = HAS_N ? vld1q_f32(&N[t].x) : up;
+            float32x4_t uv = HAS_T ? vld1q_f32(&T[t].x) : zero;
+            vlo = vminq_f32(vlo, p);
+            vhi = vmaxq_f32(vhi, p);
+            float* o = &out[t].pos.x;
+            vst1q_f32(o,   vsetq_lane_f32(vgetq_lane_f32(nv, 0), p, 3));                // px py pz nx
+            vst1q_f32(o+4, vcombine_f32(vget_low_f32(vextq_f32(nv, nv, 1)), vget_low_f32(uv))); } // ny nz u v
+        vst1q_f32(l, vlo);
+        vst1q_f32(h, vhi);
+#endif
+        lo = glm::min(lo, vec3(l[0], l[1], l[2]));
+        hi = glm::max(hi, vec3(h[0], h[1], h[2])); }
+#endif
+
+    for (; t < n; ++t) {
+        vec3 pos(P[t].x, P[t].y, P[t].z);
+        lo = glm::min(lo, pos);
+        hi = glm::max(hi, pos);
+        out[t] = makeVertex(pos, HAS_N ? vec3(N[t].x, N[t].y, N[t].z) : vec3(0,0,1),
+                            HAS_T ? vec2(T[t].x, T[t].y) : vec2(0,0)); }
+}
+
+// Writes an Assimp mesh, untransformed, into its slice of the
+// flattened arrays (preallocated by countMesh), sets the slice's
+// bounding box and returns a hash of its contents.  Slices do not
+// overlap, so any number of these run at once.
+static uint64_t packMesh(ModelData* meshdata, const aiMesh* aimesh, MeshRange& range)
+{
+    const aiVector3D* P = aimesh->mVertices;
+    const aiVector3D* N = aimesh->mNormals;
+    const aiVector3D* T = aimesh->mTextureCoords[0];
+    // Vertex has no tangent; aimesh->mTangents is not read
+
+    Vertex* out = &meshdata->vertices[range.firstVertex];
+    vec3 lo( FLT_MAX);
+    vec3 hi(-FLT_MAX);
+    uint32_t n = range.nbVertices;
+    if (aimesh->HasNormals() && aimesh->HasTextureCoords(0))
+        packVertices<true, true>(out, P, N, T, n, lo, hi);
+    else if (aimesh->HasNormals())
+        packVertices<true, false>(out, P, N, T, n, lo, hi);
+    else if (aimesh->HasTextureCoords(0))
+        packVertices<false, true>(out, P, N, T, n, lo, hi);
+    else
+        packVertices<false, false>(out, P, N, T, n, lo, hi);
+    range.bmin = lo;
+    range.bmax = hi;
+
+    // Fan out the faces, recording indices
+    uint32_t* idx = &meshdata->indices[range.firstIndex];
+    for (unsigned int t=0;  t<aimesh->mNumFaces;  ++t) {
+        const aiFace& aiface = aimesh->mFaces[t];
+        for (unsigned int i=2;  i<aiface.mNumIndices;  i++) {
+            *idx++ = aiface.mIndices[0]   + range.firstVertex;
+            *idx++ = aiface.mIndices[i-1] + range.firstVertex;
+            *idx++ = aiface.mIndices[i]   + range.firstVertex; } }
+    int32_t* mat = &meshdata->matIndx[range.firstIndex/3];
+    std::fill(mat, mat + range.nbIndices/3, int32_t(aimesh->mMaterialIndex));
+
+    uint64_t h = hashBytes(out, range.nbVertices*sizeof(Vertex));
+    return hashBytes(mat, (range.nbIndices/3)*sizeof(int32_t), h);
+}
 
+// Stores each Assimp mesh in meshImport.used into the flattened arrays,
+// and records in meshImport.meshOfAiMesh the index in meshdata->meshes
+// it became.  A first pass sizes every mesh's slice, so the arrays grow
+// once; the meshes are then packed at once by pool->parallelFor (the
+// caller takes part, so this is safe on one of pool's own workers, as
+// importModel is), or serially without a pool.  Last, serially and in
+// first-use order, a mesh identical to one stored before it is dropped
+// for that one, and a mesh with no triangles is dropped for -1; what
+// is kept closes ranks.
+static void storeMeshes(ModelData* meshdata, MeshImport& meshImport, const aiScene* aiscene,
+                        ThreadPool* pool)
+{
+    const std::vector<unsigned int>& used = meshImport.used;
+    std::vector<MeshRange> ranges(used.size());
+    size_t nbVertices = meshdata->vertices.size();
+    size_t nbIndices  = meshdata->indices.size();
+    for (size_t k=0;  k<used.size();  k++) {
+        ranges[k] = countMesh(aiscene->mMeshes[used[k]]);
+        ranges[k].firstVertex = uint32_t(nbVertices);
+        ranges[k].firstIndex  = uint32_t(nbIndices);
+        nbVertices += ranges[k].nbVertices;
+        nbIndices  += ranges[k].nbIndices; }
+    if (nbVertices > UINT32_MAX || nbIndices > UINT32_MAX)
+        throw std::runtime_error("failed to store meshes: too many vertices or indices!");
+    uint32_t vertexEnd = meshdata->vertices.size();
+    uint32_t indexEnd  = meshdata->indices.size();
+    meshdata->vertices.resize(nbVertices);
+    meshdata->indices.resize(nbIndices);
+    meshdata->matIndx.resize(nbIndices/3);
+
+    std::vector<uint64_t> hashes(used.size());
+    auto pack = [&](uint32_t k) {
+        hashes[k] = packMesh(meshdata, aiscene->mMeshes[used[k]], ranges[k]); };
+    if (pool)
+        pool->parallelFor(uint32_t(used.size()), pack);
+    else
+        for (uint32_t k=0;  k<used.size();  k++)
+            pack(k);
+
+    // Meshes only ever move down, onto slices already consumed, so the
+    // one looked at is still in place.
+    std::unordered_multimap<uint64_t, uint32_t> meshByHash;
+    for (size_t k=0;  k<used.size();  k++) {
+        MeshRange range = ranges[k];
+        int& stored = meshImport.meshOfAiMesh[used[k]];
+        stored = -1;
+        if (range.nbIndices == 0)
+            continue;
+
+        auto candidates = meshByHash.equal_range(hashes[k]);
+        for (auto it = candidates.first;  it != candidates.second  &&  stored < 0;  ++it)
+            if (sameMesh(meshdata, meshdata->meshes[it->second], range))
+                stored = it->second;
+        if (stored >= 0)
+            continue;
+
+        uint32_t shift = range.firstVertex - vertexEnd;
+        if (shift != 0 || range.firstIndex != indexEnd) {
+            std::copy_n(&meshdata->vertices[range.firstVertex], range.nbVertices,
+                        &meshdata->vertices[vertexEnd]);
+            for (uint32_t i=0;  i<range.nbIndices;  i++)
+                meshdata->indices[indexEnd+i] = meshdata->indices[range.firstIndex+i] - shift;
+            std::copy_n(&meshdata->matIndx[range.firstIndex/3], range.nbIndices/3,
+                        &meshdata->matIndx[indexEnd/3]);
+            range.firstVertex = vertexEnd;
+            range.firstIndex  = indexEnd; }
+        vertexEnd += range.nbVertices;
+        indexEnd  += range.nbIndices;
+
+        stored = int(meshdata->meshes.size());
+        meshdata->meshes.push_back(range);
+        meshByHash.emplace(hashes[k], uint32_t(stored)); }
+
+    meshdata->vertices.resize(vertexEnd);
+    meshdata->indices.resize(indexEnd);
+    meshdata->matIndx.resize(indexEnd/3);
 }
 
 // Recursively traverses the assimp node hierarchy, accumulating
-// modeling transformations, and creating and transforming any meshes
-// found.  Meshes comming from assimp can have associated surface
-// properties, so each mesh *copies* the current BRDF as a starting
-// point and modifies it from the assimp data structure.
+// modeling transformations.  Each node is kept in meshdata->nodes (the
+// root's transform including parentTr), and each node's use of a mesh
+// is recorded with the node's accumulated transformation; it becomes
+// an instance once the meshes are stored (see storeMeshes).  Meshes
+// comming from assimp can have associated surface properties,
+// referenced by material index.
 void recurseModelNodes(ModelData* meshdata,
+                       MeshImport& meshImport,
                        const aiScene* aiscene,
                        const aiNode* node,
                        const aiMatrix4x4& parentTr,
+                       const int32_t parentNode,
                        const int level)
 {
     // Print line with indentation to show structure of the model node hierarchy.
@@ -298,40 +826,35 @@ void recurseModelNodes(ModelData* meshdata,
 
     // Accumulating transformations while traversing down the hierarchy.
     aiMatrix4x4 childTr = parentTr*node->mTransformation;
-    aiMatrix3x3 normalTr = aiMatrix3x3(childTr); // Really should be inverse-transpose for full generality
+
+    // aiMatrix4x4 is row-major; glm is column-major
+    mat4 transform(childTr.a1, childTr.b1, childTr.c1, childTr.d1,
+                   childTr.a2, childTr.b2, childTr.c2, childTr.d2,
+                   childTr.a3, childTr.b3, childTr.c3, childTr.d3,
+                   childTr.a4, childTr.b4, childTr.c4, childTr.d4);
+
+    // The root is placed in model space, the others in their parent
+    const aiMatrix4x4& localTr = parentNode < 0 ? childTr : node->mTransformation;
+    int32_t nodeIndex = int32_t(meshdata->nodes.size());
+    meshdata->nodes.push_back({parentNode, mat4(localTr.a1, localTr.b1, localTr.c1, localTr.d1,
+                                                localTr.a2, localTr.b2, localTr.c2, localTr.d2,
+                                                localTr.a3, localTr.b3, localTr.c3, localTr.d3,
+                                                localTr.a4, localTr.b4, localTr.c4, localTr.d4)});
      
     // Loop through this node's meshes
     for (unsigned int m=0;  m<node->mNumMeshes; ++m) {
-        aiMesh* aimesh = aiscene->mMeshes[node->mMeshes[m]];
+        unsigned int aiIndex = node->mMeshes[m];
         //printf("  %d: %d:%d\n", m, aimesh->mNumVertices, aimesh->mNumFaces);
 
-        // Loop through all vertices and record the
-        // vertex/normal/texture/tangent data with the node's model
-        // transformation applied.
-        uint faceOffset = meshdata->vertices.size();
-        for (unsigned int t=0;  t<aimesh->mNumVertices;  ++t) {
-            aiVector3D aipnt = childTr*aimesh->mVertices[t];
-            aiVector3D ainrm = aimesh->HasNormals() ? normalTr*aimesh->mNormals[t] : aiVector3D(0,0,1);
-            aiVector3D aitex = aimesh->HasTextureCoords(0) ? aimesh->mTextureCoords[0][t] : aiVector3D(0,0,0);
-            aiVector3D aitan = aimesh->HasTangentsAndBitangents() ? normalTr*aimesh->mTangents[t] :  aiVector3D(1,0,0);
-
-
-            meshdata->vertices.push_back({{aipnt.x, aipnt.y, aipnt.z},
-                                          {ainrm.x, ainrm.y, ainrm.z},
-                                          {aitex.x, aitex.y}});
-        }
-        
-        // Loop through all faces, recording indices
-        for (unsigned int t=0;  t<aimesh->mNumFaces;  ++t) {
-            aiFace* aiface = &aimesh->mFaces[t];
-            for (int i=2;  i<aiface->mNumIndices;  i++) {
-                meshdata->matIndx.push_back(aimesh->mMaterialIndex);
-                meshdata->indices.push_back(aiface->mIndices[0]+faceOffset);
-                meshdata->indices.push_back(aiface->mIndices[i-1]+faceOffset);
-                meshdata->indices.push_back(aiface->mIndices[i]+faceOffset); } }; }
+        // Each mesh is stored once, in the order first used.
+        if (meshImport.meshOfAiMesh[aiIndex] == -2) {
+            meshImport.meshOfAiMesh[aiIndex] = -1;
+            meshImport.used.push_back(aiIndex); }
+        meshImport.uses.push_back({aiIndex, transform, uint32_t(nodeIndex)}); }
 
 
     // Recurse onto this node's children
     for (unsigned int i=0;  i<node->mNumChildren;  ++i)
-        recurseModelNodes(meshdata, aiscene, node->mChildren[i], childTr, level+1);
+        recurseModelNodes(meshdata, meshImport, aiscene, node->mChildren[i], childTr, nodeIndex,
+                          level+1);
 }
@@ -31,34 +31,35 @@ using namespace glm;
  **********************************************************************/
 void VkApp::createRtBuffers()
 {
-    // Note: This will grow to create more than the single buffer m_rtColCurrBuffer.
-    m_rtColCurrBuffer = createBufferImage(m_windowSize);
-    transitionImageLayout(m_rtColCurrBuffer.image, VK_FORMAT_R32G32B32A32_SFLOAT,
+    // Only the accumulated color needs full floats; the surface
+    // stores use the packed G-buffer formats of shared_structs.h.
+    m_rtColCurrBuffer = createBufferImage(m_windowSize, VK_FORMAT_R32G32B32A32_SFLOAT, "ray trace color");
+    transitionImageLayout(m_rtColCurrBuffer.image, m_rtColCurrBuffer.format,
                           VK_IMAGE_LAYOUT_UNDEFINED,
                           VK_IMAGE_LAYOUT_GENERAL, 1);
 
-    m_rtColPrevBuffer = createBufferImage(m_windowSize);
-    transitionImageLayout(m_rtColPrevBuffer.image, VK_FORMAT_R32G32B32A32_SFLOAT,
+    m_rtColPrevBuffer = createBufferImage(m_windowSize, VK_FORMAT_R32G32B32A32_SFLOAT, "ray trace color history");
+    transitionImageLayout(m_rtColPrevBuffer.image, m_rtColPrevBuffer.format,
       VK_IMAGE_LAYOUT_UNDEFINED,
       VK_IMAGE_LAYOUT_GENERAL, 1);
 
-    m_rtKdCurrBuffer = createBufferImage(m_windowSize);
-    transitionImageLayout(m_rtKdCurrBuffer.image, VK_FORMAT_R32G32B32A32_SFLOAT,
+    m_rtKdCurrBuffer = createBufferImage(m_windowSize, GBUFFER_KD_FORMAT, "ray trace kd");
+    transitionImageLayout(m_rtKdCurrBuffer.image, m_rtKdCurrBuffer.format,
       VK_IMAGE_LAYOUT_UNDEFINED,
       VK_IMAGE_LAYOUT_GENERAL, 1);
 
-    m_rtKdPrevBuffer = createBufferImage(m_windowSize);
-    transitionImageLayout(m_rtKdPrevBuffer.image, VK_FORMAT_R32G32B32A32_SFLOAT,
+    m_rtKdPrevBuffer = createBufferImage(m_windowSize, GBUFFER_KD_FORMAT, "ray trace kd history");
+    transitionImageLayout(m_rtKdPrevBuffer.image, m_rtKdPrevBuffer.format,
       VK_IMAGE_LAYOUT_UNDEFINED,
       VK_IMAGE_LAYOUT_GENERAL, 1);
 
-    m_rtNdCurrBuffer = createBufferImage(m_windowSize);
-    transitionImageLayout(m_rtNdCurrBuffer.image, VK_FORMAT_R32G32B32A32_SFLOAT,
+    m_rtNdCurrBuffer = createBufferImage(m_windowSize, GBUFFER_ND_FORMAT, "ray trace nd");
+    transitionImageLayout(m_rtNdCurrBuffer.image, m_rtNdCurrBuffer.format,
       VK_IMAGE_LAYOUT_UNDEFINED,
       VK_IMAGE_LAYOUT_GENERAL, 1);
 
-    m_rtNdPrevBuffer = createBufferImage(m_windowSize);
-    transitionImageLayout(m_rtNdPrevBuffer.image, VK_FORMAT_R32G32B32A32_SFLOAT,
+    m_rtNdPrevBuffer = createBufferImage(m_windowSize, GBUFFER_ND_FORMAT, "ray trace nd history");
+    transitionImageLayout(m_rtNdPrevBuffer.image, m_rtNdPrevBuffer.format,
       VK_IMAGE_LAYOUT_UNDEFINED,
       VK_IMAGE_LAYOUT_GENERAL, 1);
 
@@ -72,10 +73,11 @@ void VkApp::createRtBuffers()
  **********************************************************************/
 void VkApp::initRayTracing()
 {
-    m_pcRay.exposure = 2.0;
+    m_pcRay.exposure = m_scene.exposure;
     m_pcRay.accumulate = true;
     m_pcRay.BRDF = false;
     m_pcRay.history = false;
+    m_pcRay.explicitLight = true;
 
     // depth and normal thresholds for calculating selective weights (HERE FOR IMGUI USE)
     m_pcRay.dThresh = 0.15f;
@@ -105,6 +107,27 @@ void VkApp::initRayTracing()
     // m_rtBuilder.destroy();
 }
 
+/*********************************************************************
+ *
+ *
+ * brief:  Creates a pool of two timestamp queries, written on either
+ *         side of vkCmdTraceRaysKHR to measure the trace time.
+ **********************************************************************/
+void VkApp::createTimestampQueries()
+{
+    VkPhysicalDeviceProperties props;
+    vkGetPhysicalDeviceProperties(m_physicalDevice, &props);
+    m_timestampPeriod = props.limits.timestampPeriod;
+
+    VkQueryPoolCreateInfo qpci{VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO};
+    qpci.queryType  = VK_QUERY_TYPE_TIMESTAMP;
+    qpci.queryCount = 2;
+    if (vkCreateQueryPool(m_device, &qpci, nullptr, &m_timestampPool) != VK_SUCCESS)
+        throw std::runtime_error("failed to create timestamp query pool!");
+
+    // @@ To destroy:  vkDestroyQueryPool(m_device, m_timestampPool, nullptr); (DONE)
+}
+
 /*********************************************************************
  *
  *
@@ -126,19 +149,32 @@ void VkApp::createRtDescriptorSet()
           {5, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1,  // Nd image
             VK_SHADER_STAGE_RAYGEN_BIT_KHR},
           {6, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1,  // Prev Nd image
+            VK_SHADER_STAGE_RAYGEN_BIT_KHR},
+          {7, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1,  // Light table
             VK_SHADER_STAGE_RAYGEN_BIT_KHR}
-    });
+    }, 2);  // One set per parity (see swapRtBuffers)
     
 
     // Note: This will grow to include more buffers.
 
     m_rtDesc.write(m_device, 0, m_rtBuilder.getAccelerationStructure());
-    m_rtDesc.write(m_device, 1, m_rtColCurrBuffer.Descriptor());
-    m_rtDesc.write(m_device, 2, m_rtColPrevBuffer.Descriptor());
-    m_rtDesc.write(m_device, 3, m_rtKdCurrBuffer.Descriptor());
-    m_rtDesc.write(m_device, 4, m_rtKdPrevBuffer.Descriptor());
-    m_rtDesc.write(m_device, 5, m_rtNdCurrBuffer.Descriptor());
-    m_rtDesc.write(m_device, 6, m_rtNdPrevBuffer.Descriptor());
+    m_rtDesc.write(m_device, 7, m_lightBuff.buffer);
+
+    // Set 1 has the Curr and Prev images the other way around
+    for (int set = 0; set < 2; set++) {
+        ImageWrap* col[2] = {&m_rtColCurrBuffer, &m_rtColPrevBuffer};
+        ImageWrap* kd[2]  = {&m_rtKdCurrBuffer, &m_rtKdPrevBuffer};
+        ImageWrap* nd[2]  = {&m_rtNdCurrBuffer, &m_rtNdPrevBuffer};
+        m_rtDesc.write(m_device, 1, col[set]->Descriptor(), set);
+        m_rtDesc.write(m_device, 2, col[1-set]->Descriptor(), set);
+        m_rtDesc.write(m_device, 3, kd[set]->Descriptor(), set);
+        m_rtDesc.write(m_device, 4, kd[1-set]->Descriptor(), set);
+        m_rtDesc.write(m_device, 5, nd[set]->Descriptor(), set);
+        m_rtDesc.write(m_device, 6, nd[1-set]->Descriptor(), set); }
+
+    // The post pass shows colCurr itself when not denoising
+    m_postDesc.write(m_device, 0, m_rtColCurrBuffer.Descriptor(), 1);
+    m_postDesc.write(m_device, 0, m_rtColPrevBuffer.Descriptor(), 2);
 
 
     // m_rtDesc needs to be destroyed
@@ -192,6 +228,16 @@ void VkApp::createRtPipeline()
     groups.push_back(group);
     group.generalShader    = VK_SHADER_UNUSED_KHR;
     
+    // Shadow miss shader (missIndex 1) for explicit light connections
+    stage.module = createShaderModule(loadFile("spv/raytraceShadow.rmiss.spv"));
+    stage.stage = VK_SHADER_STAGE_MISS_BIT_KHR;
+    stages.push_back(stage);
+    
+    group.type          = VK_RAY_TRACING_SHADER_GROUP_TYPE_GENERAL_KHR;
+    group.generalShader = stages.size()-1;    // Index of shadow miss shader
+    groups.push_back(group);
+    group.generalShader    = VK_SHADER_UNUSED_KHR;
+    
     // Closest hit shader stage and group appended to stages and groups lists
     stage.module = createShaderModule(loadFile("spv/raytrace.rchit.spv"));
     stage.stage = VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR;
@@ -261,7 +307,7 @@ constexpr integral align_up(integral x, size_t a) noexcept
  **********************************************************************/
 void VkApp::createRtShaderBindingTable()
 {
-    uint32_t missCount{1};
+    uint32_t missCount{2};
     uint32_t hitCount{1};
 
     uint32_t handleCount = 1 + missCount + hitCount;
@@ -302,18 +348,17 @@ void VkApp::createRtShaderBindingTable()
                                                        0, handleCount, dataSize, handles.data());
     assert(result == VK_SUCCESS);
 
-    // Allocate a buffer for storing the SBT, and a staging buffer for transferring data to it.
+    // Allocate a buffer for storing the SBT, and staging memory for transferring data to it.
     VkDeviceSize sbtSize = m_rgenRegion.size + m_missRegion.size
         + m_hitRegion.size + m_callRegion.size;
     
-    BufferWrap staging = createBufferWrap(sbtSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-                                      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
-                                      | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+    UploadContext::Staging staging = m_upload.alloc(sbtSize);
     m_shaderBindingTableBW = createBufferWrap(sbtSize,
                                   VK_BUFFER_USAGE_TRANSFER_DST_BIT
                                   | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT
                                   | VK_BUFFER_USAGE_SHADER_BINDING_TABLE_BIT_KHR,
-                                  VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+                                  VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                                  {MEM_OTHER, "shader binding table"});
 
     // Find the SBT addresses of each group
     VkBufferDeviceAddressInfo info = {VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO};
@@ -327,9 +372,8 @@ void VkApp::createRtShaderBindingTable()
     // Helper to retrieve the handle data
     auto getHandle = [&](int i) { return handles.data() + i * handleSize; };
 
-    // Map the SBT buffer and write in the handles.
-    uint8_t* mappedMemAddress;
-    vkMapMemory(m_device, staging.memory, 0, sbtSize, 0, (void**)&mappedMemAddress);
+    // Write the handles into the (already mapped) staging memory.
+    uint8_t* mappedMemAddress = static_cast<uint8_t*>(staging.data);
     uint8_t offset = 0;
 
     // Raygen
@@ -348,11 +392,10 @@ void VkApp::createRtShaderBindingTable()
         memcpy(mappedMemAddress+offset, getHandle(handleIdx++), handleSize);
         offset += m_hitRegion.stride; }
 
-    vkUnmapMemory(m_device, staging.memory);
-    
-    copyBuffer(staging.buffer, m_shaderBindingTableBW.buffer, sbtSize);
-
-    staging.destroy(m_device);
+    VkBufferCopy copyRegion{};
+    copyRegion.srcOffset = staging.offset;
+    copyRegion.size = sbtSize;
+    vkCmdCopyBuffer(m_upload.cmdBuf(), staging.buffer, m_shaderBindingTableBW.buffer, 1, &copyRegion);
 
     // @@ destroy acceleration structure with m_shaderBindingTableBW.destroy(m_device); (DONE)
 }
@@ -373,10 +416,23 @@ void VkApp::CmdCopyImage(ImageWrap& src, ImageWrap& dst)
     imageLayoutBarrier(m_commandBuffer, dst.image,
                        VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
     
-    vkCmdCopyImage(m_commandBuffer,
-                   src.image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-                   dst.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-                   1, &imageCopyRegion);
+    if (src.format == dst.format) {
+        vkCmdCopyImage(m_commandBuffer,
+                       src.image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                       dst.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                       1, &imageCopyRegion); }
+    else {
+        // A blit converts between formats (the rgba32f accumulation
+        // buffer into the rgba16f scanline image)
+        VkImageBlit blitRegion{};
+        blitRegion.srcSubresource = imageCopyRegion.srcSubresource;
+        blitRegion.dstSubresource = imageCopyRegion.dstSubresource;
+        blitRegion.srcOffsets[1] = {int32_t(m_windowSize.width), int32_t(m_windowSize.height), 1};
+        blitRegion.dstOffsets[1] = blitRegion.srcOffsets[1];
+        vkCmdBlitImage(m_commandBuffer,
+                       src.image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                       dst.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                       1, &blitRegion, VK_FILTER_NEAREST); }
     
     imageLayoutBarrier(m_commandBuffer, src.image,
                        VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_IMAGE_LAYOUT_GENERAL);
@@ -387,6 +443,8 @@ void VkApp::CmdCopyImage(ImageWrap& src, ImageWrap& dst)
 
 void VkApp::raytrace()
 {
+    swapRtBuffers();
+
     // Determine frame specific random number
     m_pcRay.frameSeed = rand() % 32768;
 
@@ -410,11 +468,11 @@ void VkApp::raytrace()
 
     // Bind the descriptor sets (the ray tracing specific one, and the
     // full model descriptor)
-    std::vector<VkDescriptorSet> descSets{m_rtDesc.descSet, m_scDesc.descSet};
+    std::vector<VkDescriptorSet> descSets{m_rtDesc.descSets[m_rtParity], m_scDesc.descSet};
     vkCmdBindDescriptorSets(m_commandBuffer, VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR,
                             m_rtPipelineLayout, 0,
                             descSets.size(), descSets.data(),
-                            0, nullptr);
+                            1, &m_matrixOffset);  // m_scDesc's eMatrices
 
     // Push the push constants
     vkCmdPushConstants(m_commandBuffer, m_rtPipelineLayout,
@@ -424,23 +482,52 @@ void VkApp::raytrace()
                        0, sizeof(PushConstantRay), &m_pcRay);
     m_pcRay.clear = false;  // Allow accumulation after at least one path tracing pass.
 
+    // The previous frame has completed (prepareFrame waited on its
+    // fence), so its timestamps are available without waiting.
+    if (m_timestampsWritten) {
+        uint64_t ticks[2];
+        if (vkGetQueryPoolResults(m_device, m_timestampPool, 0, 2, sizeof(ticks), ticks,
+                                  sizeof(uint64_t), VK_QUERY_RESULT_64_BIT) == VK_SUCCESS)
+            m_traceTimeMs = double(ticks[1] - ticks[0]) * m_timestampPeriod / 1.0e6; }
+
+    vkCmdResetQueryPool(m_commandBuffer, m_timestampPool, 0, 2);
+    vkCmdWriteTimestamp(m_commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, m_timestampPool, 0);
+
     // This dispatches the ray generation shader for each pixel on screen.
     vkCmdTraceRaysKHR(m_commandBuffer, &m_rgenRegion, &m_missRegion, &m_hitRegion,
                       &m_callRegion, m_windowSize.width, m_windowSize.height, 1);
 
-    
-    // Copy the ray tracer output image to the scanline output image
-    // -- because we already have the operations needed to display
-    // that image on the screen.
-    CmdCopyImage(m_rtColCurrBuffer, m_scImageBuffer);
+    vkCmdWriteTimestamp(m_commandBuffer, VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,
+                        m_timestampPool, 1);
+    m_timestampsWritten = true;
 
 
+    // Nothing is copied: postProcess samples colCurr, or the denoiser
+    // reads it (and kdCurr and ndCurr) in place, and next frame's
+    // swapRtBuffers makes these Curr buffers the Prev ones.
+    VkMemoryBarrier barrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER};
+    barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    vkCmdPipelineBarrier(m_commandBuffer, VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                         0, 1, &barrier, 0, nullptr, 0, nullptr);
 
     if (m_pcRay.accumulate) frameCount++;
+}
 
-    // @@ History and Denoising: The three Curr buffers need copying to the Prev buffers.
-    CmdCopyImage(m_rtColCurrBuffer, m_rtColPrevBuffer);
-    CmdCopyImage(m_rtKdCurrBuffer, m_rtKdPrevBuffer);
-    CmdCopyImage(m_rtNdCurrBuffer, m_rtNdPrevBuffer);
+/*********************************************************************
+ *
+ *
+ * brief:  Last frame's Curr buffers become this frame's Prev ones
+ *         (the history), and its Prev buffers are overwritten as the
+ *         new Curr ones.  The rgen shader writes every Curr texel, so
+ *         what they held does not matter.
+ **********************************************************************/
+void VkApp::swapRtBuffers()
+{
+    std::swap(m_rtColCurrBuffer, m_rtColPrevBuffer);
+    std::swap(m_rtKdCurrBuffer, m_rtKdPrevBuffer);
+    std::swap(m_rtNdCurrBuffer, m_rtNdPrevBuffer);
+    m_rtParity ^= 1;
 }
 
@@ -0,0 +1,203 @@
+//////////////////////////////////////////////////////////////////////
+// Hot reloading of models and textures.  m_watcher watches every file
+// loaded; when one changes, it is read again on the worker threads
+// while frames go on, then swapped in between two frames.  Only what
+// was made from that file is replaced: a model's buffers, ObjDescs,
+// lights, materials and BLASes (after which the TLAS is refit), or a
+// texture's image.  Pipelines, descriptor layouts and everything else
+// stay.
+////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+
+#include "vkapp.h"
+#include "app.h"
+#include "model_cache.h"
+
+// Replaces v[first, first+count) with the contents of with.
+template <typename T>
+static void replaceRange(std::vector<T>& v, size_t first, size_t count, const std::vector<T>& with)
+{
+    v.erase(v.begin() + first, v.begin() + first + count);
+    v.insert(v.begin() + first, with.begin(), with.end());
+}
+
+/*********************************************************************
+ *
+ *
+ * brief:  Called between frames (the last one is done; see
+ *         prepareFrame).  Starts reading the files that changed, and
+ *         swaps in whatever has been read.  Never waits on the reads.
+ **********************************************************************/
+void VkApp::pollAssetChanges()
+{
+    for (const std::string& path : m_watcher.changed()) {
+        for (uint32_t i = 0; i < m_objData.size(); i++)
+            if (m_objData[i].path == path) {
+                printf("Reloading model %s\n", path.c_str());
+                m_modelReloads.emplace_back(i, m_workers.submit([this, path] {
+                    return std::shared_ptr<ImportedModel>(importModel(path, m_workers)); })); }
+
+        if (m_textureByPath.count(path)) {
+            printf("Reloading texture %s\n", path.c_str());
+            m_textureReloads.emplace_back(path, m_workers.submit([this, path] {
+                return m_textureCache.load(path); })); } }
+
+    // Whatever has been read, in the order it was asked for.  A file
+    // that fails to read (say, saved half done) keeps its old version.
+    for (size_t i = 0; i < m_modelReloads.size(); ) {
+        auto& reload = m_modelReloads[i];
+        if (!isReady(reload.second)) {
+            i++;
+            continue; }
+        try {
+            std::shared_ptr<ImportedModel> imported = reload.second.get();
+            reloadModel(reload.first, imported->model); }
+        catch (const std::exception& e) {
+            printf("Reload failed; keeping the old model: %s\n", e.what()); }
+        m_modelReloads.erase(m_modelReloads.begin() + i); }
+
+    for (size_t i = 0; i < m_textureReloads.size(); ) {
+        auto& reload = m_textureReloads[i];
+        if (!isReady(reload.second)) {
+            i++;
+            continue; }
+        try {
+            TextureData texture = reload.second.get();
+            reloadTexture(reload.first, texture); }
+        catch (const std::exception& e) {
+            printf("Reload failed; keeping the old texture: %s\n", e.what()); }
+        m_textureReloads.erase(m_textureReloads.begin() + i); }
+}
+
+/*********************************************************************
+ * param:  objIndex, the m_objData entry the model file was loaded into
+ * param:  model, the file as read again
+ *
+ * brief:  Replaces one model with a new version of itself, with the
+ *         same instance transforms.  Its meshes and instances may come
+ *         and go; those of later models shift to make room.  Textures
+ *         it did not use before are left out (the shaders' texture
+ *         array can not grow without new pipelines).
+ **********************************************************************/
+void VkApp::reloadModel(uint32_t objIndex, const ModelView& model)
+{
+    auto start = std::chrono::high_resolution_clock::now();
+    ObjData& old = m_objData[objIndex];
+
+    // Descriptions and instances are both kept in object order
+    uint32_t firstDesc = 0;
+    for (uint32_t i = 0; i < objIndex; i++)
+        firstDesc += static_cast<uint32_t>(m_objData[i].meshes.size());
+    auto firstInst = std::find_if(m_objInst.begin(), m_objInst.end(),
+                                  [objIndex](const ObjInst& inst) { return inst.objIndex >= objIndex; });
+    auto endInst = std::find_if(firstInst, m_objInst.end(),
+                                [objIndex](const ObjInst& inst) { return inst.objIndex > objIndex; });
+
+    ModelParts parts = makeModel(old.path, model, old.transforms, objIndex, firstDesc, false);
+
+    // The new nodes go below the same roots, so a moved placement
+    // stays where it was moved to (from the next frame on).  Nodes
+    // past the old ones shift.
+    parts.object.nodes = old.nodes;
+    for (size_t p = 0; p < parts.object.nodes.size(); p++) {
+        uint32_t root   = parts.object.nodes[p];
+        uint32_t oldEnd = m_sceneGraph.end(root);
+        int32_t  shift  = m_sceneGraph.setChildren(root, model.nodes, model.nbNodes);
+        for (ObjInst& inst : m_objInst)
+            if (inst.node >= oldEnd)
+                inst.node += shift;
+        for (auto& obj : m_objData)
+            for (uint32_t& node : obj.nodes)
+                if (node >= oldEnd)
+                    node += shift;
+        for (uint32_t& node : parts.object.nodes)
+            if (node >= oldEnd)
+                node += shift;
+        for (uint32_t i = 0; i < model.nbInstances; i++)
+            parts.instances[p*model.nbInstances + i].node += root; }
+    m_nodeInstances.clear();
+    // The BLAS builds read the new buffers; have them acquired first
+    acquireAsyncUploads(m_upload.cmdBuf(), true);
+
+    ObjData& object = parts.object;
+    object.firstLight = old.firstLight;
+    object.nbLights   = static_cast<uint32_t>(parts.lights.size());
+    replaceRange(m_lightList, old.firstLight, old.nbLights, parts.lights);
+    replaceRange(m_objDesc, firstDesc, old.meshes.size(), parts.descs);
+    replaceRange(m_objInst, firstInst - m_objInst.begin(), endInst - firstInst, parts.instances);
+    int32_t lightShift = static_cast<int32_t>(object.nbLights) - static_cast<int32_t>(old.nbLights);
+    int32_t descShift  = static_cast<int32_t>(object.meshes.size()) - static_cast<int32_t>(old.meshes.size());
+    for (uint32_t i = objIndex + 1; i < m_objData.size(); i++) {
+        m_objData[i].firstLight += lightShift;
+        for (auto& mesh : m_objData[i].meshes)
+            mesh.descIndex += descShift; }
+
+    // The last frame to use the old buffers is done
+    std::vector<uint32_t> oldBlas;
+    if (m_splitBlas)
+        for (const auto& mesh : old.meshes)
+            oldBlas.push_back(mesh.blasIndex);
+    else
+        oldBlas.push_back(old.blasIndex);
+    old.vertexBuffer.destroy(m_device);
+    old.indexBuffer.destroy(m_device);
+    old.matIndexBuffer.destroy(m_device);
+    old = std::move(object);
+
+    rebuildModelAS({objIndex}, oldBlas);
+
+    // These cover every model, but are small: simply made again
+    m_objDescriptionBW.destroy(m_device);
+    m_instDescriptionBW.destroy(m_device);
+    m_lightBuff.destroy(m_device);
+    m_materialBW.destroy(m_device);
+    m_materialColdBW.destroy(m_device);
+    createObjDescriptionBuffer();
+    createLightBuffer();
+    createMaterialBuffers();
+    m_scDesc.write(m_device, ScBindings::eObjDescs, m_objDescriptionBW.buffer);
+    m_scDesc.write(m_device, ScBindings::eInstDescs, m_instDescriptionBW.buffer);
+    m_scDesc.write(m_device, ScBindings::eMaterials, m_materialBW.buffer);
+    m_scDesc.write(m_device, ScBindings::eMaterialsCold, m_materialColdBW.buffer);
+    m_rtDesc.write(m_device, 7, m_lightBuff.buffer);
+
+    app->myCamera.modified = true;  // Restart accumulation
+    auto end = std::chrono::high_resolution_clock::now();
+    printf("Model %s reloaded in %.1f ms\n", m_objData[objIndex].path.c_str(),
+           std::chrono::duration<double, std::milli>(end - start).count());
+}
+
+/*********************************************************************
+ * param:  path, the texture file that changed
+ * param:  texture, its new contents, from m_textureCache
+ *
+ * brief:  Replaces the texture's image in place; the materials keep
+ *         referring to the same m_objText slot.  Files whose contents
+ *         were identical shared that slot, and so change along.
+ **********************************************************************/
+void VkApp::reloadTexture(const std::string& path, const TextureData& texture)
+{
+#ifdef VIRTUAL_TEXTURES
+    printf("Texture %s not reloaded; virtual textures need a restart\n", path.c_str());
+#else
+    uint32_t slot = m_textureByPath.at(path);
+    m_objText[slot].destroy(m_device);  // The last frame to use it is done
+    m_objText[slot] = createAsyncTextureImage(texture, path);
+    submitAsyncUploads();
+    acquireAsyncUploads(m_upload.cmdBuf(), true);  // Ahead of the next frame
+
+    for (auto it = m_textureByHash.begin(); it != m_textureByHash.end(); )
+        if (it->second == slot)
+            it = m_textureByHash.erase(it);
+        else
+            ++it;
+    m_textureByHash.emplace(texture.hash, slot);
+    m_scDesc.write(m_device, ScBindings::eTextures, m_objText);
+
+    app->myCamera.modified = true;  // Restart accumulation
+    printf("Texture %s reloaded\n", path.c_str());
+#endif
+}
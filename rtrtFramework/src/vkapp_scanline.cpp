@@ -28,6 +28,7 @@ using namespace glm;
 
 #include "app.h"
 #include "shaders/shared_structs.h"
+#include "light_table.h"
 
 VkAccessFlags accessFlagsForImageLayout(VkImageLayout layout)
 {
@@ -106,171 +107,86 @@ void VkApp::imageLayoutBarrier(VkCommandBuffer cmdbuffer,
 
 ImageWrap VkApp::createTextureImage(std::string fileName)
 {
-    for (int i=0;  i<fileName.size();  i++)
-        if (fileName[i] == '\\') fileName[i] = '/';
-    
-    //VkImage& textureImage, VkDeviceMemory& textureImageMemory
-    int texWidth, texHeight, texChannels;
-
     stbi_set_flip_vertically_on_load(true);
-    stbi_uc* pixels = stbi_load(fileName.c_str(), &texWidth, &texHeight, &texChannels,
-                                STBI_rgb_alpha);
-    VkDeviceSize imageSize = texWidth * texHeight * 4;
-
-    if (!pixels) {
-        throw std::runtime_error("failed to load texture image!");
-    }
-
-    BufferWrap staging = createBufferWrap(imageSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-                                      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
-                                      | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
-
-    void* data;
-    vkMapMemory(m_device, staging.memory, 0, imageSize, 0, &data);
-    memcpy(data, pixels, static_cast<size_t>(imageSize));
-    vkUnmapMemory(m_device, staging.memory);
+    return createTextureImage(m_textureCache.load(fileName), fileName);
+}
 
-    stbi_image_free(pixels);
+/*********************************************************************
+ * param:  texture, a mip chain from m_textureCache.load
+ * param:  owner, names it in the memory report
+ *
+ * brief:  Uploads every level of a (usually block compressed) mip
+ *         chain straight into a sampled GPU image.  Nothing is
+ *         generated on the GPU; all levels go in a single copy,
+ *         batched by m_upload with whatever else is being uploaded.
+ **********************************************************************/
+ImageWrap VkApp::createTextureImage(const TextureData& texture, const std::string& owner)
+{
+    VkFormat format = static_cast<VkFormat>(texture.format);
+    uint32_t mipLevels = static_cast<uint32_t>(texture.levels.size());
 
-    uint mipLevels = std::floor(std::log2(std::max(texWidth, texHeight))) + 1;
-    
-    ImageWrap myImage = createImageWrap(texWidth, texHeight, VK_FORMAT_R8G8B8A8_UNORM,
+    ImageWrap myImage = createImageWrap(texture.width, texture.height, format,
                                   VK_IMAGE_USAGE_TRANSFER_DST_BIT
-                                  | VK_IMAGE_USAGE_SAMPLED_BIT
-                                  | VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+                                  | VK_IMAGE_USAGE_SAMPLED_BIT,
                                   VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-                                  mipLevels);
-
-    transitionImageLayout(myImage.image, VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_LAYOUT_UNDEFINED,
-                          VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, mipLevels);
-
-    copyBufferToImage(staging.buffer, myImage.image, static_cast<uint32_t>(texWidth),
-                      static_cast<uint32_t>(texHeight));
-
-    staging.destroy(m_device);
-
-    generateMipmaps(myImage.image, VK_FORMAT_R8G8B8A8_UNORM, texWidth, texHeight, mipLevels);
-    
-    myImage.imageView = createImageView(myImage.image, VK_FORMAT_R8G8B8A8_UNORM);
+                                  mipLevels, {MEM_TEXTURE, owner});
+
+    std::vector<VkBufferImageCopy> regions(mipLevels);
+    for (uint32_t i = 0; i < mipLevels; i++) {
+        const TextureLevel& level = texture.levels[i];
+        VkBufferImageCopy& region = regions[i];
+        region = {};
+        region.bufferOffset = level.offset;
+        region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        region.imageSubresource.mipLevel = i;
+        region.imageSubresource.baseArrayLayer = 0;
+        region.imageSubresource.layerCount = 1;
+        region.imageOffset = {0, 0, 0};
+        region.imageExtent = {level.width, level.height, 1}; }
+
+    // copyToImage may start a new batch, hence the second m_upload.cmdBuf()
+    imageLayoutBarrier(m_upload.cmdBuf(), myImage.image,
+                       VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+    m_upload.copyToImage(texture.data.data(), texture.data.size(), myImage.image, regions);
+    imageLayoutBarrier(m_upload.cmdBuf(), myImage.image,
+                       VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+
+    myImage.imageView = createImageView(myImage.image, format, VK_IMAGE_ASPECT_COLOR_BIT, mipLevels);
     myImage.sampler = createTextureSampler();
     myImage.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
     return myImage;
 }
 
-void VkApp::generateMipmaps(VkImage image, VkFormat imageFormat,
-                            int32_t texWidth, int32_t texHeight, uint32_t mipLevels)
-{
-    // Check if image format supports linear blitting
-    VkFormatProperties formatProperties;
-    vkGetPhysicalDeviceFormatProperties(m_physicalDevice, imageFormat, &formatProperties);
-    
-    if (!(formatProperties.optimalTilingFeatures & VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT)) {
-        throw std::runtime_error("texture image format does not support linear blitting!");
-    }
-
-    VkCommandBuffer commandBuffer = createTempCmdBuffer();
-
-    VkImageMemoryBarrier barrier{VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER};
-    barrier.image = image;
-    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-    barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    barrier.subresourceRange.baseArrayLayer = 0;
-    barrier.subresourceRange.layerCount = 1;
-    barrier.subresourceRange.levelCount = 1;
-
-    int32_t mipWidth = texWidth;
-    int32_t mipHeight = texHeight;
-
-    for (uint32_t i = 1; i < mipLevels; i++) {
-        barrier.subresourceRange.baseMipLevel = i - 1;
-        barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-        barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
-        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-        barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
-
-        vkCmdPipelineBarrier(commandBuffer,
-                             VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
-                             0, nullptr,
-                             0, nullptr,
-                             1, &barrier);
-
-        VkImageBlit blit{};
-        blit.srcOffsets[0] = {0, 0, 0};
-        blit.srcOffsets[1] = {mipWidth, mipHeight, 1};
-        blit.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-        blit.srcSubresource.mipLevel = i - 1;
-        blit.srcSubresource.baseArrayLayer = 0;
-        blit.srcSubresource.layerCount = 1;
-        blit.dstOffsets[0] = {0, 0, 0};
-        blit.dstOffsets[1] = { mipWidth > 1 ? mipWidth / 2 : 1, mipHeight > 1 ? mipHeight / 2 : 1, 1 };
-        blit.dstSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-        blit.dstSubresource.mipLevel = i;
-        blit.dstSubresource.baseArrayLayer = 0;
-        blit.dstSubresource.layerCount = 1;
-
-        vkCmdBlitImage(commandBuffer,
-                       image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-                       image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-                       1, &blit,
-                       VK_FILTER_LINEAR);
-
-        barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
-        barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-        barrier.srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
-        barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
-
-        vkCmdPipelineBarrier(commandBuffer,
-                             VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0,
-                             0, nullptr,
-                             0, nullptr,
-                             1, &barrier);
-
-        if (mipWidth > 1) mipWidth /= 2;
-        if (mipHeight > 1) mipHeight /= 2;
-    }
-
-    barrier.subresourceRange.baseMipLevel = mipLevels - 1;
-    barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-    barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
-
-    vkCmdPipelineBarrier(commandBuffer,
-                         VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0,
-                         0, nullptr,
-                         0, nullptr,
-                         1, &barrier);
-
-    submitTempCmdBuffer(commandBuffer);
-}
-
+/*********************************************************************
+ * param:  cmdBuf, records the copy; m_upload.cmdBuf() or createTempCmdBuffer()
+ * param:  size, data: the buffer's contents, copied into staging right away
+ * param:  usage
+ * param:  tag, for the memory report
+ *
+ * brief:  Creates a device local buffer and records its upload into
+ *         cmdBuf.  The staging memory belongs to m_upload's open
+ *         batch, so cmdBuf must be submitted no later than that batch.
+ **********************************************************************/
 BufferWrap VkApp::createStagedBufferWrap(const VkCommandBuffer& cmdBuf,
                                          const VkDeviceSize&    size,
                                          const void*            data,
-                                         VkBufferUsageFlags     usage)
+                                         VkBufferUsageFlags     usage,
+                                         const MemoryTag&       tag)
 {
-    BufferWrap staging = createBufferWrap(size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-                                      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
-                                      | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
-
-    void* dest;
-    vkMapMemory(m_device, staging.memory, 0, size, 0, &dest);
-    memcpy(dest, data, size);
-    vkUnmapMemory(m_device, staging.memory);
-
-    
     BufferWrap bw = createBufferWrap(size, VK_BUFFER_USAGE_TRANSFER_DST_BIT | usage,
-                                 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-    copyBuffer(staging.buffer, bw.buffer, size);
+                                 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, tag);
+
+    UploadContext::Staging staging = m_upload.stage(data, size);
+    VkBufferCopy copyRegion{};
+    copyRegion.srcOffset = staging.offset;
+    copyRegion.size = size;
+    vkCmdCopyBuffer(cmdBuf, staging.buffer, bw.buffer, 1, &copyRegion);
 
-    staging.destroy(m_device);
-    
     return bw;
 }
 
 BufferWrap VkApp::createBufferWrap(VkDeviceSize size, VkBufferUsageFlags usage,
-                                      VkMemoryPropertyFlags properties)
+                                      VkMemoryPropertyFlags properties, const MemoryTag& tag)
 {
     BufferWrap result;
     
@@ -281,65 +197,21 @@ BufferWrap VkApp::createBufferWrap(VkDeviceSize size, VkBufferUsageFlags usage,
 
     vkCreateBuffer(m_device, &bufferInfo, nullptr, &result.buffer);
 
-    VkMemoryRequirements memRequirements;
-    vkGetBufferMemoryRequirements(m_device, result.buffer, &memRequirements);
-
-    VkMemoryAllocateFlagsInfo memFlags = {VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_FLAGS_INFO, nullptr,
-        VK_MEMORY_ALLOCATE_DEVICE_ADDRESS_BIT, 0};
-
-    VkMemoryAllocateInfo allocInfo{VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO};
-    allocInfo.pNext = &memFlags;
-    allocInfo.allocationSize = memRequirements.size;
-    allocInfo.memoryTypeIndex = findMemoryType(memRequirements.memoryTypeBits, properties);
-
-    if (vkAllocateMemory(m_device, &allocInfo, nullptr, &result.memory) != VK_SUCCESS) {
-        throw std::runtime_error("failed to allocate buffer memory!");
-    }
-        
-    vkBindBufferMemory(m_device, result.buffer, result.memory, 0);
+    // Memory comes out of the allocator's pooled blocks (and is bound)
+    result.allocation = m_allocator.allocate(result.buffer, properties, tag);
 
     return result;
 }
 
-void VkApp::copyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size)
-{
-    VkCommandBuffer commandBuffer =  createTempCmdBuffer();
-
-    VkBufferCopy copyRegion{};
-    copyRegion.size = size;
-    vkCmdCopyBuffer(commandBuffer, srcBuffer, dstBuffer, 1, &copyRegion);
-
-    submitTempCmdBuffer(commandBuffer);
-}
-
-
-void VkApp::copyBufferToImage(VkBuffer buffer, VkImage image, uint32_t width, uint32_t height)
-{
-    VkCommandBuffer commandBuffer = createTempCmdBuffer();
-
-    VkBufferImageCopy region{};
-    region.bufferOffset = 0;
-    region.bufferRowLength = 0;
-    region.bufferImageHeight = 0;
-    region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    region.imageSubresource.mipLevel = 0;
-    region.imageSubresource.baseArrayLayer = 0;
-    region.imageSubresource.layerCount = 1;
-    region.imageOffset = {0, 0, 0};
-    region.imageExtent = {width, height, 1};
-
-    vkCmdCopyBufferToImage(commandBuffer, buffer, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
-    
-    submitTempCmdBuffer(commandBuffer);
-}
-
+// Recorded into m_upload's open batch; it takes effect before
+// anything submitted after that batch.
 void VkApp::transitionImageLayout(VkImage image,
                                         VkFormat format,
                                         VkImageLayout oldLayout,
                                         VkImageLayout newLayout,
                                         uint32_t mipLevels)
 {
-    VkCommandBuffer commandBuffer = createTempCmdBuffer();
+    VkCommandBuffer commandBuffer = m_upload.cmdBuf();
 
     VkImageMemoryBarrier barrier{VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER};
     barrier.oldLayout = oldLayout;
@@ -360,8 +232,6 @@ void VkApp::transitionImageLayout(VkImage image,
 
     vkCmdPipelineBarrier(commandBuffer, sourceStage, destinationStage, 0,
                          0, nullptr,    0, nullptr,    1, &barrier);
-    
-    submitTempCmdBuffer(commandBuffer);
 }
 
 VkSampler VkApp::createTextureSampler()
@@ -382,6 +252,8 @@ VkSampler VkApp::createTextureSampler()
     samplerInfo.compareEnable = VK_FALSE;
     samplerInfo.compareOp = VK_COMPARE_OP_ALWAYS;
     samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
+    samplerInfo.minLod = 0.0f;
+    samplerInfo.maxLod = VK_LOD_CLAMP_NONE;  // Every level the view exposes
 
     VkSampler textureSampler;
     if (vkCreateSampler(m_device, &samplerInfo, nullptr, &textureSampler) != VK_SUCCESS) {
@@ -397,9 +269,11 @@ VkSampler VkApp::createTextureSampler()
  **********************************************************************/
 void VkApp::createPostDescriptor()
 {
+    // Set 0 shows m_scImageBuffer; sets 1 and 2, by parity, the ray
+    // traced colCurr (written by createRtDescriptorSet)
     m_postDesc.setBindings(m_device, {
             {0, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1, VK_SHADER_STAGE_FRAGMENT_BIT}
-        });
+        }, 3);
     m_postDesc.write(m_device, 0, m_scImageBuffer.Descriptor());
 
     // @@ Destroy with m_postDesc.destroy(m_device); (DONE)
@@ -412,31 +286,40 @@ void VkApp::createPostDescriptor()
  **********************************************************************/
 void VkApp::createScBuffer()
 {
-    m_scImageBuffer = createBufferImage(m_windowSize);
+    m_scImageBuffer = createBufferImage(m_windowSize, GBUFFER_COLOR_FORMAT, "scanline image");
 
-    VkCommandBuffer    cmdBuf = createTempCmdBuffer();
-    imageLayoutBarrier(cmdBuf, m_scImageBuffer.image,
+    imageLayoutBarrier(m_upload.cmdBuf(), m_scImageBuffer.image,
                        VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL);
-    submitTempCmdBuffer(cmdBuf);
     
     // @@ Destroy with m_scImageBuffer.destroy(m_device); (DONE)
 }
 
-ImageWrap VkApp::createBufferImage(VkExtent2D& size)
+ImageWrap VkApp::createBufferImage(VkExtent2D& size, VkFormat format, const std::string& owner)
 {
     //uint mipLevels = std::floor(std::log2(std::max(texWidth, texHeight))) + 1;
     uint mipLevels = 1;
 
-    ImageWrap myImage = createImageWrap(size.width, size.height, VK_FORMAT_R32G32B32A32_SFLOAT,
+    // The shaders write these as storage images (see the GBUFFER_* formats)
+    VkFormatProperties formatProperties;
+    vkGetPhysicalDeviceFormatProperties(m_physicalDevice, format, &formatProperties);
+    if (!(formatProperties.optimalTilingFeatures & VK_FORMAT_FEATURE_STORAGE_IMAGE_BIT)) {
+        throw std::runtime_error("failed to find storage image support for a G-buffer format!"); }
+
+    // Only the scanline image is rendered to, but any may be
+    VkImageUsageFlags attachment = (formatProperties.optimalTilingFeatures
+                                    & VK_FORMAT_FEATURE_COLOR_ATTACHMENT_BIT)
+        ? VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT : 0;
+
+    ImageWrap myImage = createImageWrap(size.width, size.height, format,
                                   VK_IMAGE_USAGE_TRANSFER_DST_BIT
                                   | VK_IMAGE_USAGE_SAMPLED_BIT
                                   | VK_IMAGE_USAGE_TRANSFER_SRC_BIT
                                   | VK_IMAGE_USAGE_STORAGE_BIT
-                                  | VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT,
+                                  | attachment,
                                   VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-                                  mipLevels);
+                                  mipLevels, {MEM_GBUFFER, owner});
 
-    myImage.imageView = createImageView(myImage.image, VK_FORMAT_R32G32B32A32_SFLOAT);
+    myImage.imageView = createImageView(myImage.image, format);
     myImage.sampler = createTextureSampler();
     myImage.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
     return myImage;
@@ -450,7 +333,7 @@ ImageWrap VkApp::createBufferImage(VkExtent2D& size)
 void VkApp::createScanlineRenderPass()
 {
     VkAttachmentDescription colorAttachment{};
-    colorAttachment.format = VK_FORMAT_R32G32B32A32_SFLOAT;
+    colorAttachment.format = GBUFFER_COLOR_FORMAT;
     colorAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
     colorAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
     colorAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
@@ -536,18 +419,46 @@ void VkApp::createScDescriptorSet()
     // scanline and raytracing pipelines; Note the mention of VERTEX,
     // FRAGMENT, and RAYGEN shader stages.
     m_scDesc.setBindings(m_device, {
-            {ScBindings::eMatrices, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1,
+            {ScBindings::eMatrices, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, 1,
                 VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_RAYGEN_BIT_KHR},
             {ScBindings::eObjDescs, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1,
                 VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT
                 | VK_SHADER_STAGE_RAYGEN_BIT_KHR},
+#ifdef VIRTUAL_TEXTURES
+            // Virtual texturing: the page cache and its tables replace textureSamplers[]
+            {ScBindings::eVtTextures, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1,
+                VK_SHADER_STAGE_FRAGMENT_BIT | VK_SHADER_STAGE_RAYGEN_BIT_KHR},
+            {ScBindings::eVtPageTable, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1,
+                VK_SHADER_STAGE_FRAGMENT_BIT | VK_SHADER_STAGE_RAYGEN_BIT_KHR},
+            {ScBindings::eVtFeedback, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1,
+                VK_SHADER_STAGE_FRAGMENT_BIT | VK_SHADER_STAGE_RAYGEN_BIT_KHR},
+            {ScBindings::eVtCache, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1,
+                VK_SHADER_STAGE_FRAGMENT_BIT | VK_SHADER_STAGE_RAYGEN_BIT_KHR},
+#else
             {ScBindings::eTextures, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, nbTxt,
-                VK_SHADER_STAGE_FRAGMENT_BIT | VK_SHADER_STAGE_RAYGEN_BIT_KHR}
+                VK_SHADER_STAGE_FRAGMENT_BIT | VK_SHADER_STAGE_RAYGEN_BIT_KHR},
+#endif
+            {ScBindings::eInstDescs, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1,
+                VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_RAYGEN_BIT_KHR},
+            {ScBindings::eMaterials, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1,
+                VK_SHADER_STAGE_FRAGMENT_BIT | VK_SHADER_STAGE_RAYGEN_BIT_KHR},
+            {ScBindings::eMaterialsCold, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1,
+                VK_SHADER_STAGE_RAYGEN_BIT_KHR}
         });
               
-    m_scDesc.write(m_device, ScBindings::eMatrices, m_matrixBW.buffer);
+    m_scDesc.write(m_device, ScBindings::eMatrices, m_frameArena.buffer(), sizeof(MatrixUniforms));
     m_scDesc.write(m_device, ScBindings::eObjDescs, m_objDescriptionBW.buffer);
+#ifdef VIRTUAL_TEXTURES
+    m_scDesc.write(m_device, ScBindings::eVtTextures, m_vtTexturesBW.buffer);
+    m_scDesc.write(m_device, ScBindings::eVtPageTable, m_vtPageTableBW.buffer);
+    m_scDesc.write(m_device, ScBindings::eVtFeedback, m_vtFeedbackBW.buffer);
+    m_scDesc.write(m_device, ScBindings::eVtCache, m_vtCache.Descriptor());
+#else
     m_scDesc.write(m_device, ScBindings::eTextures, m_objText);    
+#endif
+    m_scDesc.write(m_device, ScBindings::eInstDescs, m_instDescriptionBW.buffer);
+    m_scDesc.write(m_device, ScBindings::eMaterials, m_materialBW.buffer);
+    m_scDesc.write(m_device, ScBindings::eMaterialsCold, m_materialColdBW.buffer);
 
     // @@ Destroy with m_scDesc.destroy(m_device); (DONE)
 }
@@ -593,10 +504,18 @@ void VkApp::createScPipeline()
     VkVertexInputBindingDescription bindingDescription
         {0, sizeof(Vertex), VK_VERTEX_INPUT_RATE_VERTEX};
 
+#ifdef COMPACT_VERTEX
+    // The fixed function fetch unpacks both; the shader decodes the normal.
+    std::vector<VkVertexInputAttributeDescription> attributeDescriptions {
+        {0, 0, VK_FORMAT_R32G32B32_SFLOAT, static_cast<uint32_t>(offsetof(Vertex, pos))},
+        {1, 0, VK_FORMAT_R16G16_SNORM, static_cast<uint32_t>(offsetof(Vertex, nrm))},
+        {2, 0, VK_FORMAT_R16G16_SFLOAT, static_cast<uint32_t>(offsetof(Vertex, texCoord))}};
+#else
     std::vector<VkVertexInputAttributeDescription> attributeDescriptions {
         {0, 0, VK_FORMAT_R32G32B32_SFLOAT, static_cast<uint32_t>(offsetof(Vertex, pos))},
         {1, 0, VK_FORMAT_R32G32B32_SFLOAT, static_cast<uint32_t>(offsetof(Vertex, nrm))},
         {2, 0, VK_FORMAT_R32G32_SFLOAT, static_cast<uint32_t>(offsetof(Vertex, texCoord))}};
+#endif
 
     vertexInputInfo.vertexBindingDescriptionCount = 1;
     vertexInputInfo.pVertexBindingDescriptions = &bindingDescription;
@@ -698,33 +617,77 @@ void VkApp::createScPipeline()
 /*********************************************************************
  *
  *
- * brief:  Create a Vulkan buffer to hold the camera matrices, products and inverses. 
- *         Will be included in a descriptor set for use in shaders.
+ * brief:  Create a Vulkan buffer containing pointers to all object buffers 
+ *         (vertex, triangle indices, materials, and material indices. Will be 
+ *         included in a descriptor set for use in shaders.  Also a buffer
+ *         describing each instance: its mesh's ObjDesc and normal matrix.
  **********************************************************************/
-void VkApp::createMatrixBuffer()
+void VkApp::createObjDescriptionBuffer()
 {
-    m_matrixBW = createBufferWrap(sizeof(MatrixUniforms),
-                               VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT
-                               | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
-                               VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    std::vector<InstDesc> instDesc;
+    instDesc.reserve(m_objInst.size());
+    for (const ObjInst& inst : m_objInst) {
+        const ObjData& object = m_objData[inst.objIndex];
+        InstDesc desc;
+        desc.normalMatrix = glm::transpose(glm::inverse(inst.transform));
+        desc.objDesc      = object.meshes[inst.meshIndex].descIndex;
+        instDesc.push_back(desc); }
+
+    VkCommandBuffer cmdBuf = m_upload.cmdBuf();
+    m_objDescriptionBW  = createStagedBufferWrap(cmdBuf, m_objDesc,
+                                                 VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                                 {MEM_SCENE, "object descriptions"});
+    m_instDescriptionBW = createStagedBufferWrap(cmdBuf, instDesc,
+                                                 VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                                 {MEM_SCENE, "instance descriptions"});
+    // @@ Destroy with m_objDescriptionBW.destroy(m_device); (DONE)
+    // @@ Destroy with m_instDescriptionBW.destroy(m_device); (DONE)
+}
 
-    // @@ Destroy with m_matrixBW.destroy(m_device); (DONE)
+/*********************************************************************
+ *
+ *
+ * brief:  Upload the scene's material table, as its two arrays.
+ **********************************************************************/
+void VkApp::createMaterialBuffers()
+{
+    // A descriptor can not refer to an empty buffer
+    std::vector<MaterialHot>  hot  = m_materials.hot();
+    std::vector<MaterialCold> cold = m_materials.cold();
+    if (hot.empty()) {
+        hot.push_back(MaterialHot{});
+        cold.push_back(MaterialCold{}); }
+
+    VkCommandBuffer cmdBuf = m_upload.cmdBuf();
+    m_materialBW     = createStagedBufferWrap(cmdBuf, hot, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                              {MEM_SCENE, "materials (hot)"});
+    m_materialColdBW = createStagedBufferWrap(cmdBuf, cold, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                              {MEM_SCENE, "materials (cold)"});
+    // @@ Destroy with m_materialBW.destroy(m_device); (DONE)
+    // @@ Destroy with m_materialColdBW.destroy(m_device); (DONE)
 }
 
 /*********************************************************************
  *
  *
- * brief:  Create a Vulkan buffer containing pointers to all object buffers 
- *         (vertex, triangle indices, materials, and material indices. Will be 
- *         included in a descriptor set for use in shaders.
+ * brief:  Build the alias table over the emissive triangles gathered
+ *         while loading, and upload the light table for the ray tracer.
  **********************************************************************/
-void VkApp::createObjDescriptionBuffer()
+void VkApp::createLightBuffer()
 {
-    VkCommandBuffer cmdBuf = createTempCmdBuffer();
-    m_objDescriptionBW  = createStagedBufferWrap(cmdBuf, m_objDesc,
-                                                 VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
-    submitTempCmdBuffer(cmdBuf);
-    // @@ Destroy with m_objDescriptionBW.destroy(m_device); (DONE)
+    m_pcRay.lightPower = buildAliasTable(m_lightList, m_workers);
+    m_pcRay.nbLights   = static_cast<int>(m_lightList.size());
+    printf("Light table: %d lights, power %g\n", m_pcRay.nbLights, m_pcRay.lightPower);
+
+    // A descriptor can not refer to an empty buffer, so an unlit scene
+    // still gets one (unused) entry.
+    std::vector<Light> table = m_lightList;
+    if (table.empty())
+        table.push_back(Light{});
+
+    m_lightBuff = createStagedBufferWrap(m_upload.cmdBuf(), table, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                         {MEM_SCENE, "lights"});
+    // @@ Destroy with m_lightBuff.destroy(m_device); (DONE)
 }
 
 void VkApp::rasterize()
@@ -745,32 +708,86 @@ void VkApp::rasterize()
 
     vkCmdBindPipeline(m_commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, m_scanlinePipeline);
     vkCmdBindDescriptorSets(m_commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-                            m_scanlinePipelineLayout, 0, 1, &m_scDesc.descSet, 0, nullptr);
+                            m_scanlinePipelineLayout, 0, 1, &m_scDesc.descSet, 1, &m_matrixOffset);
+
+    // Pixels covered by a unit length at unit distance (see Camera::perspective)
+    float pixelsPerUnit = 0.5f*m_windowSize.height/app->myCamera.ry;
+    m_rasterTriangles = m_rasterFullTriangles = 0;
 
-    for(const ObjInst& inst : m_objInst) {
+    for (uint32_t i = 0; i < m_objInst.size(); i++) {
+        const ObjInst& inst     = m_objInst[i];
         auto& object            = m_objData[inst.objIndex];
+        auto& mesh              = object.meshes[inst.meshIndex];
         // Information pushed at each draw call
         PushConstantRaster pcRaster{
             inst.transform,      // Object's instance transform.
             nonrtLightPosition,
             nonrtLightIntensity,
-            inst.objIndex       // instance Id
+            mesh.descIndex       // instance Id
         };
         
-        pcRaster.objIndex    = inst.objIndex;  // Telling which object is drawn
+        pcRaster.objIndex    = mesh.descIndex;  // Telling which mesh is drawn
         pcRaster.modelMatrix = inst.transform;
+        pcRaster.instIndex   = i;  // Normals take the inverse transpose (see createObjDescriptionBuffer)
+
+        // A level of detail is drawn from its own range of the index
+        // buffer; its material indices are as far past the mesh's.
+        uint32_t     firstIndex  = mesh.firstIndex;
+        uint32_t     nbIndices   = mesh.nbIndices;
+        VkDeviceSize indexOffset = mesh.indexOffset;
+        uint32_t lod = selectLod(inst, mesh, pixelsPerUnit);
+        if (lod > 0) {
+            firstIndex  = mesh.lods[lod-1].firstIndex;
+            nbIndices   = mesh.lods[lod-1].nbIndices;
+            indexOffset = mesh.lodOffsets[lod-1]; }
+        pcRaster.primOffset = (firstIndex - mesh.firstIndex)/3;
+        m_rasterTriangles     += nbIndices/3;
+        m_rasterFullTriangles += mesh.nbIndices/3;
 
         vkCmdPushConstants(m_commandBuffer, m_scanlinePipelineLayout,
                            VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT, 0,
                            sizeof(PushConstantRaster), &pcRaster);
         vkCmdBindVertexBuffers(m_commandBuffer, 0, 1, &object.vertexBuffer.buffer, &offset);
-        vkCmdBindIndexBuffer(m_commandBuffer, object.indexBuffer.buffer, 0,
-                             VK_INDEX_TYPE_UINT32);
-        vkCmdDrawIndexed(m_commandBuffer, object.nbIndices, 1, 0, 0, 0); }
+        vkCmdBindIndexBuffer(m_commandBuffer, object.indexBuffer.buffer, indexOffset,
+                             mesh.indexType);
+        vkCmdDrawIndexed(m_commandBuffer, nbIndices, 1, 0,
+                         static_cast<int32_t>(mesh.firstVertex), 0); }
     
     vkCmdEndRenderPass(m_commandBuffer);
 }
 
+/*********************************************************************
+ * param:  inst, an instance about to be drawn
+ * param:  mesh, its mesh
+ * param:  pixelsPerUnit, pixels covered by a unit length at unit
+ *         distance from the eye
+ *
+ * brief:  Returns the level of detail to draw inst with: 0 for the
+ *         full mesh, or l for mesh.lods[l-1].  That is the coarsest
+ *         level whose error, scaled by the instance transform and
+ *         projected from the nearest point of the mesh's bounding
+ *         sphere, is within m_lodPixels.
+ **********************************************************************/
+uint32_t VkApp::selectLod(const ObjInst& inst, const ObjMesh& mesh, float pixelsPerUnit) const
+{
+    if (mesh.lods.empty() || m_lodPixels <= 0.0f)
+        return 0;
+
+    float scale = std::max(glm::length(glm::vec3(inst.transform[0])),
+                           std::max(glm::length(glm::vec3(inst.transform[1])),
+                                    glm::length(glm::vec3(inst.transform[2]))));
+    glm::vec3 center = glm::vec3(inst.transform * glm::vec4(0.5f*(mesh.bmin + mesh.bmax), 1.0f));
+    float radius   = 0.5f*scale*glm::length(mesh.bmax - mesh.bmin);
+    float distance = glm::length(center - app->myCamera.eye) - radius;
+    if (distance <= 0.0f)
+        return 0;  // Inside it
+
+    for (uint32_t l = static_cast<uint32_t>(mesh.lods.size()); l > 0; l--)
+        if (mesh.lods[l-1].error*scale*pixelsPerUnit/distance <= m_lodPixels)
+            return l;
+    return 0;
+}
+
 
 void VkApp::updateCameraBuffer()
 {
@@ -791,35 +808,7 @@ void VkApp::updateCameraBuffer()
     std::cout << "view: " << glm::to_string(view) << std::endl;
     std::cout << "proj: " << glm::to_string(proj) << std::endl;*/
 
-    // UBO on the device, and what stages access it.
-    VkBuffer deviceUBO      = m_matrixBW.buffer;
-    auto     uboUsageStages = VK_PIPELINE_STAGE_VERTEX_SHADER_BIT
-                            | VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR;
-
-    // Ensure that the modified UBO is not visible to previous frames.
-    VkBufferMemoryBarrier beforeBarrier{VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER};
-    beforeBarrier.srcAccessMask = VK_ACCESS_SHADER_READ_BIT;
-    beforeBarrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-    beforeBarrier.buffer        = deviceUBO;
-    beforeBarrier.offset        = 0;
-    beforeBarrier.size          = sizeof(hostUBO);
-    vkCmdPipelineBarrier(m_commandBuffer, uboUsageStages, VK_PIPELINE_STAGE_TRANSFER_BIT,
-                         VK_DEPENDENCY_DEVICE_GROUP_BIT, 0,
-                         nullptr, 1, &beforeBarrier, 0, nullptr);
-
-
-    // Schedule the host-to-device upload. (hostUBO is copied into the cmd
-    // buffer so it is okay to deallocate when the function returns).
-    vkCmdUpdateBuffer(m_commandBuffer, m_matrixBW.buffer, 0, sizeof(MatrixUniforms), &hostUBO);
-
-    // Making sure the updated UBO will be visible.
-    VkBufferMemoryBarrier afterBarrier{VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER};
-    afterBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-    afterBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
-    afterBarrier.buffer        = deviceUBO;
-    afterBarrier.offset        = 0;
-    afterBarrier.size          = sizeof(hostUBO);
-    vkCmdPipelineBarrier(m_commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, uboUsageStages,
-                         VK_DEPENDENCY_DEVICE_GROUP_BIT, 0,
-                         nullptr, 1, &afterBarrier, 0, nullptr);
+    // Written straight into this frame's region of the mapped arena;
+    // the submit makes it visible, so no copy or barrier is recorded.
+    m_matrixOffset = m_frameArena.push(hostUBO);
 }
@@ -0,0 +1,75 @@
+//////////////////////////////////////////////////////////////////////
+// Moving nodes of the scene graph (see scene_graph.h).  Once a frame,
+// the nodes moved since the last one have their world transforms
+// recomputed, and the instances placed by those nodes follow: their
+// ObjInst transform (which the raster pass pushes), their InstDesc
+// normal matrix, and the TLAS.  With one BLAS per mesh the moved
+// instances' TLAS entries are rewritten in place and the TLAS refit;
+// the monolithic layout has the transforms in its BLASes, so the moved
+// instances' entries in m_asTransformBW are rewritten and the moved
+// objects' BLASes refit, then the TLAS.  The refits are recorded into
+// the frame (see recordRefits); nothing is rebuilt or waited on.
+//
+// Only the instances move.  The light list keeps the emissive
+// triangles where they were loaded, and m_streamer keeps the chunks'
+// boxes.
+////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+
+#include "vkapp.h"
+#include "app.h"
+
+/*********************************************************************
+ *
+ *
+ * brief:  Called between frames (the last one is done; see
+ *         prepareFrame).  Does nothing if no node moved; otherwise the
+ *         work is in proportion to the nodes and instances that did.
+ **********************************************************************/
+void VkApp::updateSceneGraph()
+{
+    const std::vector<uint32_t>& changed = m_sceneGraph.update();
+    if (changed.empty())
+        return;
+
+    // The instances of each node, made again after m_objInst changed
+    if (m_nodeInstances.empty()) {
+        m_nodeInstances.reserve(m_objInst.size());
+        for (uint32_t i = 0; i < m_objInst.size(); i++)
+            m_nodeInstances.emplace_back(m_objInst[i].node, i);
+        std::sort(m_nodeInstances.begin(), m_nodeInstances.end()); }
+
+    std::vector<uint32_t> moved;
+    for (uint32_t node : changed) {
+        auto it = std::lower_bound(m_nodeInstances.begin(), m_nodeInstances.end(),
+                                   std::make_pair(node, 0u));
+        for ( ; it != m_nodeInstances.end() && it->first == node; ++it) {
+            m_objInst[it->second].transform = m_sceneGraph.world(node);
+            moved.push_back(it->second); } }
+    if (moved.empty())
+        return;
+
+    // Recorded into m_upload's batch, which goes out ahead of the frame
+    for (uint32_t i : moved) {
+        const ObjInst& inst = m_objInst[i];
+        InstDesc desc;
+        desc.normalMatrix = glm::transpose(glm::inverse(inst.transform));
+        desc.objDesc      = m_objData[inst.objIndex].meshes[inst.meshIndex].descIndex;
+        m_upload.copyToBuffer(&desc, sizeof(desc), m_instDescriptionBW.buffer,
+                              VkDeviceSize(i)*sizeof(InstDesc)); }
+
+    if (m_splitBlas)
+        for (uint32_t i : moved)
+            m_tlasInstances.setTransform(i, m_objInst[i].transform);
+    else
+        for (uint32_t i : moved) {
+            VkTransformMatrixKHR transform = toTransformMatrixKHR(m_objInst[i].transform);
+            m_upload.copyToBuffer(&transform, sizeof(transform), m_asTransformBW.buffer,
+                                  VkDeviceSize(i)*sizeof(VkTransformMatrixKHR));
+            m_blasRefits.push_back(m_objInst[i].objIndex); }
+    if (!buildTlas(false))
+        m_rtDesc.write(m_device, 0, m_rtBuilder.getAccelerationStructure());  // A new TLAS
+
+    app->myCamera.modified = true;  // Restart accumulation
+}
@@ -0,0 +1,289 @@
+//////////////////////////////////////////////////////////////////////
+// Out-of-core geometry.  A model marked streamed in the scene file is
+// cut into chunks (see geometry_chunks.h), each of which becomes an
+// m_objData entry of its own with a single mesh, BLAS and ObjDesc.
+// Every chunk starts out drawn from its proxy, which stays on the GPU.
+// Once a frame, m_streamer picks the chunks to bring in (nearest the
+// camera first, within the budget) and those to give up; the chunks
+// asked for are read on the workers and uploaded on the transfer
+// queue, while frames go on.  Swapping a chunk between its proxy and
+// its full geometry happens between two frames: its ObjDesc is
+// rewritten, its BLAS rebuilt, and the TLAS refit.
+////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+#include <float.h>
+
+#include "vkapp.h"
+#include "app.h"
+
+VkDeviceAddress getBufferDeviceAddress(VkDevice device, VkBuffer buffer);  // vkapp_loadModel.cpp
+
+// Translates a chunk's material indices, the model's own, to m_materials
+static void remapMaterials(ChunkGeometry& geometry, const std::vector<int32_t>& materialIndex)
+{
+    for (auto& m : geometry.matIndx)
+        m = materialIndex[m];
+}
+
+/*********************************************************************
+ * param:  filename, the model's file
+ * param:  model, the model as imported; read only until this returns
+ * param:  transforms, one for each instance of the whole model
+ *
+ * brief:  Adds a model to the scene as chunks, writing its chunk file
+ *         first if there is no up to date one.  Its lights and
+ *         materials are added as for any model.  Only the chunks'
+ *         proxies are uploaded; the streamed models are not reloaded
+ *         when their file changes.
+ **********************************************************************/
+void VkApp::addStreamedModel(const std::string& filename, const ModelView& model,
+                             const std::vector<glm::mat4>& transforms)
+{
+    auto start = std::chrono::high_resolution_clock::now();
+    printf("Model %s (streamed)\n", filename.c_str());
+
+    // Light sampling sees the full geometry, whatever is resident
+    std::vector<Light> lights;
+    for (const auto& transform : transforms)
+        gatherLights(model, transform, m_workers, lights);
+    m_lightList.insert(m_lightList.end(), lights.begin(), lights.end());
+    printf("lights: %zd\n", lights.size());
+
+    uint32_t modelIndex = static_cast<uint32_t>(m_streamedModels.size());
+    m_streamedModels.emplace_back();
+    StreamedModel& streamed = m_streamedModels.back();
+    streamed.materialIndex = addMaterials(model, true);
+    if (!streamed.file.open(filename)) {
+        printf("Writing chunk file %s\n", ChunkedModel::chunkPath(filename).c_str());
+        if (!ChunkedModel::write(filename, model) || !streamed.file.open(filename))
+            throw std::runtime_error("failed to write chunk file!"); }
+
+    // The proxies are read on the workers, all at once
+    const std::vector<ChunkInfo>& chunks = streamed.file.chunks();
+    std::vector<std::future<ChunkGeometry>> proxies;
+    for (uint32_t c = 0; c < chunks.size(); c++)
+        proxies.push_back(m_workers.submit([&streamed, c] {
+            ChunkGeometry proxy = streamed.file.read(c, true);
+            remapMaterials(proxy, streamed.materialIndex);
+            return proxy; }));
+
+    // The chunks are cut from the model as a whole, so its nodes are
+    // gone: the chunks of each placement hang off one root node.
+    std::vector<uint32_t> roots;
+    for (const auto& transform : transforms)
+        roots.push_back(m_sceneGraph.add(SceneGraph::NONE, transform));
+    m_nodeInstances.clear();
+
+    uint64_t proxyBytes = 0, fullBytes = 0;
+    for (uint32_t c = 0; c < chunks.size(); c++) {
+        const ChunkInfo& info = chunks[c];
+        StreamedChunk chunk;
+        chunk.objIndex = static_cast<uint32_t>(m_objData.size());
+        chunk.model    = modelIndex;
+        chunk.chunk    = c;
+        chunk.proxy    = uploadChunk(proxies[c].get(), filename + " proxy " + std::to_string(c));
+        proxyBytes += info.proxyBytes();
+        fullBytes  += info.bytes();
+
+        // A mesh of its own, placed once per transform
+        ObjData object;
+        object.transforms = transforms;
+        object.nodes      = roots;
+        object.firstLight = static_cast<uint32_t>(m_lightList.size());
+        ObjMesh mesh;
+        mesh.descIndex = static_cast<uint32_t>(m_objDesc.size());
+        object.meshes.push_back(mesh);
+        m_objData.emplace_back(std::move(object));
+        m_objDesc.emplace_back();
+
+        // Its world space box, for each placement
+        std::vector<std::pair<glm::vec3, glm::vec3>> boxes;
+        for (size_t p = 0; p < transforms.size(); p++) {
+            const glm::mat4& transform = transforms[p];
+            glm::vec3 bmin(FLT_MAX), bmax(-FLT_MAX);
+            for (int corner = 0; corner < 8; corner++) {
+                glm::vec3 p((corner & 1) ? info.bmax.x : info.bmin.x,
+                            (corner & 2) ? info.bmax.y : info.bmin.y,
+                            (corner & 4) ? info.bmax.z : info.bmin.z);
+                p = glm::vec3(transform * glm::vec4(p, 1.0f));
+                bmin = glm::min(bmin, p);
+                bmax = glm::max(bmax, p); }
+            boxes.emplace_back(bmin, bmax);
+
+            ObjInst instance;
+            instance.transform = transform;
+            instance.objIndex  = chunk.objIndex;
+            instance.meshIndex = 0;
+            instance.node      = roots[p];
+            m_objInst.push_back(instance); }
+
+        uint32_t id = m_streamer.add(boxes, info.bytes());
+        m_streamedChunks.push_back(chunk);
+        setChunkBuffers(id, m_streamedChunks[id].proxy); }
+    submitAsyncUploads();
+
+    auto end = std::chrono::high_resolution_clock::now();
+    printf("%zd chunks: %.1f MB, proxies %.1f MB\n", chunks.size(),
+           fullBytes/1048576.0, proxyBytes/1048576.0);
+    printf("Model %s added in %.1f ms\n", filename.c_str(),
+           std::chrono::duration<double, std::milli>(end - start).count());
+}
+
+/*********************************************************************
+ * param:  geometry, a chunk or proxy, with m_materials indices
+ *
+ * brief:  Creates its buffers and queues their contents on the
+ *         transfer queue; the caller submits them.
+ **********************************************************************/
+ChunkBuffers VkApp::uploadChunk(const ChunkGeometry& geometry, const std::string& owner)
+{
+    VkBufferUsageFlags flag = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
+        | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT;
+    VkBufferUsageFlags rtFlags = flag
+        | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR;
+
+    ChunkBuffers buffers;
+    buffers.nbVertices = static_cast<uint32_t>(geometry.vertices.size());
+    buffers.nbIndices  = static_cast<uint32_t>(geometry.indices.size());
+    buffers.indexType  = indexTypeFor(buffers.nbVertices);
+    std::vector<uint8_t> indices;
+    packIndices(indices, geometry.indices.data(), buffers.nbIndices, 0, buffers.indexType);
+
+    MemoryTag tag{MEM_GEOMETRY, owner};
+    buffers.vertexBuffer   = createAsyncBufferWrap(geometry.vertices,
+                                                   VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | rtFlags, tag);
+    buffers.indexBuffer    = createAsyncBufferWrap(indices,
+                                                   VK_BUFFER_USAGE_INDEX_BUFFER_BIT | rtFlags, tag);
+    buffers.matIndexBuffer = createAsyncBufferWrap(geometry.matIndx, flag, tag);
+    return buffers;
+}
+
+/*********************************************************************
+ * param:  chunk, the m_streamedChunks entry
+ * param:  buffers, its proxy's or its own
+ *
+ * brief:  Points the chunk's ObjData and ObjDesc at buffers.  The
+ *         BLAS and the device copy of the ObjDesc are left to the
+ *         caller.
+ **********************************************************************/
+void VkApp::setChunkBuffers(uint32_t chunk, const ChunkBuffers& buffers)
+{
+    ObjData& object = m_objData[m_streamedChunks[chunk].objIndex];
+    object.vertexBuffer   = buffers.vertexBuffer;
+    object.indexBuffer    = buffers.indexBuffer;
+    object.matIndexBuffer = buffers.matIndexBuffer;
+    object.nbVertices = buffers.nbVertices;
+    object.nbIndices  = buffers.nbIndices;
+    object.meshes[0].nbIndices  = buffers.nbIndices;
+    object.meshes[0].nbVertices = buffers.nbVertices;
+    object.meshes[0].indexType  = buffers.indexType;
+
+    ObjDesc& desc = m_objDesc[object.meshes[0].descIndex];
+    desc.txtOffset            = 0;
+    desc.vertexAddress        = getBufferDeviceAddress(m_device, buffers.vertexBuffer.buffer);
+    desc.indexAddress         = getBufferDeviceAddress(m_device, buffers.indexBuffer.buffer);
+    desc.materialIndexAddress = getBufferDeviceAddress(m_device, buffers.matIndexBuffer.buffer);
+    desc.indexSize            = buffers.indexType == VK_INDEX_TYPE_UINT16 ? 2 : 4;
+}
+
+/*********************************************************************
+ *
+ *
+ * brief:  Called between frames (the last one is done; see
+ *         prepareFrame).  Swaps in the chunks uploaded since the last
+ *         call, gives up those m_streamer evicts, and starts reading
+ *         those it asks for.  Never waits on the reads.
+ **********************************************************************/
+void VkApp::updateGeometryStreaming()
+{
+    if (m_streamedChunks.empty())
+        return;
+
+    std::vector<uint32_t> objects, oldBlas;
+    auto swap = [&](uint32_t c, const ChunkBuffers& buffers) {
+        uint32_t objIndex = m_streamedChunks[c].objIndex;
+        if (std::find(objects.begin(), objects.end(), objIndex) == objects.end()) {
+            const ObjData& object = m_objData[objIndex];
+            objects.push_back(objIndex);
+            oldBlas.push_back(m_splitBlas ? object.meshes[0].blasIndex : object.blasIndex); }
+        setChunkBuffers(c, buffers); };
+
+    // Acquired by the last frame's command buffer, which is done
+    for (uint32_t c : m_chunksUploaded) {
+        swap(c, m_streamedChunks[c].full);
+        m_streamer.loaded(c); }
+    m_chunksUploaded.clear();
+
+    std::vector<uint32_t> requests, evictions;
+    m_streamer.update(app->myCamera.eye, MAX_CHUNK_REQUESTS, requests, evictions);
+    for (uint32_t c : evictions) {
+        StreamedChunk& chunk = m_streamedChunks[c];
+        swap(c, chunk.proxy);
+        chunk.full.vertexBuffer.destroy(m_device);  // The last frame to use them is done
+        chunk.full.indexBuffer.destroy(m_device);
+        chunk.full.matIndexBuffer.destroy(m_device);
+        chunk.full = ChunkBuffers(); }
+
+    if (!objects.empty()) {
+        rebuildModelAS(objects, oldBlas);
+        for (uint32_t objIndex : objects) {
+            uint32_t descIndex = m_objData[objIndex].meshes[0].descIndex;
+            m_upload.copyToBuffer(&m_objDesc[descIndex], sizeof(ObjDesc),
+                                  m_objDescriptionBW.buffer, sizeof(ObjDesc)*descIndex); }
+        app->myCamera.modified = true; }  // Restart accumulation
+
+    for (uint32_t c : requests) {
+        const StreamedChunk& chunk = m_streamedChunks[c];
+        const StreamedModel& model = m_streamedModels[chunk.model];
+        uint32_t index = chunk.chunk;
+        m_chunkLoads.emplace_back(c, m_workers.submit([&model, index] {
+            ChunkGeometry geometry = model.file.read(index, false);
+            remapMaterials(geometry, model.materialIndex);
+            return geometry; })); }
+
+    // Whatever has been read goes to the transfer queue; it is swapped
+    // in by the first call after the frame that acquires it.
+    for (size_t i = 0; i < m_chunkLoads.size(); ) {
+        auto& load = m_chunkLoads[i];
+        if (!isReady(load.second)) {
+            i++;
+            continue; }
+        uint32_t c = load.first;
+        try {
+            ChunkGeometry geometry = load.second.get();
+            m_streamedChunks[c].full = uploadChunk(geometry, "streamed chunk " + std::to_string(c));
+            submitAsyncUploads([this, c] { m_chunksUploaded.push_back(c); }); }
+        catch (const std::exception& e) {
+            printf("Chunk %d not loaded; keeping its proxy: %s\n", c, e.what());
+            m_streamer.failed(c); }
+        m_chunkLoads.erase(m_chunkLoads.begin() + i); }
+}
+
+/*********************************************************************
+ *
+ *
+ * brief:  Destroys every chunk's buffers, after waiting on the reads
+ *         still going.  The chunks' m_objData entries only borrowed
+ *         them, and are left with null handles.
+ **********************************************************************/
+void VkApp::destroyGeometryStreaming()
+{
+    for (auto& load : m_chunkLoads)
+        load.second.wait();
+    m_chunkLoads.clear();
+
+    for (auto& chunk : m_streamedChunks) {
+        for (ChunkBuffers* buffers : {&chunk.proxy, &chunk.full}) {
+            buffers->vertexBuffer.destroy(m_device);
+            buffers->indexBuffer.destroy(m_device);
+            buffers->matIndexBuffer.destroy(m_device); }
+        ObjData& object = m_objData[chunk.objIndex];
+        object.vertexBuffer   = BufferWrap{};
+        object.indexBuffer    = BufferWrap{};
+        object.matIndexBuffer = BufferWrap{}; }
+    m_streamedChunks.clear();
+    m_streamedModels.clear();
+}
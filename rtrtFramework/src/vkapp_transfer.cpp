@@ -0,0 +1,170 @@
+//////////////////////////////////////////////////////////////////////
+// Background uploads on the transfer queue.  Buffers and textures are
+// copied by m_transfer, whose batches run on m_transferQueue alongside
+// the frames.  Each resource is then released by the transfer queue
+// family and acquired by the graphics one, in the first frame (or
+// other graphics command buffer) recorded after its batch is done.
+////////////////////////////////////////////////////////////////////////
+
+#include <vector>
+
+#include "vkapp.h"
+
+BufferWrap VkApp::createAsyncBufferWrap(VkDeviceSize size, const void* data, VkBufferUsageFlags usage,
+                                        const MemoryTag& tag)
+{
+    BufferWrap bw = createBufferWrap(size, VK_BUFFER_USAGE_TRANSFER_DST_BIT | usage,
+                                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, tag);
+    m_transfer.copyToBuffer(data, size, bw.buffer);
+
+    // Sharing the graphics queue, the batch's closing barrier is enough.
+    if (m_transferQueueIndex == m_graphicsQueueIndex)
+        return bw;
+
+    VkBufferMemoryBarrier barrier{VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER};
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.srcQueueFamilyIndex = m_transferQueueIndex;
+    barrier.dstQueueFamilyIndex = m_graphicsQueueIndex;
+    barrier.buffer = bw.buffer;
+    barrier.offset = 0;
+    barrier.size = VK_WHOLE_SIZE;
+    vkCmdPipelineBarrier(m_transfer.cmdBuf(), VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0,
+                         0, nullptr, 1, &barrier, 0, nullptr);
+
+    barrier.srcAccessMask = 0;
+    barrier.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT;
+    m_asyncOpen.buffers.push_back(barrier);
+    return bw;
+}
+
+/*********************************************************************
+ * param:  texture, a mip chain from m_textureCache.load
+ *
+ * brief:  As createTextureImage, but on the transfer queue.  The
+ *         image reaches SHADER_READ_ONLY_OPTIMAL as part of its
+ *         ownership transfer.
+ **********************************************************************/
+ImageWrap VkApp::createAsyncTextureImage(const TextureData& texture, const std::string& owner)
+{
+    VkFormat format = static_cast<VkFormat>(texture.format);
+    uint32_t mipLevels = static_cast<uint32_t>(texture.levels.size());
+
+    ImageWrap myImage = createImageWrap(texture.width, texture.height, format,
+                                  VK_IMAGE_USAGE_TRANSFER_DST_BIT
+                                  | VK_IMAGE_USAGE_SAMPLED_BIT,
+                                  VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                                  mipLevels, {MEM_TEXTURE, owner});
+
+    std::vector<VkBufferImageCopy> regions(mipLevels);
+    for (uint32_t i = 0; i < mipLevels; i++) {
+        const TextureLevel& level = texture.levels[i];
+        VkBufferImageCopy& region = regions[i];
+        region = {};
+        region.bufferOffset = level.offset;
+        region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        region.imageSubresource.mipLevel = i;
+        region.imageSubresource.baseArrayLayer = 0;
+        region.imageSubresource.layerCount = 1;
+        region.imageOffset = {0, 0, 0};
+        region.imageExtent = {level.width, level.height, 1}; }
+
+    // The stages imageLayoutBarrier picks are not all valid on a
+    // transfer only queue, so these barriers are spelled out.
+    VkImageMemoryBarrier barrier{VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER};
+    barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.image = myImage.image;
+    barrier.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, mipLevels, 0, 1};
+    barrier.srcAccessMask = 0;
+    barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    vkCmdPipelineBarrier(m_transfer.cmdBuf(), VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+                         0, nullptr, 0, nullptr, 1, &barrier);
+
+    m_transfer.copyToImage(texture.data.data(), texture.data.size(), myImage.image, regions);
+
+    barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = 0;
+    if (m_transferQueueIndex == m_graphicsQueueIndex) {
+        // A plain transition; nothing changes hands
+        barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+        vkCmdPipelineBarrier(m_transfer.cmdBuf(), VK_PIPELINE_STAGE_TRANSFER_BIT,
+                             VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0,
+                             0, nullptr, 0, nullptr, 1, &barrier); }
+    else {
+        // Release; the matching acquire repeats the layout transition
+        barrier.srcQueueFamilyIndex = m_transferQueueIndex;
+        barrier.dstQueueFamilyIndex = m_graphicsQueueIndex;
+        vkCmdPipelineBarrier(m_transfer.cmdBuf(), VK_PIPELINE_STAGE_TRANSFER_BIT,
+                             VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0,
+                             0, nullptr, 0, nullptr, 1, &barrier);
+
+        barrier.srcAccessMask = 0;
+        barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+        m_asyncOpen.images.push_back(barrier); }
+
+    myImage.imageView = createImageView(myImage.image, format, VK_IMAGE_ASPECT_COLOR_BIT, mipLevels);
+    myImage.sampler = createTextureSampler();
+    myImage.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    return myImage;
+}
+
+/*********************************************************************
+ * param:  onReady, called (on this thread) once the uploads are
+ *         usable, e.g. to hook them into the scene
+ *
+ * brief:  Submits everything created with createAsync* since the last
+ *         call.  Returns right away.
+ **********************************************************************/
+void VkApp::submitAsyncUploads(std::function<void()> onReady)
+{
+    m_asyncOpen.serial = m_transfer.flush();
+    m_asyncOpen.onReady = std::move(onReady);
+    m_asyncPending.push_back(std::move(m_asyncOpen));
+    m_asyncOpen = AsyncUpload();
+}
+
+/*********************************************************************
+ * param:  cmdBuf, a graphics queue command buffer being recorded
+ * param:  wait, block until every submitted upload is done
+ *
+ * brief:  Records the acquire half of the ownership transfer for each
+ *         submitted upload whose batch is done, and calls its onReady.
+ *         Their fences have signaled, so cmdBuf needs no semaphore.
+ **********************************************************************/
+void VkApp::acquireAsyncUploads(VkCommandBuffer cmdBuf, bool wait)
+{
+    if (wait)
+        m_transfer.finish();
+
+    // Batches complete in order
+    size_t ready = 0;
+    while (ready < m_asyncPending.size() && m_transfer.complete(m_asyncPending[ready].serial))
+        ready++;
+    if (ready == 0)
+        return;
+
+    std::vector<VkBufferMemoryBarrier> buffers;
+    std::vector<VkImageMemoryBarrier>  images;
+    for (size_t i = 0; i < ready; i++) {
+        const AsyncUpload& upload = m_asyncPending[i];
+        buffers.insert(buffers.end(), upload.buffers.begin(), upload.buffers.end());
+        images.insert(images.end(), upload.images.begin(), upload.images.end()); }
+    if (!buffers.empty() || !images.empty())
+        vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                             VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, 0, nullptr,
+                             static_cast<uint32_t>(buffers.size()), buffers.data(),
+                             static_cast<uint32_t>(images.size()), images.data());
+
+    std::vector<AsyncUpload> done(std::make_move_iterator(m_asyncPending.begin()),
+                                  std::make_move_iterator(m_asyncPending.begin() + ready));
+    m_asyncPending.erase(m_asyncPending.begin(), m_asyncPending.begin() + ready);
+    for (auto& upload : done)
+        if (upload.onReady)
+            upload.onReady();
+}
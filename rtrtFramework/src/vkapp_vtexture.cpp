@@ -0,0 +1,196 @@
+//////////////////////////////////////////////////////////////////////
+// The Vulkan side of virtual texturing (VIRTUAL_TEXTURES in
+// shaders/shared_structs.h): the page cache image, the page table,
+// texture description and feedback buffers, and the per frame
+// streaming of requested pages.  See virtual_texture.h.
+////////////////////////////////////////////////////////////////////////
+
+#include <string.h>
+#include <chrono>
+#include <vector>
+
+#include "vkapp.h"
+
+#ifdef VIRTUAL_TEXTURES
+
+// New page requests accepted per frame
+#define VT_MAX_REQUESTS 64
+
+/*********************************************************************
+ *
+ * brief:  Creates the page cache and the buffers the shaders use to
+ *         find pages in it, once all models' textures have been added
+ *         to m_vt.  Each texture's pinned page is loaded right away.
+ **********************************************************************/
+void VkApp::createVirtualTextures()
+{
+    uint32_t size = VT_CACHE_TILES*VT_TILE_SIZE;
+    VkFormat format = static_cast<VkFormat>(m_vt.cacheFormat());
+
+    m_vtCache = createImageWrap(size, size, format,
+                                VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+                                VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 1, {MEM_TEXTURE, "virtual texture cache"});
+    m_vtCache.imageView = createImageView(m_vtCache.image, format);
+    m_vtCache.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+
+    // Tiles are addressed directly; mip selection and wrapping happen
+    // in the shader, and the borders only cover bilinear filtering.
+    VkSamplerCreateInfo samplerInfo{VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO};
+    samplerInfo.magFilter = VK_FILTER_LINEAR;
+    samplerInfo.minFilter = VK_FILTER_LINEAR;
+    samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+    samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    samplerInfo.anisotropyEnable = VK_FALSE;
+    samplerInfo.unnormalizedCoordinates = VK_FALSE;
+    if (vkCreateSampler(m_device, &samplerInfo, nullptr, &m_vtCache.sampler) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create texture sampler!"); }
+
+    VkCommandBuffer cmdBuf = m_upload.cmdBuf();
+    imageLayoutBarrier(cmdBuf, m_vtCache.image,
+                       VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+
+    // Buffers may not be empty, so a scene without textures gets one dummy entry.
+    std::vector<VtTexture> textures = m_vt.textures();
+    if (textures.empty())
+        textures.push_back({1, 1, 1, 0});
+    m_vtTexturesBW = createStagedBufferWrap(cmdBuf, textures, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                            {MEM_TEXTURE, "virtual textures"});
+
+    // The page table and feedback are small and change every frame;
+    // both stay mapped in host visible memory.
+    VkDeviceSize pageBytes = sizeof(uint32_t)*std::max(1u, m_vt.nbPages());
+    VkMemoryPropertyFlags hostFlags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
+        | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+    m_vtPageTableBW = createBufferWrap(pageBytes, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, hostFlags,
+                                       {MEM_TEXTURE, "virtual texture page table"});
+    m_vtFeedbackBW  = createBufferWrap(pageBytes, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, hostFlags,
+                                       {MEM_TEXTURE, "virtual texture feedback"});
+    m_vtPageTableMap = (uint32_t*)m_vtPageTableBW.allocation.mapped;
+    m_vtFeedbackMap  = (uint32_t*)m_vtFeedbackBW.allocation.mapped;
+    memset(m_vtPageTableMap, 0xff, pageBytes);  // VT_NOT_RESIDENT
+    memset(m_vtFeedbackMap, 0, pageBytes);
+
+    std::vector<uint32_t> pinned = m_vt.pinnedPages();
+    if (pinned.size() > VT_CACHE_TILES*VT_CACHE_TILES)
+        throw std::runtime_error("too many textures for the virtual texture cache!");
+    for (auto page : pinned)
+        m_vtLoads.emplace_back(page, m_workers.submit([this, page] { return buildVtTile(page); }));
+    std::vector<std::pair<uint32_t, std::vector<uint8_t>>> tiles;
+    for (auto& load : m_vtLoads)
+        tiles.emplace_back(load.first, load.second.get());
+    m_vtLoads.clear();
+    uploadVtTiles(tiles, true);
+
+    printf("Virtual textures: %d textures, %d pages, cache of %d tiles (%.1f MB)\n",
+           m_vt.nbTextures(), m_vt.nbPages(), VT_CACHE_TILES*VT_CACHE_TILES,
+           VT_CACHE_TILES*VT_CACHE_TILES*m_vt.tileBytes()/1048576.0);
+
+    // @@ Destroy with destroyVirtualTextures(); (DONE)
+}
+
+std::vector<uint8_t> VkApp::buildVtTile(uint32_t page)
+{
+    std::vector<uint8_t> tile(m_vt.tileBytes());
+    m_vt.buildTile(page, tile.data());
+    return tile;
+}
+
+/*********************************************************************
+ * param:  tiles, (page, tile contents) pairs built by buildVtTile
+ * param:  pin, keep these pages resident for good
+ *
+ * brief:  Places tiles in the cache and records their copy into
+ *         m_upload's batch, which is submitted ahead of this frame,
+ *         then publishes the new page table.  Only called while the
+ *         GPU is idle (after the frame fence), so evicted tiles are no
+ *         longer being read.
+ **********************************************************************/
+void VkApp::uploadVtTiles(const std::vector<std::pair<uint32_t, std::vector<uint8_t>>>& tiles,
+                          bool pin)
+{
+    if (tiles.empty())
+        return;
+
+    VkDeviceSize tileBytes = m_vt.tileBytes();
+    VkDeviceSize bytes = tileBytes*tiles.size();
+    UploadContext::Staging staging = m_upload.alloc(bytes);
+    uint8_t* data = static_cast<uint8_t*>(staging.data);
+
+    std::vector<VkBufferImageCopy> regions;
+    for (const auto& tile : tiles) {
+        uint32_t slot = m_vt.place(tile.first, m_vtFrame, pin);
+        if (slot == VT_NOT_RESIDENT)
+            continue;  // Cache full of pages in use; it will be asked for again
+
+        VkBufferImageCopy region{};
+        region.bufferOffset = staging.offset + tileBytes*regions.size();
+        region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        region.imageSubresource.mipLevel = 0;
+        region.imageSubresource.baseArrayLayer = 0;
+        region.imageSubresource.layerCount = 1;
+        region.imageOffset = {int32_t((slot % VT_CACHE_TILES)*VT_TILE_SIZE),
+                              int32_t((slot / VT_CACHE_TILES)*VT_TILE_SIZE), 0};
+        region.imageExtent = {VT_TILE_SIZE, VT_TILE_SIZE, 1};
+        memcpy(data + tileBytes*regions.size(), tile.second.data(), tileBytes);
+        regions.push_back(region); }
+
+    if (!regions.empty()) {
+        VkCommandBuffer cmdBuf = m_upload.cmdBuf();
+        imageLayoutBarrier(cmdBuf, m_vtCache.image, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                           VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+        vkCmdCopyBufferToImage(cmdBuf, staging.buffer, m_vtCache.image,
+                               VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                               static_cast<uint32_t>(regions.size()), regions.data());
+        imageLayoutBarrier(cmdBuf, m_vtCache.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                           VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL); }
+
+    memcpy(m_vtPageTableMap, m_vt.pageTable().data(), sizeof(uint32_t)*m_vt.nbPages());
+}
+
+/*********************************************************************
+ *
+ * brief:  Once a frame, after its fence (so the previous frame's
+ *         feedback is complete): turns the feedback into page
+ *         requests for the worker threads, and uploads whichever
+ *         requested tiles they have finished.  Nothing waits on a
+ *         tile; until it arrives the shaders use a coarser level.
+ **********************************************************************/
+void VkApp::updateVirtualTextures()
+{
+    m_vtFrame++;
+
+    std::vector<uint32_t> requests;
+    m_vt.collectRequests(m_vtFeedbackMap, m_vtFrame, VT_MAX_REQUESTS, requests);
+    memset(m_vtFeedbackMap, 0, sizeof(uint32_t)*m_vt.nbPages());
+    for (auto page : requests)
+        m_vtLoads.emplace_back(page, m_workers.submit([this, page] { return buildVtTile(page); }));
+
+    std::vector<std::pair<uint32_t, std::vector<uint8_t>>> ready;
+    for (size_t i = 0; i < m_vtLoads.size(); ) {
+        auto& load = m_vtLoads[i];
+        if (isReady(load.second)) {
+            ready.emplace_back(load.first, load.second.get());
+            load = std::move(m_vtLoads.back());
+            m_vtLoads.pop_back(); }
+        else
+            i++; }
+
+    uploadVtTiles(ready);
+}
+
+void VkApp::destroyVirtualTextures()
+{
+    // The workers may still be building tiles from m_vt
+    for (auto& load : m_vtLoads)
+        load.second.wait();
+    m_vtLoads.clear();
+
+    m_vtCache.destroy(m_device);
+    m_vtTexturesBW.destroy(m_device);
+    m_vtPageTableBW.destroy(m_device);
+    m_vtFeedbackBW.destroy(m_device);
+}
+
+#endif